@@ -0,0 +1,407 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Context.h"
+
+// image data types of the encoder (double samples) and of the decoder (int samples)
+typedef struct encoder_image_struct {
+	int Rows, Columns;
+	double *Pixel_Data;
+} encoder_image;
+
+typedef struct decoder_image_struct {
+	int Rows, Columns;
+	int *Pixel_Data;
+} decoder_image;
+
+// a benchmark image: a bundled .bmp image (converted to .ppm) or a synthetic one
+typedef struct bench_image_struct {
+	char Name[40];
+	int Rows, Columns;
+} bench_image;
+
+// synthetic image sizes, from VGA to 8K
+static const struct { const char *Name; int Columns, Rows; } Synthetic_Sizes[] = {
+	{ "vga", 640, 480 }, { "hd", 1280, 720 }, { "fhd", 1920, 1080 },
+	{ "4k", 3840, 2160 }, { "8k", 7680, 4320 } };
+#define NUM_SYNTHETIC_SIZES 5
+
+// the block benchmarks run on up to BENCH_BLOCKS blocks taken evenly from the image
+#define BENCH_BLOCKS 4096
+
+// the format of the benchmarks (quantization matrix 1, nothing else)
+#define BENCH_FORMAT 1
+
+// state of the benchmark run: the directory of the intermediate files, the number
+// of timed runs of every benchmark, and the file receiving the results (one JSON
+// object per line); the output of the codec itself goes to /dev/null
+static char Work_Directory[64];
+static int Num_Runs, Num_Image_Runs;
+static FILE *Results_File;
+
+void Fetch_Image(char *, encoder_image *);
+void Colour_Space_422(encoder_image *, encoder_image *);
+void Init_DCT_Coeffs(void);
+void Block_DCT(double [][8]);
+void Quantize_Block(double [][8], int);
+unsigned int Write_Coded_Block(double [][8], FILE *);
+unsigned int Write_Bits(FILE *, int, int);
+void Encoder(char *, int *, int, char *, int, int, long long, double, char *, int, int);
+unsigned int Read_Coded_Block(FILE *, int [][8], int, int *, int *);
+void Seek_Bits(FILE *, unsigned long long);
+int  Quant_Val(int, int);
+void Init_IDCT_Coeffs();
+void Block_IDCT(int [][8]);
+void Interpolate_Colourspace(decoder_image *, decoder_image *);
+void Decoder(char *, char *, int, char *, int, int *);
+void Parse_bmp(char *, char *);
+static void Write_Synthetic_Image(bench_image *, const char *, int, int);
+static void Benchmark_Image(bench_image *);
+static double Now(void);
+static int Compare_Times(const void *, const void *);
+static void Report(const char *, bench_image *, const char *, double *, int, double);
+
+
+int main(int argc, char *argv[]) {
+	// Bench [-data directory] [-runs count] [-image-runs count] [-sizes name,name,...] [-out file]
+	// benchmarks the stages of the codec and the whole encoder and decoder on the .bmp
+	// images of the data directory and on synthetic images of the listed sizes
+	bench_image Image;
+	char Data_Directory[100], Sizes[100], Filename[200], Bmp_Filename[200], *Output_Filename, *Size_Name;
+	const char *Bmp_Names[] = { "fireball", "fractal1", "fractal2", "motorcycle" };
+	int i, valid;
+	FILE *Bmp_File;
+
+	strcpy(Data_Directory, "../data");
+	strcpy(Sizes, "vga,hd,fhd,4k,8k");
+	Output_Filename = NULL;
+	Num_Runs = 15;
+	Num_Image_Runs = 5;
+	valid = 1;
+	for (i = 1; valid && (i < argc); i++) {
+		if (!strcmp(argv[i], "-data") && (i + 1 < argc)) sscanf(argv[++i], "%99s", Data_Directory);
+		else if (!strcmp(argv[i], "-runs") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &Num_Runs) == 1) && (Num_Runs > 0);
+		else if (!strcmp(argv[i], "-image-runs") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &Num_Image_Runs) == 1) && (Num_Image_Runs > 0);
+		else if (!strcmp(argv[i], "-sizes") && (i + 1 < argc)) sscanf(argv[++i], "%99s", Sizes);
+		else if (!strcmp(argv[i], "-out") && (i + 1 < argc)) Output_Filename = argv[++i];
+		else valid = 0;
+	}
+	if (!valid) {
+		printf("\nFormat for benchmarking: Bench [-data directory] [-runs count] [-image-runs count]\n");
+		printf("                               [-sizes name,name,...] [-out file]\n");
+		printf("   benchmarks the block DCT and IDCT, quantization, lossless coding and decoding, the\n");
+		printf("   colourspace conversions, and the whole encoder and decoder, on the .bmp images of\n");
+		printf("   directory (../data by default) and on synthetic images of the listed sizes (vga, hd,\n");
+		printf("   fhd, 4k and 8k by default, \"none\" for none)\n");
+		printf("   every benchmark is timed count times (15 by default, and 5 by default for the whole\n");
+		printf("   encoder and decoder with -image-runs), and its median, percentiles, minimum and\n");
+		printf("   maximum are written as one JSON object per line to file (or to the standard output),\n");
+		printf("   with the number of plane allocations of the encoder and decoder runs after the first\n\n");
+		return 1;
+	}
+
+	// the results go to the standard output, or to a file, and the codec output to /dev/null
+	if (Output_Filename != NULL) {
+		if ((Results_File = fopen(Output_Filename, "w")) == NULL) {
+			printf("Problem opening results file %s\n", Output_Filename); exit(1); }
+	} else Results_File = fdopen(dup(fileno(stdout)), "w");
+	fflush(stdout);
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		fprintf(stderr, "Problem redirecting the codec output\n"); exit(1); }
+
+	strcpy(Work_Directory, "/tmp/mic_bench_XXXXXX");
+	if (mkdtemp(Work_Directory) == NULL) {
+		fprintf(stderr, "Problem creating a work directory\n"); exit(1); }
+	Init_DCT_Coeffs();
+	Init_IDCT_Coeffs();
+
+	// the bundled images (those that are in the data directory)
+	for (i = 0; i < 4; i++) {
+		sprintf(Bmp_Filename, "%s/%s.bmp", Data_Directory, Bmp_Names[i]);
+		if ((Bmp_File = fopen(Bmp_Filename, "rb")) == NULL) continue;
+		fclose(Bmp_File);
+		sprintf(Bmp_Filename, "%s/%s", Data_Directory, Bmp_Names[i]);
+		sprintf(Filename, "%s/%s", Work_Directory, Bmp_Names[i]);
+		Parse_bmp(Bmp_Filename, Filename);
+		strcpy(Image.Name, Bmp_Names[i]);
+		Benchmark_Image(&Image);
+	}
+
+	// the synthetic images, in the order of the list
+	for (Size_Name = strtok(Sizes, ","); Size_Name != NULL; Size_Name = strtok(NULL, ",")) {
+		for (i = 0; (i < NUM_SYNTHETIC_SIZES) && strcmp(Size_Name, Synthetic_Sizes[i].Name); i++);
+		if (i < NUM_SYNTHETIC_SIZES) {
+			Write_Synthetic_Image(&Image, Synthetic_Sizes[i].Name, Synthetic_Sizes[i].Columns, Synthetic_Sizes[i].Rows);
+			Benchmark_Image(&Image);
+		} else if (strcmp(Size_Name, "none")) fprintf(stderr, "Unrecognized image size %s\n", Size_Name);
+	}
+
+	rmdir(Work_Directory);
+	fclose(Results_File);
+	return 0;
+}
+
+static void Write_Synthetic_Image(bench_image *Image, const char *Size_Name, int Columns, int Rows) {
+	// writes a synthetic .ppm image of the given size: smooth gradients, a band of
+	// sinusoidal texture and a band of noise, so that the coder sees flat, textured
+	// and busy blocks in about the proportions of a photograph
+	char Filename[200];
+	unsigned char *Row;
+	unsigned int Seed = 12345;
+	int i, j, colour, Value;
+	FILE *Image_File;
+
+	sprintf(Image->Name, "synthetic_%s", Size_Name);
+	sprintf(Filename, "%s/%s.ppm", Work_Directory, Image->Name);
+	if ((Image_File = fopen(Filename, "wb")) == NULL) {
+		fprintf(stderr, "Problem opening synthetic image %s\n", Filename); exit(1); }
+	fprintf(Image_File, "P6\n%d %d\n255\n", Columns, Rows);
+
+	Row = (unsigned char *)malloc((size_t)3*Columns);
+	for (i = 0; i < Rows; i++) {
+		for (j = 0; j < Columns; j++)
+			for (colour = 0; colour < 3; colour++) {
+				Value = (255*(colour == 0 ? j : colour == 1 ? i : i + j))/(colour == 2 ? Rows + Columns : colour == 1 ? Rows : Columns);
+				if ((j > Columns/3) && (j < 2*Columns/3))
+					Value = (int)(128.0 + 100.0*sin(j*0.15*(colour + 1))*cos(i*0.11));
+				else if (j >= 2*Columns/3) {
+					Seed = Seed*1103515245 + 12345;
+					Value += (int)((Seed >> 16) % 64) - 32;
+				}
+				Row[3*j + colour] = (Value < 0) ? 0 : (Value > 255) ? 255 : Value;
+			}
+		fwrite(Row, 1, (size_t)3*Columns, Image_File);
+	}
+	free(Row);
+	fclose(Image_File);
+}
+
+static void Benchmark_Image(bench_image *Image) {
+	// runs every benchmark on the image Work_Directory/Image->Name.ppm
+	encoder_image Source_Image, Downsampled_Image;
+	decoder_image Decoded_Image, Upsampled_Image;
+	double (*Blocks)[8][8], (*DCT_Blocks)[8][8], (*Quantized_Blocks)[8][8], Block_Data[8][8];
+	int (*Dequantized_Blocks)[8][8], Int_Block[8][8];
+	double *Times, Start;
+	long k, Num_Blocks, Total_Blocks, Step, Block, Plane_Offset;
+	int Run, i, j, Format, Block_Quant, Plane_Columns, Bits_Left;
+	long Encode_Grows = 0, Decode_Grows = 0;
+	char Filename[200], Source_Name[200], Destination_Name[200];
+	FILE *Null_File, *Coded_File;
+
+	fprintf(stderr, "Benchmarking %s\n", Image->Name);
+	Times = (double *)malloc((size_t)((Num_Runs > Num_Image_Runs) ? Num_Runs : Num_Image_Runs)*sizeof(double));
+	sprintf(Filename, "%s/%s.ppm", Work_Directory, Image->Name);
+	Fetch_Image(Filename, &Source_Image);
+	Image->Rows = Source_Image.Rows;
+	Image->Columns = Source_Image.Columns;
+
+	// colourspace conversion and downsampling
+	for (Run = 0; Run < Num_Runs; Run++) {
+		Start = Now();
+		Colour_Space_422(&Source_Image, &Downsampled_Image);
+		Times[Run] = Now() - Start;
+	}
+	Report("Colour_Space_422", Image, "s", Times, Num_Runs, (double)Image->Rows*Image->Columns);
+
+	// the blocks of the benchmarks, taken evenly from the Y, U and V planes (which
+	// follow each other, U and V with half the columns of Y)
+	Total_Blocks = (long)(Downsampled_Image.Rows/8)*(Downsampled_Image.Columns/8)*2;
+	Step = (Total_Blocks > BENCH_BLOCKS) ? Total_Blocks/BENCH_BLOCKS : 1;
+	Num_Blocks = Total_Blocks/Step;
+	Blocks = malloc((size_t)Num_Blocks*sizeof(*Blocks));
+	DCT_Blocks = malloc((size_t)Num_Blocks*sizeof(*DCT_Blocks));
+	Quantized_Blocks = malloc((size_t)Num_Blocks*sizeof(*Quantized_Blocks));
+	Dequantized_Blocks = malloc((size_t)Num_Blocks*sizeof(*Dequantized_Blocks));
+	for (k = 0; k < Num_Blocks; k++) {
+		Block = k*Step;
+		Plane_Offset = 0;
+		Plane_Columns = Downsampled_Image.Columns;
+		if (Block >= Total_Blocks/2) {
+			Plane_Offset = (long)Downsampled_Image.Rows*Downsampled_Image.Columns;
+			Plane_Columns /= 2;
+			Block -= Total_Blocks/2;
+			if (Block >= Total_Blocks/4) {
+				Plane_Offset += Plane_Offset/2;
+				Block -= Total_Blocks/4;
+			}
+		}
+		for (i = 0; i < 8; i++)
+			for (j = 0; j < 8; j++)
+				Blocks[k][i][j] = Downsampled_Image.Pixel_Data[Plane_Offset +
+					(8*(Block/(Plane_Columns/8)) + i)*(long)Plane_Columns + 8*(Block % (Plane_Columns/8)) + j];
+	}
+
+	// block DCT and quantization
+	for (Run = 0; Run < Num_Runs; Run++) {
+		Start = Now();
+		for (k = 0; k < Num_Blocks; k++) {
+			memcpy(DCT_Blocks[k], Blocks[k], sizeof(Block_Data));
+			Block_DCT(DCT_Blocks[k]);
+		}
+		Times[Run] = Now() - Start;
+	}
+	Report("Block_DCT", Image, "s/block", Times, Num_Runs, (double)Num_Blocks);
+
+	for (Run = 0; Run < Num_Runs; Run++) {
+		Start = Now();
+		for (k = 0; k < Num_Blocks; k++) {
+			memcpy(Quantized_Blocks[k], DCT_Blocks[k], sizeof(Block_Data));
+			Quantize_Block(Quantized_Blocks[k], BENCH_FORMAT);
+		}
+		Times[Run] = Now() - Start;
+	}
+	Report("Quantize_Block", Image, "s/block", Times, Num_Runs, (double)Num_Blocks);
+
+	// lossless coding, to /dev/null, and decoding, from a file of the coded blocks
+	if ((Null_File = fopen("/dev/null", "wb")) == NULL) {
+		fprintf(stderr, "Problem opening /dev/null\n"); exit(1); }
+	Bits_Left = 0;
+	for (Run = 0; Run < Num_Runs; Run++) {
+		Start = Now();
+		for (k = 0; k < Num_Blocks; k++)
+			Bits_Left = Write_Coded_Block(Quantized_Blocks[k], Null_File);
+		Times[Run] = Now() - Start;
+	}
+	// the serializer keeps the bits of an unfinished byte, which would shift the blocks
+	// of the coded file below, so it is flushed to a whole byte
+	if (Bits_Left > 0) Write_Bits(Null_File, 0, 8 - Bits_Left);
+	fclose(Null_File);
+	Report("Write_Coded_Block", Image, "s/block", Times, Num_Runs, (double)Num_Blocks);
+
+	if ((Coded_File = tmpfile()) == NULL) {
+		fprintf(stderr, "Problem opening a temporary file\n"); exit(1); }
+	Write_Bits(Coded_File, 0, 16);
+	for (k = 0; k < Num_Blocks; k++)
+		Write_Coded_Block(Quantized_Blocks[k], Coded_File);
+	Write_Bits(Coded_File, 0, 16);
+	for (Run = 0; Run < Num_Runs; Run++) {
+		Seek_Bits(Coded_File, 16);
+		Format = BENCH_FORMAT;
+		Start = Now();
+		for (k = 0; k < Num_Blocks; k++) {
+			Block_Quant = Format;
+			Read_Coded_Block(Coded_File, Dequantized_Blocks[k], Format, &Block_Quant, NULL);
+		}
+		Times[Run] = Now() - Start;
+	}
+	fclose(Coded_File);
+	// the timing is only of use if the blocks decode to the coded ones
+	for (k = 0; k < Num_Blocks; k++)
+		for (i = 0; i < 8; i++)
+			for (j = 0; j < 8; j++)
+				if (Dequantized_Blocks[k][i][j] != (int)Quantized_Blocks[k][i][j]*Quant_Val(8*i + j, BENCH_FORMAT)) {
+					fprintf(stderr, "Block %ld of %s is not decoded as it was coded\n", k, Image->Name); exit(1); }
+	Report("Read_Coded_Block", Image, "s/block", Times, Num_Runs, (double)Num_Blocks);
+
+	// block IDCT
+	for (Run = 0; Run < Num_Runs; Run++) {
+		Start = Now();
+		for (k = 0; k < Num_Blocks; k++) {
+			memcpy(Int_Block, Dequantized_Blocks[k], sizeof(Int_Block));
+			Block_IDCT(Int_Block);
+		}
+		Times[Run] = Now() - Start;
+	}
+	Report("Block_IDCT", Image, "s/block", Times, Num_Runs, (double)Num_Blocks);
+
+	// interpolation and colourspace conversion, of the downsampled image
+	Decoded_Image.Rows = Downsampled_Image.Rows;
+	Decoded_Image.Columns = Downsampled_Image.Columns;
+	Decoded_Image.Pixel_Data = (int *)malloc((size_t)2*Decoded_Image.Rows*Decoded_Image.Columns*sizeof(int));
+	for (k = 0; k < 2L*Decoded_Image.Rows*Decoded_Image.Columns; k++)
+		Decoded_Image.Pixel_Data[k] = (int)Downsampled_Image.Pixel_Data[k];
+	for (Run = 0; Run < Num_Runs; Run++) {
+		Start = Now();
+		Interpolate_Colourspace(&Decoded_Image, &Upsampled_Image);
+		Times[Run] = Now() - Start;
+	}
+	Report("Interpolate_Colourspace", Image, "s", Times, Num_Runs, (double)Image->Rows*Image->Columns);
+
+	free(Decoded_Image.Pixel_Data);
+	free(Dequantized_Blocks);
+	free(Quantized_Blocks);
+	free(DCT_Blocks);
+	free(Blocks);
+
+	// the whole encoder and decoder, from and to files (the names are extended by the codec),
+	// counting the arena allocations of the runs that follow the first one (none are
+	// expected, the planes of the codec context already fit the image)
+	Format = BENCH_FORMAT;
+	for (Run = 0; Run < Num_Image_Runs; Run++) {
+		sprintf(Source_Name, "%s/%s", Work_Directory, Image->Name);
+		sprintf(Destination_Name, "%s/%s", Work_Directory, Image->Name);
+		if (Run == 1) Encode_Grows = -Codec_Context()->Grows;
+		Start = Now();
+		Encoder(Source_Name, &Format, 1, Destination_Name, 0, 0, 0, 0.0, "ppm", 0, 0);
+		Times[Run] = Now() - Start;
+	}
+	if (Num_Image_Runs > 1) Encode_Grows += Codec_Context()->Grows;
+	Report("encode", Image, "s", Times, Num_Image_Runs, (double)Image->Rows*Image->Columns);
+
+	for (Run = 0; Run < Num_Image_Runs; Run++) {
+		sprintf(Source_Name, "%s/%s", Work_Directory, Image->Name);
+		sprintf(Destination_Name, "%s/%s", Work_Directory, Image->Name);
+		if (Run == 1) Decode_Grows = -Codec_Context()->Grows;
+		Start = Now();
+		Decoder(Source_Name, Destination_Name, 0, "ppm", 1, NULL);
+		Times[Run] = Now() - Start;
+	}
+	if (Num_Image_Runs > 1) Decode_Grows += Codec_Context()->Grows;
+	Report("decode", Image, "s", Times, Num_Image_Runs, (double)Image->Rows*Image->Columns);
+	fprintf(Results_File, "{\"benchmark\": \"arena_grows\", \"image\": \"%s\", \"columns\": %d, \"rows\": %d, "
+		"\"encode\": %ld, \"decode\": %ld}\n", Image->Name, Image->Columns, Image->Rows, Encode_Grows, Decode_Grows);
+	fflush(Results_File);
+
+	sprintf(Filename, "%s/%s.ppm", Work_Directory, Image->Name); remove(Filename);
+	sprintf(Filename, "%s/%s.mic", Work_Directory, Image->Name); remove(Filename);
+	sprintf(Filename, "%s/%s_sw.ppm", Work_Directory, Image->Name); remove(Filename);
+	free(Times);
+}
+
+static double Now(void) {
+	// monotonic wall time in seconds
+	struct timespec Time;
+
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (double)Time.tv_sec + 1e-9*(double)Time.tv_nsec;
+}
+
+static int Compare_Times(const void *a, const void *b) {
+	return (*(const double *)a > *(const double *)b) - (*(const double *)a < *(const double *)b);
+}
+
+static void Report(const char *Benchmark, bench_image *Image, const char *Unit, double *Times, int Num_Times, double Work) {
+	// writes the statistics of the timed runs: per block for the block benchmarks
+	// (Work is the number of blocks of a run), per image otherwise, with the throughput
+	// in megapixels per second at the median (Work is the number of pixels)
+	double Scale, Median;
+	int k;
+
+	Scale = (!strcmp(Unit, "s/block")) ? 1.0/Work : 1.0;
+	for (k = 0; k < Num_Times; k++) Times[k] *= Scale;
+	qsort(Times, Num_Times, sizeof(double), Compare_Times);
+	Median = (Num_Times % 2) ? Times[Num_Times/2] : 0.5*(Times[Num_Times/2 - 1] + Times[Num_Times/2]);
+
+	fprintf(Results_File, "{\"benchmark\": \"%s\", \"image\": \"%s\", \"columns\": %d, \"rows\": %d, \"unit\": \"%s\", "
+		"\"runs\": %d, \"median\": %.9g, \"p10\": %.9g, \"p90\": %.9g, \"p99\": %.9g, \"min\": %.9g, \"max\": %.9g",
+		Benchmark, Image->Name, Image->Columns, Image->Rows, Unit, Num_Times,
+		Median,
+		Times[(int)ceil(0.10*Num_Times) - 1], Times[(int)ceil(0.90*Num_Times) - 1],
+		Times[(int)ceil(0.99*Num_Times) - 1], Times[0], Times[Num_Times - 1]);
+	if (Scale == 1.0)
+		fprintf(Results_File, ", \"megapixels_per_second\": %.6g", Work/1e6/Median);
+	fprintf(Results_File, "}\n");
+	fflush(Results_File);
+}
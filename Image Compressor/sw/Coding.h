@@ -10,6 +10,9 @@
 #include <string.h>
 #include <math.h>
 
+#include "Precision.h"
+#include "Context.h"
+
 #ifndef PI
 #ifdef M_PI
 #define PI M_PI
@@ -35,18 +38,123 @@
 #define V 2
 
 // indices for accessing a desired sample from memory
-#define YUV_offset(colour,num_rows,num_cols) ((colour) ? ((colour)/2) ? (3*(num_rows)*(num_cols)/2) : ((num_rows)*(num_cols)) : 0)
+// (computed on long, planes of large images exceed the range of int)
+#define YUV_offset(colour,num_rows,num_cols) ((colour) ? ((colour)/2) ? (3*(long)(num_rows)*(num_cols)/2) : ((long)(num_rows)*(num_cols)) : 0)
 #define YUV_row_step(colour,num_cols) ((colour) ? (num_cols)/2 : (num_cols))
 
-#define RGB_index(num_rows,num_cols,row,col,colour) (3*((row)*(num_cols)+(col))+(colour))
+#define RGB_index(num_rows,num_cols,row,col,colour) (3*((long)(row)*(num_cols)+(col))+(colour))
 #define YUV_index(num_rows,num_cols,row,col,colour)   \
 	YUV_offset(colour,num_rows,num_cols) +             \
-	(row)*YUV_row_step(colour,num_cols) + (col)
+	(long)(row)*YUV_row_step(colour,num_cols) + (col)
+
+// compressed stream header: 0xECE744, a format byte, the image size and the
+// offset of the Y, U and V segments; the format byte holds the quantization
+// matrix in bits 1..0, the adaptive quantization flag in bit 2, the entropy
+// coder in bit 3, the chroma subsampling in bit 4, the block skip flag in bit 5 and
+// the header layout in bits 7..6
+#define FORMAT_QUANT(format)    ((format) & 0x3)
+#define FORMAT_ADAPTIVE(format) (((format) >> 2) & 0x1)
+#define FORMAT_ENTROPY(format)  (((format) >> 3) & 0x1)
+#define FORMAT_CHROMA(format)   (((format) >> 4) & 0x1)
+#define FORMAT_SKIP(format)     (((format) >> 5) & 0x1)
+#define FORMAT_HEADER(format)   (((format) >> 6) & 0x3)
+
+// entropy coders (the fixed codes are the ones read by the hardware decoder)
+#define ENTROPY_FIXED 0   // the ZERO_RUN, CODE_3, CODE_9 and BLOCK_END codes
+#define ENTROPY_ARITH 1   // context-adaptive binary arithmetic coding of each block row (Entropy.c)
+
+// chroma subsampling (4:2:2 is the one read by the hardware decoder)
+#define CHROMA_422 0   // U and V have half the columns of Y
+#define CHROMA_420 1   // U and V have half the columns and half the rows of Y (top half of the 4:2:2 planes)
+
+// header layouts (the narrow one is the one read by the hardware decoder)
+#define HEADER_NARROW 0   // 16-bit rows/columns, segment offsets as 24-bit byte + 8-bit bit offset
+#define HEADER_WIDE   1   // 32-bit rows/columns, segment offsets as 56-bit byte + 8-bit bit offset
+
+// with adaptive quantization every block starts with a prefix selecting its
+// matrix: 0 keeps the matrix of the previous block in the block row, 1 is
+// followed by the 2-bit matrix; every block row starts from the format's matrix
+#define QUANT_KEEP   0
+#define QUANT_SELECT 1
+
+// in the frames of a sequence that follow the first frame of their group, every block
+// starts with a flag: a skipped block has no other bits and keeps the quantized
+// coefficients (and matrix) it had in the previous frame; a skipped block counts as the
+// previous block for the adaptive quantization prefix
+#define BLOCK_CODED 0
+#define BLOCK_SKIP  1
+
+// images are coded in whole blocks: 8 rows (16 in 4:2:0, 8 for U and V) and 16 columns
+// (8 for U and V), partial blocks at the right and bottom edges are padded by replication
+#define PADDED_ROWS(num_rows,format) ((FORMAT_CHROMA(format) == CHROMA_420) ? \
+	((((num_rows) + 15)/16)*16) : ((((num_rows) + 7)/8)*8))
+#define PADDED_COLUMNS(num_cols) ((((num_cols) + 15)/16)*16)
+
+// the hardware decoder reads the narrow header and codes only whole blocks, so an image
+// that needs padding is always coded with the wide header
+#define PADDED_SIZE(num_rows,num_cols,format) ((PADDED_ROWS(num_rows,format) != (num_rows)) || \
+	(PADDED_COLUMNS(num_cols) != (num_cols)))
+
+// debug levels (hardware validation data): the levels of a run are a set, with bit
+// level set for each level, and each level is written to its own file
+#define DEBUG_LEVEL(level) (1 << (level))
+
+// SRAM memory images (Sram.c): the external SRAM holds 2^20 16-bit words, the RGB
+// input (three bytes per pixel, two bytes per word) and the coefficients (one per word)
+// start at address 0 and the YUV planes (two samples per word, Y then U then V, at the
+// YUV_offset of each plane) at 614400, the base addresses of the testbench milestones
+#define SRAM_NONE   0
+#define SRAM_HEX    1   // $readmemh text, an @ address line and one word per line
+#define SRAM_BINARY 2   // raw words, most significant byte first
+#define SRAM_RGB_BASE   0
+#define SRAM_YUV_BASE   614400
+#define SRAM_COEFF_BASE 0
+#define SRAM_WORDS      1048576
+
+extern int sram_format;
+void Write_SRAM_Image(char *, const char *, long, const unsigned char *, size_t);
+
+// the debug file of a level (Sram.c), output_file.d<level>e or output_file.d<level>d
+FILE *Open_Debug_File(char *, int, char);
+
+// the Y, U and V planes of the encoder (double) or of the decoder (int) gathered in
+// 1 or 2 bytes per sample for the debug files and the SRAM images (Sram.c)
+unsigned char *Pack_Planes(const double *, const int *, int, int, int, int, size_t *);
 
 // lossless coding scan pattern
-static int Scan_Pattern[64] = {
+static const int Scan_Pattern[64] = {
 	0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
 	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
 	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
 	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
 
+// row kernels for colourspace conversion and chroma filtering (Kernels.c, the column
+// filters of 4:2:0 take the rows of the filter window and work on whole rows), the
+// scratch row is CHROMA_SCRATCH_SIZE(num_cols) samples for a row of num_cols columns
+#define CHROMA_SCRATCH_SIZE(num_cols) ((num_cols) + 16)
+
+void RGB_To_YUV_Row(const int *, int *, int *, int *, int);
+void YUV_To_RGB_Row(const int *, const int *, const int *, int *, int);
+void Downsample_Chroma_Row(const int *, int *, int, short *);
+void Upsample_Chroma_Row(const int *, int *, int, short *);
+void Downsample_Chroma_Column(const int *const *, int *, int);
+void Upsample_Chroma_Column(const int *const *, int *, int);
+
+// row kernels for the image quality metrics (Kernels.c): the squared error of two rows of
+// 8-bit samples and the weighted sum of rows used by the structural similarity windows
+unsigned long long Squared_Error_Row(const unsigned char *, const unsigned char *, int);
+void Weighted_Sum_Rows(const float *const *, const float *, int, float *, int);
+
+// arithmetic coding of a block row (Entropy.c): blocks of 64 quantized values in scan
+// order, with the matrix of each block when quantization is adaptive (else NULL)
+size_t Arith_Encode_Block_Row(const int *, const int *, int, int, unsigned char **, size_t *);
+size_t Arith_Decode_Block_Row(const unsigned char *, size_t, int *, int *, int, int);
+
+// stage profiling (Profile.c): stages are timed between Profile_Begin and Profile_End
+// and the fixed code symbols are counted with Profile_Symbol, when profile_enabled is set
+extern int profile_enabled;
+void Profile_Begin(const char *);
+void Profile_End(const char *);
+void Profile_Symbol(int);
+void Profile_File(const char *, int);
+void Profile_Stream(const char *);
@@ -5,56 +5,406 @@
    Ontario, Canada
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <math.h>
-
-void Compare(char *Source_Filename_1, char *Source_Filename_2)
-{
-	unsigned char temp_char_1, temp_char_2;
-	char temp_string[50];
-	int pixel_counter, total_error, difference;
-	int temp_int;
-	double RMSE, PSNR;
-	FILE *Source_File_1, *Source_File_2; 
+#include "Coding.h"
+#include <pthread.h>
+#include <unistd.h>
+
+// image data type
+typedef struct image_struct {
+	int Rows, Columns;
+	int *Pixel_Data;
+} image;
+
+// an image being compared, as R, G, B and luma planes of 8-bit samples
+typedef struct compare_image_struct {
+	int Rows, Columns;
+	unsigned char *Planes[4];
+} compare_image;
+
+// the metrics are computed on parallel lanes, lane k taking every Num_Lanes-th band
+// of rows (block rows of 8 rows for the squared errors, bands of SSIM_BAND output rows
+// for the structural similarity), and adding up its own sums
+typedef struct compare_lane_struct {
+	const compare_image *Image_1, *Image_2;
+	const float *Luma_1, *Luma_2;
+	int Rows, Columns, Lane, Num_Lanes;
+	unsigned long long Squared_Error[4];
+	unsigned long long *Block_Error;
+	double SSIM_Sum, CS_Sum;
+} compare_lane;
+
+// planes of the compared images
+#define PLANE_R 0
+#define PLANE_G 1
+#define PLANE_B 2
+#define PLANE_Y 3
+
+// structural similarity (Wang et al.): 11x11 Gaussian window of standard deviation
+// 1.5 over the luma samples, the windows fully inside the image, and the multi-scale
+// index over 5 scales halved by 2x2 averaging, with the weights of the original paper
+#define SSIM_WINDOW 11
+#define SSIM_SIGMA  1.5
+#define SSIM_C1     ((0.01*255.0)*(0.01*255.0))
+#define SSIM_C2     ((0.03*255.0)*(0.03*255.0))
+#define SSIM_BAND   16
+#define MS_SSIM_SCALES 5
+
+static const double MS_SSIM_Weights[MS_SSIM_SCALES] = { 0.0448, 0.2856, 0.3001, 0.2363, 0.1333 };
+
+static float SSIM_Weights[SSIM_WINDOW];
+
+void Compare(char *, char *, int, char *);
+int  Decode_RGB_Image(char *, image *);
+static void Read_PPM_Image(char *, compare_image *);
+static void Split_Planes(compare_image *, const int *, const unsigned char *);
+static int Run_Lanes(void *(*)(void *), compare_lane *, const compare_image *, const compare_image *,
+	const float *, const float *, int, int, int);
+static void *Squared_Error_Lane(void *);
+static void *SSIM_Lane(void *);
+static double PSNR_Of(unsigned long long, unsigned long long);
+static void Write_Error_Map(char *, const unsigned long long *, int, int, int, int);
+
+
+void Compare(char *Source_Filename_1, char *Source_Filename_2, int Decode_Source_2, char *Map_Filename) {
+	// compares the image Source_Filename_1.ppm to Source_Filename_2.ppm, or to the stream
+	// Source_Filename_2.mic decoded in memory: PSNR of each of R, G and B, of all of them
+	// and of the luma, SSIM and MS-SSIM of the luma, and optionally the map of the mean
+	// squared error of every 8x8 block, written to Map_Filename.pgm
+	compare_image Image_1, Image_2;
+	image Decoded_Image;
+	compare_lane *Lanes;
+	unsigned long long Squared_Error[4], *Block_Error, Worst_Error;
+	long i, j, Pixels, Block_Pixels, Worst_Block;
+	int k, Rows, Columns, Block_Rows, Block_Columns, Num_Lanes, Scales, Scale_Rows, Scale_Columns;
+	float *Luma_1, *Luma_2, *Half_1, *Half_2;
+	double SSIM, CS, MS_SSIM, CS_Product, Weight_Sum, Sum;
 
 	strcat(Source_Filename_1, ".ppm");
-	strcat(Source_Filename_2, ".ppm");
-	printf("Comparing file %s to %s\n", Source_Filename_1, Source_Filename_2);
-
-	// open files
-	if ((Source_File_1 = fopen(Source_Filename_1, "rb")) == NULL) { printf("Problem with file %s\n", Source_Filename_1); exit(0); }
-	if ((Source_File_2 = fopen(Source_Filename_2, "rb")) == NULL) { printf("Problem with file %s\n", Source_Filename_2); exit(0); }
-
-	// strip headers
-	fscanf(Source_File_1, "%s", temp_string); fscanf(Source_File_2, "%s", temp_string); // image type - usually P6
-	fscanf(Source_File_1, "%d", &temp_int);   fscanf(Source_File_2, "%d", &temp_int);   // Pixel Columns
-	fscanf(Source_File_1, "%d", &temp_int);   fscanf(Source_File_2, "%d", &temp_int);   // Pixel Rows
-	fscanf(Source_File_1, "%s", temp_string); fscanf(Source_File_2, "%s", temp_string); // max colours - usually 255
-	fgetc(Source_File_1);                     fgetc(Source_File_2);                     // newline character
-
-	// compare image data
-	pixel_counter = total_error = 0;
-	while (!(feof(Source_File_1) || feof(Source_File_2))) {
-		temp_char_1 = fgetc(Source_File_1);
-		temp_char_2 = fgetc(Source_File_2);
-		if (!(feof(Source_File_1) || feof(Source_File_2))) {
-			pixel_counter++;
-			difference = (int)temp_char_1 - (int)temp_char_2;
-			total_error += difference * difference;
+	Read_PPM_Image(Source_Filename_1, &Image_1);
+	if (Decode_Source_2) {
+		if (Decode_RGB_Image(Source_Filename_2, &Decoded_Image)) exit(1);
+		Image_2.Rows = Decoded_Image.Rows;
+		Image_2.Columns = Decoded_Image.Columns;
+		Split_Planes(&Image_2, Decoded_Image.Pixel_Data, NULL);
+		printf("Comparing file %s to %s (decoded in memory)\n", Source_Filename_1, Source_Filename_2);
+	} else {
+		strcat(Source_Filename_2, ".ppm");
+		Read_PPM_Image(Source_Filename_2, &Image_2);
+		printf("Comparing file %s to %s\n", Source_Filename_1, Source_Filename_2);
+	}
+	if ((Image_1.Rows != Image_2.Rows) || (Image_1.Columns != Image_2.Columns)) {
+		printf("Image sizes differ: %d x %d and %d x %d\n",
+			Image_1.Columns, Image_1.Rows, Image_2.Columns, Image_2.Rows); exit(1); }
+	Rows = Image_1.Rows;
+	Columns = Image_1.Columns;
+	Pixels = (long)Rows*Columns;
+
+	// one lane per processor, the block errors are kept for the map (R, G and B together)
+	Num_Lanes = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (Num_Lanes < 1) Num_Lanes = 1;
+	Lanes = (compare_lane *)malloc(Num_Lanes*sizeof(compare_lane));
+	Block_Rows = (Rows + 7)/8;
+	Block_Columns = (Columns + 7)/8;
+	Block_Error = (unsigned long long *)calloc((size_t)Block_Rows*Block_Columns, sizeof(unsigned long long));
+
+	// squared errors, 64-bit sums of each plane
+	Num_Lanes = Run_Lanes(Squared_Error_Lane, Lanes, &Image_1, &Image_2, NULL, NULL, Rows, Columns, Num_Lanes);
+	for (k = 0; k < 4; k++) {
+		Squared_Error[k] = 0;
+		for (i = 0; i < Num_Lanes; i++)
+			Squared_Error[k] += Lanes[i].Squared_Error[k];
+	}
+	for (i = 0; i < Num_Lanes; i++) {
+		for (j = 0; j < (long)Block_Rows*Block_Columns; j++)
+			Block_Error[j] += Lanes[i].Block_Error[j];
+		free(Lanes[i].Block_Error);
+	}
+
+	printf("Compared %ld pixels, PSNR: %10.4lf\n", Pixels,
+		PSNR_Of(Squared_Error[PLANE_R] + Squared_Error[PLANE_G] + Squared_Error[PLANE_B], 3*Pixels));
+	printf("PSNR R: %10.4lf  G: %10.4lf  B: %10.4lf  Y: %10.4lf\n",
+		PSNR_Of(Squared_Error[PLANE_R], Pixels), PSNR_Of(Squared_Error[PLANE_G], Pixels),
+		PSNR_Of(Squared_Error[PLANE_B], Pixels), PSNR_Of(Squared_Error[PLANE_Y], Pixels));
+
+	// the worst block, and the error map
+	Worst_Block = 0;
+	Worst_Error = 0;
+	for (i = 0; i < Block_Rows; i++)
+		for (j = 0; j < Block_Columns; j++) {
+			Block_Pixels = (long)(((8*i + 8 <= Rows) ? 8 : Rows - 8*i)*((8*j + 8 <= Columns) ? 8 : Columns - 8*j));
+			if (Block_Error[i*Block_Columns + j]*64 > Worst_Error*Block_Pixels) {
+				Worst_Block = i*Block_Columns + j;
+				Worst_Error = Block_Error[Worst_Block]*64/Block_Pixels;
+			}
+		}
+	printf("Worst 8x8 block at x %ld y %ld, PSNR: %10.4lf\n", 8*(Worst_Block % Block_Columns),
+		8*(Worst_Block / Block_Columns), PSNR_Of(Worst_Error, 3*64));
+	if (Map_Filename != NULL) Write_Error_Map(Map_Filename, Block_Error, Block_Rows, Block_Columns, Rows, Columns);
+
+	// the structural similarity of the luma, at the scales that fit a window
+	for (i = 0; i < SSIM_WINDOW; i++)
+		SSIM_Weights[i] = (float)exp(-(i - SSIM_WINDOW/2)*(i - SSIM_WINDOW/2)/(2.0*SSIM_SIGMA*SSIM_SIGMA));
+	for (i = 0, Sum = 0.0; i < SSIM_WINDOW; i++) Sum += SSIM_Weights[i];
+	for (i = 0; i < SSIM_WINDOW; i++) SSIM_Weights[i] /= Sum;
+
+	Luma_1 = (float *)malloc((size_t)Pixels*sizeof(float));
+	Luma_2 = (float *)malloc((size_t)Pixels*sizeof(float));
+	for (i = 0; i < Pixels; i++) {
+		Luma_1[i] = Image_1.Planes[PLANE_Y][i];
+		Luma_2[i] = Image_2.Planes[PLANE_Y][i];
+	}
+
+	SSIM = 0.0;
+	MS_SSIM = CS_Product = 1.0;
+	Weight_Sum = 0.0;
+	Scale_Rows = Rows;
+	Scale_Columns = Columns;
+	for (Scales = 0; (Scales < MS_SSIM_SCALES) && (Scale_Rows >= SSIM_WINDOW) && (Scale_Columns >= SSIM_WINDOW); Scales++) {
+		k = Run_Lanes(SSIM_Lane, Lanes, NULL, NULL, Luma_1, Luma_2, Scale_Rows, Scale_Columns, Num_Lanes);
+		for (i = 0, SSIM = CS = 0.0; i < k; i++) {
+			SSIM += Lanes[i].SSIM_Sum;
+			CS += Lanes[i].CS_Sum;
+		}
+		SSIM /= (double)(Scale_Rows - SSIM_WINDOW + 1)*(Scale_Columns - SSIM_WINDOW + 1);
+		CS /= (double)(Scale_Rows - SSIM_WINDOW + 1)*(Scale_Columns - SSIM_WINDOW + 1);
+		if (Scales == 0) printf("SSIM (Y): %8.6lf\n", SSIM);
+
+		// the contrast and structure terms of the scales before the last one, and the
+		// SSIM of the last one (the scales are cut short on small images, with the
+		// weights renormalized)
+		MS_SSIM = CS_Product*pow((SSIM > 0.0) ? SSIM : 0.0, MS_SSIM_Weights[Scales]);
+		CS_Product *= pow((CS > 0.0) ? CS : 0.0, MS_SSIM_Weights[Scales]);
+		Weight_Sum += MS_SSIM_Weights[Scales];
+
+		// next scale, by 2x2 averaging
+		Half_1 = (float *)malloc((size_t)(Scale_Rows/2)*(Scale_Columns/2)*sizeof(float));
+		Half_2 = (float *)malloc((size_t)(Scale_Rows/2)*(Scale_Columns/2)*sizeof(float));
+		for (i = 0; i < Scale_Rows/2; i++)
+			for (j = 0; j < Scale_Columns/2; j++) {
+				Half_1[i*(Scale_Columns/2) + j] = 0.25f*(Luma_1[(2*i)*Scale_Columns + 2*j] + Luma_1[(2*i)*Scale_Columns + 2*j + 1] +
+					Luma_1[(2*i + 1)*Scale_Columns + 2*j] + Luma_1[(2*i + 1)*Scale_Columns + 2*j + 1]);
+				Half_2[i*(Scale_Columns/2) + j] = 0.25f*(Luma_2[(2*i)*Scale_Columns + 2*j] + Luma_2[(2*i)*Scale_Columns + 2*j + 1] +
+					Luma_2[(2*i + 1)*Scale_Columns + 2*j] + Luma_2[(2*i + 1)*Scale_Columns + 2*j + 1]);
+			}
+		free(Luma_1);
+		free(Luma_2);
+		Luma_1 = Half_1;
+		Luma_2 = Half_2;
+		Scale_Rows /= 2;
+		Scale_Columns /= 2;
+	}
+	if (Scales > 0) {
+		MS_SSIM = pow(MS_SSIM, 1.0/Weight_Sum);
+		printf("MS-SSIM (Y): %8.6lf (%d scales)\n", MS_SSIM, Scales);
+	} else printf("Image is too small for SSIM (%d x %d window)\n", SSIM_WINDOW, SSIM_WINDOW);
+
+	free(Luma_1);
+	free(Luma_2);
+	free(Block_Error);
+	free(Lanes);
+	for (k = 0; k < 4; k++) {
+		free(Image_1.Planes[k]);
+		free(Image_2.Planes[k]);
+	}
+}
+
+static void Read_PPM_Image(char *Filename, compare_image *Source_Image) {
+	// reads a binary .ppm image into R, G, B and luma planes
+	unsigned char *Data;
+	char temp_string[50];
+	size_t Size;
+	FILE *Source_File;
+
+	if ((Source_File = fopen(Filename, "rb")) == NULL) { printf("Problem with file %s\n", Filename); exit(1); }
+
+	// strip header
+	fscanf(Source_File, "%s", temp_string);                 // image type - usually P6
+	fscanf(Source_File, "%d", &Source_Image->Columns);      // Pixel Columns
+	fscanf(Source_File, "%d", &Source_Image->Rows);         // Pixel Rows
+	fscanf(Source_File, "%s", temp_string);                 // max colours - usually 255
+	fgetc(Source_File);                                     // newline character
+	if ((Source_Image->Rows <= 0) || (Source_Image->Columns <= 0)) {
+		printf("Invalid image size in %s\n", Filename); exit(1); }
+
+	Size = (size_t)3*Source_Image->Rows*Source_Image->Columns;
+	Data = (unsigned char *)malloc(Size);
+	if (fread(Data, 1, Size, Source_File) != Size) { printf("File %s is truncated\n", Filename); exit(1); }
+	fclose(Source_File);
+
+	Split_Planes(Source_Image, NULL, Data);
+	free(Data);
+}
+
+static void Split_Planes(compare_image *Source_Image, const int *Samples, const unsigned char *Bytes) {
+	// splits interleaved RGB samples (from a decoder, or bytes from a file) into planes,
+	// with the full range BT.601 luma rounded to 8 bits
+	long i, Pixels = (long)Source_Image->Rows*Source_Image->Columns;
+	int k, RGB[3];
+
+	for (k = 0; k < 4; k++)
+		Source_Image->Planes[k] = (unsigned char *)malloc((size_t)Pixels);
+	for (i = 0; i < Pixels; i++) {
+		for (k = 0; k < 3; k++) {
+			RGB[k] = (Samples != NULL) ? Samples[3*i + k] : Bytes[3*i + k];
+			Source_Image->Planes[k][i] = RGB[k];
+		}
+		Source_Image->Planes[PLANE_Y][i] = (19595*RGB[PLANE_R] + 38470*RGB[PLANE_G] + 7471*RGB[PLANE_B] + (1 << 15)) >> 16;
+	}
+}
+
+static int Run_Lanes(void *(*Lane_Function)(void *), compare_lane *Lanes,
+	const compare_image *Image_1, const compare_image *Image_2, const float *Luma_1, const float *Luma_2,
+	int Rows, int Columns, int Num_Lanes
+) {
+	// runs Lane_Function on parallel lanes over the rows, no more lanes than bands of rows,
+	// and returns the number of lanes
+	pthread_t *Threads;
+	int Lane, Bands;
+
+	Bands = (Lane_Function == SSIM_Lane) ? (Rows - SSIM_WINDOW + SSIM_BAND)/SSIM_BAND : (Rows + 7)/8;
+	if (Num_Lanes > Bands) Num_Lanes = Bands;
+	if (Num_Lanes < 1) Num_Lanes = 1;
+
+	Threads = (pthread_t *)malloc(Num_Lanes*sizeof(pthread_t));
+	for (Lane = 0; Lane < Num_Lanes; Lane++) {
+		Lanes[Lane].Image_1 = Image_1;
+		Lanes[Lane].Image_2 = Image_2;
+		Lanes[Lane].Luma_1 = Luma_1;
+		Lanes[Lane].Luma_2 = Luma_2;
+		Lanes[Lane].Rows = Rows;
+		Lanes[Lane].Columns = Columns;
+		Lanes[Lane].Lane = Lane;
+		Lanes[Lane].Num_Lanes = Num_Lanes;
+		if (pthread_create(&Threads[Lane], NULL, Lane_Function, &Lanes[Lane])) {
+			printf("Problem starting comparison lane %d\n", Lane); exit(1); }
+	}
+	for (Lane = 0; Lane < Num_Lanes; Lane++)
+		pthread_join(Threads[Lane], NULL);
+	free(Threads);
+
+	return Num_Lanes;
+}
+
+static void *Squared_Error_Lane(void *Lane) {
+	// sums the squared errors of the lane's block rows, for each plane and for every
+	// 8x8 block (R, G and B together)
+	compare_lane *Compare_Lane = (compare_lane *)Lane;
+	int i, j, k, Block_Row, Block_Columns, Width;
+	unsigned long long Error;
+	long Offset;
+
+	Block_Columns = (Compare_Lane->Columns + 7)/8;
+	Compare_Lane->Block_Error = (unsigned long long *)calloc((size_t)((Compare_Lane->Rows + 7)/8)*Block_Columns,
+		sizeof(unsigned long long));
+	for (k = 0; k < 4; k++) Compare_Lane->Squared_Error[k] = 0;
+
+	for (Block_Row = Compare_Lane->Lane; 8*Block_Row < Compare_Lane->Rows; Block_Row += Compare_Lane->Num_Lanes)
+		for (i = 8*Block_Row; (i < 8*Block_Row + 8) && (i < Compare_Lane->Rows); i++)
+			for (j = 0; j < Block_Columns; j++) {
+				Offset = (long)i*Compare_Lane->Columns + 8*j;
+				Width = (8*j + 8 <= Compare_Lane->Columns) ? 8 : Compare_Lane->Columns - 8*j;
+				for (k = 0; k < 4; k++) {
+					Error = Squared_Error_Row(Compare_Lane->Image_1->Planes[k] + Offset,
+						Compare_Lane->Image_2->Planes[k] + Offset, Width);
+					Compare_Lane->Squared_Error[k] += Error;
+					if (k != PLANE_Y) Compare_Lane->Block_Error[(long)Block_Row*Block_Columns + j] += Error;
+				}
+			}
+	return NULL;
+}
+
+static void *SSIM_Lane(void *Lane) {
+	// sums the SSIM and its contrast and structure term over the windows of the lane's
+	// bands of output rows: the means, variances and covariance of every window are the
+	// Gaussian filtered samples, squares and products, filtered along the rows of the
+	// band (and the window rows below it) and then down the columns
+	compare_lane *Compare_Lane = (compare_lane *)Lane;
+	int i, j, k, q, Band, Columns, Out_Rows, Out_Columns, Band_Rows;
+	const float *Window[SSIM_WINDOW], *Row_1, *Row_2;
+	float *Products[5], *Filtered[5], *Means[5], m1, m2, s11, s22, s12;
+	double CS;
+
+	Columns = Compare_Lane->Columns;
+	Out_Rows = Compare_Lane->Rows - SSIM_WINDOW + 1;
+	Out_Columns = Columns - SSIM_WINDOW + 1;
+	for (q = 0; q < 5; q++) {
+		Products[q] = (float *)malloc((size_t)Columns*sizeof(float));
+		Filtered[q] = (float *)malloc((size_t)(SSIM_BAND + SSIM_WINDOW - 1)*Out_Columns*sizeof(float));
+		Means[q] = (float *)malloc((size_t)Out_Columns*sizeof(float));
+	}
+	Compare_Lane->SSIM_Sum = Compare_Lane->CS_Sum = 0.0;
+
+	for (Band = Compare_Lane->Lane; SSIM_BAND*Band < Out_Rows; Band += Compare_Lane->Num_Lanes) {
+		Band_Rows = (SSIM_BAND*(Band + 1) <= Out_Rows) ? SSIM_BAND : Out_Rows - SSIM_BAND*Band;
+
+		// the rows of the band's windows, filtered along the row
+		for (i = 0; i < Band_Rows + SSIM_WINDOW - 1; i++) {
+			Row_1 = Compare_Lane->Luma_1 + (long)(SSIM_BAND*Band + i)*Columns;
+			Row_2 = Compare_Lane->Luma_2 + (long)(SSIM_BAND*Band + i)*Columns;
+			for (j = 0; j < Columns; j++) {
+				Products[0][j] = Row_1[j];
+				Products[1][j] = Row_2[j];
+				Products[2][j] = Row_1[j]*Row_1[j];
+				Products[3][j] = Row_2[j]*Row_2[j];
+				Products[4][j] = Row_1[j]*Row_2[j];
+			}
+			for (q = 0; q < 5; q++) {
+				for (k = 0; k < SSIM_WINDOW; k++) Window[k] = Products[q] + k;
+				Weighted_Sum_Rows(Window, SSIM_Weights, SSIM_WINDOW, Filtered[q] + (long)i*Out_Columns, Out_Columns);
+			}
+		}
+
+		// down the columns, then the index of every window
+		for (i = 0; i < Band_Rows; i++) {
+			for (q = 0; q < 5; q++) {
+				for (k = 0; k < SSIM_WINDOW; k++) Window[k] = Filtered[q] + (long)(i + k)*Out_Columns;
+				Weighted_Sum_Rows(Window, SSIM_Weights, SSIM_WINDOW, Means[q], Out_Columns);
+			}
+			for (j = 0; j < Out_Columns; j++) {
+				m1 = Means[0][j];
+				m2 = Means[1][j];
+				s11 = Means[2][j] - m1*m1;
+				s22 = Means[3][j] - m2*m2;
+				s12 = Means[4][j] - m1*m2;
+				CS = (2.0*s12 + SSIM_C2)/(s11 + s22 + SSIM_C2);
+				Compare_Lane->CS_Sum += CS;
+				Compare_Lane->SSIM_Sum += CS*(2.0*m1*m2 + SSIM_C1)/(m1*m1 + m2*m2 + SSIM_C1);
+			}
 		}
 	}
 
-	// close files
-	fclose(Source_File_1);
-	fclose(Source_File_2);
+	for (q = 0; q < 5; q++) {
+		free(Products[q]);
+		free(Filtered[q]);
+		free(Means[q]);
+	}
+	return NULL;
+}
+
+static double PSNR_Of(unsigned long long Squared_Error, unsigned long long Samples) {
+	// peak signal-to-noise ratio of 8-bit samples (infinite for identical samples)
+	return 10.0*log10(255.0*255.0*(double)Samples/(double)Squared_Error);
+}
 
-	// compute SNR
-	RMSE = (double)total_error / (double)pixel_counter;
-	RMSE = sqrt(RMSE);
-	// printf("Total error: %10.4lf RMSE: %10.4lf\n", (double)total_error, RMSE);
-	PSNR = 20.0*log10(255.0 / RMSE);
+static void Write_Error_Map(char *Filename, const unsigned long long *Block_Error,
+	int Block_Rows, int Block_Columns, int Rows, int Columns
+) {
+	// writes the mean squared error (over R, G and B, clipped to 255) of every 8x8
+	// block as a .pgm image with one pixel per block
+	int i, j, Block_Pixels;
+	unsigned long long Error;
+	FILE *Map_File;
 
-	printf("Compared %d pixels, PSNR: %10.4lf\n", pixel_counter/3, PSNR);
+	strcat(Filename, ".pgm");
+	if ((Map_File = fopen(Filename, "wb")) == NULL) {
+		printf("Problem opening error map file %s\n", Filename); exit(1); }
+	fprintf(Map_File, "P5\n%d %d\n255\n", Block_Columns, Block_Rows);
+	for (i = 0; i < Block_Rows; i++)
+		for (j = 0; j < Block_Columns; j++) {
+			Block_Pixels = ((8*i + 8 <= Rows) ? 8 : Rows - 8*i)*((8*j + 8 <= Columns) ? 8 : Columns - 8*j);
+			Error = (Block_Error[(long)i*Block_Columns + j] + 3*Block_Pixels/2)/(3*Block_Pixels);
+			fputc((Error > 255) ? 255 : (int)Error, Map_File);
+		}
+	fclose(Map_File);
+	printf("Wrote the %d x %d map of the 8x8 block errors to %s\n", Block_Columns, Block_Rows, Filename);
 }
@@ -0,0 +1,71 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "Context.h"
+
+// the context of each thread, reached through Context_Key
+static pthread_key_t Context_Key;
+static pthread_once_t Context_Key_Once = PTHREAD_ONCE_INIT;
+
+static void Create_Context_Key(void);
+static void Free_Codec_Context(void *);
+codec_context *Codec_Context(void);
+void *Arena_Plane(plane_arena *, size_t);
+
+
+static void Create_Context_Key(void) {
+	if (pthread_key_create(&Context_Key, Free_Codec_Context)) {
+		printf("Problem creating the codec context key\n"); exit(1); }
+}
+
+static void Free_Codec_Context(void *Context) {
+	// called when a thread with a context exits
+	codec_context *Codec = (codec_context *)Context;
+
+	free(Codec->Pixel_Data.Data);
+	free(Codec->Downsampled_Data.Data);
+	free(Codec->DCT_Data.Data);
+	free(Codec->Source_Data.Data);
+	free(Codec->Upsampled_Data.Data);
+	free(Codec->Row_Data.Data);
+	free(Codec);
+}
+
+codec_context *Codec_Context(void) {
+	// the context of the calling thread, created (with empty arenas) on first use
+	codec_context *Codec;
+
+	pthread_once(&Context_Key_Once, Create_Context_Key);
+	if ((Codec = (codec_context *)pthread_getspecific(Context_Key)) == NULL) {
+		if ((Codec = (codec_context *)calloc(1, sizeof(codec_context))) == NULL) {
+			printf("Problem allocating a codec context\n"); exit(1); }
+		if (pthread_setspecific(Context_Key, Codec)) {
+			printf("Problem setting the codec context\n"); exit(1); }
+	}
+	return Codec;
+}
+
+void *Arena_Plane(plane_arena *Arena, size_t Size) {
+	// a buffer of at least Size bytes, aligned to ARENA_ALIGNMENT; the arena only grows
+	// (to Size, rounded up to the alignment) and its contents are not kept when it does
+	codec_context *Codec;
+
+	if (Size > Arena->Size) {
+		Size = (Size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+		free(Arena->Data);
+		if (posix_memalign(&Arena->Data, ARENA_ALIGNMENT, Size)) {
+			printf("Problem allocating %lu bytes for a plane\n", (unsigned long)Size); exit(1); }
+		Arena->Size = Size;
+		Codec = Codec_Context();
+		Codec->Grows++;
+	}
+	return Arena->Data;
+}
@@ -0,0 +1,40 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stddef.h>
+
+// codec contexts (Context.c): every thread that encodes or decodes has a context of
+// its own, created on first use and kept until the thread exits, which holds the
+// planes of the codec in grow-only arenas; an arena is only reallocated when a plane
+// is larger than any it held before, so repeated encodes and decodes of images no
+// larger than the largest one seen do no heap allocation for their planes
+#define ARENA_ALIGNMENT 64   // cache line, and the width of the widest vector loads
+
+typedef struct plane_arena_struct {
+	void *Data;
+	size_t Size;
+} plane_arena;
+
+// the planes returned by the encoder and decoder stages belong to the context of the
+// calling thread, and are valid until the same stage runs again on that thread
+typedef struct codec_context_struct {
+	plane_arena Pixel_Data;        // RGB source image (Fetch_Image)
+	plane_arena Downsampled_Data;  // YUV planes before the DCT (Colour_Space_422, Fetch_YUV_Image)
+	plane_arena DCT_Data;          // DCT coefficients (Discrete_Cosine_Transform)
+	plane_arena Source_Data;       // decoded YUV planes (Lossless_Dequant_IDCT)
+	plane_arena Upsampled_Data;    // interpolated RGB image (Interpolate_Colourspace)
+	plane_arena Row_Data;          // row scratch of the colourspace stages and image writers
+	long Grows;                    // number of times an arena was (re)allocated
+} codec_context;
+
+codec_context *Codec_Context(void);
+void *Arena_Plane(plane_arena *, size_t);
+
+#endif
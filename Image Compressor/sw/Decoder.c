@@ -6,6 +6,8 @@
  */
 
 #include "Coding.h"
+#include <pthread.h>
+#include <unistd.h>
 
 // image data type
 typedef struct image_struct {
@@ -13,124 +15,502 @@ typedef struct image_struct {
 	int *Pixel_Data;
 } image;
 
+// an arithmetic coded stream, held in memory, and the region of it to decode; every
+// block row is preceded by its length in bytes, so the block rows are located first
+// and then decoded in parallel by Num_Lanes threads, lane k taking every Num_Lanes-th
+// block row of the region, starting from the k-th
+typedef struct arith_stream_struct {
+	int Compression_Format, Block_Size, Block_Rows, Block_Columns, Components, Num_Lanes, Transform;
+	int First_Block_Row, Last_Block_Row, First_Block_Column, Last_Block_Column;
+	int Source_Rows, Source_Columns, Image_Rows, Image_Columns;
+	int *Source_Data;
+	const unsigned char *Stream;
+	unsigned long long Stream_Size, *Row_Starts, *Row_Lengths;
+	int Truncated;   // set by a lane that finds a block row past the end of the stream
+} arith_stream;
+
+typedef struct decoder_lane_struct {
+	arith_stream *Coded_Stream;
+	int Lane;
+} decoder_lane;
+
+// output formats for the decoded image
+#define OUTPUT_PPM    0   // interpolated RGB, .ppm image (default)
+#define OUTPUT_YUV422 1   // planar Y, U and V samples as coded (4:2:2 or 4:2:0), no interpolation
+#define OUTPUT_Y      2   // planar Y samples only, the U and V segments are not decoded
+#define OUTPUT_RGB    3   // interpolated RGB, raw interleaved samples without header
+#define OUTPUT_BMP    4   // interpolated RGB, 24-bit .bmp image
+
 // coefficient matrix for DCT
-int IDCT_Coeffs[8][8];
+static int IDCT_Coeffs[8][8];
+
+// coefficient matrices for the reduced IDCTs used by scaled decoding, of 1, 2 and 4
+// points (indexed by Block_Size/2); all the matrices are computed once
+static int Scaled_IDCT_Coeffs[3][8][8];
+static pthread_once_t IDCT_Coeffs_Once = PTHREAD_ONCE_INIT;
 
 // global variables (with limited scope) related to debug
 // (for generating hardware validation data)
-static int debug_level;
-static int *debug_data;
-static char debug_filename[100];
-static FILE *debug_file;
+static int debug_levels;
+static int *debug_data = NULL;   // the pre-IDCT coefficients, when they are written
+static char debug_basename[100];
+static int sram_export;
+
+// global variables (with limited scope) related to region of interest decoding:
+// the crop rectangle (crop_rows is 0 when the full image is decoded) and the
+// position in the image of the block-aligned region that is actually decoded
+static int crop_row, crop_column, crop_rows, crop_columns;
+static int region_row, region_column;
+
+// size of the image recorded in the stream header (the decoded blocks
+// cover it, padded to 8 rows, or 16 in 4:2:0, and 16 columns) and its
+// chroma subsampling (U and V have half the rows of Y in 4:2:0)
+static int header_rows, header_columns, header_chroma, header_format;
+
+// when decoding a sequence, the quantized coefficients and the matrix of every
+// block of the previous frame (65 values per block, for reference_blocks blocks)
+static int sequence_decoding = 0;
+static int *reference_data = NULL;
+static long reference_blocks;
+
+// when the matrices are kept (Decode_Coefficients), the matrix of every decoded block,
+// in the order of the blocks (Y, U and V, each by rows)
+static int keep_quants = 0;
+static int *quant_data = NULL;
+
+// state of the serializer in Read_Bits
+static unsigned int read_buffer = 0, read_pointer = 32;
+
+// the blocks of the stream being decoded whose zero runs went past the end of the
+// block (Read_Coded_Block stops them at the end, the stream is corrupt)
+static long overrun_blocks = 0;
 
 // function prototypes
-void Lossless_Dequant_IDCT(char *, image *);
-unsigned int Read_Coded_Block(FILE *, int [][8], int);
+void Decode_Sequence(char *, char *, int, char *, int, int *);
+void Decoder(char *, char *, int, char *, int, int *);
+int  Decode_RGB_Image(char *, image *);
+int  Decode_RGB_Region(char *, int *, image *);
+void Decode_Coefficients(char *, image *, int **);
+int  Lossless_Dequant_IDCT(char *, image *, int, int, int);
+void Stream_Header(int *, int *, int *);
+static int  Arith_Dequant_IDCT(FILE *, arith_stream *, unsigned long long *);
+static void *Decode_Block_Row_Lane(void *);
+unsigned int Read_Coded_Block(FILE *, int [][8], int, int *, int *);
 int  Read_Bits(FILE *, int);
+void Seek_Bits(FILE *, unsigned long long);
+static unsigned long long *Read_Block_Row_Index(char *, int);
 int  Quant_Val(int, int);
 //static void Fetch_Block(int *, int [][8], int, int, int, int, int);
 void Init_IDCT_Coeffs();
+static void Compute_IDCT_Coeffs(void);
 void Block_IDCT(int [][8]);
-static void Write_Block(int [][8], int *, int, int, int, int, int);
+void Block_Scaled_IDCT(int [][8], int);
+static void Write_Block(int [][8], int *, int, int, int, int, int, int);
 void Interpolate_Colourspace(image *, image *);
 void Write_PPM_Image(image *, char *);
+void Write_YUV_Image(image *, char *, int);
+void Write_RGB_Image(image *, char *);
+void Write_BMP_Image(image *, char *);
+static void Crop_Image(image *, int, int, int, int, int, int);
+
+void Decode_Sequence(char *Source_Filename, char *Destination_Filename, int Num_Frames,
+	char *Output_Name, int Scale, int *Crop
+) {
+	// decodes the frames Source_Filename_<frame>.mic (numbered from 0000) of a sequence to
+	// Destination_Filename_<frame>, keeping the coefficients of each frame for the next one
+	char Source_Frame[120], Destination_Frame[120];
+	int Frame;
+
+	sequence_decoding = 1;
+	for (Frame = 0; Frame < Num_Frames; Frame++) {
+		sprintf(Source_Frame, "%s_%04d", Source_Filename, Frame);
+		sprintf(Destination_Frame, "%s_%04d", Destination_Filename, Frame);
+		Decoder(Source_Frame, Destination_Frame, 0, Output_Name, Scale, Crop);
+	}
+	free(reference_data);
+	reference_data = NULL;
+	sequence_decoding = 0;
+}
 
-void Decoder(char *Source_Filename, char *Destination_Filename, int debug_info) {   
+void Decoder(char *Source_Filename, char *Destination_Filename, int debug_info, char *Output_Name, int Scale, int *Crop) {   
 	image Source_Image, Upsampled_Image;
+	int i, Output_Format, Components, Rows, Columns;
+	char Debug_Filename[110];
+	size_t SRAM_Size;
+	unsigned char *SRAM_Buffer;
 
-	// setup for debug
-	debug_level = debug_info;
-	sprintf(debug_filename, "%s.d%dd", Destination_Filename, debug_level);
+	// select the output format
+	if (!strcmp(Output_Name, "ppm")) Output_Format = OUTPUT_PPM;
+	else if (!strcmp(Output_Name, "yuv422")) Output_Format = OUTPUT_YUV422;
+	else if (!strcmp(Output_Name, "y")) Output_Format = OUTPUT_Y;
+	else if (!strcmp(Output_Name, "rgb")) Output_Format = OUTPUT_RGB;
+	else if (!strcmp(Output_Name, "bmp")) Output_Format = OUTPUT_BMP;
+	else { printf("Unrecognized output format %s\n", Output_Name); exit(1); }
+	if ((Scale != 1) && (Scale != 2) && (Scale != 4) && (Scale != 8)) {
+		printf("Unsupported scale 1/%d, use 1, 2, 4 or 8\n", Scale); exit(1); }
+
+	// setup for region of interest decoding (Crop is x, y, width, height)
+	crop_rows = 0;
+	if (Crop != NULL) {
+		if ((Crop[0] < 0) || (Crop[1] < 0) || (Crop[2] <= 0) || (Crop[3] <= 0)) {
+			printf("Invalid crop rectangle %d %d %d %d\n", Crop[0], Crop[1], Crop[2], Crop[3]); exit(1); }
+		if ((Scale != 1) || (debug_info & (DEBUG_LEVEL(1) | DEBUG_LEVEL(2))) || (sram_format != SRAM_NONE)) {
+			printf("Cropping cannot be combined with scaling, debug levels 1 and 2 or SRAM images\n"); exit(1); }
+		if ((Output_Format == OUTPUT_YUV422) && ((Crop[0] % 2) || (Crop[2] % 2))) {
+			printf("Cropping planar YUV output needs an even x and width\n"); exit(1); }
+		crop_column = Crop[0];
+		crop_row = Crop[1];
+		crop_columns = Crop[2];
+		crop_rows = Crop[3];
+	}
+
+	// setup for debug (the SRAM images are of the whole image at full size)
+	debug_levels = debug_info;
+	strcpy(debug_basename, Destination_Filename);
+	sram_export = sram_format;
+	if ((sram_export != SRAM_NONE) && ((Scale != 1) || (Output_Format == OUTPUT_Y))) {
+		printf("SRAM images cannot be combined with scaling or luma only output\n"); exit(1); }
 	strcat(Source_Filename, ".mic");
-	strcat(Destination_Filename, "_sw.ppm");
+	strcat(Destination_Filename, (Output_Format == OUTPUT_YUV422) ? "_sw.yuv" :
+		(Output_Format == OUTPUT_Y) ? "_sw.y" : (Output_Format == OUTPUT_RGB) ? "_sw.rgb" :
+		(Output_Format == OUTPUT_BMP) ? "_sw.bmp" : "_sw.ppm");
 	printf("Decoding file %s to image %s\n", Source_Filename, Destination_Filename);
 
+	// luma only output skips the U and V segments, unless
+	// the debug data (which covers all components) is needed
+	Components = ((Output_Format == OUTPUT_Y) && !(debug_levels & (DEBUG_LEVEL(1) | DEBUG_LEVEL(2)))) ? 1 : 3;
+
 	// Decompress the image
-	Lossless_Dequant_IDCT(Source_Filename, &Source_Image);
-	Interpolate_Colourspace(&Source_Image, &Upsampled_Image);
-	Write_PPM_Image(&Upsampled_Image, Destination_Filename);
+	Profile_File(Source_Filename, 0);
+	Profile_Stream(Source_Filename);
+	Profile_Begin("Lossless_Dequant_IDCT");
+	if (Lossless_Dequant_IDCT(Source_Filename, &Source_Image, Components, Scale, 1)) exit(1);
+	Profile_End("Lossless_Dequant_IDCT");
+
+	// debug information (milestone 1 transmission file)
+	if (debug_levels & DEBUG_LEVEL(1)) {
+		sprintf(Debug_Filename, "%s.d1d", debug_basename);
+		printf("Writing debug information for level 1 to file %s\n", Debug_Filename);
+		Write_YUV_Image(&Source_Image, Debug_Filename, 3);
+	}
+	// the YUV region the IDCT writes, in the same layout
+	if (sram_export != SRAM_NONE) {
+		SRAM_Buffer = Pack_Planes(NULL, Source_Image.Pixel_Data, Source_Image.Rows, Source_Image.Columns, header_chroma, 1,
+			&SRAM_Size);
+		Write_SRAM_Image(debug_basename, "yuv", SRAM_YUV_BASE, SRAM_Buffer, SRAM_Size);
+		free(SRAM_Buffer);
+	}
 
-	free(Upsampled_Image.Pixel_Data);
-	free(Source_Image.Pixel_Data);
+	// the decoded blocks are trimmed to the crop rectangle, or else to the image size
+	// (scaled down and, for planar YUV output, to an even width, and an even height
+	// in 4:2:0, to keep whole U and V samples)
+	if (crop_rows > 0) {
+		Rows = crop_rows;
+		Columns = crop_columns;
+	} else {
+		region_row = crop_row = 0;
+		region_column = crop_column = 0;
+		Rows = (header_rows + Scale - 1)/Scale;
+		Columns = (header_columns + Scale - 1)/Scale;
+	}
+
+	if ((Output_Format == OUTPUT_YUV422) || (Output_Format == OUTPUT_Y)) {
+		if (Output_Format == OUTPUT_YUV422) {
+			Columns += Columns % 2;
+			if (header_chroma == CHROMA_420) {
+				if ((crop_rows > 0) && ((crop_row % 2) || (crop_rows % 2))) {
+					printf("Cropping 4:2:0 planar YUV output needs an even y and height\n"); exit(1); }
+				Rows += Rows % 2;
+			}
+		}
+		if ((Rows != Source_Image.Rows) || (Columns != Source_Image.Columns))
+			Crop_Image(&Source_Image, Components, 0, crop_row - region_row, crop_column - region_column, Rows, Columns);
+		Profile_Begin("Write_YUV_Image");
+		Write_YUV_Image(&Source_Image, Destination_Filename, (Output_Format == OUTPUT_Y) ? 1 : 3);
+		Profile_End("Write_YUV_Image");
+		printf("Wrote %d x %d planar %s samples\n", Source_Image.Columns, Source_Image.Rows,
+			(Output_Format == OUTPUT_Y) ? "Y" : (header_chroma == CHROMA_420) ? "4:2:0 YUV" : "4:2:2 YUV");
+	} else {
+		Profile_Begin("Interpolate_Colourspace");
+		Interpolate_Colourspace(&Source_Image, &Upsampled_Image);
+		Profile_End("Interpolate_Colourspace");
+		if ((Rows != Upsampled_Image.Rows) || (Columns != Upsampled_Image.Columns))
+			Crop_Image(&Upsampled_Image, 3, 1, crop_row - region_row, crop_column - region_column, Rows, Columns);
+		// the RGB region, the pixels in the order of the .ppm image
+		if (sram_export != SRAM_NONE) {
+			SRAM_Size = (size_t)Rows*Columns*3;
+			SRAM_Buffer = (unsigned char *)malloc(SRAM_Size);
+			for (i = 0; i < (long)SRAM_Size; i++)
+				SRAM_Buffer[i] = Upsampled_Image.Pixel_Data[i] & 0xFF;
+			Write_SRAM_Image(debug_basename, "rgb", SRAM_RGB_BASE, SRAM_Buffer, SRAM_Size);
+			free(SRAM_Buffer);
+		}
+		if (Output_Format == OUTPUT_RGB) {
+			Profile_Begin("Write_RGB_Image");
+			Write_RGB_Image(&Upsampled_Image, Destination_Filename);
+			Profile_End("Write_RGB_Image");
+			printf("Wrote %d x %d interleaved RGB samples\n", Upsampled_Image.Columns, Upsampled_Image.Rows);
+		} else if (Output_Format == OUTPUT_BMP) {
+			Profile_Begin("Write_BMP_Image");
+			Write_BMP_Image(&Upsampled_Image, Destination_Filename);
+			Profile_End("Write_BMP_Image");
+		} else {
+			Profile_Begin("Write_PPM_Image");
+			Write_PPM_Image(&Upsampled_Image, Destination_Filename);
+			Profile_End("Write_PPM_Image");
+		}
+	}
+	Profile_File(Destination_Filename, 1);
+}
+
+int Decode_RGB_Image(char *Source_Filename, image *RGB_Image) {
+	// decodes the whole stream Source_Filename.mic to interpolated RGB samples in
+	// memory, trimmed to the image size, without writing an output image
+	return Decode_RGB_Region(Source_Filename, NULL, RGB_Image);
+}
+
+int Decode_RGB_Region(char *Source_Filename, int *Crop, image *RGB_Image) {
+	// decodes the crop rectangle Crop (x, y, width, height, inside the image) of the
+	// stream Source_Filename.mic to interpolated RGB samples in memory, as the decoder
+	// does for -crop (a fixed coded stream needs its block row index), or the whole
+	// image when Crop is NULL; returns 1 (after printing why) when the stream cannot
+	// be decoded, so that the daemon answers the request instead of exiting
+	image Source_Image;
+	int Rows, Columns;
+
+	crop_rows = 0;
+	region_row = crop_row = 0;
+	region_column = crop_column = 0;
+	if (Crop != NULL) {
+		crop_column = Crop[0];
+		crop_row = Crop[1];
+		crop_columns = Crop[2];
+		crop_rows = Crop[3];
+	}
+	debug_levels = 0;
+	sram_export = SRAM_NONE;
+	strcat(Source_Filename, ".mic");
+
+	if (Lossless_Dequant_IDCT(Source_Filename, &Source_Image, 3, 1, 1)) return 1;
+	Interpolate_Colourspace(&Source_Image, RGB_Image);
+	Rows = (crop_rows > 0) ? crop_rows : header_rows;
+	Columns = (crop_rows > 0) ? crop_columns : header_columns;
+	if ((Rows != RGB_Image->Rows) || (Columns != RGB_Image->Columns))
+		Crop_Image(RGB_Image, 3, 1, crop_row - region_row, crop_column - region_column, Rows, Columns);
+	return 0;
 }
 
-void Lossless_Dequant_IDCT(char *Filename, image *Source_Image) {
+void Decode_Coefficients(char *Source_Filename, image *Coefficient_Image, int **Block_Quants) {
+	// entropy decodes and dequantizes every block of the whole stream Source_Filename.mic,
+	// keeping the coefficients of each block in its place (no IDCT), and returns the
+	// matrix of every block in *Block_Quants (allocated here, to be freed by the caller)
+	crop_rows = 0;
+	region_row = crop_row = 0;
+	region_column = crop_column = 0;
+	debug_levels = 0;
+	sram_export = SRAM_NONE;
+	strcat(Source_Filename, ".mic");
+
+	keep_quants = 1;
+	if (Lossless_Dequant_IDCT(Source_Filename, Coefficient_Image, 3, 1, 0)) exit(1);
+	keep_quants = 0;
+	*Block_Quants = quant_data;
+	quant_data = NULL;
+}
+
+int Lossless_Dequant_IDCT(char *Filename, image *Source_Image, int Components, int Scale, int Transform) {
 	// Performs lossless decoding, dequantization and IDCT on all the blocks
-	int i, j, colour, Compression_Format;
-	int Block_Rows, Block_Columns, Source_Rows, Source_Columns;
-	int *Source_Data, Block_Data[8][8];
-	unsigned char file_data;
+	// of the first Components colour components (1 for Y only, 3 for YUV);
+	// for Scale > 1 each block is reconstructed at (8/Scale)x(8/Scale) samples;
+	// when cropping only the blocks of the region around the crop rectangle are
+	// transformed, and the block row index is used to seek to each block row; without
+	// Transform the dequantized coefficients of each block are kept in its place (no IDCT);
+	// returns 1, after printing why, for a stream that cannot be decoded (the callers
+	// other than the daemon exit)
+	int i, j, colour, Compression_Format, Header_Format, Block_Size, Block_Quant, Failed = 0;
+	int Block_Rows, Block_Columns, Source_Rows, Source_Columns, Image_Rows, Image_Columns;
+	int First_Block_Row, Last_Block_Row, First_Block_Column, Last_Block_Column;
+	size_t Debug_Size;
+	unsigned char *Debug_Buffer;
+	FILE *Debug_File;
+	int *Source_Data, Block_Data[8][8], *Block_Reference = NULL;
+	long Reference_Base = 0;
+	unsigned long long *Row_Offsets = NULL;
+	unsigned long long encoded_byte_offset[3], decoded_byte_offset[3], block_bits;
+	unsigned int encoded_bit_offset[3], decoded_bit_offset[3];
+	arith_stream Coded_Stream;
 	FILE *Source_File;
 
 	// Open the file
 	if ((Source_File = fopen(Filename, "rb")) == NULL) {
-		printf("Problem opening source compressed stream %s\n", Filename); exit(1); }
+		printf("Problem opening source compressed stream %s\n", Filename); return 1; }
+	read_buffer = 0;
+	read_pointer = 32;
 
-	// Extract compressed file header information
+	// Extract compressed file header information: the narrow header has the image size
+	// on 16 bits and 24-bit byte offsets, the wide header 32 bits and 56-bit byte offsets
 	fgetc(Source_File); fgetc(Source_File); fgetc(Source_File); // strip 0xECE744
-	file_data = fgetc(Source_File);
-	Compression_Format = file_data & 0x3;
+	Compression_Format = fgetc(Source_File);
+	Header_Format = FORMAT_HEADER(Compression_Format);
+	if ((Header_Format != HEADER_NARROW) && (Header_Format != HEADER_WIDE)) {
+		printf("Unrecognized header layout %d in %s\n", Header_Format, Filename); fclose(Source_File); return 1; }
 
-	file_data = fgetc(Source_File);
-	Source_Rows = file_data << 8;
-	file_data = fgetc(Source_File);
-	Source_Rows |= file_data;
+	header_rows = header_columns = 0;
+	for (i = (Header_Format == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		header_rows = (header_rows << 8) | fgetc(Source_File);
+	for (i = (Header_Format == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		header_columns = (header_columns << 8) | fgetc(Source_File);
 
-	file_data = fgetc(Source_File);
-	Source_Columns = file_data << 8;
-	file_data = fgetc(Source_File);
-	Source_Columns |= file_data;
-
-	unsigned int encoded_byte_offset[3], encoded_bit_offset[3];
 	for (colour = 0; colour < 3; colour++) {
-		file_data = fgetc(Source_File);
-		encoded_byte_offset[colour] = file_data << 16;
-		file_data = fgetc(Source_File);
-		encoded_byte_offset[colour] |= file_data << 8;
-		file_data = fgetc(Source_File);
-		encoded_byte_offset[colour] |= file_data;
-		file_data = fgetc(Source_File);
-		encoded_bit_offset[colour] = file_data;
+		encoded_byte_offset[colour] = 0;
+		for (i = (Header_Format == HEADER_WIDE) ? 7 : 3; i > 0; i--)
+			encoded_byte_offset[colour] = (encoded_byte_offset[colour] << 8) | (unsigned long long)fgetc(Source_File);
+		encoded_bit_offset[colour] = fgetc(Source_File);
 	}
+	if ((header_rows <= 0) || (header_columns <= 0)) {
+		printf("Invalid image size %d x %d in %s\n", header_columns, header_rows, Filename); fclose(Source_File); return 1; }
 
+	// the coded blocks cover the image padded to whole blocks
+	header_chroma = FORMAT_CHROMA(Compression_Format);
+	header_format = Compression_Format;
+	Source_Rows = PADDED_ROWS(header_rows, Compression_Format);
+	Source_Columns = PADDED_COLUMNS(header_columns);
 	Block_Rows = Source_Rows/8;
 	Block_Columns = Source_Columns/8;
 
-	// allocate memory
-	Source_Data = (int *)malloc(Source_Rows*Source_Columns*2*sizeof(int));
-	if (debug_level == 2) debug_data = (int *)malloc(Source_Rows*Source_Columns*3*sizeof(int));
+	// the frames of a sequence after the first one of their group need the previous frame
+	if (FORMAT_SKIP(Compression_Format) && (!sequence_decoding || (FORMAT_ENTROPY(Compression_Format) != ENTROPY_FIXED))) {
+		printf("%s is a frame of a sequence, decode it with the frames before it (-frames)\n", Filename);
+		fclose(Source_File); return 1; }
+	if (sequence_decoding) {
+		if (reference_data == NULL) {
+			reference_blocks = 2L*Block_Rows*Block_Columns;
+			reference_data = (int *)calloc((size_t)65*reference_blocks, sizeof(int));
+		} else if (reference_blocks != 2L*Block_Rows*Block_Columns) {
+			printf("Image size of %s differs from the previous frame\n", Filename); fclose(Source_File); return 1; }
+	}
 
-	// fill the IDCT coefficient matrix
+	// the region to decode, in Y blocks: the whole image, or the block rows covering the
+	// crop rectangle and the chroma blocks (16 columns) covering it with one more on each
+	// side, so that the interpolation filter sees the same samples as for the whole image
+	// (in 4:2:0 the rows are chosen the same way, in chroma blocks of 16 rows)
+	First_Block_Row = 0; Last_Block_Row = Block_Rows - 1;
+	First_Block_Column = 0; Last_Block_Column = Block_Columns - 1;
+	if (crop_rows > 0) {
+		if ((crop_row + crop_rows > header_rows) || (crop_column + crop_columns > header_columns)) {
+			printf("Crop rectangle is outside the %d x %d image\n", header_columns, header_rows); fclose(Source_File); return 1; }
+		First_Block_Row = crop_row/8;
+		Last_Block_Row = (crop_row + crop_rows - 1)/8;
+		if (header_chroma == CHROMA_420) {
+			First_Block_Row = 2*((crop_row/16 > 0) ? crop_row/16 - 1 : 0);
+			Last_Block_Row = 2*((crop_row + crop_rows - 1)/16 + 1) + 1;
+			if (Last_Block_Row >= Block_Rows) Last_Block_Row = Block_Rows - 1;
+		}
+		First_Block_Column = 2*((crop_column/16 > 0) ? crop_column/16 - 1 : 0);
+		Last_Block_Column = 2*((crop_column + crop_columns - 1)/16 + 1) + 1;
+		if (Last_Block_Column >= Block_Columns) Last_Block_Column = Block_Columns - 1;
+		if ((FORMAT_ENTROPY(Compression_Format) == ENTROPY_FIXED) &&
+		    ((Row_Offsets = Read_Block_Row_Index(Filename, Block_Rows)) == NULL)) {
+			fclose(Source_File); return 1; }
+	}
+	if (keep_quants)
+		quant_data = (int *)malloc((size_t)2*Block_Rows*Block_Columns*sizeof(int));
+	region_row = 8*First_Block_Row;
+	region_column = 8*First_Block_Column;
+
+	// the decoded image is smaller by Scale in each direction
+	Block_Size = 8/Scale;
+	Image_Rows = (Last_Block_Row - First_Block_Row + 1)*Block_Size;
+	Image_Columns = (Last_Block_Column - First_Block_Column + 1)*Block_Size;
+
+	// the planes come from the context of the thread
+	Source_Data = (int *)Arena_Plane(&Codec_Context()->Source_Data,
+		(size_t)Image_Rows*Image_Columns*((Components == 1) ? 1 : 2)*sizeof(int));
+	if ((debug_levels & DEBUG_LEVEL(2)) || (sram_export != SRAM_NONE)) debug_data = (int *)malloc((size_t)Source_Rows*Source_Columns*3*sizeof(int));
+
+	// the IDCT coefficient matrices
 	Init_IDCT_Coeffs();
 
-	unsigned int decoded_byte_offset[3], decoded_bit_offset[3];
-	decoded_byte_offset[0] = (unsigned int)ftell(Source_File);
-	decoded_bit_offset[0] = 0;
-		
-	unsigned int block_bits = 0;
+	// arithmetic coded streams are decoded in parallel, from memory
+	overrun_blocks = 0;
+	if (FORMAT_ENTROPY(Compression_Format) == ENTROPY_ARITH) {
+		Coded_Stream.Compression_Format = Compression_Format;
+		Coded_Stream.Block_Size = Block_Size;
+		Coded_Stream.Transform = Transform;
+		Coded_Stream.Block_Rows = Block_Rows;
+		Coded_Stream.Block_Columns = Block_Columns;
+		Coded_Stream.Components = Components;
+		Coded_Stream.First_Block_Row = First_Block_Row;
+		Coded_Stream.Last_Block_Row = Last_Block_Row;
+		Coded_Stream.First_Block_Column = First_Block_Column;
+		Coded_Stream.Last_Block_Column = Last_Block_Column;
+		Coded_Stream.Source_Rows = Source_Rows;
+		Coded_Stream.Source_Columns = Source_Columns;
+		Coded_Stream.Image_Rows = Image_Rows;
+		Coded_Stream.Image_Columns = Image_Columns;
+		Coded_Stream.Source_Data = Source_Data;
+		Failed = Arith_Dequant_IDCT(Source_File, &Coded_Stream, encoded_byte_offset);
+	}
+
+	block_bits = 0;
 	// process blocks in sequence from the bitstream
-	for (colour = 0; colour < 3; colour++) {
+	for (colour = 0; (FORMAT_ENTROPY(Compression_Format) == ENTROPY_FIXED) && (colour < 3); colour++) {
 		if (colour == 0) {
-			decoded_byte_offset[0] = (unsigned int)ftell(Source_File);
+			decoded_byte_offset[0] = (unsigned long long)ftell(Source_File);
 			decoded_bit_offset[0] = 0;
 		} else {
 			decoded_byte_offset[colour] = decoded_byte_offset[0] + (block_bits / 8);
-			decoded_bit_offset[colour] = (block_bits % 8);
+			decoded_bit_offset[colour] = (unsigned int)(block_bits % 8);
+		}
+		if (colour == Components) break;   // the segment following the last decoded one is still checked
+		for (i = First_Block_Row; i <= Last_Block_Row; i++) {
+			// when cropping, entropy decode each block row only up to the last block of the region
+			if (crop_rows > 0) Seek_Bits(Source_File, Row_Offsets[colour*Block_Rows + i]);
+			Block_Quant = FORMAT_QUANT(Compression_Format);
+			for (j = 0; j <= Last_Block_Column; j++) {
+				if (reference_data != NULL)
+					Block_Reference = &reference_data[65*(Reference_Base + (long)i*YUV_row_step(colour, Block_Columns) + j)];
+				block_bits += Read_Coded_Block(Source_File, Block_Data, Compression_Format, &Block_Quant, Block_Reference);
+				if (quant_data != NULL)
+					quant_data[Reference_Base + (long)i*YUV_row_step(colour, Block_Columns) + j] = Block_Quant;
+				if (j < First_Block_Column) continue;
+				if (debug_data != NULL)
+					Write_Block(Block_Data, debug_data, i, j, Source_Rows, Source_Columns, colour, 8);
+				if (Transform && (Block_Size < 8)) Block_Scaled_IDCT(Block_Data, Block_Size);
+				else if (Transform) Block_IDCT(Block_Data);
+				Write_Block(Block_Data, Source_Data, i - First_Block_Row, j - First_Block_Column,
+					Image_Rows, Image_Columns, colour, Block_Size);
+			}
 		}
-		for (i = 0; i < Block_Rows; i++)
-			for (j = 0; j < Block_Columns; j++) {
-				block_bits += Read_Coded_Block(Source_File, Block_Data, Compression_Format);
-				if (debug_level == 2)
-					Write_Block(Block_Data, debug_data, i, j, Source_Rows, Source_Columns, colour);
-				Block_IDCT(Block_Data);
-				Write_Block(Block_Data, Source_Data, i, j, Source_Rows, Source_Columns, colour);
+		Reference_Base += (long)((colour == Y) || (header_chroma == CHROMA_422) ? Block_Rows : Block_Rows/2)*
+			YUV_row_step(colour, Block_Columns);
+		if (colour == Y) {   // since U and V have half the width of Y
+			First_Block_Column /= 2;
+			Last_Block_Column /= 2;
+			if (header_chroma == CHROMA_420) {   // and half the height, in 4:2:0
+				First_Block_Row /= 2;
+				Last_Block_Row /= 2;
 			}
-		if (colour == Y) Block_Columns /= 2;   // since U and V have half the width of Y
+		}
 	}
 
-	for (colour = 0; colour < 3; colour++) {
+	// a stream that could not be decoded leaves the planes incomplete
+	if (Failed || (overrun_blocks > 0)) {
+		if (overrun_blocks > 0) printf("Compressed stream %s is corrupt (%ld blocks overrun)\n", Filename, overrun_blocks);
+		free(debug_data);
+		debug_data = NULL;
+		free(quant_data);
+		quant_data = NULL;
+		free(Row_Offsets);
+		fclose(Source_File);
+		return 1;
+	}
+
+	// segment offsets are only known when all the blocks have been decoded
+	for (colour = 0; (FORMAT_ENTROPY(Compression_Format) == ENTROPY_FIXED) && (crop_rows == 0) &&
+			(colour < 3) && (colour <= Components); colour++) {
 		if (encoded_byte_offset[colour] != decoded_byte_offset[colour]) {
-			fprintf(stdout, "Colour = %c\tEncoded byte offset = %d\t!= Decoded byte offset = %d\n", \
+			fprintf(stdout, "Colour = %c\tEncoded byte offset = %llu\t!= Decoded byte offset = %llu\n", \
 				(colour == 0) ? 'Y' : (colour == 1) ? 'U' : 'V', \
 				encoded_byte_offset[colour], decoded_byte_offset[colour]);
 		}
@@ -141,48 +521,229 @@ void Lossless_Dequant_IDCT(char *Filename, image *Source_Image) {
 		}
 	}
 
-	if (debug_level == 2) {
-		printf("Writing debug information for level %d to file %s\n", debug_level, debug_filename);
-		Block_Rows = Source_Rows;
-		Block_Columns = Source_Columns;
-		if ((debug_file = fopen(debug_filename, "wb")) == NULL) {
-			printf("Problem opening debug file %s\n", debug_filename); exit(1); }
-		for (colour = 0; colour < 3; colour++) {
-			for (i = 0; i < Block_Rows; i++)
-				for (j = 0; j < Block_Columns; j++)
-					fprintf(debug_file, "%c%c",
-							(debug_data[YUV_index(Source_Rows, Source_Columns, i, j, colour)] >> 8) & 0xFF,
-							(debug_data[YUV_index(Source_Rows, Source_Columns, i, j, colour)]) & 0xFF);
-			if (colour == Y) Block_Columns /= 2;
+	// the pre-IDCT coefficients in 16 bits, for the debug file and the coefficient region of the SRAM
+	if ((debug_levels & DEBUG_LEVEL(2)) || (sram_export != SRAM_NONE)) {
+		Debug_Buffer = Pack_Planes(NULL, debug_data, Source_Rows, Source_Columns, header_chroma, 2, &Debug_Size);
+		if (debug_levels & DEBUG_LEVEL(2)) {
+			Debug_File = Open_Debug_File(debug_basename, 2, 'd');
+			if (fwrite(Debug_Buffer, 1, Debug_Size, Debug_File) != Debug_Size) {
+				printf("Problem writing debug information for level 2\n"); exit(1); }
+			fclose(Debug_File);
 		}
-		fclose(debug_file);
+		if (sram_export != SRAM_NONE)
+			Write_SRAM_Image(debug_basename, "coeff", SRAM_COEFF_BASE, Debug_Buffer, Debug_Size);
+		free(Debug_Buffer);
 		free(debug_data);
+		debug_data = NULL;
 	}
 
-	Source_Image->Rows = Source_Rows;
-	Source_Image->Columns = Source_Columns;
+	Source_Image->Rows = Image_Rows;
+	Source_Image->Columns = Image_Columns;
 	Source_Image->Pixel_Data = Source_Data;
 
+	free(Row_Offsets);
 	fclose(Source_File);
+	return 0;
 }
 
-unsigned int Read_Coded_Block(FILE *Source_File, int Block_Data[][8], int Compression_Format) {
-	// reads a block of coefficients from the bitstream and dequantizes it
+static int Arith_Dequant_IDCT(FILE *Source_File, arith_stream *Coded_Stream, unsigned long long *Segment_Offsets) {
+	// reads the stream into memory, locates its block rows from their lengths
+	// and decodes the block rows of the region on parallel lanes; returns 1 (after
+	// printing why) for a truncated stream
+	int i, colour, Lane, Num_Lanes, Block_Rows;
+	unsigned long long Position;
+	unsigned char *Stream;
+	decoder_lane *Lanes;
+	pthread_t *Threads;
+
+	fseek(Source_File, 0, SEEK_END);
+	Coded_Stream->Stream_Size = (unsigned long long)ftell(Source_File);
+	Stream = (unsigned char *)malloc(Coded_Stream->Stream_Size);
+	fseek(Source_File, 0, SEEK_SET);
+	if (fread(Stream, 1, Coded_Stream->Stream_Size, Source_File) != Coded_Stream->Stream_Size) {
+		printf("Problem reading the compressed stream\n"); free(Stream); return 1; }
+	Coded_Stream->Stream = Stream;
+
+	// the block rows of each segment follow each other, each one preceded by its length
+	Coded_Stream->Row_Starts = (unsigned long long *)malloc((size_t)3*Coded_Stream->Block_Rows*sizeof(unsigned long long));
+	Coded_Stream->Row_Lengths = (unsigned long long *)malloc((size_t)3*Coded_Stream->Block_Rows*sizeof(unsigned long long));
+	for (colour = 0; colour < Coded_Stream->Components; colour++) {
+		Position = Segment_Offsets[colour];
+		Block_Rows = ((colour != Y) && (FORMAT_CHROMA(Coded_Stream->Compression_Format) == CHROMA_420)) ?
+			Coded_Stream->Block_Rows/2 : Coded_Stream->Block_Rows;
+		for (i = 0; i < Block_Rows; i++) {
+			if (Position + 4 > Coded_Stream->Stream_Size) {
+				printf("Compressed stream is truncated\n");
+				free(Coded_Stream->Row_Lengths); free(Coded_Stream->Row_Starts); free(Stream);
+				return 1;
+			}
+			Coded_Stream->Row_Lengths[colour*Coded_Stream->Block_Rows + i] =
+				((unsigned long long)Stream[Position] << 24) | ((unsigned long long)Stream[Position+1] << 16) |
+				((unsigned long long)Stream[Position+2] << 8) | (unsigned long long)Stream[Position+3];
+			Coded_Stream->Row_Starts[colour*Coded_Stream->Block_Rows + i] = Position + 4;
+			Position += 4 + Coded_Stream->Row_Lengths[colour*Coded_Stream->Block_Rows + i];
+		}
+		if ((colour < 2) && (Position != Segment_Offsets[colour + 1]))
+			fprintf(stdout, "Colour = %c\tEncoded byte offset = %llu\t!= Decoded byte offset = %llu\n",
+				(colour == 0) ? 'U' : 'V', Segment_Offsets[colour + 1], Position);
+	}
+
+	// one lane per processor, but no more lanes than block rows
+	Num_Lanes = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (Num_Lanes > Coded_Stream->Components*(Coded_Stream->Last_Block_Row - Coded_Stream->First_Block_Row + 1))
+		Num_Lanes = Coded_Stream->Components*(Coded_Stream->Last_Block_Row - Coded_Stream->First_Block_Row + 1);
+	if (Num_Lanes < 1) Num_Lanes = 1;
+	Coded_Stream->Num_Lanes = Num_Lanes;
+	Coded_Stream->Truncated = 0;
+
+	Lanes = (decoder_lane *)malloc(Num_Lanes*sizeof(decoder_lane));
+	Threads = (pthread_t *)malloc(Num_Lanes*sizeof(pthread_t));
+	for (Lane = 0; Lane < Num_Lanes; Lane++) {
+		Lanes[Lane].Coded_Stream = Coded_Stream;
+		Lanes[Lane].Lane = Lane;
+		if (pthread_create(&Threads[Lane], NULL, Decode_Block_Row_Lane, &Lanes[Lane])) {
+			printf("Problem starting decoding lane %d\n", Lane); exit(1); }
+	}
+	for (Lane = 0; Lane < Num_Lanes; Lane++)
+		pthread_join(Threads[Lane], NULL);
+
+	free(Threads);
+	free(Lanes);
+	free(Coded_Stream->Row_Lengths);
+	free(Coded_Stream->Row_Starts);
+	free(Stream);
+	if (Coded_Stream->Truncated) printf("Compressed stream is truncated\n");
+	return Coded_Stream->Truncated;
+}
+
+void Stream_Header(int *Rows, int *Columns, int *Compression_Format) {
+	// the image size and the format byte of the last stream read by Lossless_Dequant_IDCT
+	*Rows = header_rows;
+	*Columns = header_columns;
+	*Compression_Format = header_format;
+}
+
+static void *Decode_Block_Row_Lane(void *Lane) {
+	// decodes, dequantizes and transforms the lane's block rows of the region: a row is
+	// decoded up to the last block of the region (the whole row when not cropping, in
+	// which case its decoded length is checked against the one in the stream)
+	decoder_lane *Decoder_Lane = (decoder_lane *)Lane;
+	arith_stream *Coded_Stream = Decoder_Lane->Coded_Stream;
+	int i, j, k, t, colour, Block_Columns, First_Block_Column, Last_Block_Column, Decoded_Columns;
+	int First_Block_Row, Last_Block_Row;
+	int *Values, *Block_Quants, Block_Data[8][8];
+	long Quant_Base;
+	unsigned long long Row;
+	size_t Length;
+
+	Values = (int *)malloc((size_t)64*Coded_Stream->Block_Columns*sizeof(int));
+	Block_Quants = (int *)malloc(Coded_Stream->Block_Columns*sizeof(int));
+
+	for (colour = 0, t = 0; colour < Coded_Stream->Components; colour++) {
+		Block_Columns = (colour == Y) ? Coded_Stream->Block_Columns : Coded_Stream->Block_Columns/2;
+		First_Block_Column = (colour == Y) ? Coded_Stream->First_Block_Column : Coded_Stream->First_Block_Column/2;
+		Last_Block_Column = (colour == Y) ? Coded_Stream->Last_Block_Column : Coded_Stream->Last_Block_Column/2;
+		Decoded_Columns = (crop_rows > 0) ? Last_Block_Column + 1 : Block_Columns;
+		First_Block_Row = Coded_Stream->First_Block_Row;
+		Last_Block_Row = Coded_Stream->Last_Block_Row;
+		if ((colour != Y) && (FORMAT_CHROMA(Coded_Stream->Compression_Format) == CHROMA_420)) {
+			First_Block_Row /= 2;
+			Last_Block_Row /= 2;
+		}
+		// the first block of the component, among the kept matrices
+		Quant_Base = (colour == Y) ? 0 : (long)Coded_Stream->Block_Rows*Coded_Stream->Block_Columns;
+		if (colour == V)
+			Quant_Base += (long)((FORMAT_CHROMA(Coded_Stream->Compression_Format) == CHROMA_420) ?
+				Coded_Stream->Block_Rows/2 : Coded_Stream->Block_Rows)*Block_Columns;
+
+		for (i = First_Block_Row; i <= Last_Block_Row; i++, t++) {
+			if (t % Coded_Stream->Num_Lanes != Decoder_Lane->Lane) continue;
+			Row = colour*Coded_Stream->Block_Rows + i;
+			if (Coded_Stream->Row_Starts[Row] + Coded_Stream->Row_Lengths[Row] > Coded_Stream->Stream_Size) {
+				Coded_Stream->Truncated = 1;
+				continue;
+			}
+
+			for (j = 0; j < Decoded_Columns; j++) Block_Quants[j] = FORMAT_QUANT(Coded_Stream->Compression_Format);
+			Length = Arith_Decode_Block_Row(Coded_Stream->Stream + Coded_Stream->Row_Starts[Row],
+				(size_t)Coded_Stream->Row_Lengths[Row], Values,
+				FORMAT_ADAPTIVE(Coded_Stream->Compression_Format) ? Block_Quants : NULL,
+				Decoded_Columns, FORMAT_QUANT(Coded_Stream->Compression_Format));
+			if ((crop_rows == 0) && (Length != Coded_Stream->Row_Lengths[Row]))
+				fprintf(stdout, "Colour = %c\tBlock row %d\tEncoded length = %llu\t!= Decoded length = %llu\n",
+					(colour == 0) ? 'Y' : (colour == 1) ? 'U' : 'V', i,
+					Coded_Stream->Row_Lengths[Row], (unsigned long long)Length);
+
+			for (j = First_Block_Column; j <= Last_Block_Column; j++) {
+				if (quant_data != NULL) quant_data[Quant_Base + (long)i*Block_Columns + j] = Block_Quants[j];
+				for (k = 0; k < 64; k++)
+					Block_Data[Scan_Pattern[k]/8][Scan_Pattern[k]%8] =
+						Values[64*j + k] * Quant_Val(Scan_Pattern[k], Block_Quants[j]);
+				if (debug_data != NULL)
+					Write_Block(Block_Data, debug_data, i, j, Coded_Stream->Source_Rows, Coded_Stream->Source_Columns, colour, 8);
+				if (Coded_Stream->Transform && (Coded_Stream->Block_Size < 8)) Block_Scaled_IDCT(Block_Data, Coded_Stream->Block_Size);
+				else if (Coded_Stream->Transform) Block_IDCT(Block_Data);
+				Write_Block(Block_Data, Coded_Stream->Source_Data, i - First_Block_Row,
+					j - First_Block_Column, Coded_Stream->Image_Rows, Coded_Stream->Image_Columns,
+					colour, Coded_Stream->Block_Size);
+			}
+		}
+	}
+
+	free(Block_Quants);
+	free(Values);
+	return NULL;
+}
+
+unsigned int Read_Coded_Block(FILE *Source_File, int Block_Data[][8], int Compression_Format, int *Block_Quant,
+	int *Block_Reference
+) {
+	// reads a block of coefficients from the bitstream and dequantizes it; with adaptive
+	// quantization the block's prefix updates Block_Quant, the matrix of the previous
+	// block in the block row (else it is the matrix of the format); in a sequence,
+	// Block_Reference holds the quantized coefficients (in scan order) and the matrix
+	// of the block in the previous frame, which a skipped block keeps and a coded
+	// block replaces
 	int i, k, code;
 	unsigned int block_bits = 0;
+
+	if (FORMAT_SKIP(Compression_Format)) {
+		block_bits += 1;
+		if (Read_Bits(Source_File, 1) == BLOCK_SKIP) {
+			*Block_Quant = Block_Reference[64];
+			for (k = 0; k < 64; k++) {
+				i = Scan_Pattern[k];
+				Block_Data[i/8][i%8] = Block_Reference[k] * Quant_Val(i, *Block_Quant);
+			}
+			return block_bits;
+		}
+	}
+
+	if (FORMAT_ADAPTIVE(Compression_Format)) {
+		block_bits += 1;
+		if (Read_Bits(Source_File, 1) == QUANT_SELECT) {
+			*Block_Quant = Read_Bits(Source_File, 2); block_bits += 2;
+		}
+	}
 	
 	// Decode one block
 	k = 0;
 	while (k < 64) {
 		code = Read_Bits(Source_File, 2); block_bits += 2;
+		if (profile_enabled) Profile_Symbol(code);
 		switch(code) {
 			case ZERO_RUN : // a run of zeros
 				code = Read_Bits(Source_File, 3); block_bits += 3;
 
 				code += (code) ? k : k + 8;
+				if (code > 64) {   // only in a corrupt stream
+					code = 64;
+					overrun_blocks++;
+				}
 				while (k < code) {
 					i = Scan_Pattern[k];
 					Block_Data[i/8][i%8] = 0;
+					if (Block_Reference != NULL) Block_Reference[k] = 0;
 					k++;
 				}
 				break;
@@ -190,7 +751,8 @@ unsigned int Read_Coded_Block(FILE *Source_File, int Block_Data[][8], int Compre
 				code = Read_Bits(Source_File, 9); block_bits += 9;
 				i = Scan_Pattern[k];
 				code = (code >= 256) ? code - 512 : code;
-				code *= Quant_Val(i, Compression_Format);
+				if (Block_Reference != NULL) Block_Reference[k] = code;
+				code *= Quant_Val(i, *Block_Quant);
 				Block_Data[i/8][i%8] = code;
 				k++;
 				break;
@@ -198,7 +760,8 @@ unsigned int Read_Coded_Block(FILE *Source_File, int Block_Data[][8], int Compre
 				code = Read_Bits(Source_File, 3); block_bits += 3;
 				i = Scan_Pattern[k];
 				code = (code >= 4) ? code - 8 : code;
-				code *= Quant_Val(i, Compression_Format);
+				if (Block_Reference != NULL) Block_Reference[k] = code;
+				code *= Quant_Val(i, *Block_Quant);
 				Block_Data[i/8][i%8] = code;
 				k++;
 				break;
@@ -207,18 +770,20 @@ unsigned int Read_Coded_Block(FILE *Source_File, int Block_Data[][8], int Compre
 				while (k < code) {
 					i = Scan_Pattern[k];
 					Block_Data[i/8][i%8] = 0;
+					if (Block_Reference != NULL) Block_Reference[k] = 0;
 					k++;
 				}
 				break;
 			default : printf("Unrecognized code in bistream - terminating!\n"); exit(1);
 		}
 	} 
+	if (Block_Reference != NULL) Block_Reference[64] = *Block_Quant;
 	return block_bits;
 }
 
 int Read_Bits(FILE *Source_File, int length) {
 	// reads length bits from the bitstream (the serializer)
-	static unsigned int buffer = 0, pointer = 32;
+	unsigned int buffer = read_buffer, pointer = read_pointer;
 	unsigned int bits;
 	unsigned char read_val_H, read_val_L;
 	unsigned int read_val;
@@ -235,9 +800,58 @@ int Read_Bits(FILE *Source_File, int length) {
 	buffer <<= length;
 	pointer += length;
 
+	read_buffer = buffer;
+	read_pointer = pointer;
 	return (int)bits;
 }
 
+void Seek_Bits(FILE *Source_File, unsigned long long bit_offset) {
+	// moves the serializer to a bit offset from the start of the file;
+	// the stream is read in 16-bit words, so the word holding the offset
+	// is fetched and the bits before the offset are dropped
+	fseek(Source_File, (long)(2*(bit_offset/16)), SEEK_SET);
+	read_buffer = 0;
+	read_pointer = 32;
+	if (bit_offset % 16)
+		Read_Bits(Source_File, (int)(bit_offset % 16));
+}
+
+static unsigned long long *Read_Block_Row_Index(char *Filename, int Block_Rows) {
+	// reads the block row index (.mici) written by the encoder next to the
+	// compressed stream: the bit offset of every block row of Y, U and V; returns
+	// NULL (after printing why) for a missing index or one of another stream
+	int i, j;
+	char Index_Filename[104];
+	unsigned long long *Row_Offsets;
+	FILE *Index_File;
+
+	sprintf(Index_Filename, "%si", Filename);
+	if ((Index_File = fopen(Index_Filename, "rb")) == NULL) {
+		printf("Problem opening block row index %s (encode with -index)\n", Index_Filename); return NULL; }
+
+	if ((fgetc(Index_File) != 0xEC) || (fgetc(Index_File) != 0xE7) ||
+		(fgetc(Index_File) != 0x44) || (fgetc(Index_File) != 0x49)) {
+		printf("File %s is not a block row index\n", Index_Filename); fclose(Index_File); return NULL; }
+	for (i = 0, j = 0; j < 4; j++)
+		i = (i << 8) | fgetc(Index_File);
+	if (i != Block_Rows) {
+		printf("Block row index %s has %d block rows, expected %d\n", Index_Filename, i, Block_Rows);
+		fclose(Index_File); return NULL; }
+
+	Row_Offsets = (unsigned long long *)malloc((size_t)3*Block_Rows*sizeof(unsigned long long));
+	for (i = 0; i < 3*Block_Rows; i++) {
+		Row_Offsets[i] = 0;
+		for (j = 0; j < 8; j++)
+			Row_Offsets[i] = (Row_Offsets[i] << 8) | (unsigned long long)fgetc(Index_File);
+	}
+	if (feof(Index_File)) {
+		printf("Block row index %s is truncated\n", Index_Filename);
+		free(Row_Offsets); fclose(Index_File); return NULL; }
+
+	fclose(Index_File);
+	return Row_Offsets;
+}
+
 int Quant_Val(int location, int Compression_Format) {
 	// returns the quantization value for the current location and format
 	if (Compression_Format == 0) {
@@ -265,29 +879,46 @@ int Quant_Val(int location, int Compression_Format) {
 }
 
 void Init_IDCT_Coeffs() {
-	// initializes the IDCT coefficient matrix for the block IDCT function
-	int i, j; double s;
+	// initializes the IDCT coefficient matrices for the block IDCT functions
+	// (they are only computed on the first call of the process)
+	int i, j;
+	FILE *Debug_File;
 
-	for (i = 0; i < 8; i++) {
-		s = (i == 0) ? sqrt(1.0 / 8.0) : sqrt(2.0 / 8.0);
-		for (j = 0; j < 8; j++)
-			IDCT_Coeffs[i][j] = (int)(s*cos((PI/8.0)*i*(j + 0.5))*4096.0); // fixed point at bit 12
-	}
+	pthread_once(&IDCT_Coeffs_Once, Compute_IDCT_Coeffs);
 
 	// debug information
-	if (debug_level == 3) {
-		printf("Writing debug information for level %d to file %s\n", debug_level, debug_filename);
-		if ((debug_file = fopen(debug_filename, "wb")) == NULL) {
-			printf("Problem opening debug file %s\n", debug_filename); exit(1); }
+	if (debug_levels & DEBUG_LEVEL(3)) {
+		Debug_File = Open_Debug_File(debug_basename, 3, 'd');
 		for (i = 0; i < 8; i++) {
 			for (j = 0; j < 8; j++)
-				fprintf(debug_file, "%5d ", IDCT_Coeffs[i][j]);
-			fprintf(debug_file, "\n");
+				fprintf(Debug_File, "%5d ", IDCT_Coeffs[i][j]);
+			fprintf(Debug_File, "\n");
 		}
-		fclose(debug_file);
+		fclose(Debug_File);
 	}
 }
 
+static void Compute_IDCT_Coeffs(void) {
+	// the 8-point matrix, and the Block_Size-point matrices used for scaled decoding;
+	// their normalization is the one of the 8-point matrix, so that the first
+	// Block_Size x Block_Size coefficients of a block give its average over
+	// (8/Block_Size)x(8/Block_Size) sample areas
+	int i, j, Block_Size; double s;
+
+	for (i = 0; i < 8; i++) {
+		s = (i == 0) ? sqrt(1.0 / 8.0) : sqrt(2.0 / 8.0);
+		for (j = 0; j < 8; j++)
+			IDCT_Coeffs[i][j] = (int)(s*cos((PI/8.0)*i*(j + 0.5))*(double)(1 << DCT_COEFF_BITS)); // fixed point at bit DCT_COEFF_BITS
+	}
+
+	for (Block_Size = 1; Block_Size < 8; Block_Size *= 2)
+		for (i = 0; i < Block_Size; i++) {
+			s = (i == 0) ? sqrt(1.0 / 8.0) : sqrt(2.0 / 8.0);
+			for (j = 0; j < Block_Size; j++)
+				Scaled_IDCT_Coeffs[Block_Size/2][i][j] = (int)(s*cos((PI/Block_Size)*i*(j + 0.5))*(double)(1 << DCT_COEFF_BITS)); // fixed point at bit DCT_COEFF_BITS
+		}
+}
+
 void Block_IDCT(int Block_Data[][8])
 {
 	int i, j, k, s, temp[8][8];
@@ -298,7 +929,7 @@ void Block_IDCT(int Block_Data[][8])
 			s = 0;
 			for (k = 0; k < 8; k++)
 				s += Block_Data[i][k] * IDCT_Coeffs[k][j];
-			temp[i][j] = s >> 8;
+			temp[i][j] = s >> DCT_FIRST_SHIFT;
 		}
 
 	// pre-multiplication with the transponsed coefficient matrix
@@ -307,54 +938,69 @@ void Block_IDCT(int Block_Data[][8])
 			s = 0;
 			for (k = 0; k < 8; k++)
 				s += IDCT_Coeffs[k][i] * temp[k][j];
-			s >>= 16;
+			s >>= DCT_SECOND_SHIFT;
+			s = (s > 255) ? 255 : (s < 0) ? 0 : s; // clipping to ensure values on 8 bits (0 .. 255)
+			Block_Data[i][j] = s;
+		}
+}
+
+void Block_Scaled_IDCT(int Block_Data[][8], int Block_Size)
+{
+	// reconstructs the top-left Block_Size x Block_Size samples of the block from
+	// its low-frequency coefficients, with the same rounding as Block_IDCT
+	int i, j, k, s, temp[8][8];
+	int (*Scaled_Coeffs)[8] = Scaled_IDCT_Coeffs[Block_Size/2];
+
+	// 1x1: the DC coefficient alone gives the block average, no transform needed
+	if (Block_Size == 1) {
+		s = (Scaled_Coeffs[0][0] * ((Block_Data[0][0] * Scaled_Coeffs[0][0]) >> DCT_FIRST_SHIFT)) >> DCT_SECOND_SHIFT;
+		Block_Data[0][0] = (s > 255) ? 255 : (s < 0) ? 0 : s;
+		return;
+	}
+
+	// post-multiplication with the coefficient matrix
+	for (i = 0; i < Block_Size; i++)
+		for (j = 0; j < Block_Size; j++) {
+			s = 0;
+			for (k = 0; k < Block_Size; k++)
+				s += Block_Data[i][k] * Scaled_Coeffs[k][j];
+			temp[i][j] = s >> DCT_FIRST_SHIFT;
+		}
+
+	// pre-multiplication with the transponsed coefficient matrix
+	for (j = 0; j < Block_Size; j++)
+		for (i = 0; i < Block_Size; i++) {
+			s = 0;
+			for (k = 0; k < Block_Size; k++)
+				s += Scaled_Coeffs[k][i] * temp[k][j];
+			s >>= DCT_SECOND_SHIFT;
 			s = (s > 255) ? 255 : (s < 0) ? 0 : s; // clipping to ensure values on 8 bits (0 .. 255)
 			Block_Data[i][j] = s;
 		}
 }
 
 static void Write_Block(int Block_Data[][8], int *IDCT_Data,
-		int Block_Row, int Block_Column, int Rows, int Columns, int colour
+		int Block_Row, int Block_Column, int Rows, int Columns, int colour, int Block_Size
 		) {
 	// opposite of fetch block, writes a block back into the image/plane data array
+	// (the top-left Block_Size x Block_Size samples, 8 unless decoding is scaled)
 	int i, j;
 
-	for (i = 0; i < 8; i++)
-		for (j = 0; j < 8; j++)
-			IDCT_Data[YUV_index(Rows, Columns, 8*Block_Row+i, 8*Block_Column+j, colour)] =
+	for (i = 0; i < Block_Size; i++)
+		for (j = 0; j < Block_Size; j++)
+			IDCT_Data[YUV_index(Rows, Columns, Block_Size*Block_Row+i, Block_Size*Block_Column+j, colour)] =
 				Block_Data[i][j];
 }
 
 void Interpolate_Colourspace(image *IDCT_Image, image *Upsampled_Image) {
-	// performs upsampling(interpolation) and colourspace conversion on YUV to obtain RGB
-	int i, j, colour, IDCT_Rows, IDCT_Columns, Upsampled_Rows, Upsampled_Columns;
+	// performs upsampling(interpolation) and colourspace conversion on YUV to obtain RGB;
+	// in 4:2:0 the U and V rows are first interpolated along the columns (even rows are
+	// copied, odd rows are filtered with the same taps as the columns)
+	int i, t, r, IDCT_Rows, IDCT_Columns, Upsampled_Rows, Upsampled_Columns, Chroma_Rows;
 	int *IDCT_Data, *Upsampled_Data;
-	int Y_val, U_val, V_val, R_val, G_val, B_val;
-	int jm2, jm1, jp1, jp2, jp3;
-	int YUV_RGB_matrix[9] = {
-		76284,    0  , 104595,
-		76284,  25624,  53281,
-		76284, 132251,    0   };
-
-	// debug information
-	if (debug_level == 1) {
-		printf("Writing debug information for level %d to file %s\n", debug_level, debug_filename);
-		Upsampled_Rows = IDCT_Image->Rows;
-		Upsampled_Columns = IDCT_Image->Columns;
-		IDCT_Rows = Upsampled_Rows;
-		IDCT_Columns = Upsampled_Columns;
-		debug_data = IDCT_Image->Pixel_Data;
-		if ((debug_file = fopen(debug_filename, "wb")) == NULL) {
-			printf("Problem opening debug file %s\n", debug_filename); exit(1); }
-		for (colour = 0; colour < 3; colour++) {
-			for (i = 0; i < IDCT_Rows; i++)
-				for (j = 0; j < IDCT_Columns; j++)
-					fprintf(debug_file, "%c", debug_data[YUV_index(
-								Upsampled_Rows, Upsampled_Columns, i, j, colour)]);
-			if (colour == Y) IDCT_Columns /= 2;
-		}
-		fclose(debug_file);
-	}
+	int *U_Row, *V_Row, *U_Column, *V_Column;
+	const int *U_Window[6], *V_Window[6];
+	short *Chroma_Scratch;
 
 	IDCT_Rows = IDCT_Image->Rows;
 	IDCT_Columns = IDCT_Image->Columns;
@@ -363,68 +1009,47 @@ void Interpolate_Colourspace(image *IDCT_Image, image *Upsampled_Image) {
 	// Upsampling
 	Upsampled_Rows = IDCT_Rows;
 	Upsampled_Columns = IDCT_Columns;
-	Upsampled_Data = (int *)malloc(Upsampled_Rows*Upsampled_Columns*3*sizeof(int));
+	Upsampled_Data = (int *)Arena_Plane(&Codec_Context()->Upsampled_Data,
+		(size_t)Upsampled_Rows*Upsampled_Columns*3*sizeof(int));
 
-	for (i = 0; i < Upsampled_Rows; i++)
-		for (j = 0; j < Upsampled_Columns; j++) {
-			Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, G)] =
-				IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, j, Y)];
-
-			jm2 = (j/2 < 2) ? 0 : j/2 - 2;
-			jm1 = (j/2 < 1) ? 0 : j/2 - 1;
-			jp1 = (j/2 < (Upsampled_Columns/2 - 1)) ? j/2 + 1 : Upsampled_Columns/2 - 1;
-			jp2 = (j/2 < (Upsampled_Columns/2 - 2)) ? j/2 + 2 : Upsampled_Columns/2 - 1;
-			jp3 = (j/2 < (Upsampled_Columns/2 - 3)) ? j/2 + 3 : Upsampled_Columns/2 - 1;
-
-			if (j%2 == 0) {
-				Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, B)] =
-					IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, j/2, U)];
-				Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, R)] =
-					IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, j/2, V)];
-			} else {
+	// the rows and the filter scratch share the row arena
+	U_Row = (int *)Arena_Plane(&Codec_Context()->Row_Data,
+		(size_t)3*Upsampled_Columns*sizeof(int) + CHROMA_SCRATCH_SIZE(Upsampled_Columns)*sizeof(short));
+	V_Row = U_Row + Upsampled_Columns;
+	U_Column = V_Row + Upsampled_Columns;
+	V_Column = U_Column + Upsampled_Columns/2;
+	Chroma_Scratch = (short *)(V_Column + Upsampled_Columns/2);
+	Chroma_Rows = (header_chroma == CHROMA_420) ? IDCT_Rows/2 : IDCT_Rows;
 
-				Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, B)] = (
-						21 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jm2, U)] -
-						52 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jm1, U)] +
-						159 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, j/2, U)] +
-						159 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jp1, U)] -
-						52 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jp2, U)] +
-						21 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jp3, U)] +
-						128) >> 8;
-
-				Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, R)] = (
-						21 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jm2, V)] -
-						52 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jm1, V)] +
-						159 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, j/2, V)] +
-						159 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jp1, V)] -
-						52 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jp2, V)] +
-						21 * IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, jp3, V)] +
-						128) >> 8;
+	for (i = 0; i < Upsampled_Rows; i++) {
+		if (header_chroma == CHROMA_420) {
+			if (i % 2) {
+				for (t = 0; t < 6; t++) {
+					r = i/2 - 2 + t;
+					r = (r < 0) ? 0 : (r > Chroma_Rows - 1) ? Chroma_Rows - 1 : r;
+					U_Window[t] = &IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, r, 0, U)];
+					V_Window[t] = &IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, r, 0, V)];
+				}
+				Upsample_Chroma_Column(U_Window, U_Column, Upsampled_Columns/2);
+				Upsample_Chroma_Column(V_Window, V_Column, Upsampled_Columns/2);
+			} else {
+				memcpy(U_Column, &IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i/2, 0, U)], (Upsampled_Columns/2)*sizeof(int));
+				memcpy(V_Column, &IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i/2, 0, V)], (Upsampled_Columns/2)*sizeof(int));
 			}
+		} else {
+			U_Column = &IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, 0, U)];
+			V_Column = &IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, 0, V)];
 		}
 
-	// Colourspace conversion
-	for (i = 0; i < Upsampled_Rows; i++)
-		for (j = 0; j < Upsampled_Columns; j++) {
-			Y_val = Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, G)] - 16;
-			U_val = Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, B)] - 128;
-			V_val = Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, R)] - 128;
-
-			R_val = YUV_RGB_matrix[0]*Y_val + YUV_RGB_matrix[1]*U_val + YUV_RGB_matrix[2]*V_val;
-			G_val = YUV_RGB_matrix[3]*Y_val - YUV_RGB_matrix[4]*U_val - YUV_RGB_matrix[5]*V_val;
-			B_val = YUV_RGB_matrix[6]*Y_val + YUV_RGB_matrix[7]*U_val + YUV_RGB_matrix[8]*V_val;
+		// even columns are copied, odd columns are interpolated with
+		// taps 21, -52, 159, 159, -52, 21, done a row at a time
+		Upsample_Chroma_Row(U_Column, U_Row, Upsampled_Columns, Chroma_Scratch);
+		Upsample_Chroma_Row(V_Column, V_Row, Upsampled_Columns, Chroma_Scratch);
 
-			R_val >>= 16; G_val >>= 16; B_val >>= 16;
-
-			// clipping to keep the range on 8 bits (0 .. 255)
-			R_val = (R_val < 0) ? 0 : (R_val > 255) ? 255 : R_val;
-			G_val = (G_val < 0) ? 0 : (G_val > 255) ? 255 : G_val;
-			B_val = (B_val < 0) ? 0 : (B_val > 255) ? 255 : B_val;
-
-			Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, R)] = R_val;
-			Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, G)] = G_val;
-			Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, B)] = B_val;
-		}
+		// Colourspace conversion
+		YUV_To_RGB_Row(&IDCT_Data[YUV_index(IDCT_Rows, IDCT_Columns, i, 0, Y)], U_Row, V_Row,
+			&Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, 0, R)], Upsampled_Columns);
+	}
 
 	Upsampled_Image->Rows = Upsampled_Rows;
 	Upsampled_Image->Columns = Upsampled_Columns;
@@ -462,3 +1087,145 @@ void Write_PPM_Image(image *Upsampled_Image, char *Filename) {
 
 	fclose(outfile);
 }
+
+void Write_YUV_Image(image *IDCT_Image, char *Filename, int Components) {
+	// writes the first Components planes of the decoded (pre-interpolation) image,
+	// as 8-bit samples, Y first (full width) followed by U and V (half width, and
+	// half height in 4:2:0)
+	int i, j, colour, Rows, Columns;
+	int *IDCT_Data;
+	unsigned char *Row_Buffer;
+	FILE *outfile;
+
+	// Open the file
+	if ((outfile = fopen(Filename, "wb")) == NULL) {
+		printf("Problem opening destination YUV image %s\n", Filename); exit(1); }
+
+	Rows = IDCT_Image->Rows;
+	Columns = IDCT_Image->Columns;
+	IDCT_Data = IDCT_Image->Pixel_Data;
+	Row_Buffer = (unsigned char *)Arena_Plane(&Codec_Context()->Row_Data, Columns*sizeof(unsigned char));
+
+	for (colour = 0; colour < Components; colour++)
+		for (i = 0; i < (((colour != Y) && (header_chroma == CHROMA_420)) ? Rows/2 : Rows); i++) {
+			for (j = 0; j < YUV_row_step(colour, Columns); j++)
+				Row_Buffer[j] = IDCT_Data[YUV_index(Rows, Columns, i, j, colour)] & 0xFF;
+			fwrite(Row_Buffer, sizeof(unsigned char), YUV_row_step(colour, Columns), outfile);
+		}
+
+	fclose(outfile);
+}
+
+void Write_RGB_Image(image *Upsampled_Image, char *Filename) {
+	// writes the decompressed image as raw interleaved RGB samples (a .ppm without header)
+	int i, j, Upsampled_Rows, Upsampled_Columns;
+	int *Upsampled_Data;
+	unsigned char *Row_Buffer;
+	FILE *outfile;
+
+	// Open the file
+	if ((outfile = fopen(Filename, "wb")) == NULL) {
+		printf("Problem opening destination RGB image %s\n", Filename); exit(1); }
+
+	Upsampled_Rows = Upsampled_Image->Rows;
+	Upsampled_Columns = Upsampled_Image->Columns;
+	Upsampled_Data = Upsampled_Image->Pixel_Data;
+	Row_Buffer = (unsigned char *)Arena_Plane(&Codec_Context()->Row_Data, (size_t)3*Upsampled_Columns*sizeof(unsigned char));
+
+	for (i = 0; i < Upsampled_Rows; i++) {
+		for (j = 0; j < 3*Upsampled_Columns; j++)
+			Row_Buffer[j] = Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, 0, R) + j];
+		fwrite(Row_Buffer, sizeof(unsigned char), 3*Upsampled_Columns, outfile);
+	}
+
+	fclose(outfile);
+}
+
+static void Write_Little_Endian(FILE *outfile, unsigned int value, int bytes) {
+	// writes a bytes-wide field of a .bmp header, least significant byte first
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		fputc((value >> (8 * i)) & 0xFF, outfile);
+}
+
+void Write_BMP_Image(image *Upsampled_Image, char *Filename) {
+	// writes the decompressed image as a 24-bit uncompressed .bmp (BITMAPINFOHEADER),
+	// i.e. the format accepted by Parse_bmp: bottom-up rows of BGR padded to 32 bits
+	int i, j, Upsampled_Rows, Upsampled_Columns, Row_Size;
+	int *Upsampled_Data;
+	unsigned char *Row_Buffer;
+	FILE *outfile;
+
+	// Open the file
+	if ((outfile = fopen(Filename, "wb")) == NULL) {
+		printf("Problem opening destination BMP image %s\n", Filename); exit(1); }
+
+	Upsampled_Rows = Upsampled_Image->Rows;
+	Upsampled_Columns = Upsampled_Image->Columns;
+	Upsampled_Data = Upsampled_Image->Pixel_Data;
+	Row_Size = ((Upsampled_Columns * 24 + 31) / 32) * 4;
+	Row_Buffer = (unsigned char *)Arena_Plane(&Codec_Context()->Row_Data, Row_Size*sizeof(unsigned char));
+	memset(Row_Buffer, 0, Row_Size);   // the padding
+
+	// file header (14 bytes) and DIB header (40 bytes)
+	fprintf(outfile, "BM");
+	Write_Little_Endian(outfile, 14 + 40 + Row_Size * Upsampled_Rows, 4);
+	Write_Little_Endian(outfile, 0, 4);
+	Write_Little_Endian(outfile, 14 + 40, 4);
+	Write_Little_Endian(outfile, 40, 4);
+	Write_Little_Endian(outfile, Upsampled_Columns, 4);
+	Write_Little_Endian(outfile, Upsampled_Rows, 4);
+	Write_Little_Endian(outfile, 1, 2);                          // colour planes
+	Write_Little_Endian(outfile, 24, 2);                         // bits per pixel
+	Write_Little_Endian(outfile, 0, 4);                          // no compression
+	Write_Little_Endian(outfile, Row_Size * Upsampled_Rows, 4);
+	Write_Little_Endian(outfile, 2835, 4);                       // 72 DPI
+	Write_Little_Endian(outfile, 2835, 4);
+	Write_Little_Endian(outfile, 0, 4);
+	Write_Little_Endian(outfile, 0, 4);
+
+	for (i = Upsampled_Rows - 1; i >= 0; i--) {
+		for (j = 0; j < Upsampled_Columns; j++) {
+			Row_Buffer[3*j+0] = Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, B)];
+			Row_Buffer[3*j+1] = Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, G)];
+			Row_Buffer[3*j+2] = Upsampled_Data[RGB_index(Upsampled_Rows, Upsampled_Columns, i, j, R)];
+		}
+		fwrite(Row_Buffer, sizeof(unsigned char), Row_Size, outfile);
+	}
+
+	fclose(outfile);
+}
+
+static void Crop_Image(image *Region_Image, int Components, int Interleaved,
+	int Row, int Column, int Crop_Rows, int Crop_Columns
+) {
+	// cuts the Crop_Rows x Crop_Columns rectangle at (Row, Column) out of the decoded
+	// region, in place, either from the planar YUV layout (first Components planes)
+	// or from interleaved RGB
+	int i, j, colour, Rows, Columns;
+	int *Data;
+
+	Rows = Region_Image->Rows;
+	Columns = Region_Image->Columns;
+	Data = Region_Image->Pixel_Data;
+
+	// the cropped image is never larger than the region, and it is
+	// filled in the same order as it is read, so the copy can be in place
+	if (Interleaved) {
+		for (i = 0; i < Crop_Rows; i++)
+			for (j = 0; j < 3*Crop_Columns; j++)
+				Data[RGB_index(Crop_Rows, Crop_Columns, i, 0, R) + j] =
+					Data[RGB_index(Rows, Columns, Row + i, Column, R) + j];
+	} else {
+		for (colour = 0; colour < Components; colour++)
+			for (i = 0; i < (((colour != Y) && (header_chroma == CHROMA_420)) ? Crop_Rows/2 : Crop_Rows); i++)
+				for (j = 0; j < YUV_row_step(colour, Crop_Columns); j++)
+					Data[YUV_index(Crop_Rows, Crop_Columns, i, j, colour)] =
+						Data[YUV_index(Rows, Columns, (((colour != Y) && (header_chroma == CHROMA_420)) ? Row/2 : Row) + i,
+							(colour ? Column/2 : Column) + j, colour)];
+	}
+
+	Region_Image->Rows = Crop_Rows;
+	Region_Image->Columns = Crop_Columns;
+}
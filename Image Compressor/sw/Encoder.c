@@ -6,6 +6,8 @@ Ontario, Canada
 */
 
 #include "Coding.h"
+#include <pthread.h>
+#include <unistd.h>
 
 // image data type
 typedef struct image_struct {
@@ -13,49 +15,312 @@ typedef struct image_struct {
 	double *Pixel_Data;
 } image;
 
-// coefficient matrix for DCT
-double DCT_Coeffs[8][8];
+// coefficient matrices for the DCT, in fixed point and in double precision (for debug
+// level 4), computed once; DCT_Coeffs is the one used by the calling thread
+static double DCT_Fixed_Coeffs[8][8], DCT_Double_Coeffs[8][8];
+static pthread_once_t DCT_Coeffs_Once = PTHREAD_ONCE_INIT;
+static __thread double (*DCT_Coeffs)[8] = DCT_Fixed_Coeffs;
+
+// input formats for the source image
+#define INPUT_PPM    0   // RGB .ppm image, converted to YUV and filtered (default)
+#define INPUT_Y4M    1   // first frame of a .y4m stream, 8-bit 4:2:2 (or 4:2:0 for a 4:2:0 encode)
+#define INPUT_YUV422 2   // raw planar 4:2:2 samples (.yuv, as written by -decode -out yuv422)
 
 // global variables (with limited scope) related to debug
 // (for generating hardware validation data)
-static int debug_level;
-static double *debug_data;
-static char debug_filename[100];
-static FILE *debug_file;
+static int debug_levels;
+static char debug_basename[100];
+
+// size of the source image before it is padded to whole blocks (this is
+// the size recorded in the stream header)
+static int Image_Rows, Image_Columns;
+
+// format the image is transformed for (the chroma subsampling is shared by
+// all the streams of a multi-format encode)
+static int Image_Format;
+
+// set once the image size is known for all the frames of a sequence, after
+// which the frames are fetched in parallel and only checked against it
+static int Image_Size_Fixed = 0;
+
+// state of the serializer in Write_Bits, one per thread since
+// the streams of a multi-format encode are coded in parallel
+static __thread unsigned int write_buffer = 0, write_pointer = 0;
+
+// one compressed stream of a multi-format encode
+typedef struct lossless_job_struct {
+	image *DCT_Image;
+	char Filename[120];
+	int Compression_Format, Scan_Cutoff, Write_Index;
+	int Status;   // of Lossless_Coding, checked once the threads are joined
+} lossless_job;
+
+// the frames of a sequence encode, coded in groups: the first frame of a group is a plain
+// stream, the others skip the blocks whose quantized coefficients match (within
+// Skip_Threshold) the ones the decoder holds from the previous frame; the groups are
+// independent, so the workers take them in turn from Next_Group
+typedef struct sequence_job_struct {
+	char *Source_Filename, *Destination_Filename;
+	int Input_Format, Input_Columns, Input_Rows, Compression_Format, Write_Index;
+	int Num_Frames, Group_Size, Skip_Threshold, Next_Group;
+	int Status;   // set by the first group that fails, the others stop
+	pthread_mutex_t Group_Lock;
+} sequence_job;
+
+// scan positions after which rate control zeroes the coefficients of
+// every block, for the candidates coarser than quantization matrix Q0
+static const int Scan_Cutoffs[] = { 48, 36, 28, 21, 15, 10, 6, 3, 1 };
+#define NUM_SCAN_CUTOFFS ((int)(sizeof(Scan_Cutoffs)/sizeof(Scan_Cutoffs[0])))
+
+// adaptive quantization: blocks whose AC activity (the sum of the magnitudes of the
+// AC coefficients out of the DCT) is below these thresholds use the matrix one or
+// two steps coarser than the format's matrix
+#define ACTIVITY_FLAT   400.0
+#define ACTIVITY_SMOOTH 1600.0
 
 // function prototypes
+static int Input_Format_Code(char *);
+static void *Encode_Group_Thread(void *);
+static void Fetch_Frame(sequence_job *, int, image *);
 void Fetch_Image(char *, image *);
+int  Encode_RGB_Image(unsigned char *, int, int, int, char *, int);
+static void Replicate_Edges(double *, int, int);
+void Fetch_YUV_Image(char *, int, int, int, int, image *);
 void Colour_Space_422(image *, image *);
+static void Decimate_Chroma_Columns(double *, int, int, int);
+static void Write_Debug_Planes(double *, int, int, int, int);
+static void Write_SRAM_Regions(image *, image *, image *);
 void Discrete_Cosine_Transform(image *, image *, int);
 void Init_DCT_Coeffs(void);
+static void Compute_DCT_Coeffs(void);
 static void Fetch_Block(double *, double [][8], int, int, int, int, int);
 void Quantize_Block(double [][8], int);
 void Block_DCT(double [][8]);
 static void Write_Block(double [][8], double *, int, int, int, int, int);
-void Lossless_Coding(image *, char *, int);
+int  Rate_Control(image *, int, long long, int *);
+static void Truncate_Block(double [][8], int);
+int  Adaptive_Quant(double [][8], int);
+int  Lossless_Coding(image *, char *, int, int, int, int *, int, int *);
+void Code_Coefficients(image *, int *, int, int, char *, int, int);
+static void *Lossless_Coding_Thread(void *);
+static int  Same_Block(int *, int, int *, int);
+static void Scan_Block(double [][8], int *);
+unsigned int Coded_Block_Bits(int *, int);
 unsigned int Write_Coded_Block(double [][8], FILE *);
 unsigned int Write_Bits(FILE *, int, int);
 
-void Encoder(char *Source_Filename, int Compression_Format, char *Destination_Filename, int debug_info) {
+void Encoder(char *Source_Filename, int *Compression_Formats, int Num_Formats,
+	char *Destination_Filename, int debug_info, int Write_Index,
+	long long Target_Bytes, double Target_BPP, char *Input_Name, int Input_Columns, int Input_Rows
+) {
+	// encodes the image once for each of the Num_Formats formats; the colourspace
+	// conversion and the DCT do not depend on the format, so they are done once and
+	// the quantization and lossless coding of each format run in parallel (when there
+	// is more than one format, the output files are Destination_Filename_q<format>.mic);
+	// with a target size (in bytes, or in bits per pixel) the single format is only
+	// the finest one considered, and rate control picks the one that fits the target;
+	// a source that is already in YUV goes straight to the DCT (Input_Columns and
+	// Input_Rows give the size of a raw .yuv source)
 	image Source_Image, Downsampled_Image, DCT_Image;
+	lossless_job *Jobs;
+	pthread_t *Threads;
+	int k, Input_Format;
+	char Index_Filename[124];
+
+	Input_Format = Input_Format_Code(Input_Name);
 
 	// setup for debug
-	debug_level = debug_info;
-	sprintf(debug_filename, "%s.d%de", Destination_Filename, debug_level);
+	debug_levels = debug_info;
+	Image_Format = Compression_Formats[0];
+	strcpy(debug_basename, Destination_Filename);
+	Init_DCT_Coeffs();
 
-	strcat(Source_Filename, ".ppm");
-	strcat(Destination_Filename, ".mic");
-	printf("Encoding image %s to file %s\n", Source_Filename, Destination_Filename);
+	Jobs = (lossless_job *)malloc(Num_Formats*sizeof(lossless_job));
+	Threads = (pthread_t *)malloc(Num_Formats*sizeof(pthread_t));
+	for (k = 0; k < Num_Formats; k++) {
+		Jobs[k].DCT_Image = &DCT_Image;
+		Jobs[k].Compression_Format = Compression_Formats[k];
+		Jobs[k].Scan_Cutoff = 64;
+		Jobs[k].Write_Index = Write_Index;
+		Jobs[k].Status = 0;
+		if (Num_Formats == 1) sprintf(Jobs[k].Filename, "%s.mic", Destination_Filename);
+		else sprintf(Jobs[k].Filename, "%s_q%d.mic", Destination_Filename, FORMAT_QUANT(Compression_Formats[k]));
+	}
+
+	strcat(Source_Filename, (Input_Format == INPUT_Y4M) ? ".y4m" : (Input_Format == INPUT_YUV422) ? ".yuv" : ".ppm");
+	for (k = 0; k < Num_Formats; k++)
+		printf("Encoding image %s to file %s\n", Source_Filename, Jobs[k].Filename);
 
 	// Compress the image
-	Fetch_Image(Source_Filename, &Source_Image);
-	Colour_Space_422(&Source_Image, &Downsampled_Image);
-	Discrete_Cosine_Transform(&Downsampled_Image, &DCT_Image, Compression_Format);
-	Lossless_Coding(&DCT_Image, Destination_Filename, Compression_Format);
+	if (Input_Format == INPUT_PPM) {
+		Profile_Begin("Fetch_Image");
+		Fetch_Image(Source_Filename, &Source_Image);
+		Profile_End("Fetch_Image");
+		if (sram_format != SRAM_NONE)
+			Write_SRAM_Regions(&Source_Image, NULL, NULL);
+		Profile_Begin("Colour_Space_422");
+		Colour_Space_422(&Source_Image, &Downsampled_Image);
+		Profile_End("Colour_Space_422");
+	} else {
+		Source_Image.Pixel_Data = NULL;
+		Profile_Begin("Fetch_YUV_Image");
+		Fetch_YUV_Image(Source_Filename, Input_Format, Input_Columns, Input_Rows, 0, &Downsampled_Image);
+		Profile_End("Fetch_YUV_Image");
+	}
+	Profile_File(Source_Filename, 0);
+	if (debug_levels & DEBUG_LEVEL(1))
+		Write_Debug_Planes(Downsampled_Image.Pixel_Data, Downsampled_Image.Rows, Downsampled_Image.Columns, 1, 1);
+	Profile_Begin("Discrete_Cosine_Transform");
+	Discrete_Cosine_Transform(&Downsampled_Image, &DCT_Image, Compression_Formats[0]);
+	Profile_End("Discrete_Cosine_Transform");
+	if (sram_format != SRAM_NONE)
+		Write_SRAM_Regions(NULL, &Downsampled_Image, &DCT_Image);
+	if (Target_BPP > 0.0)
+		Target_Bytes = (long long)(Target_BPP * (double)Image_Rows * (double)Image_Columns / 8.0);
+	if (Target_Bytes > 0) {
+		Profile_Begin("Rate_Control");
+		Jobs[0].Compression_Format = Rate_Control(&DCT_Image, Compression_Formats[0], Target_Bytes, &Jobs[0].Scan_Cutoff);
+		Profile_End("Rate_Control");
+	}
+	Profile_Begin("Lossless_Coding");
+	if (Num_Formats == 1) Lossless_Coding_Thread(&Jobs[0]);
+	else {
+		for (k = 0; k < Num_Formats; k++)
+			if (pthread_create(&Threads[k], NULL, Lossless_Coding_Thread, &Jobs[k])) {
+				printf("Problem starting the encoding thread for format %d\n", Compression_Formats[k]); exit(1); }
+		for (k = 0; k < Num_Formats; k++)
+			pthread_join(Threads[k], NULL);
+	}
+	Profile_End("Lossless_Coding");
+	for (k = 0; k < Num_Formats; k++)
+		if (Jobs[k].Status) exit(1);
+
+	// the component sizes are those of the first stream
+	for (k = 0; profile_enabled && (k < Num_Formats); k++) {
+		Profile_File(Jobs[k].Filename, 1);
+		if (Write_Index) {
+			sprintf(Index_Filename, "%si", Jobs[k].Filename);
+			Profile_File(Index_Filename, 1);
+		}
+	}
+	Profile_Stream(Jobs[0].Filename);   // the only one, -profile takes a single format
+
+	free(Threads);
+	free(Jobs);
+}
+
+void Encode_Sequence(char *Source_Filename, int Compression_Format, char *Destination_Filename,
+	int Write_Index, int Num_Frames, int Group_Size, int Skip_Threshold,
+	char *Input_Name, int Input_Columns, int Input_Rows
+) {
+	// encodes Num_Frames frames, from Source_Filename_<frame>.ppm (numbered from 0000)
+	// or the frames of a .y4m or .yuv source, to Destination_Filename_<frame>.mic, in
+	// groups of Group_Size frames coded in parallel
+	sequence_job Job;
+	image First_Frame;
+	pthread_t *Threads;
+	int k, Num_Groups, Num_Workers;
+
+	Job.Input_Format = Input_Format_Code(Input_Name);
+	Job.Source_Filename = Source_Filename;
+	Job.Destination_Filename = Destination_Filename;
+	Job.Input_Columns = Input_Columns;
+	Job.Input_Rows = Input_Rows;
+	Job.Compression_Format = Compression_Format;
+	Job.Write_Index = Write_Index;
+	Job.Num_Frames = Num_Frames;
+	Job.Group_Size = Group_Size;
+	Job.Skip_Threshold = Skip_Threshold;
+	Job.Next_Group = 0;
+	Job.Status = 0;
+	pthread_mutex_init(&Job.Group_Lock, NULL);
+
+	debug_levels = 0;
+	Image_Format = Compression_Format;
+	Init_DCT_Coeffs();
+
+	if (Job.Input_Format != INPUT_PPM)
+		strcat(Source_Filename, (Job.Input_Format == INPUT_Y4M) ? ".y4m" : ".yuv");
+	printf("Encoding %d frames of %s%s to files %s_<frame>.mic, in groups of %d frames\n", Num_Frames,
+		Source_Filename, (Job.Input_Format == INPUT_PPM) ? "_<frame>.ppm" : "", Destination_Filename, Group_Size);
+
+	// the size of the first frame is the size of all the frames
+	Fetch_Frame(&Job, 0, &First_Frame);
+	Image_Size_Fixed = 1;
+
+	// one worker per processor, but no more workers than groups
+	Num_Groups = (Num_Frames + Group_Size - 1)/Group_Size;
+	Num_Workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (Num_Workers > Num_Groups) Num_Workers = Num_Groups;
+	if (Num_Workers < 1) Num_Workers = 1;
+
+	Threads = (pthread_t *)malloc(Num_Workers*sizeof(pthread_t));
+	for (k = 0; k < Num_Workers; k++)
+		if (pthread_create(&Threads[k], NULL, Encode_Group_Thread, &Job)) {
+			printf("Problem starting the encoding thread for group %d\n", k); exit(1); }
+	for (k = 0; k < Num_Workers; k++)
+		pthread_join(Threads[k], NULL);
+
+	free(Threads);
+	pthread_mutex_destroy(&Job.Group_Lock);
+	Image_Size_Fixed = 0;
+	if (Job.Status) exit(1);
+}
+
+static void *Encode_Group_Thread(void *Sequence) {
+	// takes the groups of frames in turn, keeping for each group the quantized coefficients
+	// (and matrix) of every block as the decoder holds them, 65 values per block
+	sequence_job *Job = (sequence_job *)Sequence;
+	image Downsampled_Image, DCT_Image;
+	int Group, Frame, Status, *Reference;
+	char Filename[120];
+
+	while (1) {
+		pthread_mutex_lock(&Job->Group_Lock);
+		Group = Job->Next_Group++;
+		Status = Job->Status;
+		pthread_mutex_unlock(&Job->Group_Lock);
+		if (Status || (Group*Job->Group_Size >= Job->Num_Frames)) break;
+
+		Reference = NULL;
+		for (Frame = Group*Job->Group_Size; (Frame < (Group + 1)*Job->Group_Size) && (Frame < Job->Num_Frames); Frame++) {
+			Fetch_Frame(Job, Frame, &Downsampled_Image);
+			Discrete_Cosine_Transform(&Downsampled_Image, &DCT_Image, Job->Compression_Format);
+			if (Reference == NULL)
+				Reference = (int *)calloc((size_t)65*(DCT_Image.Rows/8)*(DCT_Image.Columns/8)*2, sizeof(int));
+			sprintf(Filename, "%s_%04d.mic", Job->Destination_Filename, Frame);
+			if (Lossless_Coding(&DCT_Image, Filename, (Frame == Group*Job->Group_Size) ?
+				Job->Compression_Format : Job->Compression_Format | (1 << 5),
+				64, Job->Write_Index, Reference, Job->Skip_Threshold, NULL)) {
+				pthread_mutex_lock(&Job->Group_Lock);
+				Job->Status = 1;
+				pthread_mutex_unlock(&Job->Group_Lock);
+				break;
+			}
+		}
+		free(Reference);
+	}
+	return NULL;
+}
+
+static void Fetch_Frame(sequence_job *Job, int Frame, image *Downsampled_Image) {
+	// the colourspace converted and downsampled planes of one frame of a sequence
+	image Source_Image;
+	char Filename[120];
+
+	if (Job->Input_Format == INPUT_PPM) {
+		sprintf(Filename, "%s_%04d.ppm", Job->Source_Filename, Frame);
+		Fetch_Image(Filename, &Source_Image);
+		Colour_Space_422(&Source_Image, Downsampled_Image);
+	} else Fetch_YUV_Image(Job->Source_Filename, Job->Input_Format, Job->Input_Columns, Job->Input_Rows,
+		Frame, Downsampled_Image);
+}
 
-	free(DCT_Image.Pixel_Data);
-	free(Downsampled_Image.Pixel_Data);
-	free(Source_Image.Pixel_Data);
+static int Input_Format_Code(char *Input_Name) {
+	if (!strcmp(Input_Name, "ppm")) return INPUT_PPM;
+	else if (!strcmp(Input_Name, "y4m")) return INPUT_Y4M;
+	else if (!strcmp(Input_Name, "yuv422")) return INPUT_YUV422;
+	printf("Unrecognized input format %s\n", Input_Name); exit(1);
 }
 
 void Fetch_Image(char *Filename, image *Source_Image) {
@@ -75,14 +340,27 @@ void Fetch_Image(char *Filename, image *Source_Image) {
 	fscanf(Source_File, "%s", temp_string);     // max colours - usually 255
 	fgetc(Source_File);
 
-	// read the image data
-	Pixel_Data = (double *)malloc(Rows*Columns*3*sizeof(double));
-	for (i = 0; i < Rows; i++)
-		for (j = 0; j < Columns; j++) {
+	if ((Rows <= 0) || (Columns <= 0)) {
+		printf("Invalid image size %d x %d in %s\n", Columns, Rows, Filename); exit(1); }
+	if (Image_Size_Fixed && ((Rows != Image_Rows) || (Columns != Image_Columns))) {
+		printf("Image size %d x %d of %s differs from the first frame\n", Columns, Rows, Filename); exit(1); }
+	if (!Image_Size_Fixed) {
+		Image_Rows = Rows;
+		Image_Columns = Columns;
+	}
+	Rows = PADDED_ROWS(Image_Rows, Image_Format);
+	Columns = PADDED_COLUMNS(Image_Columns);
+
+	// read the image data, then replicate the last column and row
+	// into the padding that completes the edge blocks
+	Pixel_Data = (double *)Arena_Plane(&Codec_Context()->Pixel_Data, (size_t)Rows*Columns*3*sizeof(double));
+	for (i = 0; i < Image_Rows; i++)
+		for (j = 0; j < Image_Columns; j++) {
 			Pixel_Data[RGB_index(Rows,Columns,i,j,R)] = (double)((int)fgetc(Source_File));
 			Pixel_Data[RGB_index(Rows,Columns,i,j,G)] = (double)((int)fgetc(Source_File));
 			Pixel_Data[RGB_index(Rows,Columns,i,j,B)] = (double)((int)fgetc(Source_File));
 		}
+	Replicate_Edges(Pixel_Data, Rows, Columns);
 	fclose(Source_File);
 
 	Source_Image->Rows = Rows;
@@ -90,16 +368,154 @@ void Fetch_Image(char *Filename, image *Source_Image) {
 	Source_Image->Pixel_Data = Pixel_Data;
 }
 
+int Encode_RGB_Image(unsigned char *RGB_Data, int Rows, int Columns, int Compression_Format,
+	char *Destination_Filename, int Write_Index
+) {
+	// encodes Rows x Columns interleaved RGB samples in memory (in the order of a .ppm
+	// image) to Destination_Filename.mic with the single format Compression_Format, as
+	// the encoder does for a .ppm source, without debug data (for the daemon, Serve.c);
+	// returns the status of Lossless_Coding
+	image Source_Image, Downsampled_Image, DCT_Image;
+	int i, j, colour, Padded_Rows, Padded_Columns;
+	double *Pixel_Data;
+
+	debug_levels = 0;
+	Image_Format = Compression_Format;
+	Image_Rows = Rows;
+	Image_Columns = Columns;
+	Init_DCT_Coeffs();
+	strcat(Destination_Filename, ".mic");
+
+	Padded_Rows = PADDED_ROWS(Rows, Compression_Format);
+	Padded_Columns = PADDED_COLUMNS(Columns);
+	Pixel_Data = (double *)Arena_Plane(&Codec_Context()->Pixel_Data, (size_t)Padded_Rows*Padded_Columns*3*sizeof(double));
+	for (i = 0; i < Rows; i++)
+		for (j = 0; j < Columns; j++)
+			for (colour = 0; colour < 3; colour++)
+				Pixel_Data[RGB_index(Padded_Rows,Padded_Columns,i,j,colour)] = (double)RGB_Data[3*((long)i*Columns + j) + colour];
+	Replicate_Edges(Pixel_Data, Padded_Rows, Padded_Columns);
+	Source_Image.Rows = Padded_Rows;
+	Source_Image.Columns = Padded_Columns;
+	Source_Image.Pixel_Data = Pixel_Data;
+
+	Colour_Space_422(&Source_Image, &Downsampled_Image);
+	Discrete_Cosine_Transform(&Downsampled_Image, &DCT_Image, Compression_Format);
+	return Lossless_Coding(&DCT_Image, Destination_Filename, Compression_Format, 64, Write_Index, NULL, 0, NULL);
+}
+
+static void Replicate_Edges(double *Pixel_Data, int Rows, int Columns) {
+	// fills the padding of the Rows x Columns RGB image (past Image_Rows and Image_Columns)
+	// with the last column and row of the image
+	int i, j, colour;
+
+	for (i = 0; i < Image_Rows; i++)
+		for (j = Image_Columns; j < Columns; j++)
+			for (colour = 0; colour < 3; colour++)
+				Pixel_Data[RGB_index(Rows,Columns,i,j,colour)] =
+					Pixel_Data[RGB_index(Rows,Columns,i,Image_Columns-1,colour)];
+	for (i = Image_Rows; i < Rows; i++)
+		memcpy(&Pixel_Data[RGB_index(Rows,Columns,i,0,R)],
+			&Pixel_Data[RGB_index(Rows,Columns,Image_Rows-1,0,R)], 3*Columns*sizeof(double));
+}
+
+void Fetch_YUV_Image(char *Filename, int Input_Format, int Input_Columns, int Input_Rows, int Frame, image *Downsampled_Image) {
+	// reads frame Frame of a source that is already in YUV straight into the planes of the
+	// downsampled image (no colourspace conversion or filtering), padded like Fetch_Image;
+	// 4:2:2 samples are decimated along the columns for a 4:2:0 encode
+	int i, j, f, colour, Rows, Columns, Input_Chroma, Sample_Rows, Sample_Columns, Plane_Rows, Plane_Columns;
+	long Frame_Bytes;
+	char Header[1024], *Token, *Position;
+	unsigned char *Row_Buffer;
+	double *Plane_Data;
+	FILE *Source_File;
+
+	// open the file
+	if ((Source_File = fopen(Filename, "rb")) == NULL) {
+		printf("Problem opening source image %s\n", Filename); exit(1); }
+
+	// a .y4m stream header gives the frame size and the chroma subsampling (4:2:0 when
+	// absent), and every frame starts with its own header line
+	Input_Chroma = CHROMA_422;
+	if (Input_Format == INPUT_Y4M) {
+		if ((fgets(Header, sizeof(Header), Source_File) == NULL) || strncmp(Header, "YUV4MPEG2 ", 10)) {
+			printf("Source image %s is not a YUV4MPEG2 stream\n", Filename); exit(1); }
+		Input_Columns = Input_Rows = 0;
+		Input_Chroma = CHROMA_420;
+		// the groups of a sequence read their frames in parallel, hence strtok_r
+		for (Token = strtok_r(Header + 10, " \n", &Position); Token != NULL; Token = strtok_r(NULL, " \n", &Position)) {
+			if (Token[0] == 'W') Input_Columns = atoi(Token + 1);
+			else if (Token[0] == 'H') Input_Rows = atoi(Token + 1);
+			else if (Token[0] == 'C') {
+				if (!strcmp(Token, "C422")) Input_Chroma = CHROMA_422;
+				else if (strcmp(Token, "C420") && strcmp(Token, "C420jpeg") &&
+				         strcmp(Token, "C420paldv") && strcmp(Token, "C420mpeg2")) {
+					printf("Unsupported colourspace %s in %s, expecting 8-bit 4:2:2 or 4:2:0\n", Token + 1, Filename); exit(1); }
+			}
+		}
+	}
+	if ((Input_Rows <= 0) || (Input_Columns <= 0)) {
+		printf("Invalid image size %d x %d in %s\n", Input_Columns, Input_Rows, Filename); exit(1); }
+	if ((Input_Chroma == CHROMA_420) && (FORMAT_CHROMA(Image_Format) != CHROMA_420)) {
+		printf("Source image %s is 4:2:0, encode it with -420\n", Filename); exit(1); }
+
+	// skip to the frame (the frames of a .y4m stream start with their own header line)
+	Frame_Bytes = (long)Input_Rows*Input_Columns + 2L*((Input_Columns + 1)/2)*
+		((Input_Chroma == CHROMA_420) ? (Input_Rows + 1)/2 : Input_Rows);
+	if (Input_Format == INPUT_Y4M) {
+		for (f = 0; f <= Frame; f++)
+			if ((fgets(Header, sizeof(Header), Source_File) == NULL) || strncmp(Header, "FRAME", 5) ||
+			    ((f < Frame) && fseek(Source_File, Frame_Bytes, SEEK_CUR))) {
+				printf("Source image %s has no frame %d\n", Filename, Frame); exit(1); }
+	} else fseek(Source_File, Frame*Frame_Bytes, SEEK_SET);
+
+	if (Image_Size_Fixed && ((Input_Rows != Image_Rows) || (Input_Columns != Image_Columns))) {
+		printf("Image size %d x %d of %s differs from the first frame\n", Input_Columns, Input_Rows, Filename); exit(1); }
+	if (!Image_Size_Fixed) {
+		Image_Rows = Input_Rows;
+		Image_Columns = Input_Columns;
+	}
+	Rows = PADDED_ROWS(Image_Rows, Image_Format);
+	Columns = PADDED_COLUMNS(Image_Columns);
+
+	// read the planes, U and V having half the columns (rounded up) and, in 4:2:0,
+	// half the rows of Y, replicating the last column and row into the padding
+	Plane_Data = (double *)Arena_Plane(&Codec_Context()->Downsampled_Data, (size_t)Rows*Columns*2*sizeof(double));
+	Row_Buffer = (unsigned char *)Arena_Plane(&Codec_Context()->Row_Data, Columns*sizeof(unsigned char));
+	for (colour = 0; colour < 3; colour++) {
+		Sample_Columns = (colour == Y) ? Image_Columns : (Image_Columns + 1)/2;
+		Sample_Rows = ((colour != Y) && (Input_Chroma == CHROMA_420)) ? (Image_Rows + 1)/2 : Image_Rows;
+		Plane_Columns = YUV_row_step(colour, Columns);
+		Plane_Rows = ((colour != Y) && (Input_Chroma == CHROMA_420)) ? Rows/2 : Rows;
+		for (i = 0; i < Sample_Rows; i++) {
+			if (fread(Row_Buffer, sizeof(unsigned char), Sample_Columns, Source_File) != (size_t)Sample_Columns) {
+				printf("Source image %s is too short for frame %d of %d x %d\n", Filename, Frame, Image_Columns, Image_Rows); exit(1); }
+			for (j = 0; j < Plane_Columns; j++)
+				Plane_Data[YUV_index(Rows, Columns, i, j, colour)] =
+					(double)Row_Buffer[(j < Sample_Columns) ? j : Sample_Columns - 1];
+		}
+		for (i = Sample_Rows; i < Plane_Rows; i++)
+			memcpy(&Plane_Data[YUV_index(Rows, Columns, i, 0, colour)],
+				&Plane_Data[YUV_index(Rows, Columns, Sample_Rows - 1, 0, colour)], Plane_Columns*sizeof(double));
+	}
+	fclose(Source_File);
+
+	if ((Input_Chroma == CHROMA_422) && (FORMAT_CHROMA(Image_Format) == CHROMA_420))
+		for (colour = U; colour <= V; colour++)
+			Decimate_Chroma_Columns(Plane_Data, Rows, Columns, colour);
+
+	Downsampled_Image->Rows = Rows;
+	Downsampled_Image->Columns = Columns;
+	Downsampled_Image->Pixel_Data = Plane_Data;
+}
+
 void Colour_Space_422(image *Source_Image, image *Downsampled_Image) {
 	int i, j, colour;
 	int Source_Rows, Source_Columns, Downsampled_Rows, Downsampled_Columns;
 	int jm5, jm3, jm1, jp1, jp3, jp5;
 	double *Source_Data, *Downsampled_Data;
+	int *RGB_Row, *Y_Row, *U_Row, *V_Row;
+	short *Chroma_Scratch;
  	double Y_val, U_val, V_val, R_val, G_val, B_val;
- 	double RGB_YUV_matrix_int[9] = {
-		16843.0,   33030.0,   6423.0,
-		-9699.0,  -19071.0,   28770.0,
-		28770.0,  -24117.0,  -4653.0 };
 	double RGB_YUV_matrix_dbl[9] = {
 		 0.257,   0.504,   0.098,
 		-0.148,  -0.291,   0.439, 
@@ -109,14 +525,15 @@ void Colour_Space_422(image *Source_Image, image *Downsampled_Image) {
 	Source_Columns = Source_Image->Columns;
 	Source_Data = Source_Image->Pixel_Data;
 
-	// Colourspace conversion
-	for (i = 0; i < Source_Rows; i++)
-		for (j = 0; j < Source_Columns; j++) {
-			R_val = Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, R)];
-			G_val = Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, G)];
-			B_val = Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, B)];
+	// Colourspace conversion in double precision (the fixed-point
+	// conversion is done a row at a time together with the downsampling)
+	if (debug_levels & DEBUG_LEVEL(4))
+		for (i = 0; i < Source_Rows; i++)
+			for (j = 0; j < Source_Columns; j++) {
+				R_val = Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, R)];
+				G_val = Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, G)];
+				B_val = Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, B)];
 
-			if (debug_level == 4) {
 				Y_val = RGB_YUV_matrix_dbl[0]*R_val + RGB_YUV_matrix_dbl[1]*G_val + RGB_YUV_matrix_dbl[2]*B_val; 
 				Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, G)] = Y_val + 16.0;
 
@@ -125,41 +542,30 @@ void Colour_Space_422(image *Source_Image, image *Downsampled_Image) {
 
 				V_val = RGB_YUV_matrix_dbl[6]*R_val + RGB_YUV_matrix_dbl[7]*G_val + RGB_YUV_matrix_dbl[8]*B_val; 
 				Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, R)] = V_val + 128.0;				
-			} else {
-				Y_val = RGB_YUV_matrix_int[0]*R_val + RGB_YUV_matrix_int[1]*G_val + RGB_YUV_matrix_int[2]*B_val;
-				Y_val += (double)(((16 << 1) + 1) << 15); Y_val = floor(Y_val / (double)(1 << 16));
-				if (Y_val < 0.0) 
-					Y_val = 0.0; 
-				if (Y_val > 255.0) 
-					Y_val = 255.0;
-				Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, G)] = Y_val;
-
-				U_val = RGB_YUV_matrix_int[3]*R_val + RGB_YUV_matrix_int[4]*G_val + RGB_YUV_matrix_int[5]*B_val;
-				U_val += (double)(((128 << 1) + 1) << 15); U_val = floor(U_val / (double)(1 << 16));
-				Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, B)] = U_val;
-
-				V_val = RGB_YUV_matrix_int[6]*R_val + RGB_YUV_matrix_int[7]*G_val + RGB_YUV_matrix_int[8]*B_val;
-				V_val += (double)(((128 << 1) + 1) << 15); V_val = floor(V_val / (double)(1 << 16));
-				Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, R)] = V_val;
 			}
-		}
 
 	// Downsampling
 	Downsampled_Rows = Source_Rows;
 	Downsampled_Columns = Source_Columns;
-	Downsampled_Data = (double *)malloc(Downsampled_Rows*Downsampled_Columns*2*sizeof(double));
-	if (debug_level == 1) 
-		debug_data = (double *)malloc(Source_Rows*Source_Columns*3*sizeof(double));
-
-	for (i = 0; i < Downsampled_Rows; i++)
-		for (j = 0; j < Downsampled_Columns; j++) {
-			Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j, Y)] =
-				Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, G)];
-			if (debug_level == 1)
-				debug_data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j, Y)] =
+	Downsampled_Data = (double *)Arena_Plane(&Codec_Context()->Downsampled_Data,
+		(size_t)Downsampled_Rows*Downsampled_Columns*2*sizeof(double));
+
+	// the rows and the filter scratch share the row arena (6*Source_Columns ints keep
+	// the scratch aligned)
+	RGB_Row = (int *)Arena_Plane(&Codec_Context()->Row_Data,
+		(size_t)6*Source_Columns*sizeof(int) + CHROMA_SCRATCH_SIZE(Source_Columns)*sizeof(short));
+	Y_Row = RGB_Row + 3*Source_Columns;
+	U_Row = Y_Row + Source_Columns;
+	V_Row = U_Row + Source_Columns;
+	Chroma_Scratch = (short *)(V_Row + Source_Columns);
+
+	for (i = 0; i < Downsampled_Rows; i++) {
+		if (debug_levels & DEBUG_LEVEL(4)) {
+			for (j = 0; j < Downsampled_Columns; j++)
+				Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j, Y)] =
 					Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, G)];
 
-			if (j%2 == 0) {
+			for (j = 0; j < Downsampled_Columns; j += 2) {
 				jm5 = (j < 5) ? 0 : j - 5;
 				jm3 = (j < 3) ? 0 : j - 3;
 				jm1 = (j < 1) ? 0 : j - 1;
@@ -167,80 +573,141 @@ void Colour_Space_422(image *Source_Image, image *Downsampled_Image) {
 				jp3 = (j < (Downsampled_Columns - 3)) ? j + 3 : Downsampled_Columns - 1;
 				jp5 = (j < (Downsampled_Columns - 5)) ? j + 5 : Downsampled_Columns - 1;
 
-				if (debug_level == 4) {
-					Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j/2, U)] = 
-						0.043 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm5, B)] -
-						0.102 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm3, B)] +
-						0.311 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm1, B)] + 
-						0.500 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, B)] + 
-						0.311 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp1, B)] - 
-						0.102 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp3, B)] +
-						0.043 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp5, B)];
-
-					Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j/2, V)] = 
-						0.043 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm5, R)] -
-						0.102 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm3, R)] +
-						0.311 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm1, R)] + 
-						0.500 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, R)] + 
-						0.311 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp1, R)] - 
-						0.102 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp3, R)] +
-						0.043 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp5, R)];
-				} else {
-					U_val = 
-						 22.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm5, B)] -
-						 52.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm3, B)] +
-						159.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm1, B)] +
-						256.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, B)] +
-						159.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp1, B)] -
-						 52.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp3, B)] +
-						 22.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp5, B)];
-					U_val += (double)(1 << 8); U_val = floor(U_val / (double)(1 << 9));
-					if (U_val < 0.0) 
-						U_val = 0.0; 
-					if (U_val > 255.0) 
-						U_val = 255.0;
-					Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j/2, U)] = U_val;
-					if (debug_level == 1)
-						debug_data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j/2, U)] = U_val;
-
-					V_val = 
-						 22.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm5, R)] -
-						 52.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm3, R)] +
-						159.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm1, R)] +
-						256.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, R)] +
-						159.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp1, R)] -
-						 52.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp3, R)] +
-						 22.0 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp5, R)];
-					V_val += (double)(1 << 8); V_val = floor(V_val / (double)(1 << 9));
-					if (V_val < 0.0) 
-						V_val = 0.0; 
-					if (V_val > 255.0) 
-						V_val = 255.0;
-					Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j/2, V)] = V_val;
-					if (debug_level == 1)
-						debug_data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j/2, V)] = V_val;
-				}
-			}				
+				Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j/2, U)] = 
+					0.043 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm5, B)] -
+					0.102 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm3, B)] +
+					0.311 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm1, B)] + 
+					0.500 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, B)] + 
+					0.311 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp1, B)] - 
+					0.102 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp3, B)] +
+					0.043 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp5, B)];
+
+				Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j/2, V)] = 
+					0.043 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm5, R)] -
+					0.102 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm3, R)] +
+					0.311 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jm1, R)] + 
+					0.500 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, j, R)] + 
+					0.311 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp1, R)] - 
+					0.102 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp3, R)] +
+					0.043 * Source_Data[RGB_index(Source_Rows, Source_Columns, i, jp5, R)];
+			}
+		} else {
+			// fixed-point colourspace conversion followed by the
+			// filter (taps 22, -52, 159, 256, 159, -52, 22) on U and V
+			for (j = 0; j < 3*Source_Columns; j++)
+				RGB_Row[j] = (int)Source_Data[RGB_index(Source_Rows, Source_Columns, i, 0, R) + j];
+			RGB_To_YUV_Row(RGB_Row, Y_Row, U_Row, V_Row, Source_Columns);
+			Downsample_Chroma_Row(U_Row, U_Row, Source_Columns, Chroma_Scratch);
+			Downsample_Chroma_Row(V_Row, V_Row, Source_Columns, Chroma_Scratch);
+
+			for (j = 0; j < Downsampled_Columns; j++)
+				Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j, Y)] = (double)Y_Row[j];
+			for (j = 0; j < Downsampled_Columns/2; j++) {
+				Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j, U)] = (double)U_Row[j];
+				Downsampled_Data[YUV_index(Downsampled_Rows, Downsampled_Columns, i, j, V)] = (double)V_Row[j];
+			}
 		}
+	}
+
+	// 4:2:0 filters and decimates U and V along the columns as well
+	if (FORMAT_CHROMA(Image_Format) == CHROMA_420)
+		for (colour = U; colour <= V; colour++)
+			Decimate_Chroma_Columns(Downsampled_Data, Downsampled_Rows, Downsampled_Columns, colour);
 
 	Downsampled_Image->Rows = Downsampled_Rows;
 	Downsampled_Image->Columns = Downsampled_Columns;
 	Downsampled_Image->Pixel_Data = Downsampled_Data;
+}
 
-	if (debug_level == 1) {
-		printf("Writing debug information for level %d to file %s\n", debug_level, debug_filename);
-		if ((debug_file = fopen(debug_filename, "wb")) == NULL) {
-			printf("Problem opening debug file %s\n", debug_filename); exit(1); }
-		for (colour = 0; colour < 3; colour++) {
-			for (i = 0; i < Downsampled_Rows; i++)
-				for (j = 0; j < Downsampled_Columns; j++)
-					fprintf(debug_file, "%c",
-						((int)(debug_data[YUV_index(Source_Rows, Source_Columns, i, j, colour)])) & 0xFF );
-			if (colour == Y) Downsampled_Columns /= 2;
-		}
-		fclose(debug_file);
-		free(debug_data);
+static void Write_Debug_Planes(double *Plane_Data, int Rows, int Columns, int Level, int Bytes) {
+	// writes the Y, U and V planes for a debug level: the colourspace converted and
+	// downsampled (pre-DCT) planes in 8 bits for level 1, the DCT (pre-quantization)
+	// coefficients in 16 bits for level 2
+	size_t Size;
+	unsigned char *Buffer;
+	FILE *Debug_File;
+
+	Buffer = Pack_Planes(Plane_Data, NULL, Rows, Columns, FORMAT_CHROMA(Image_Format), Bytes, &Size);
+	Debug_File = Open_Debug_File(debug_basename, Level, 'e');
+	if (fwrite(Buffer, 1, Size, Debug_File) != Size) {
+		printf("Problem writing debug information for level %d\n", Level); exit(1); }
+	fclose(Debug_File);
+	free(Buffer);
+}
+
+static void Write_SRAM_Regions(image *Source_Image, image *Downsampled_Image, image *DCT_Image) {
+	// writes the SRAM images of the encoder milestones: the RGB region (the .ppm pixels,
+	// without the padding to whole blocks) that milestone 1 reads, the YUV region it
+	// writes for milestone 2, and the coefficient region milestone 2 writes (the milestone 3
+	// testbench starts from the .ppm, so this region is only checked against)
+	int i, j;
+	size_t Size;
+	unsigned char *Buffer;
+
+	if (Source_Image != NULL) {
+		Buffer = (unsigned char *)malloc((size_t)Image_Rows*Image_Columns*3);
+		for (i = 0, Size = 0; i < Image_Rows; i++)
+			for (j = 0; j < 3*Image_Columns; j++)
+				Buffer[Size++] = (int)Source_Image->Pixel_Data[RGB_index(Source_Image->Rows, Source_Image->Columns, i, 0, R) + j] & 0xFF;
+		Write_SRAM_Image(debug_basename, "rgb", SRAM_RGB_BASE, Buffer, Size);
+		free(Buffer);
+	}
+	if (Downsampled_Image != NULL) {
+		Buffer = Pack_Planes(Downsampled_Image->Pixel_Data, NULL, Downsampled_Image->Rows, Downsampled_Image->Columns,
+			FORMAT_CHROMA(Image_Format), 1, &Size);
+		Write_SRAM_Image(debug_basename, "yuv", SRAM_YUV_BASE, Buffer, Size);
+		free(Buffer);
+	}
+	if (DCT_Image != NULL) {
+		Buffer = Pack_Planes(DCT_Image->Pixel_Data, NULL, DCT_Image->Rows, DCT_Image->Columns,
+			FORMAT_CHROMA(Image_Format), 2, &Size);
+		Write_SRAM_Image(debug_basename, "coeff", SRAM_COEFF_BASE, Buffer, Size);
+		free(Buffer);
+	}
+}
+
+static void Decimate_Chroma_Columns(double *Downsampled_Data, int Rows, int Columns, int colour) {
+	// 4:2:2 -> 4:2:0 for one chroma plane: row r of the plane becomes the filtered row 2r,
+	// with the taps of the 4:2:2 filter along the columns (in double precision for debug
+	// level 4); the result is in the top half of the plane, the bottom half is unused
+	int i, j, t, Half_Columns = Columns/2;
+	int *Plane, *Out_Row;
+	const int *Window[7];
+	double *Column_Data;
+	static const int Window_Offsets[7] = { -5, -3, -1, 0, 1, 3, 5 };
+	static const double Window_Taps[7] = { 0.043, -0.102, 0.311, 0.500, 0.311, -0.102, 0.043 };
+
+	// clamped row of the window
+	#define WINDOW_ROW(r, t) ((2*(r) + Window_Offsets[t] < 0) ? 0 : \
+		(2*(r) + Window_Offsets[t] > Rows - 1) ? Rows - 1 : 2*(r) + Window_Offsets[t])
+
+	if (debug_levels & DEBUG_LEVEL(4)) {
+		Column_Data = (double *)malloc((size_t)Rows*Half_Columns*sizeof(double));
+		memcpy(Column_Data, &Downsampled_Data[YUV_index(Rows, Columns, 0, 0, colour)], (size_t)Rows*Half_Columns*sizeof(double));
+		for (i = 0; i < Rows/2; i++)
+			for (j = 0; j < Half_Columns; j++) {
+				Downsampled_Data[YUV_index(Rows, Columns, i, j, colour)] = 0.0;
+				for (t = 0; t < 7; t++)
+					Downsampled_Data[YUV_index(Rows, Columns, i, j, colour)] +=
+						Window_Taps[t] * Column_Data[(long)WINDOW_ROW(i, t)*Half_Columns + j];
+			}
+		free(Column_Data);
+		return;
+	}
+
+	Plane = (int *)Arena_Plane(&Codec_Context()->Row_Data, (size_t)(Rows + 1)*Half_Columns*sizeof(int));
+	Out_Row = Plane + (long)Rows*Half_Columns;
+	for (i = 0; i < Rows; i++)
+		for (j = 0; j < Half_Columns; j++)
+			Plane[(long)i*Half_Columns + j] = (int)Downsampled_Data[YUV_index(Rows, Columns, i, j, colour)];
+	for (i = 0; i < Rows/2; i++) {
+		for (t = 0; t < 7; t++)
+			Window[t] = Plane + (long)WINDOW_ROW(i, t)*Half_Columns;
+		Downsample_Chroma_Column(Window, Out_Row, Half_Columns);
+		for (j = 0; j < Half_Columns; j++)
+			Downsampled_Data[YUV_index(Rows, Columns, i, j, colour)] = (double)Out_Row[j];
 	}
+	#undef WINDOW_ROW
 }
 
 void Discrete_Cosine_Transform(image *Downsampled_Image, image *DCT_Image, int Compression_Format) {
@@ -254,11 +721,7 @@ void Discrete_Cosine_Transform(image *Downsampled_Image, image *DCT_Image, int C
 	Block_Columns = DCT_Columns/8;
 
 	Downsampled_Data = Downsampled_Image->Pixel_Data;
-	DCT_Data = (double *)malloc(DCT_Rows*DCT_Columns*2*sizeof(double));
-	if (debug_level == 2) 
-		debug_data = (double *)malloc(DCT_Rows*DCT_Columns*2*sizeof(double));
-
-	Init_DCT_Coeffs();
+	DCT_Data = (double *)Arena_Plane(&Codec_Context()->DCT_Data, (size_t)DCT_Rows*DCT_Columns*2*sizeof(double));
 
 	// process the blocks in sequence, from Y to U to V
 	// for a given component, process the blocks by rows
@@ -269,63 +732,55 @@ void Discrete_Cosine_Transform(image *Downsampled_Image, image *DCT_Image, int C
 				//printf("\n New block: %d %d %d ----------------", colour, Block_Rows, Block_Columns);
 				Block_DCT(Block_Data);
 				//if (i==0 && j==1) printf("\n%f", Block_Data[0][0]);
-				if (debug_level == 2)
-					Write_Block(Block_Data, debug_data, i, j, DCT_Rows, DCT_Columns, colour);
 				Write_Block(Block_Data, DCT_Data, i, j, DCT_Rows, DCT_Columns, colour);
 				//if (i==0 && j==1) exit(0);
 			}
-		if (colour == Y) Block_Columns /= 2;   // since U and V have half as many columns
-	}
-
-	if (debug_level == 2) {
-		printf("Writing debug information for level %d to file %s\n", debug_level, debug_filename);
-		Block_Rows = DCT_Rows;
-		Block_Columns = DCT_Columns;
-		if ((debug_file = fopen(debug_filename, "wb")) == NULL) {
-			printf("Problem opening debug file %s\n", debug_filename); exit(1); }
-		for (colour = 0; colour < 3; colour++) {
-			for (i = 0; i < Block_Rows; i++)
-				for (j = 0; j < Block_Columns; j++)
-					fprintf(debug_file, "%c%c",
-						((int)(debug_data[YUV_index(DCT_Rows, DCT_Columns, i, j, colour)]) >> 8) & 0xFF,
-						 (int)(debug_data[YUV_index(DCT_Rows, DCT_Columns, i, j, colour)]) & 0xFF );
-			if (colour == Y) Block_Columns /= 2;
+		if (colour == Y) {
+			Block_Columns /= 2;   // since U and V have half as many columns
+			if (FORMAT_CHROMA(Compression_Format) == CHROMA_420) Block_Rows /= 2;   // and rows, in 4:2:0
 		}
-		fclose(debug_file);
-		free(debug_data);
 	}
 
+	// the coefficients are not changed after the DCT, so they are written as they are
+	if (debug_levels & DEBUG_LEVEL(2))
+		Write_Debug_Planes(DCT_Data, DCT_Rows, DCT_Columns, 2, 2);
+
 	DCT_Image->Rows = DCT_Rows;
 	DCT_Image->Columns = DCT_Columns;
 	DCT_Image->Pixel_Data = DCT_Data;
 }
 
 void Init_DCT_Coeffs(void) {
+	// selects the coefficient matrix of the calling thread (computing the
+	// matrices on the first call of the process)
 	int i, j;
-	double s;
+	FILE *Debug_File;
 
-	for (i = 0; i < 8; i++) {
-		s = (i == 0) ? sqrt(1.0 / 8.0) : sqrt(2.0 / 8.0);
-		for (j = 0; j < 8; j++) {
-			if (debug_level == 4) {
-				DCT_Coeffs[i][j] = s * cos((PI/8.0)*i*(j + 0.5));
-			} else {
-				DCT_Coeffs[i][j] = (double)((int)(s*cos((PI/8.0)*i*(j + 0.5))*4096.0)); // fixed point at bit 12
-			}
-		}
-	}
+	pthread_once(&DCT_Coeffs_Once, Compute_DCT_Coeffs);
+	DCT_Coeffs = (debug_levels & DEBUG_LEVEL(4)) ? DCT_Double_Coeffs : DCT_Fixed_Coeffs;
 
 	// debug information
-	if (debug_level == 3) {
-		printf("Writing debug information for level %d to file %s\n", debug_level, debug_filename);
-		if ((debug_file = fopen(debug_filename, "wb")) == NULL) {
-			printf("Problem opening debug file %s\n", debug_filename); exit(1); }
+	if (debug_levels & DEBUG_LEVEL(3)) {
+		Debug_File = Open_Debug_File(debug_basename, 3, 'e');
 		for (i = 0; i < 8; i++) {
 			for (j = 0; j < 8; j++)
-				fprintf(debug_file, "%5d ", (int)(DCT_Coeffs[i][j]));
-			fprintf(debug_file, "\n");
+				fprintf(Debug_File, "%5d ", (int)(DCT_Coeffs[i][j]));
+			fprintf(Debug_File, "\n");
+		}
+		fclose(Debug_File);
+	}
+}
+
+static void Compute_DCT_Coeffs(void) {
+	int i, j;
+	double s;
+
+	for (i = 0; i < 8; i++) {
+		s = (i == 0) ? sqrt(1.0 / 8.0) : sqrt(2.0 / 8.0);
+		for (j = 0; j < 8; j++) {
+			DCT_Double_Coeffs[i][j] = s * cos((PI/8.0)*i*(j + 0.5));
+			DCT_Fixed_Coeffs[i][j] = (double)((int)(s*cos((PI/8.0)*i*(j + 0.5))*(double)(1 << DCT_COEFF_BITS))); // fixed point at bit DCT_COEFF_BITS
 		}
-		fclose(debug_file);
 	}
 }
 
@@ -343,6 +798,8 @@ static void Fetch_Block(double *Downsampled_Data, double Block_Data[][8],
 void Quantize_Block(double Block_Data[][8], int Compression_Format) {
 	int i, j, s;
 	double t;
+
+	Compression_Format = FORMAT_QUANT(Compression_Format);
 	
 	// quantization
 	for (j = 0; j < 8; j++)
@@ -388,8 +845,8 @@ void Block_DCT(double Block_Data[][8]) {
 			s = 0.0;
 			for (k = 0; k < 8; k++)
 				s += Block_Data[i][k] * DCT_Coeffs[j][k];
-			if (debug_level == 4) temp[i][j] = s;
-			else temp[i][j] = floor((s + (double)(1 << 7)) / (double)(1 << 8));
+			if (debug_levels & DEBUG_LEVEL(4)) temp[i][j] = s;
+			else temp[i][j] = floor((s + (double)(1 << (DCT_FIRST_SHIFT - 1))) / (double)(1 << DCT_FIRST_SHIFT));
 		}
 
 	// pre-multiplication with the coefficient matrix
@@ -401,8 +858,8 @@ void Block_DCT(double Block_Data[][8]) {
 				//if(i==1 && j==0)
 					//printf("%f, %f, %f\n", temp[k][j], DCT_Coeffs[i][k],  DCT_Coeffs[i][k] * temp[k][j]);
 			}
-			if (debug_level == 4) Block_Data[i][j] = s;
-			else Block_Data[i][j] = floor((s + (double)(1 << 15)) / (double)(1 << 16));
+			if (debug_levels & DEBUG_LEVEL(4)) Block_Data[i][j] = s;
+			else Block_Data[i][j] = floor((s + (double)(1 << (DCT_SECOND_SHIFT - 1))) / (double)(1 << DCT_SECOND_SHIFT));
 			//if(i==1 && j==0)
 				//printf("\n end: %f -> %f\n", s, Block_Data[i][j]);
 			//if (i==1 && j==0) exit(0);
@@ -420,15 +877,140 @@ static void Write_Block(double Block_Data[][8], double *DCT_Data,
 				Block_Data[i][j];
 }
 
-void Lossless_Coding(image *DCT_Image, char *Filename, int Compression_Format) {
-	int colour, i, j, DCT_Rows, DCT_Columns, Block_Rows, Block_Columns;
+static void *Lossless_Coding_Thread(void *Job) {
+	lossless_job *Coding_Job = (lossless_job *)Job;
+
+	Coding_Job->Status = Lossless_Coding(Coding_Job->DCT_Image, Coding_Job->Filename,
+		Coding_Job->Compression_Format, Coding_Job->Scan_Cutoff, Coding_Job->Write_Index, NULL, 0, NULL);
+	return NULL;
+}
+
+int Rate_Control(image *DCT_Image, int Compression_Format, long long Target_Bytes, int *Scan_Cutoff) {
+	// picks the finest candidate whose stream fits in Target_Bytes: the quantization
+	// matrices from Compression_Format down to Q0, then Q0 with the coefficients past
+	// each of the Scan_Cutoffs zeroed (still a plain stream for any decoder); the size
+	// of every candidate is counted in one pass, from the symbol lengths of
+	// Write_Coded_Block (5 bits for runs and 3-bit values, 11 for 9-bit values,
+	// 2 for the end of block) without writing any bits
+	int colour, i, j, k, q, DCT_Rows, DCT_Columns, Block_Rows, Block_Columns;
+	int Num_Candidates, Finest_Quant, Header_Size, Chosen, Scanned_Block[64];
+	double *DCT_Data, Block_Data[8][8], Quantized_Data[8][8];
+	unsigned long long Candidate_Bits[3 + NUM_SCAN_CUTOFFS];
+	long long Candidate_Bytes;
+
+	DCT_Rows = DCT_Image->Rows;
+	DCT_Columns = DCT_Image->Columns;
+	DCT_Data = DCT_Image->Pixel_Data;
+	Block_Rows = DCT_Rows/8;
+	Block_Columns = DCT_Columns/8;
+
+	// candidate k < Finest_Quant + 1 is matrix Finest_Quant - k, the others are Q0 with a cutoff
+	Finest_Quant = (FORMAT_QUANT(Compression_Format) > 2) ? 2 : FORMAT_QUANT(Compression_Format);
+	Num_Candidates = Finest_Quant + 1 + NUM_SCAN_CUTOFFS;
+	for (k = 0; k < Num_Candidates; k++) Candidate_Bits[k] = 0;
+
+	for (colour = 0; colour < 3; colour++) {
+		for (i = 0; i < Block_Rows; i++)
+			for (j = 0; j < Block_Columns; j++) {
+				Fetch_Block(DCT_Data, Block_Data, i, j, DCT_Rows, DCT_Columns, colour);
+				for (q = Finest_Quant; q >= 0; q--) {
+					memcpy(Quantized_Data, Block_Data, sizeof(Quantized_Data));
+					Quantize_Block(Quantized_Data, q);
+					Scan_Block(Quantized_Data, Scanned_Block);
+					Candidate_Bits[Finest_Quant - q] += Coded_Block_Bits(Scanned_Block, 64);
+				}
+				for (k = 0; k < NUM_SCAN_CUTOFFS; k++)
+					Candidate_Bits[Finest_Quant + 1 + k] += Coded_Block_Bits(Scanned_Block, Scan_Cutoffs[k]);
+			}
+		if (colour == Y) {
+			Block_Columns /= 2;
+			if (FORMAT_CHROMA(Compression_Format) == CHROMA_420) Block_Rows /= 2;
+		}
+	}
+
+	// the stream is padded with 16 zero bits after the header
+	Header_Size = ((FORMAT_HEADER(Compression_Format) == HEADER_WIDE) || (Image_Rows > 0xFFFF) ||
+		(Image_Columns > 0xFFFF) || PADDED_SIZE(Image_Rows, Image_Columns, Compression_Format)) ? 36 : 20;
+	for (Chosen = 0; Chosen < Num_Candidates - 1; Chosen++)
+		if (Header_Size + (long long)((Candidate_Bits[Chosen] + 16)/8) <= Target_Bytes) break;
+	Candidate_Bytes = Header_Size + (long long)((Candidate_Bits[Chosen] + 16)/8);
+
+	*Scan_Cutoff = (Chosen <= Finest_Quant) ? 64 : Scan_Cutoffs[Chosen - Finest_Quant - 1];
+	q = (Chosen <= Finest_Quant) ? Finest_Quant - Chosen : 0;
+	printf("Rate control: target %lld bytes, format %d", Target_Bytes, q);
+	if (*Scan_Cutoff < 64) printf(" with coefficients past scan position %d zeroed", *Scan_Cutoff);
+	printf(", %lld bytes\n", Candidate_Bytes);
+	if (Candidate_Bytes > Target_Bytes)
+		printf("Rate control: no candidate fits the target, using the smallest one\n");
+
+	return (Compression_Format & ~0x3) | q;
+}
+
+int Adaptive_Quant(double Block_Data[][8], int Compression_Format) {
+	// picks the quantization matrix of a block from its AC activity:
+	// flat blocks are quantized harder, textured ones with the format's matrix
+	int i, j, Quant;
+	double Activity = 0.0;
+
+	for (i = 0; i < 8; i++)
+		for (j = 0; j < 8; j++)
+			if (i || j) Activity += fabs(Block_Data[i][j]);
+
+	Quant = FORMAT_QUANT(Compression_Format);
+	if (Quant > 2) Quant = 2;
+	if (Activity < ACTIVITY_SMOOTH) Quant--;
+	if (Activity < ACTIVITY_FLAT) Quant--;
+	return (Quant < 0) ? 0 : Quant;
+}
+
+static void Truncate_Block(double Block_Data[][8], int Scan_Cutoff) {
+	// zeroes the coefficients from scan position Scan_Cutoff onwards
+	int k;
+
+	for (k = Scan_Cutoff; k < 64; k++)
+		Block_Data[Scan_Pattern[k]/8][Scan_Pattern[k]%8] = 0.0;
+}
+
+void Code_Coefficients(image *DCT_Image, int *Block_Quants, int Rows, int Columns, char *Filename,
+	int Compression_Format, int Write_Index
+) {
+	// codes DCT coefficients that do not come from the DCT of the encoder (the
+	// compressed-domain transforms of Transform.c), for an image of Rows x Columns
+	// pixels; with adaptive quantization a block uses its matrix in Block_Quants
+	// (in the order of the blocks, Y, U and V, each by rows), or the one picked
+	// from its activity where that is negative
+	debug_levels = 0;
+	Image_Rows = Rows;
+	Image_Columns = Columns;
+	Image_Format = Compression_Format;
+	if (Lossless_Coding(DCT_Image, Filename, Compression_Format, 64, Write_Index, NULL, 0, Block_Quants)) exit(1);
+}
+
+int Lossless_Coding(image *DCT_Image, char *Filename, int Compression_Format, int Scan_Cutoff, int Write_Index,
+	int *Reference, int Skip_Threshold, int *Block_Quants
+) {
+	// codes the quantized blocks; in a sequence, Reference holds the quantized coefficients
+	// (in scan order) and the matrix of every block as the decoder holds them from the
+	// previous frame, and is updated with this frame; with the skip flag in the format,
+	// the blocks within Skip_Threshold of their reference are skipped; Block_Quants, when
+	// not NULL, gives the matrix of the blocks (see Code_Coefficients); it runs in the
+	// threads of the encoder, so a problem is printed and returned (1) rather than exiting
+	int colour, i, j, DCT_Rows, DCT_Columns, Block_Rows, Block_Columns, Index_Rows, Header_Size;
+	int Block_Quant = 0, Previous_Quant = 0, *Row_Values = NULL, *Row_Quants = NULL;
+	int Scanned_Block[64], *Block_Reference, Skip;
+	long Reference_Base = 0, Skipped_Blocks = 0, Total_Blocks = 0;
 	double *DCT_Data, Block_Data[8][8];
-	FILE *Destination_File;
-	unsigned int byte_offset[3], bit_offset[3], bits_left;
+	FILE *Destination_File, *Index_File;
+	unsigned int bit_offset[3], bits_left;
+	unsigned long long byte_offset[3];
+	unsigned long long *Row_Offsets = NULL;
+	unsigned char *Row_Buffer = NULL;
+	size_t Row_Bytes, Row_Capacity = 0;
+	char Index_Filename[124];
 
 	// Open the file
 	if ((Destination_File = fopen(Filename, "wb")) == NULL) {
-		printf("Problem opening destination compressed stream %s\n", Filename); exit(1); }
+		printf("Problem opening destination compressed stream %s\n", Filename); return 1; }
 
 	DCT_Rows = DCT_Image->Rows;
 	DCT_Columns = DCT_Image->Columns;
@@ -438,64 +1020,222 @@ void Lossless_Coding(image *DCT_Image, char *Filename, int Compression_Format) {
 
 	DCT_Data = DCT_Image->Pixel_Data;
 
-	// provide the compressed stream header
-	
+	// bit offset (from the start of the file) of the first block of each block row,
+	// Index_Rows per component (in 4:2:0 the second half of the U and V ones is unused)
+	Index_Rows = Block_Rows;
+	if (Write_Index)
+		Row_Offsets = (unsigned long long *)calloc((size_t)3*Index_Rows, sizeof(unsigned long long));
+
+	// the narrow header only holds 16-bit image sizes, and only images of whole blocks
+	if ((FORMAT_HEADER(Compression_Format) == HEADER_NARROW) &&
+	    ((Image_Rows > 0xFFFF) || (Image_Columns > 0xFFFF))) {
+		printf("Image size %d x %d does not fit the narrow header, using the wide header\n", Image_Columns, Image_Rows);
+		Compression_Format = (Compression_Format & 0x3F) | (HEADER_WIDE << 6);
+	}
+	if ((FORMAT_HEADER(Compression_Format) == HEADER_NARROW) &&
+	    PADDED_SIZE(Image_Rows, Image_Columns, Compression_Format)) {
+		printf("Image size %d x %d is padded to whole blocks, using the wide header\n", Image_Columns, Image_Rows);
+		Compression_Format = (Compression_Format & 0x3F) | (HEADER_WIDE << 6);
+	}
+
+	// provide the compressed stream header (the segment offsets are filled in at the end)
 	fprintf(Destination_File, "%c%c", 0xEC, 0xE7);
 	fprintf(Destination_File, "%c%c", 0x44, Compression_Format);
-	fprintf(Destination_File, "%c%c", (DCT_Rows >> 8) & 0xFF, DCT_Rows & 0xFF);
-	fprintf(Destination_File, "%c%c", (DCT_Columns >> 8) & 0xFF, DCT_Columns & 0xFF);
-	fprintf(Destination_File, "%c%c", 0x00, 0x00);
-	fprintf(Destination_File, "%c%c", 0x00, 0x00);
-	fprintf(Destination_File, "%c%c", 0x00, 0x00);
-	fprintf(Destination_File, "%c%c", 0x00, 0x00);
-	fprintf(Destination_File, "%c%c", 0x00, 0x00);
-	fprintf(Destination_File, "%c%c", 0x00, 0x00);
-	
+	if (FORMAT_HEADER(Compression_Format) == HEADER_WIDE) {
+		Header_Size = 36;
+		for (j = 24; j >= 0; j -= 8) fputc((Image_Rows >> j) & 0xFF, Destination_File);
+		for (j = 24; j >= 0; j -= 8) fputc((Image_Columns >> j) & 0xFF, Destination_File);
+	} else {
+		Header_Size = 20;
+		fprintf(Destination_File, "%c%c", (Image_Rows >> 8) & 0xFF, Image_Rows & 0xFF);
+		fprintf(Destination_File, "%c%c", (Image_Columns >> 8) & 0xFF, Image_Columns & 0xFF);
+	}
+	while (ftell(Destination_File) < Header_Size)
+		fputc(0x00, Destination_File);
+
+
+	// with the arithmetic coder the blocks of a row are coded together
+	if (FORMAT_ENTROPY(Compression_Format) == ENTROPY_ARITH) {
+		Row_Values = (int *)malloc((size_t)64*Block_Columns*sizeof(int));
+		Row_Quants = (int *)malloc(Block_Columns*sizeof(int));
+	}
 
 	// process the blocks in sequence
+	write_buffer = 0;
+	write_pointer = 0;
 	bits_left = 0;
 	for (colour = 0; colour < 3; colour++) {
-		byte_offset[colour] = (unsigned int)ftell(Destination_File);
+		byte_offset[colour] = (unsigned long long)ftell(Destination_File);
 		bit_offset[colour] = bits_left;
-		for (i = 0; i < Block_Rows; i++)
-		for (j = 0; j < Block_Columns; j++) {
-			Fetch_Block(DCT_Data, Block_Data, i, j, DCT_Rows, DCT_Columns, colour);
-			Quantize_Block(Block_Data, Compression_Format);
-			//printf("\nQuantized: %f",Block_Data[0][0]);
-			bits_left = Write_Coded_Block(Block_Data, Destination_File);
-			//printf("\nbits_left: %u", bits_left);
-			//if (i == 20 && j == 32) exit(0);
+		for (i = 0; i < Block_Rows; i++) {
+			for (j = 0; j < Block_Columns; j++) {
+				if (Write_Index && (j == 0))
+					Row_Offsets[colour*Index_Rows + i] = 8ULL*(unsigned long long)ftell(Destination_File) + bits_left;
+				Fetch_Block(DCT_Data, Block_Data, i, j, DCT_Rows, DCT_Columns, colour);
+				Block_Quant = FORMAT_QUANT(Compression_Format);
+				if (FORMAT_ADAPTIVE(Compression_Format)) {
+					if (j == 0) Previous_Quant = FORMAT_QUANT(Compression_Format);
+					if ((Block_Quants != NULL) && (Block_Quants[Reference_Base + (long)i*Block_Columns + j] >= 0))
+						Block_Quant = Block_Quants[Reference_Base + (long)i*Block_Columns + j];
+					else Block_Quant = Adaptive_Quant(Block_Data, Compression_Format);
+					Quantize_Block(Block_Data, Block_Quant);
+				} else Quantize_Block(Block_Data, Compression_Format);
+				if (Scan_Cutoff < 64) Truncate_Block(Block_Data, Scan_Cutoff);
+
+				// in a sequence, a block is skipped (the decoder keeps its reference) or
+				// it becomes the reference for the next frame
+				if (Reference != NULL) {
+					Block_Reference = &Reference[65*(Reference_Base + (long)i*Block_Columns + j)];
+					Scan_Block(Block_Data, Scanned_Block);
+					Skip = FORMAT_SKIP(Compression_Format) &&
+						Same_Block(Scanned_Block, Block_Quant, Block_Reference, Skip_Threshold);
+					Total_Blocks++;
+					if (FORMAT_SKIP(Compression_Format))
+						bits_left = Write_Bits(Destination_File, Skip ? BLOCK_SKIP : BLOCK_CODED, 1);
+					if (Skip) {
+						Previous_Quant = Block_Reference[64];
+						Skipped_Blocks++;
+						continue;
+					}
+					memcpy(Block_Reference, Scanned_Block, sizeof(Scanned_Block));
+					Block_Reference[64] = Block_Quant;
+				}
+				if (FORMAT_ADAPTIVE(Compression_Format)) {
+					// prefix with the matrix of the block, if it differs from the previous one
+					if (FORMAT_ENTROPY(Compression_Format) == ENTROPY_FIXED) {
+						if (Block_Quant == Previous_Quant) Write_Bits(Destination_File, QUANT_KEEP, 1);
+						else Write_Bits(Destination_File, (QUANT_SELECT << 2) | Block_Quant, 3);
+					}
+					Previous_Quant = Block_Quant;
+				}
+				//printf("\nQuantized: %f",Block_Data[0][0]);
+				if (FORMAT_ENTROPY(Compression_Format) == ENTROPY_ARITH) {
+					Scan_Block(Block_Data, &Row_Values[64*j]);
+					Row_Quants[j] = Block_Quant;
+				} else bits_left = Write_Coded_Block(Block_Data, Destination_File);
+				//printf("\nbits_left: %u", bits_left);
+				//if (i == 20 && j == 32) exit(0);
+			}
+			// with the arithmetic coder, the row is coded on its own and preceded by its length in bytes
+			if (FORMAT_ENTROPY(Compression_Format) == ENTROPY_ARITH) {
+				Row_Bytes = Arith_Encode_Block_Row(Row_Values, FORMAT_ADAPTIVE(Compression_Format) ? Row_Quants : NULL,
+					Block_Columns, FORMAT_QUANT(Compression_Format), &Row_Buffer, &Row_Capacity);
+				for (j = 24; j >= 0; j -= 8)
+					fputc((int)((Row_Bytes >> j) & 0xFF), Destination_File);
+				fwrite(Row_Buffer, sizeof(unsigned char), Row_Bytes, Destination_File);
+			}
 		}
+		Reference_Base += (long)Block_Rows*Block_Columns;
 		if (colour == Y) {
 			Block_Columns /= 2;
+			if (FORMAT_CHROMA(Compression_Format) == CHROMA_420) Block_Rows /= 2;
 		}
 	}
+	if (FORMAT_SKIP(Compression_Format))
+		printf("File %s: %ld of %ld blocks skipped\n", Filename, Skipped_Blocks, Total_Blocks);
 
 	// pad with zeros to the end of a 16 bit word
 	Write_Bits(Destination_File, 0, 16);
+	free(Row_Buffer);
+	free(Row_Quants);
+	free(Row_Values);
 
 	// overwrite header with correct offset for Y/U/V segments in the bitstream
 	for (colour = 0; colour < 3; colour++) {
-		fseek(Destination_File, 8+4*colour, SEEK_SET);
-		//printf("\n%d, %d, %d", colour, byte_offset[colour], bit_offset[colour]);
-		fprintf(Destination_File, "%c%c", (byte_offset[colour] >> 16) & 0xFF, (byte_offset[colour] >> 8) & 0xFF);
-		fprintf(Destination_File, "%c%c", (byte_offset[colour]) & 0xFF, bit_offset[colour] & 0xFF);
-	} 
-	
+		if (FORMAT_HEADER(Compression_Format) == HEADER_WIDE) {
+			fseek(Destination_File, 12+8*colour, SEEK_SET);
+			for (j = 48; j >= 0; j -= 8)
+				fputc((int)((byte_offset[colour] >> j) & 0xFF), Destination_File);
+		} else {
+			if (byte_offset[colour] > 0xFFFFFF) {
+				printf("Compressed stream exceeds the 24-bit offsets of the narrow header, encode with -wide\n");
+				fclose(Destination_File);
+				remove(Filename);
+				free(Row_Offsets);
+				return 1;
+			}
+			fseek(Destination_File, 8+4*colour, SEEK_SET);
+			//printf("\n%d, %d, %d", colour, byte_offset[colour], bit_offset[colour]);
+			fprintf(Destination_File, "%c%c", (int)(byte_offset[colour] >> 16) & 0xFF, (int)(byte_offset[colour] >> 8) & 0xFF);
+			fputc((int)(byte_offset[colour] & 0xFF), Destination_File);
+		}
+		fputc(bit_offset[colour] & 0xFF, Destination_File);
+	}
+
 	fclose(Destination_File);
+
+	// block row index (.mici) for region of interest decoding: the 0xECE7 0x4449 marker,
+	// the number of block rows on 32 bits and then the 64-bit offset of every block row,
+	// for Y, U and V in sequence, most significant byte first as in the stream header
+	if (Write_Index) {
+		sprintf(Index_Filename, "%si", Filename);
+		printf("Writing block row index to file %s\n", Index_Filename);
+		if ((Index_File = fopen(Index_Filename, "wb")) == NULL) {
+			printf("Problem opening block row index %s\n", Index_Filename);
+			free(Row_Offsets);
+			return 1;
+		}
+		fprintf(Index_File, "%c%c%c%c", 0xEC, 0xE7, 0x44, 0x49);
+		for (j = 24; j >= 0; j -= 8)
+			fputc((Index_Rows >> j) & 0xFF, Index_File);
+		for (i = 0; i < 3*Index_Rows; i++)
+			for (j = 56; j >= 0; j -= 8)
+				fputc((int)((Row_Offsets[i] >> j) & 0xFF), Index_File);
+		fclose(Index_File);
+		free(Row_Offsets);
+	}
+	return 0;
 }
 
-unsigned int Write_Coded_Block(double Block_Data[][8], FILE *Destination_File) {
-	int i, j, temp, Scanned_Block[64];
+static int Same_Block(int *Scanned_Block, int Block_Quant, int *Block_Reference, int Skip_Threshold) {
+	// whether the block has the matrix of its reference and no coefficient
+	// differs from the reference by more than Skip_Threshold
+	int k;
+
+	if (Block_Quant != Block_Reference[64]) return 0;
+	for (k = 0; k < 64; k++)
+		if (abs(Scanned_Block[k] - Block_Reference[k]) > Skip_Threshold) return 0;
+	return 1;
+}
+
+static void Scan_Block(double Block_Data[][8], int *Scanned_Block) {
+	// rounds the block to integers in scan order
+	int i, j;
 	double s;
-	unsigned int bit_offset;
-	
-	// round double precision values to integers
+
 	for (i = 0; i < 64; i++) {
 		j = Scan_Pattern[i];
 		s = Block_Data[j/8][j%8];
 		Scanned_Block[i] = (int)floor(((2.0 * s) + 1.0) / 2.0);
 	}
+}
+
+unsigned int Coded_Block_Bits(int *Scanned_Block, int Scan_Cutoff) {
+	// number of bits Write_Coded_Block uses for the scanned block, with
+	// the coefficients from scan position Scan_Cutoff onwards taken as zero
+	int i, j;
+	unsigned int bits = 0;
+
+	i = 0; while (i < 64) {
+		j = 0; while ((i + j < Scan_Cutoff) && (Scanned_Block[i+j] == 0)) { j++; }
+		if (i + j < Scan_Cutoff) {
+			bits += 5*((j + 7)/8);   // runs of up to 8 zeros
+			bits += ((Scanned_Block[i+j] < 4) && (Scanned_Block[i+j] >= -4)) ? 5 : 11;
+			i += j + 1;
+		} else {
+			bits += 2;
+			i = 64;
+		}
+	}
+	return bits;
+}
+
+unsigned int Write_Coded_Block(double Block_Data[][8], FILE *Destination_File) {
+	int i, j, temp, Scanned_Block[64];
+	unsigned int bit_offset;
+	
+	// round double precision values to integers
+	Scan_Block(Block_Data, Scanned_Block);
 	
 	// losslessly code the block
 	i = 0; while (i < 64) {
@@ -506,20 +1246,24 @@ unsigned int Write_Coded_Block(double Block_Data[][8], FILE *Destination_File) {
 				while (temp >= 8) {
 					//printf("\nIndex(%i) Append 8-zeros", i+j);
 					bit_offset = Write_Bits(Destination_File, (ZERO_RUN << 3), 5);
+					if (profile_enabled) Profile_Symbol(ZERO_RUN);
 					temp -= 8;
 				}
 				if (temp > 0){
 					//printf("\nIndex(%i) Append %d-zeros", i+j, temp);
 					bit_offset = Write_Bits(Destination_File, ((ZERO_RUN << 3) | temp), 5);   
+					if (profile_enabled) Profile_Symbol(ZERO_RUN);
 				}            
 			}
 			//printf("\nIndex(%i) Append %d", i+j, Scanned_Block[i+j]);
 			if ((Scanned_Block[i+j] < 4) && (Scanned_Block[i+j] >= -4)) 
 				bit_offset = Write_Bits(Destination_File, ((CODE_3 << 3) | (Scanned_Block[i+j] & 0x7)), 5);
 			else bit_offset = Write_Bits(Destination_File, ((CODE_9 << 9) | (Scanned_Block[i+j] & 0x1FF)), 11);
+			if (profile_enabled) Profile_Symbol(((Scanned_Block[i+j] < 4) && (Scanned_Block[i+j] >= -4)) ? CODE_3 : CODE_9);
 		} else {
 			//printf("\nIndex(%i) Append EOB", i+j);
 			bit_offset = Write_Bits(Destination_File, BLOCK_END, 2);
+			if (profile_enabled) Profile_Symbol(BLOCK_END);
 			}
 		i += j + 1;
 	}
@@ -528,14 +1272,12 @@ unsigned int Write_Coded_Block(double Block_Data[][8], FILE *Destination_File) {
 
 unsigned int Write_Bits(FILE *Destination_File, int bits, int length) {
 
-	static unsigned int buffer = 0, pointer = 0;
-
-	buffer = (buffer << length) | bits;
-	pointer += length;
+	write_buffer = (write_buffer << length) | bits;
+	write_pointer += length;
 
-	while (pointer >= 8) {
-		fprintf(Destination_File, "%c", 0xFF & (buffer >> (pointer - 8)));
-		pointer -= 8;
+	while (write_pointer >= 8) {
+		fputc(0xFF & (write_buffer >> (write_pointer - 8)), Destination_File);
+		write_pointer -= 8;
 	}
-	return pointer;
+	return write_pointer;
 }
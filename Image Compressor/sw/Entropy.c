@@ -0,0 +1,311 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+// Context-adaptive binary arithmetic coding of block rows, the alternative to the
+// fixed codes of Write_Coded_Block. The blocks are given as 64 quantized values in
+// scan order; every block row is coded on its own (the coder is flushed and the
+// contexts are reset at the end of each row), so that any block row can be decoded
+// from its start alone and the block rows can be decoded in parallel.
+//
+// Each block is binarized as:
+//   - with adaptive quantization, the matrix prefix: keep (context) or 2 raw bits
+//   - coded flag: whether any value is non-zero (context: previous block coded)
+//   - for each scan position up to the last non-zero value: significance, and for
+//     significant values the level (greater than one, then a unary remainder up
+//     to 14 and an order 0 Exp-Golomb escape), the sign (raw) and a last flag
+// The DC value is coded as the difference to the DC of the previous block in the row.
+//
+// The range coder has a 32-bit range and 12-bit probabilities, with the carries
+// propagated through a cached output byte; the first output byte of the coder is
+// always zero and is not stored, so the decoder reads exactly the bytes written.
+
+#define PROB_BITS     12
+#define PROB_INIT     (1 << (PROB_BITS - 1))
+#define ADAPT_FAST    1
+#define ADAPT_SLOW    4
+#define RANGE_TOP     (1U << 24)
+#define LEVEL_UNARY   14
+
+// a context: the probability of a zero bin and its adaptation shift, which starts
+// at ADAPT_FAST (the contexts restart at every block row) and grows by one with
+// every bin up to ADAPT_SLOW
+typedef struct bin_context_struct {
+	unsigned short Probability, Shift;
+} bin_context;
+
+typedef struct entropy_contexts_struct {
+	bin_context Quant_Keep;
+	bin_context Coded[2];
+	bin_context Significant[64];
+	bin_context Last[64];
+	bin_context Greater_One[4];
+	bin_context Level[4][8];
+} entropy_contexts;
+
+typedef struct range_encoder_struct {
+	unsigned long long low;
+	unsigned int range;
+	unsigned char cache;
+	unsigned long long cache_size;
+	int first;
+	unsigned char *Buffer;
+	size_t Size, Capacity;
+} range_encoder;
+
+typedef struct range_decoder_struct {
+	unsigned int range, code;
+	const unsigned char *Stream;
+	size_t Position, Available;
+} range_decoder;
+
+static int Level_Band(int k) {
+	// groups the scan positions for the level contexts
+	return (k == 0) ? 0 : (k < 3) ? 1 : (k < 10) ? 2 : 3;
+}
+
+static void Init_Contexts(entropy_contexts *Contexts) {
+	bin_context *Context = (bin_context *)Contexts;
+	size_t i;
+
+	for (i = 0; i < sizeof(entropy_contexts)/sizeof(bin_context); i++) {
+		Context[i].Probability = PROB_INIT;
+		Context[i].Shift = ADAPT_FAST;
+	}
+}
+
+static void Adapt(bin_context *Context, int bit) {
+	if (!bit) Context->Probability += ((1 << PROB_BITS) - Context->Probability) >> Context->Shift;
+	else Context->Probability -= Context->Probability >> Context->Shift;
+	if (Context->Shift < ADAPT_SLOW) Context->Shift++;
+}
+
+static void Put_Byte(range_encoder *Encoder, unsigned char byte) {
+	if (Encoder->first) { Encoder->first = 0; return; }
+	if (Encoder->Size == Encoder->Capacity) {
+		Encoder->Capacity = (Encoder->Capacity) ? 2*Encoder->Capacity : 4096;
+		Encoder->Buffer = (unsigned char *)realloc(Encoder->Buffer, Encoder->Capacity);
+	}
+	Encoder->Buffer[Encoder->Size++] = byte;
+}
+
+static void Shift_Low(range_encoder *Encoder) {
+	// moves the top byte of low out, holding back 0xFF bytes until a carry is resolved
+	unsigned char temp;
+
+	if (((unsigned int)Encoder->low < 0xFF000000U) || ((Encoder->low >> 32) != 0)) {
+		temp = Encoder->cache;
+		do {
+			Put_Byte(Encoder, (unsigned char)(temp + (unsigned char)(Encoder->low >> 32)));
+			temp = 0xFF;
+		} while (--Encoder->cache_size != 0);
+		Encoder->cache = (unsigned char)((unsigned int)Encoder->low >> 24);
+	}
+	Encoder->cache_size++;
+	Encoder->low = (unsigned long long)((unsigned int)Encoder->low << 8);
+}
+
+static void Encode_Bit(range_encoder *Encoder, bin_context *Context, int bit) {
+	unsigned int bound = (Encoder->range >> PROB_BITS) * Context->Probability;
+
+	if (!bit) Encoder->range = bound;
+	else {
+		Encoder->low += bound;
+		Encoder->range -= bound;
+	}
+	Adapt(Context, bit);
+	while (Encoder->range < RANGE_TOP) {
+		Encoder->range <<= 8;
+		Shift_Low(Encoder);
+	}
+}
+
+static void Encode_Raw_Bits(range_encoder *Encoder, unsigned int bits, int length) {
+	// bins with probability one half, most significant first
+	while (length-- > 0) {
+		Encoder->range >>= 1;
+		if ((bits >> length) & 1) Encoder->low += Encoder->range;
+		while (Encoder->range < RANGE_TOP) {
+			Encoder->range <<= 8;
+			Shift_Low(Encoder);
+		}
+	}
+}
+
+static int Decode_Bit(range_decoder *Decoder, bin_context *Context) {
+	unsigned int bound = (Decoder->range >> PROB_BITS) * Context->Probability;
+	int bit;
+
+	if (Decoder->code < bound) {
+		Decoder->range = bound;
+		bit = 0;
+	} else {
+		Decoder->code -= bound;
+		Decoder->range -= bound;
+		bit = 1;
+	}
+	Adapt(Context, bit);
+	while (Decoder->range < RANGE_TOP) {
+		Decoder->range <<= 8;
+		Decoder->code = (Decoder->code << 8) |
+			((Decoder->Position < Decoder->Available) ? Decoder->Stream[Decoder->Position] : 0);
+		Decoder->Position++;
+	}
+	return bit;
+}
+
+static unsigned int Decode_Raw_Bits(range_decoder *Decoder, int length) {
+	unsigned int bits = 0;
+
+	while (length-- > 0) {
+		Decoder->range >>= 1;
+		bits <<= 1;
+		if (Decoder->code >= Decoder->range) {
+			Decoder->code -= Decoder->range;
+			bits |= 1;
+		}
+		while (Decoder->range < RANGE_TOP) {
+			Decoder->range <<= 8;
+			Decoder->code = (Decoder->code << 8) |
+				((Decoder->Position < Decoder->Available) ? Decoder->Stream[Decoder->Position] : 0);
+			Decoder->Position++;
+		}
+	}
+	return bits;
+}
+
+static void Encode_Level(range_encoder *Encoder, entropy_contexts *Contexts, int k, int value) {
+	// codes a non-zero value: magnitude minus one as greater-than-one, unary and escape, then the sign
+	int i, band = Level_Band(k), remainder, magnitude = (value < 0) ? -value : value;
+
+	Encode_Bit(Encoder, &Contexts->Greater_One[band], magnitude > 1);
+	if (magnitude > 1) {
+		remainder = magnitude - 2;
+		for (i = 0; (i < LEVEL_UNARY) && (i <= remainder); i++)
+			Encode_Bit(Encoder, &Contexts->Level[band][(i < 7) ? i : 7], remainder > i);
+		if (remainder >= LEVEL_UNARY) {
+			// order 0 Exp-Golomb: the length in unary, then the bits below the leading one
+			remainder = remainder - LEVEL_UNARY + 1;
+			for (i = 0; (remainder >> (i + 1)) != 0; i++) Encode_Raw_Bits(Encoder, 1, 1);
+			Encode_Raw_Bits(Encoder, 0, 1);
+			Encode_Raw_Bits(Encoder, (unsigned int)remainder, i);
+		}
+	}
+	Encode_Raw_Bits(Encoder, value < 0, 1);
+}
+
+static int Decode_Level(range_decoder *Decoder, entropy_contexts *Contexts, int k) {
+	int i, band = Level_Band(k), length, magnitude = 1;
+
+	if (Decode_Bit(Decoder, &Contexts->Greater_One[band])) {
+		magnitude = 2;
+		for (i = 0; (i < LEVEL_UNARY) && Decode_Bit(Decoder, &Contexts->Level[band][(i < 7) ? i : 7]); i++)
+			magnitude++;
+		if (i == LEVEL_UNARY) {
+			for (length = 0; (length < 24) && Decode_Raw_Bits(Decoder, 1); length++);
+			magnitude += (int)(((1U << length) | Decode_Raw_Bits(Decoder, length)) - 1);
+		}
+	}
+	return Decode_Raw_Bits(Decoder, 1) ? -magnitude : magnitude;
+}
+
+size_t Arith_Encode_Block_Row(const int *Blocks, const int *Block_Quants, int Num_Blocks,
+	int Base_Quant, unsigned char **Buffer, size_t *Capacity
+) {
+	// codes Num_Blocks blocks of 64 scan ordered values into *Buffer (grown as needed),
+	// with the matrix prefixes of Block_Quants unless it is NULL; returns the bytes used
+	entropy_contexts Contexts;
+	range_encoder Encoder;
+	int i, k, Last, Previous_DC = 0, Previous_Coded = 0, Previous_Quant = Base_Quant, Values[64];
+
+	Init_Contexts(&Contexts);
+	Encoder.low = 0;
+	Encoder.range = 0xFFFFFFFFU;
+	Encoder.cache = 0;
+	Encoder.cache_size = 1;
+	Encoder.first = 1;
+	Encoder.Buffer = *Buffer;
+	Encoder.Capacity = *Capacity;
+	Encoder.Size = 0;
+
+	for (i = 0; i < Num_Blocks; i++) {
+		if (Block_Quants != NULL) {
+			Encode_Bit(&Encoder, &Contexts.Quant_Keep, Block_Quants[i] != Previous_Quant);
+			if (Block_Quants[i] != Previous_Quant) Encode_Raw_Bits(&Encoder, Block_Quants[i], 2);
+			Previous_Quant = Block_Quants[i];
+		}
+
+		memcpy(Values, &Blocks[64*i], sizeof(Values));
+		Values[0] -= Previous_DC;
+		Previous_DC = Blocks[64*i];
+
+		for (Last = 63; (Last >= 0) && (Values[Last] == 0); Last--);
+		Encode_Bit(&Encoder, &Contexts.Coded[Previous_Coded], Last >= 0);
+		Previous_Coded = (Last >= 0);
+
+		for (k = 0; k <= Last; k++) {
+			if (k < 63) Encode_Bit(&Encoder, &Contexts.Significant[k], Values[k] != 0);
+			if (Values[k] != 0) {
+				Encode_Level(&Encoder, &Contexts, k, Values[k]);
+				if (k < 63) Encode_Bit(&Encoder, &Contexts.Last[k], k == Last);
+			}
+		}
+	}
+
+	// flush
+	for (i = 0; i < 5; i++) Shift_Low(&Encoder);
+
+	*Buffer = Encoder.Buffer;
+	*Capacity = Encoder.Capacity;
+	return Encoder.Size;
+}
+
+size_t Arith_Decode_Block_Row(const unsigned char *Stream, size_t Available, int *Blocks,
+	int *Block_Quants, int Num_Blocks, int Base_Quant
+) {
+	// decodes Num_Blocks blocks into 64 scan ordered values each, and their matrices
+	// into Block_Quants unless it is NULL; returns the bytes read from Stream
+	entropy_contexts Contexts;
+	range_decoder Decoder;
+	int i, k, Last, Coded, Previous_DC = 0, Previous_Coded = 0, Previous_Quant = Base_Quant;
+	int *Values;
+
+	Init_Contexts(&Contexts);
+	Decoder.range = 0xFFFFFFFFU;
+	Decoder.code = 0;
+	Decoder.Stream = Stream;
+	Decoder.Available = Available;
+	for (Decoder.Position = 0; Decoder.Position < 4; Decoder.Position++)
+		Decoder.code = (Decoder.code << 8) | ((Decoder.Position < Available) ? Stream[Decoder.Position] : 0);
+
+	for (i = 0; i < Num_Blocks; i++) {
+		if (Block_Quants != NULL) {
+			if (Decode_Bit(&Decoder, &Contexts.Quant_Keep))
+				Previous_Quant = (int)Decode_Raw_Bits(&Decoder, 2);
+			Block_Quants[i] = Previous_Quant;
+		}
+
+		Values = &Blocks[64*i];
+		memset(Values, 0, 64*sizeof(int));
+		Coded = Decode_Bit(&Decoder, &Contexts.Coded[Previous_Coded]);
+		Previous_Coded = Coded;
+
+		for (k = 0, Last = !Coded; !Last && (k < 64); k++) {
+			if ((k == 63) || Decode_Bit(&Decoder, &Contexts.Significant[k])) {
+				Values[k] = Decode_Level(&Decoder, &Contexts, k);
+				Last = (k == 63) || Decode_Bit(&Decoder, &Contexts.Last[k]);
+			}
+		}
+
+		Values[0] += Previous_DC;
+		Previous_DC = Values[0];
+	}
+
+	return Decoder.Position;
+}
@@ -0,0 +1,406 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include <stdlib.h>
+
+#include "Precision.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Row kernels shared by the encoder and the decoder. Edge replication is done
+// once per row into a padded scratch row, so that the inner loops have no
+// index clamping. Samples are held on 16 bits in the scratch row, which is
+// exact for the 8-bit (0 .. 255) data that reaches the chroma filters.
+
+static void Pad_Chroma_Row(const int *Row, short *Padded_Row, int Columns, int stride, int phase, int left, int right) {
+	// Padded_Row[m + left] = Row[stride*m + phase], clamped to the row, for m = -left .. Columns + right - 1
+	int m, k;
+
+	for (m = -left; m < Columns + right; m++) {
+		k = stride*m + phase;
+		k = (k < 0) ? 0 : (k > stride*Columns - 1) ? stride*Columns - 1 : k;
+		Padded_Row[m + left] = (short)Row[k];
+	}
+}
+
+void Downsample_Chroma_Row(const int *Row, int *Downsampled_Row, int Columns, short *Scratch) {
+	// 4:4:4 -> 4:2:2 filter and decimation of one chroma row (Columns samples in,
+	// Columns/2 samples out), taps 22, -52, 159, 256, 159, -52, 22 rounded at bit 9.
+	// The odd-phase samples are the six symmetric taps around each even sample,
+	// so the odd and even phases are split out once, with the edge padding
+	// (the input is consumed first, so Downsampled_Row may be the same as Row)
+	short *Odd, *Even;
+	int k, s, Half_Columns = Columns/2;
+
+	Odd = Scratch;
+	Even = Scratch + Half_Columns + 8;
+	Pad_Chroma_Row(Row, Odd, Half_Columns, 2, 1, 3, 2);
+	Pad_Chroma_Row(Row, Even, Half_Columns, 2, 0, 0, 0);
+
+	k = 0;
+#ifdef __SSE2__
+	{
+		__m128i c_outer = _mm_set_epi16(-52, 22, -52, 22, -52, 22, -52, 22);
+		__m128i c_inner = _mm_set_epi16(256, 159, 256, 159, 256, 159, 256, 159);
+		__m128i round = _mm_set1_epi32(1 << 8), zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+		__m128i s1, s2, s3, e, lo, hi, out;
+		int h;
+
+		for (; k + 16 <= Half_Columns; k += 16)
+			for (h = k; h < k + 16; h += 8) {
+				s1 = _mm_add_epi16(_mm_loadu_si128((__m128i *)(Odd + h)), _mm_loadu_si128((__m128i *)(Odd + h + 5)));
+				s2 = _mm_add_epi16(_mm_loadu_si128((__m128i *)(Odd + h + 1)), _mm_loadu_si128((__m128i *)(Odd + h + 4)));
+				s3 = _mm_add_epi16(_mm_loadu_si128((__m128i *)(Odd + h + 2)), _mm_loadu_si128((__m128i *)(Odd + h + 3)));
+				e = _mm_loadu_si128((__m128i *)(Even + h));
+
+				lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(s1, s2), c_outer),
+				                   _mm_madd_epi16(_mm_unpacklo_epi16(s3, e), c_inner));
+				hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(s1, s2), c_outer),
+				                   _mm_madd_epi16(_mm_unpackhi_epi16(s3, e), c_inner));
+				lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 9);
+				hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 9);
+
+				// clipping to 8 bits (0 .. 255)
+				out = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(lo, hi), zero), max);
+				_mm_storeu_si128((__m128i *)(Downsampled_Row + h), _mm_unpacklo_epi16(out, zero));
+				_mm_storeu_si128((__m128i *)(Downsampled_Row + h + 4), _mm_unpackhi_epi16(out, zero));
+			}
+	}
+#endif
+	for (; k < Half_Columns; k++) {
+		s = 22 * (Odd[k] + Odd[k+5]) - 52 * (Odd[k+1] + Odd[k+4]) + 159 * (Odd[k+2] + Odd[k+3]) + 256 * Even[k];
+		s = (s + (1 << 8)) >> 9;
+		Downsampled_Row[k] = (s < 0) ? 0 : (s > 255) ? 255 : s;
+	}
+}
+
+void Upsample_Chroma_Row(const int *Row, int *Upsampled_Row, int Columns, short *Scratch) {
+	// 4:2:2 -> 4:4:4 interpolation of one chroma row (Columns/2 samples in,
+	// Columns samples out): even samples are copied, odd samples are filtered
+	// with taps 21, -52, 159, 159, -52, 21 rounded at bit 8 (no clipping)
+	short *Padded;
+	int k, s, Half_Columns = Columns/2;
+
+	Padded = Scratch;
+	Pad_Chroma_Row(Row, Padded, Half_Columns, 1, 0, 2, 3);
+
+	k = 0;
+#ifdef __SSE2__
+	{
+		__m128i c_outer = _mm_set_epi16(-52, 21, -52, 21, -52, 21, -52, 21);
+		__m128i c_inner = _mm_set1_epi16(159);
+		__m128i round = _mm_set1_epi32(1 << 7);
+		__m128i s1, s2, s3, lo, hi, q;
+		int h;
+
+		for (; k + 16 <= Half_Columns; k += 16)
+			for (h = k; h < k + 16; h += 8) {
+				s1 = _mm_add_epi16(_mm_loadu_si128((__m128i *)(Padded + h)), _mm_loadu_si128((__m128i *)(Padded + h + 5)));
+				s2 = _mm_add_epi16(_mm_loadu_si128((__m128i *)(Padded + h + 1)), _mm_loadu_si128((__m128i *)(Padded + h + 4)));
+				s3 = _mm_add_epi16(_mm_loadu_si128((__m128i *)(Padded + h + 2)), _mm_loadu_si128((__m128i *)(Padded + h + 3)));
+
+				lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(s1, s2), c_outer),
+				                   _mm_madd_epi16(_mm_unpacklo_epi16(s3, _mm_setzero_si128()), c_inner));
+				hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(s1, s2), c_outer),
+				                   _mm_madd_epi16(_mm_unpackhi_epi16(s3, _mm_setzero_si128()), c_inner));
+				lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 8);
+				hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 8);
+
+				// interleave the copied even samples with the filtered odd samples
+				q = _mm_loadu_si128((__m128i *)(Row + h));
+				_mm_storeu_si128((__m128i *)(Upsampled_Row + 2*h), _mm_unpacklo_epi32(q, lo));
+				_mm_storeu_si128((__m128i *)(Upsampled_Row + 2*h + 4), _mm_unpackhi_epi32(q, lo));
+				q = _mm_loadu_si128((__m128i *)(Row + h + 4));
+				_mm_storeu_si128((__m128i *)(Upsampled_Row + 2*h + 8), _mm_unpacklo_epi32(q, hi));
+				_mm_storeu_si128((__m128i *)(Upsampled_Row + 2*h + 12), _mm_unpackhi_epi32(q, hi));
+			}
+	}
+#endif
+	for (; k < Half_Columns; k++) {
+		s = 21 * (Padded[k] + Padded[k+5]) - 52 * (Padded[k+1] + Padded[k+4]) + 159 * (Padded[k+2] + Padded[k+3]);
+		Upsampled_Row[2*k] = Row[k];
+		Upsampled_Row[2*k+1] = (s + 128) >> 8;
+	}
+}
+
+void Downsample_Chroma_Column(const int *const *Rows, int *Downsampled_Row, int Columns) {
+	// 4:2:2 -> 4:2:0 filter and decimation along the columns: the same taps as
+	// Downsample_Chroma_Row, applied to the seven rows 2r-5, 2r-3, 2r-1, 2r, 2r+1,
+	// 2r+3, 2r+5 (given in that order in Rows, clamped to the plane by the caller)
+	// to give row r; every column is independent, so the columns are vectorized
+	int j, s;
+
+	j = 0;
+#ifdef __SSE2__
+	{
+		__m128i c_outer = _mm_set_epi16(-52, 22, -52, 22, -52, 22, -52, 22);
+		__m128i c_inner = _mm_set_epi16(256, 159, 256, 159, 256, 159, 256, 159);
+		__m128i round = _mm_set1_epi32(1 << 8), zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+		__m128i r[7], s1, s2, s3, lo, hi, out;
+		int t;
+
+		for (; j + 8 <= Columns; j += 8) {
+			for (t = 0; t < 7; t++)
+				r[t] = _mm_packs_epi32(_mm_loadu_si128((__m128i *)(Rows[t] + j)), _mm_loadu_si128((__m128i *)(Rows[t] + j + 4)));
+			s1 = _mm_add_epi16(r[0], r[6]);
+			s2 = _mm_add_epi16(r[1], r[5]);
+			s3 = _mm_add_epi16(r[2], r[4]);
+
+			lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(s1, s2), c_outer),
+			                   _mm_madd_epi16(_mm_unpacklo_epi16(s3, r[3]), c_inner));
+			hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(s1, s2), c_outer),
+			                   _mm_madd_epi16(_mm_unpackhi_epi16(s3, r[3]), c_inner));
+			lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 9);
+			hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 9);
+
+			// clipping to 8 bits (0 .. 255)
+			out = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(lo, hi), zero), max);
+			_mm_storeu_si128((__m128i *)(Downsampled_Row + j), _mm_unpacklo_epi16(out, zero));
+			_mm_storeu_si128((__m128i *)(Downsampled_Row + j + 4), _mm_unpackhi_epi16(out, zero));
+		}
+	}
+#endif
+	for (; j < Columns; j++) {
+		s = 22 * (Rows[0][j] + Rows[6][j]) - 52 * (Rows[1][j] + Rows[5][j]) + 159 * (Rows[2][j] + Rows[4][j]) + 256 * Rows[3][j];
+		s = (s + (1 << 8)) >> 9;
+		Downsampled_Row[j] = (s < 0) ? 0 : (s > 255) ? 255 : s;
+	}
+}
+
+void Upsample_Chroma_Column(const int *const *Rows, int *Upsampled_Row, int Columns) {
+	// 4:2:0 -> 4:2:2 interpolation along the columns: row 2r is row r of the
+	// plane (copied by the caller) and row 2r+1 is filtered with the taps of
+	// Upsample_Chroma_Row from the six rows r-2 .. r+3 (given in Rows, clamped)
+	int j, s;
+
+	j = 0;
+#ifdef __SSE2__
+	{
+		__m128i c_outer = _mm_set_epi16(-52, 21, -52, 21, -52, 21, -52, 21);
+		__m128i c_inner = _mm_set1_epi16(159);
+		__m128i round = _mm_set1_epi32(1 << 7);
+		__m128i r[6], s1, s2, s3, lo, hi;
+		int t;
+
+		for (; j + 8 <= Columns; j += 8) {
+			for (t = 0; t < 6; t++)
+				r[t] = _mm_packs_epi32(_mm_loadu_si128((__m128i *)(Rows[t] + j)), _mm_loadu_si128((__m128i *)(Rows[t] + j + 4)));
+			s1 = _mm_add_epi16(r[0], r[5]);
+			s2 = _mm_add_epi16(r[1], r[4]);
+			s3 = _mm_add_epi16(r[2], r[3]);
+
+			lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(s1, s2), c_outer),
+			                   _mm_madd_epi16(_mm_unpacklo_epi16(s3, _mm_setzero_si128()), c_inner));
+			hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(s1, s2), c_outer),
+			                   _mm_madd_epi16(_mm_unpackhi_epi16(s3, _mm_setzero_si128()), c_inner));
+			_mm_storeu_si128((__m128i *)(Upsampled_Row + j), _mm_srai_epi32(_mm_add_epi32(lo, round), 8));
+			_mm_storeu_si128((__m128i *)(Upsampled_Row + j + 4), _mm_srai_epi32(_mm_add_epi32(hi, round), 8));
+		}
+	}
+#endif
+	for (; j < Columns; j++) {
+		s = 21 * (Rows[0][j] + Rows[5][j]) - 52 * (Rows[1][j] + Rows[4][j]) + 159 * (Rows[2][j] + Rows[3][j]);
+		Upsampled_Row[j] = (s + 128) >> 8;
+	}
+}
+
+#ifdef __SSE2__
+// selects lanes i0, i1 of a and lanes i2, i3 of b (shufps on integer data)
+#define SHUFFLE_32(a, b, i0, i1, i2, i3) _mm_castps_si128(_mm_shuffle_ps( \
+	_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(i3, i2, i1, i0)))
+
+// packs the low 16 bits of a (even half) and b (odd half) of each 32-bit lane
+#define PAIR_16(a, b) _mm_or_si128(_mm_and_si128((a), _mm_set1_epi32(0xFFFF)), _mm_slli_epi32((b), 16))
+#endif
+
+void RGB_To_YUV_Row(const int *RGB_Row, int *Y_Row, int *U_Row, int *V_Row, int Columns) {
+	// colourspace conversion of one row of interleaved RGB samples to Y, U and V rows,
+	// with the 16-bit fixed-point matrix (16843, 33030, 6423, -9699, -19071, 28770,
+	// 28770, -24117, -4653) at COLOUR_BITS, offsets 16 / 128 and rounding at bit
+	// COLOUR_BITS (Y is clipped); the vector code holds the 16-bit matrix only
+	int j, R_val, G_val, B_val, Y_val;
+
+	j = 0;
+#if defined(__SSE2__) && (COLOUR_BITS == 16)
+	{
+		// 33030 does not fit on 16 bits, it is applied as 16515 * (2 * G)
+		__m128i c_Y = PAIR_16(_mm_set1_epi32(16843), _mm_set1_epi32(16515)), c_YB = _mm_set1_epi32(6423);
+		__m128i c_U = PAIR_16(_mm_set1_epi32(-9699), _mm_set1_epi32(-19071)), c_UB = _mm_set1_epi32(28770);
+		__m128i c_V = PAIR_16(_mm_set1_epi32(28770), _mm_set1_epi32(-24117)), c_VB = _mm_set1_epi32(-4653 & 0xFFFF);
+		__m128i o_Y = _mm_set1_epi32(((16 << 1) + 1) << 15), o_UV = _mm_set1_epi32(((128 << 1) + 1) << 15);
+		__m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+		__m128i a, b, c, t0, t1, Rv, Gv, Bv, Yv, Uv, Vv;
+
+		for (; j + 4 <= Columns; j += 4) {
+			// deinterleave four RGB pixels
+			a = _mm_loadu_si128((__m128i *)(RGB_Row + 3*j));
+			b = _mm_loadu_si128((__m128i *)(RGB_Row + 3*j + 4));
+			c = _mm_loadu_si128((__m128i *)(RGB_Row + 3*j + 8));
+			t0 = SHUFFLE_32(b, c, 2, 3, 0, 1);
+			Rv = SHUFFLE_32(a, t0, 0, 3, 0, 3);
+			t0 = SHUFFLE_32(a, b, 1, 2, 0, 1);
+			t1 = SHUFFLE_32(b, c, 3, 0, 2, 3);
+			Gv = SHUFFLE_32(t0, t1, 0, 2, 0, 2);
+			t1 = SHUFFLE_32(c, c, 0, 3, 0, 3);
+			Bv = SHUFFLE_32(t0, t1, 1, 3, 0, 1);
+
+			Yv = _mm_add_epi32(_mm_madd_epi16(PAIR_16(Rv, _mm_add_epi32(Gv, Gv)), c_Y), _mm_madd_epi16(Bv, c_YB));
+			Uv = _mm_add_epi32(_mm_madd_epi16(PAIR_16(Rv, Gv), c_U), _mm_madd_epi16(Bv, c_UB));
+			Vv = _mm_add_epi32(_mm_madd_epi16(PAIR_16(Rv, Gv), c_V), _mm_madd_epi16(Bv, c_VB));
+			Yv = _mm_srai_epi32(_mm_add_epi32(Yv, o_Y), 16);
+			Uv = _mm_srai_epi32(_mm_add_epi32(Uv, o_UV), 16);
+			Vv = _mm_srai_epi32(_mm_add_epi32(Vv, o_UV), 16);
+
+			// clipping Y to 8 bits (0 .. 255)
+			Yv = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(Yv, Yv), zero), max);
+			_mm_storeu_si128((__m128i *)(Y_Row + j), _mm_unpacklo_epi16(Yv, zero));
+			_mm_storeu_si128((__m128i *)(U_Row + j), Uv);
+			_mm_storeu_si128((__m128i *)(V_Row + j), Vv);
+		}
+	}
+#endif
+	for (; j < Columns; j++) {
+		R_val = RGB_Row[3*j + 0];
+		G_val = RGB_Row[3*j + 1];
+		B_val = RGB_Row[3*j + 2];
+
+		Y_val = (COLOUR_COEFF(16843)*R_val + COLOUR_COEFF(33030)*G_val + COLOUR_COEFF(6423)*B_val
+			+ (((16 << 1) + 1) << (COLOUR_BITS - 1))) >> COLOUR_BITS;
+		Y_Row[j] = (Y_val < 0) ? 0 : (Y_val > 255) ? 255 : Y_val;
+		U_Row[j] = (-COLOUR_COEFF(9699)*R_val - COLOUR_COEFF(19071)*G_val + COLOUR_COEFF(28770)*B_val
+			+ (((128 << 1) + 1) << (COLOUR_BITS - 1))) >> COLOUR_BITS;
+		V_Row[j] = (COLOUR_COEFF(28770)*R_val - COLOUR_COEFF(24117)*G_val - COLOUR_COEFF(4653)*B_val
+			+ (((128 << 1) + 1) << (COLOUR_BITS - 1))) >> COLOUR_BITS;
+	}
+}
+
+void YUV_To_RGB_Row(const int *Y_Row, const int *U_Row, const int *V_Row, int *RGB_Row, int Columns) {
+	// colourspace conversion of one row of upsampled Y, U and V samples to interleaved RGB,
+	// with the 16-bit fixed-point matrix (76284, 104595, 25624, 53281, 132251) at COLOUR_BITS
+	// and clipping (the vector code holds the 16-bit matrix only)
+	int j, Y_val, U_val, V_val, R_val, G_val, B_val;
+
+	j = 0;
+#if defined(__SSE2__) && (COLOUR_BITS == 16)
+	{
+		// the coefficients above 16 bits are split over scaled inputs:
+		// 76284 = 19071 * 4, 104595 = 20919 * 5, 132251 = 18893 * 7, 53281 = 26640 * 2 + 1
+		__m128i c_R = PAIR_16(_mm_set1_epi32(19071), _mm_set1_epi32(20919));
+		__m128i c_G = PAIR_16(_mm_set1_epi32(19071), _mm_set1_epi32(-25624));
+		__m128i c_GV = PAIR_16(_mm_set1_epi32(-26640), _mm_set1_epi32(-1));
+		__m128i c_B = PAIR_16(_mm_set1_epi32(19071), _mm_set1_epi32(18893));
+		__m128i o_Y = _mm_set1_epi32(16), o_UV = _mm_set1_epi32(128);
+		__m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+		__m128i Yv, Uv, Vv, Y4, Rv, Gv, Bv, RG, t0, t1;
+
+		for (; j + 4 <= Columns; j += 4) {
+			Yv = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(Y_Row + j)), o_Y);
+			Uv = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(U_Row + j)), o_UV);
+			Vv = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(V_Row + j)), o_UV);
+			Y4 = _mm_slli_epi32(Yv, 2);
+
+			Rv = _mm_madd_epi16(PAIR_16(Y4, _mm_add_epi32(_mm_slli_epi32(Vv, 2), Vv)), c_R);
+			Gv = _mm_add_epi32(_mm_madd_epi16(PAIR_16(Y4, Uv), c_G), _mm_madd_epi16(PAIR_16(_mm_add_epi32(Vv, Vv), Vv), c_GV));
+			Bv = _mm_madd_epi16(PAIR_16(Y4, _mm_sub_epi32(_mm_slli_epi32(Uv, 3), Uv)), c_B);
+
+			// clipping to keep the range on 8 bits (0 .. 255)
+			Rv = _mm_srai_epi32(Rv, 16); Gv = _mm_srai_epi32(Gv, 16); Bv = _mm_srai_epi32(Bv, 16);
+			t0 = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(Rv, Gv), zero), max);
+			t1 = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(Bv, Bv), zero), max);
+			Rv = _mm_unpacklo_epi16(t0, zero);
+			Gv = _mm_unpackhi_epi16(t0, zero);
+			Bv = _mm_unpacklo_epi16(t1, zero);
+
+			// reinterleave four RGB pixels
+			RG = _mm_unpacklo_epi32(Rv, Gv);
+			t0 = SHUFFLE_32(Bv, RG, 0, 0, 2, 2);
+			_mm_storeu_si128((__m128i *)(RGB_Row + 3*j), SHUFFLE_32(RG, t0, 0, 1, 0, 2));
+			t0 = SHUFFLE_32(RG, Bv, 3, 3, 1, 1);
+			RG = _mm_unpackhi_epi32(Rv, Gv);
+			_mm_storeu_si128((__m128i *)(RGB_Row + 3*j + 4), SHUFFLE_32(t0, RG, 0, 2, 0, 1));
+			t0 = SHUFFLE_32(Bv, RG, 2, 2, 2, 2);
+			t1 = SHUFFLE_32(RG, Bv, 3, 3, 3, 3);
+			_mm_storeu_si128((__m128i *)(RGB_Row + 3*j + 8), SHUFFLE_32(t0, t1, 0, 2, 0, 2));
+		}
+	}
+#endif
+	for (; j < Columns; j++) {
+		Y_val = Y_Row[j] - 16;
+		U_val = U_Row[j] - 128;
+		V_val = V_Row[j] - 128;
+
+		R_val = (COLOUR_COEFF(76284)*Y_val + COLOUR_COEFF(104595)*V_val) >> COLOUR_BITS;
+		G_val = (COLOUR_COEFF(76284)*Y_val - COLOUR_COEFF(25624)*U_val - COLOUR_COEFF(53281)*V_val) >> COLOUR_BITS;
+		B_val = (COLOUR_COEFF(76284)*Y_val + COLOUR_COEFF(132251)*U_val) >> COLOUR_BITS;
+
+		RGB_Row[3*j + 0] = (R_val < 0) ? 0 : (R_val > 255) ? 255 : R_val;
+		RGB_Row[3*j + 1] = (G_val < 0) ? 0 : (G_val > 255) ? 255 : G_val;
+		RGB_Row[3*j + 2] = (B_val < 0) ? 0 : (B_val > 255) ? 255 : B_val;
+	}
+}
+
+unsigned long long Squared_Error_Row(const unsigned char *Row_1, const unsigned char *Row_2, int Columns) {
+	// sum of the squared differences of two rows of 8-bit samples; the vector sums are
+	// held on 32 bits, which is exact for 8192 iterations (8 * 255 * 255 per iteration)
+	unsigned long long Sum = 0;
+	int j, d;
+
+	j = 0;
+#ifdef __SSE2__
+	{
+		__m128i zero = _mm_setzero_si128(), acc, diff;
+		unsigned int lanes[4];
+		int k;
+
+		while (j + 8 <= Columns) {
+			acc = zero;
+			for (k = 0; (k < 8192) && (j + 8 <= Columns); k++, j += 8) {
+				diff = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(Row_1 + j)), zero),
+				                     _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(Row_2 + j)), zero));
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(diff, diff));
+			}
+			_mm_storeu_si128((__m128i *)lanes, acc);
+			Sum += (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		}
+	}
+#endif
+	for (; j < Columns; j++) {
+		d = (int)Row_1[j] - (int)Row_2[j];
+		Sum += d*d;
+	}
+	return Sum;
+}
+
+void Weighted_Sum_Rows(const float *const *Rows, const float *Weights, int Taps, float *Sum_Row, int Columns) {
+	// Sum_Row[j] = sum over k of Weights[k] * Rows[k][j], for the window filters of the
+	// structural similarity (the rows of a vertical window, or the shifted positions of a
+	// row for a horizontal one)
+	int j, k;
+	float s;
+
+	j = 0;
+#ifdef __SSE2__
+	{
+		__m128 acc;
+
+		for (; j + 4 <= Columns; j += 4) {
+			acc = _mm_mul_ps(_mm_loadu_ps(Rows[0] + j), _mm_set1_ps(Weights[0]));
+			for (k = 1; k < Taps; k++)
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(Rows[k] + j), _mm_set1_ps(Weights[k])));
+			_mm_storeu_ps(Sum_Row + j, acc);
+		}
+	}
+#endif
+	for (; j < Columns; j++) {
+		s = Rows[0][j]*Weights[0];
+		for (k = 1; k < Taps; k++)
+			s += Rows[k][j]*Weights[k];
+		Sum_Row[j] = s;
+	}
+}
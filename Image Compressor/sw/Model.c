@@ -0,0 +1,293 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include "Coding.h"
+
+// Cycle-approximate model of the hardware encoder for -model: milestone 1
+// (ColourspaceConversion_Downsample.sv) and milestone 2 (DCT.sv), counted per pixel
+// pair and per 8x8 block from the states of the RTL. The fixed part of every block
+// (fetching S, computing T and S') follows from the schedule; the quantization and
+// lossless coding depends on the coefficients, taken from a compressed stream with
+// the decoder's Read_Coded_Block (the RTL emits a zero run in a cycle of its own and
+// a 16-bit word of the stream whenever one is complete).
+
+// the schedule of the RTL: 4 multipliers, and a 132-cycle block period with the fetch
+// of S at cycle 0, T computed from cycle 65 and S' from cycle 131 (with the multipliers
+// shared), and the quantization and coding of the block before from cycle 33
+#define RTL_MULTIPLIERS 4
+#define RTL_PERIOD      132
+#define RTL_QLE_START   33
+
+// the work of the stages, per pair of pixels (milestone 1) and per block (milestone 2)
+#define CSC_MULTS_PER_PAIR   24   // Y, U, V of two pixels and a U' or V' tap pair, 6 cycles of 4
+#define CSC_READS_PER_PAIR   3    // 6 bytes of RGB
+#define CSC_WRITES_PER_PAIR  2    // a Y word, and a U' or V' word every other pair
+#define CSC_FLUSH_PAIRS      4    // the FIR filter runs 8 pixels past the end of the row
+#define CSC_ROW_CYCLES       3    // S_CSCD_NEW_PIXEL_ROW, S_CSCD_1, S_CSCD_2
+
+#define FS_READS      32   // 8 rows of 4 words
+#define FS_CYCLES     4    // S_DCT_FS_0, _1, _2, _3 around a word a cycle
+#define DCT_MULTS     256  // one 1-D pass: 64 outputs of a 4-tap butterfly
+#define DCT_OUTPUTS   64
+#define CT_CYCLES     3    // S_DCT_CT_0, _1, _2
+#define SD_CYCLES     3    // S_DCT_Sd_0, _1, _2
+#define SD_OVERLAP    2    // S_DCT_Sd_0 and _1 only address T, during S_DCT_CT_2 of the next block
+#define QLE_CYCLES    4    // S_DCT_QLE_0, the hold for the last coefficient, S_DCT_QLE_1 and _2
+#define HEADER_WRITES 6    // the rest of the header, after the last block
+#define OFFSET_WRITES 2    // the U or V segment offset, after the last block of Y or U
+
+#define MAX_QLE_CYCLES 256 // 64 coefficients, the overhead and at most 2 cycles per released run
+
+// the data dependent work of the blocks of a segment
+typedef struct segment_model_struct {
+	long Blocks;
+	unsigned long long Words, Release_Cycles, QLE_Cycles;
+	unsigned long long QLE_Histogram[MAX_QLE_CYCLES];
+	int Min_QLE, Max_QLE;
+} segment_model;
+
+void Performance_Model(char *, int, int, int, int, int, char *);
+unsigned int Read_Coded_Block(FILE *, int [][8], int, int *, int *);
+void Seek_Bits(FILE *, unsigned long long);
+static int Divide_Up(int, int);
+static void Model_Stream(char *, int *, int *, int *, segment_model *);
+static void Model_Uniform(int, int, segment_model *);
+static void Count_QLE(segment_model *, int, int);
+
+
+static int Divide_Up(int Value, int Divisor) {
+	return (Value + Divisor - 1)/Divisor;
+}
+
+static void Count_QLE(segment_model *Segment, int Cycles, int Release_Cycles) {
+	// adds the quantization and coding of a block
+	if (Cycles >= MAX_QLE_CYCLES) Cycles = MAX_QLE_CYCLES - 1;
+	Segment->QLE_Histogram[Cycles]++;
+	Segment->QLE_Cycles += Cycles;
+	Segment->Release_Cycles += Release_Cycles;
+	if (Cycles < Segment->Min_QLE) Segment->Min_QLE = Cycles;
+	if (Cycles > Segment->Max_QLE) Segment->Max_QLE = Cycles;
+}
+
+static void Model_Stream(char *Source_Filename, int *Rows, int *Columns, int *Compression_Format, segment_model *Segments) {
+	// walks every block of Source_Filename.mic for the cycles of its quantization and
+	// lossless coding and the 16-bit words of the stream written to the SRAM
+	int i, j, k, colour, Header_Format, Header_Bytes, Block_Rows, Block_Columns, Segment_Columns;
+	int Block_Quant, Block_Data[8][8], Scanned_Block[65], Zeros, Release_Cycles;
+	unsigned long long Bits;
+	FILE *Source_File;
+
+	strcat(Source_Filename, ".mic");
+	if ((Source_File = fopen(Source_Filename, "rb")) == NULL) {
+		printf("Problem opening source compressed stream %s\n", Source_Filename); exit(1); }
+
+	// the header, as read by the decoder
+	fgetc(Source_File); fgetc(Source_File); fgetc(Source_File); // strip 0xECE744
+	*Compression_Format = fgetc(Source_File);
+	Header_Format = FORMAT_HEADER(*Compression_Format);
+	if ((Header_Format != HEADER_NARROW) && (Header_Format != HEADER_WIDE)) {
+		printf("Unrecognized header layout %d in %s\n", Header_Format, Source_Filename); exit(1); }
+	*Rows = *Columns = 0;
+	for (i = (Header_Format == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		*Rows = (*Rows << 8) | fgetc(Source_File);
+	for (i = (Header_Format == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		*Columns = (*Columns << 8) | fgetc(Source_File);
+	if ((*Rows <= 0) || (*Columns <= 0)) {
+		printf("Invalid image size %d x %d in %s\n", *Columns, *Rows, Source_Filename); exit(1); }
+	if (FORMAT_ENTROPY(*Compression_Format)) {
+		printf("%s is arithmetic coded, the hardware writes the fixed codes only\n", Source_Filename); exit(1); }
+	if (FORMAT_SKIP(*Compression_Format)) {
+		printf("%s is a frame of a sequence, the hardware codes still images only\n", Source_Filename); exit(1); }
+	if (FORMAT_ADAPTIVE(*Compression_Format)) {
+		printf("%s has adaptive quantization, the hardware codes a fixed matrix only\n", Source_Filename); exit(1); }
+	if (FORMAT_CHROMA(*Compression_Format) == CHROMA_420) {
+		printf("%s is 4:2:0, the hardware codes 4:2:2 only\n", Source_Filename); exit(1); }
+	Header_Bytes = (Header_Format == HEADER_WIDE) ? 36 : 20;
+
+	Block_Rows = PADDED_ROWS(*Rows, *Compression_Format)/8;
+	Block_Columns = PADDED_COLUMNS(*Columns)/8;
+
+	// the segments follow each other without padding, a word is written when it fills
+	Seek_Bits(Source_File, 8*(unsigned long long)Header_Bytes);
+	Bits = 0;
+	for (colour = 0; colour < 3; colour++) {
+		Segment_Columns = (colour) ? Block_Columns/2 : Block_Columns;
+		memset(&Segments[colour], 0, sizeof(segment_model));
+		Segments[colour].Blocks = (long)Block_Rows*Segment_Columns;
+		Segments[colour].Min_QLE = MAX_QLE_CYCLES;
+		for (i = 0; i < Block_Rows; i++) {
+			Block_Quant = FORMAT_QUANT(*Compression_Format);
+			for (j = 0; j < Segment_Columns; j++) {
+				Segments[colour].Words -= Bits/16;
+				Bits += Read_Coded_Block(Source_File, Block_Data, *Compression_Format, &Block_Quant, Scanned_Block);
+				Segments[colour].Words += Bits/16;
+
+				// a non-zero coefficient after zeros holds the scan for a cycle, and takes a
+				// cycle for every ZERO_RUN code of the run (8 zeros at most each); the zeros
+				// at the end of the block go into BLOCK_END
+				for (k = 0, Zeros = 0, Release_Cycles = 0; k < 64; k++)
+					if (Scanned_Block[k] != 0) {
+						if (Zeros > 0) Release_Cycles += 1 + Divide_Up(Zeros, 8);
+						Zeros = 0;
+					} else Zeros++;
+				Count_QLE(&Segments[colour], DCT_OUTPUTS + QLE_CYCLES + Release_Cycles, Release_Cycles);
+			}
+		}
+	}
+	fclose(Source_File);
+	Source_Filename[strlen(Source_Filename) - 4] = '\0';
+}
+
+static void Model_Uniform(int Rows, int Columns, segment_model *Segments) {
+	// without a stream every block takes the shortest quantization and coding (no zero
+	// runs) and is coded in 4 words (1 bit per pixel)
+	long k;
+	int colour;
+
+	for (colour = 0; colour < 3; colour++) {
+		memset(&Segments[colour], 0, sizeof(segment_model));
+		Segments[colour].Blocks = (long)Divide_Up(Rows, 8)*((colour) ? Divide_Up(Columns, 16) : 2*Divide_Up(Columns, 16));
+		Segments[colour].Words = 4*(unsigned long long)Segments[colour].Blocks;
+		Segments[colour].Min_QLE = MAX_QLE_CYCLES;
+		for (k = 0; k < Segments[colour].Blocks; k++)
+			Count_QLE(&Segments[colour], DCT_OUTPUTS + QLE_CYCLES, 0);
+	}
+}
+
+void Performance_Model(char *Filename, int Rows, int Columns, int Multipliers, int Period, int Sequential,
+	char *Json_Filename
+) {
+	// models the hardware encoding of Filename.mic (or, with Rows and Columns, of an image
+	// of that size) with Multipliers multipliers (0 for those of the RTL) and a block
+	// period of Period cycles (-1 for that of the RTL, 0 for the shortest the stages
+	// allow, or the stages one block at a time if Sequential),
+	// printing the cycles, the SRAM words, the embedded RAM accesses and the multiplier
+	// uses, and writing them to Json_Filename.model.json (unless it is NULL)
+	const char *Names[3] = { "Y", "U", "V" };
+	const double Clocks[2] = { 50e6, 100e6 };
+	segment_model Segments[3];
+	int colour, c, Compression_Format = 0, Pair_Cycles, Fetch_Cycles, CT_Cycles, Sd_Cycles, Stage_Period;
+	int Block_Period, Max_QLE;
+	long Blocks, Pairs;
+	unsigned long long CSC_Cycles, CSC_Mults, CSC_Reads, CSC_Writes, DCT_Cycles, DCT_Mults, DCT_Reads, DCT_Writes;
+	unsigned long long QLE_Total, Words, Overruns[3], Total_Cycles;
+	double CSC_Use, DCT_Use, Total_Use;
+	FILE *Json_File;
+
+	if (Multipliers <= 0) Multipliers = RTL_MULTIPLIERS;
+	if (Period < 0) Period = RTL_PERIOD;
+	if ((Rows > 0) && (Columns > 0)) Model_Uniform(Rows, Columns, Segments);
+	else Model_Stream(Filename, &Rows, &Columns, &Compression_Format, Segments);
+
+	// milestone 1: a pair of pixels takes 6 cycles with 4 multipliers, fewer multipliers
+	// take longer and more wait for the SRAM (3 reads and 2 writes per pair)
+	Pair_Cycles = Divide_Up(CSC_MULTS_PER_PAIR, Multipliers);
+	if (Pair_Cycles < CSC_READS_PER_PAIR + CSC_WRITES_PER_PAIR) Pair_Cycles = CSC_READS_PER_PAIR + CSC_WRITES_PER_PAIR;
+	Pairs = (long)Rows*(Divide_Up(Columns, 2) + CSC_FLUSH_PAIRS);
+	CSC_Cycles = (unsigned long long)Rows*CSC_ROW_CYCLES + (unsigned long long)Pairs*Pair_Cycles + 1;
+	CSC_Mults = (unsigned long long)Pairs*CSC_MULTS_PER_PAIR;
+	CSC_Reads = (unsigned long long)Rows + (unsigned long long)Pairs*CSC_READS_PER_PAIR;
+	CSC_Writes = (unsigned long long)Pairs*CSC_WRITES_PER_PAIR - (unsigned long long)Rows*CSC_FLUSH_PAIRS*CSC_WRITES_PER_PAIR;
+
+	// milestone 2: the fetch of S reads a word a cycle, and a pass of the DCT takes a cycle
+	// per output with 4 multipliers; both ports of S (or of the two T memories) are read
+	// every cycle, so more multipliers wait for the embedded RAMs
+	Blocks = Segments[Y].Blocks + Segments[U].Blocks + Segments[V].Blocks;
+	Fetch_Cycles = FS_READS + FS_CYCLES;
+	CT_Cycles = Divide_Up(DCT_MULTS, Multipliers);
+	if (CT_Cycles < DCT_OUTPUTS) CT_Cycles = DCT_OUTPUTS;
+	Sd_Cycles = CT_Cycles + SD_CYCLES;
+	CT_Cycles += CT_CYCLES;
+	Max_QLE = 0;
+	QLE_Total = Words = 0;
+	for (colour = 0; colour < 3; colour++) {
+		if (Segments[colour].Max_QLE > Max_QLE) Max_QLE = Segments[colour].Max_QLE;
+		QLE_Total += Segments[colour].QLE_Cycles;
+		Words += Segments[colour].Words;
+		Overruns[colour] = 0;
+	}
+
+	if (Sequential) {
+		Block_Period = 0;
+		DCT_Cycles = (unsigned long long)Blocks*(Fetch_Cycles + CT_Cycles + Sd_Cycles) + QLE_Total;
+	} else {
+		// T of a block and S' of the block before share the multipliers, and the coding
+		// of a block must end before the next fetch takes the SRAM
+		Stage_Period = CT_Cycles + Sd_Cycles - SD_OVERLAP;
+		if (Stage_Period < Fetch_Cycles) Stage_Period = Fetch_Cycles;
+		if (Period > 0) {
+			if (Period < Stage_Period) {
+				printf("A block period of %d cycles is too short, T and S' take %d cycles with %d multipliers\n",
+					Period, Stage_Period, Multipliers); exit(1); }
+			Block_Period = Period;
+		} else Block_Period = (Stage_Period > RTL_QLE_START + Max_QLE) ? Stage_Period : RTL_QLE_START + Max_QLE;
+		for (colour = 0; colour < 3; colour++)
+			for (c = Block_Period - RTL_QLE_START + 1; c < MAX_QLE_CYCLES; c++)
+				Overruns[colour] += Segments[colour].QLE_Histogram[c];
+		// S' of the last block is in the period after its fetch, its coding in the next
+		DCT_Cycles = (unsigned long long)(Blocks + 2)*Block_Period + RTL_QLE_START + Max_QLE;
+	}
+	DCT_Cycles += 2*OFFSET_WRITES + HEADER_WRITES;
+	DCT_Mults = 2*(unsigned long long)DCT_MULTS*Blocks;
+	DCT_Reads = (unsigned long long)FS_READS*Blocks;
+	DCT_Writes = Words + 2*OFFSET_WRITES + HEADER_WRITES + 1;
+	Total_Cycles = CSC_Cycles + DCT_Cycles;
+
+	CSC_Use = (double)CSC_Mults/((double)Multipliers*CSC_Cycles);
+	DCT_Use = (double)DCT_Mults/((double)Multipliers*DCT_Cycles);
+	Total_Use = (double)(CSC_Mults + DCT_Mults)/((double)Multipliers*Total_Cycles);
+
+	printf("Hardware model of a %d x %d image, %ld blocks, %d multipliers, ", Columns, Rows, Blocks, Multipliers);
+	if (Sequential) printf("one block at a time\n");
+	else printf("a block every %d cycles\n", Block_Period);
+	printf("Colourspace conversion and downsampling: %llu cycles (%d per pixel pair), %llu SRAM reads, %llu SRAM writes, %llu multiplications (%.1f%% use)\n",
+		CSC_Cycles, Pair_Cycles, CSC_Reads, CSC_Writes, CSC_Mults, 100.0*CSC_Use);
+	printf("Per block: fetch %d cycles, T %d cycles, S' %d cycles; %d SRAM reads, %d multiplications,\n",
+		Fetch_Cycles, CT_Cycles, Sd_Cycles, FS_READS, 2*DCT_MULTS);
+	printf("   embedded RAM S %d writes %d reads, T %d writes %d reads, S' %d writes %d reads\n",
+		FS_READS/2, 2*DCT_OUTPUTS, DCT_OUTPUTS/2, 4*DCT_OUTPUTS, DCT_OUTPUTS, DCT_OUTPUTS);
+	for (colour = 0; colour < 3; colour++)
+		printf("%s: %ld blocks, quantization and coding %d to %d cycles (%.1f per block, %.2f holding for zero runs), %.2f SRAM writes per block\n",
+			Names[colour], Segments[colour].Blocks, Segments[colour].Min_QLE, Segments[colour].Max_QLE,
+			(double)Segments[colour].QLE_Cycles/Segments[colour].Blocks, (double)Segments[colour].Release_Cycles/Segments[colour].Blocks,
+			(double)Segments[colour].Words/Segments[colour].Blocks);
+	for (colour = 0; colour < 3; colour++)
+		if (Overruns[colour] > 0)
+			printf("Warning: %llu %s blocks take more than the %d cycles left for their coding in the block period\n",
+				Overruns[colour], Names[colour], Block_Period - RTL_QLE_START);
+	printf("DCT, quantization and coding: %llu cycles, %llu SRAM reads, %llu SRAM writes, %llu multiplications (%.1f%% use)\n",
+		DCT_Cycles, DCT_Reads, DCT_Writes, DCT_Mults, 100.0*DCT_Use);
+	for (c = 0; c < 2; c++)
+		printf("Total at %.0f MHz: %llu cycles, %.3f ms (%.1f%% multiplier use)\n",
+			Clocks[c]/1e6, Total_Cycles, 1e3*Total_Cycles/Clocks[c], 100.0*Total_Use);
+
+	if (Json_Filename == NULL) return;
+	strcat(Json_Filename, ".model.json");
+	if ((Json_File = fopen(Json_Filename, "w")) == NULL) {
+		printf("Problem opening model file %s\n", Json_Filename); exit(1); }
+	fprintf(Json_File, "{\n  \"columns\": %d,\n  \"rows\": %d,\n  \"format\": %d,\n  \"blocks\": %ld,\n",
+		Columns, Rows, Compression_Format, Blocks);
+	fprintf(Json_File, "  \"schedule\": { \"multipliers\": %d, \"sequential\": %s, \"block_period\": %d, \"qle_start\": %d },\n",
+		Multipliers, (Sequential) ? "true" : "false", Block_Period, RTL_QLE_START);
+	fprintf(Json_File, "  \"colourspace\": { \"cycles\": %llu, \"pair_cycles\": %d, \"sram_reads\": %llu, \"sram_writes\": %llu, \"multiplications\": %llu, \"multiplier_use\": %.6f },\n",
+		CSC_Cycles, Pair_Cycles, CSC_Reads, CSC_Writes, CSC_Mults, CSC_Use);
+	fprintf(Json_File, "  \"block\": { \"fetch_cycles\": %d, \"t_cycles\": %d, \"sd_cycles\": %d, \"sram_reads\": %d, \"multiplications\": %d,\n",
+		Fetch_Cycles, CT_Cycles, Sd_Cycles, FS_READS, 2*DCT_MULTS);
+	fprintf(Json_File, "    \"ram_s\": { \"writes\": %d, \"reads\": %d }, \"ram_t\": { \"writes\": %d, \"reads\": %d }, \"ram_sd\": { \"writes\": %d, \"reads\": %d } },\n",
+		FS_READS/2, 2*DCT_OUTPUTS, DCT_OUTPUTS/2, 4*DCT_OUTPUTS, DCT_OUTPUTS, DCT_OUTPUTS);
+	fprintf(Json_File, "  \"segments\": [\n");
+	for (colour = 0; colour < 3; colour++)
+		fprintf(Json_File, "    { \"name\": \"%s\", \"blocks\": %ld, \"qle_cycles\": %llu, \"qle_min\": %d, \"qle_max\": %d, \"release_cycles\": %llu, \"sram_writes\": %llu, \"overruns\": %llu }%s\n",
+			Names[colour], Segments[colour].Blocks, Segments[colour].QLE_Cycles, Segments[colour].Min_QLE, Segments[colour].Max_QLE,
+			Segments[colour].Release_Cycles, Segments[colour].Words, Overruns[colour], (colour < 2) ? "," : "");
+	fprintf(Json_File, "  ],\n  \"dct\": { \"cycles\": %llu, \"sram_reads\": %llu, \"sram_writes\": %llu, \"multiplications\": %llu, \"multiplier_use\": %.6f },\n",
+		DCT_Cycles, DCT_Reads, DCT_Writes, DCT_Mults, DCT_Use);
+	fprintf(Json_File, "  \"total_cycles\": %llu,\n  \"multiplier_use\": %.6f,\n", Total_Cycles, Total_Use);
+	fprintf(Json_File, "  \"seconds\": { \"50MHz\": %.9f, \"100MHz\": %.9f }\n}\n", Total_Cycles/Clocks[0], Total_Cycles/Clocks[1]);
+	fclose(Json_File);
+	printf("Wrote the model to %s\n", Json_Filename);
+}
@@ -0,0 +1,50 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#ifndef PRECISION_H
+#define PRECISION_H
+
+// fixed-point precision of the codec, set at compile time (i.e. "make compile
+// PRECISION=-DDCT_COEFF_BITS=10" after "make clean"); the defaults are those of
+// the hardware:
+//   DCT_COEFF_BITS   fraction bits of the DCT and IDCT coefficients (12)
+//   DCT_PASS_BITS    fraction bits of the results of the first pass of the transform,
+//                    which is shifted down by DCT_COEFF_BITS - DCT_PASS_BITS and the
+//                    second pass by DCT_COEFF_BITS + DCT_PASS_BITS (4, for >> 8, >> 16)
+//   COLOUR_BITS      fraction bits of the colourspace conversion matrices (16)
+#ifndef DCT_COEFF_BITS
+#define DCT_COEFF_BITS 12
+#endif
+#ifndef DCT_PASS_BITS
+#define DCT_PASS_BITS 4
+#endif
+#ifndef COLOUR_BITS
+#define COLOUR_BITS 16
+#endif
+
+#if (DCT_COEFF_BITS < 4) || (DCT_COEFF_BITS > 14)
+#error "DCT_COEFF_BITS must be 4 to 14 (the IDCT sums are held on 32 bits)"
+#endif
+#if (DCT_PASS_BITS < 0) || (DCT_PASS_BITS >= DCT_COEFF_BITS) || (DCT_COEFF_BITS + DCT_PASS_BITS > 18)
+#error "DCT_PASS_BITS must be 0 to DCT_COEFF_BITS - 1, and DCT_COEFF_BITS + DCT_PASS_BITS at most 18"
+#endif
+#if (COLOUR_BITS < 6) || (COLOUR_BITS > 20)
+#error "COLOUR_BITS must be 6 to 20 (the colourspace sums are held on 32 bits)"
+#endif
+
+#define DCT_FIRST_SHIFT  (DCT_COEFF_BITS - DCT_PASS_BITS)
+#define DCT_SECOND_SHIFT (DCT_COEFF_BITS + DCT_PASS_BITS)
+
+// a colourspace matrix coefficient given with 16 fraction bits, at COLOUR_BITS
+// (rounded to the nearest when there are fewer bits)
+#if COLOUR_BITS >= 16
+#define COLOUR_COEFF(c) ((c) * (1 << (COLOUR_BITS - 16)))
+#else
+#define COLOUR_COEFF(c) (((c) + (1 << (15 - COLOUR_BITS))) >> (16 - COLOUR_BITS))
+#endif
+
+#endif
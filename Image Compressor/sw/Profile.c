@@ -0,0 +1,178 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include "Coding.h"
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define READ_CYCLES() ((unsigned long long)__rdtsc())
+#else
+#define READ_CYCLES() 0ULL
+#endif
+
+// Stage profiling for -profile: the wall time and time stamp counter cycles of every
+// stage, the bytes of the files read and written, the bits of every component of the
+// compressed stream (from the segment offsets of its header), the number of fixed
+// code symbols of every type written or read, and the peak resident set size.
+
+#define MAX_PROFILE_STAGES 16
+
+typedef struct profile_stage_struct {
+	const char *Name;
+	int Calls;
+	double Seconds, Start;
+	unsigned long long Cycles, Start_Cycles;
+} profile_stage;
+
+// set when profiling, checked by the coders before counting symbols (Coding.h)
+int profile_enabled = 0;
+
+static profile_stage stages[MAX_PROFILE_STAGES];
+static int num_stages = 0;
+static unsigned long long bytes_read = 0, bytes_written = 0;
+static unsigned long long symbol_counts[4] = { 0, 0, 0, 0 };
+static unsigned long long component_bits[3] = { 0, 0, 0 };
+static int stream_rows = 0, stream_columns = 0, stream_format = 0;
+
+void Profile_Symbol_Counts(unsigned long long *);
+void Profile_Write(char *, const char *);
+static double Wall_Time(void);
+
+
+static double Wall_Time(void) {
+	// monotonic wall time in seconds
+	struct timespec Time;
+
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (double)Time.tv_sec + 1e-9*(double)Time.tv_nsec;
+}
+
+void Profile_Begin(const char *Stage) {
+	// starts timing a stage (stages are told apart by name, and add up over calls)
+	int k;
+
+	if (!profile_enabled) return;
+	for (k = 0; (k < num_stages) && strcmp(stages[k].Name, Stage); k++);
+	if (k == num_stages) {
+		if (num_stages == MAX_PROFILE_STAGES) return;
+		stages[num_stages].Name = Stage;
+		stages[num_stages].Calls = 0;
+		stages[num_stages].Seconds = 0.0;
+		stages[num_stages].Cycles = 0;
+		num_stages++;
+	}
+	stages[k].Start = Wall_Time();
+	stages[k].Start_Cycles = READ_CYCLES();
+}
+
+void Profile_End(const char *Stage) {
+	// stops timing a stage
+	unsigned long long Cycles = READ_CYCLES();
+	double Seconds = Wall_Time();
+	int k;
+
+	if (!profile_enabled) return;
+	for (k = 0; (k < num_stages) && strcmp(stages[k].Name, Stage); k++);
+	if (k == num_stages) return;
+	stages[k].Calls++;
+	stages[k].Seconds += Seconds - stages[k].Start;
+	stages[k].Cycles += Cycles - stages[k].Start_Cycles;
+}
+
+void Profile_Symbol(int Code) {
+	// counts a ZERO_RUN, CODE_3, CODE_9 or BLOCK_END symbol (the formats of a
+	// multi-format encoding are coded in parallel)
+	__atomic_fetch_add(&symbol_counts[Code], 1ULL, __ATOMIC_RELAXED);
+}
+
+void Profile_Symbol_Counts(unsigned long long *Counts) {
+	// copies the number of symbols of each type counted so far
+	int k;
+
+	for (k = 0; k < 4; k++)
+		Counts[k] = symbol_counts[k];
+}
+
+void Profile_File(const char *Filename, int Written) {
+	// adds the size of a file read or written
+	struct stat File_Status;
+
+	if (!profile_enabled || (stat(Filename, &File_Status) != 0)) return;
+	if (Written) bytes_written += (unsigned long long)File_Status.st_size;
+	else bytes_read += (unsigned long long)File_Status.st_size;
+}
+
+void Profile_Stream(const char *Filename) {
+	// reads the header of a compressed stream for the image size and the bits of
+	// each component, the distance between the segment offsets (the last segment
+	// ends with the stream)
+	unsigned long long Offsets[4];
+	int i, colour;
+	struct stat File_Status;
+	FILE *Source_File;
+
+	if (!profile_enabled || ((Source_File = fopen(Filename, "rb")) == NULL)) return;
+	fgetc(Source_File); fgetc(Source_File); fgetc(Source_File); // strip 0xECE744
+	stream_format = fgetc(Source_File);
+	stream_rows = stream_columns = 0;
+	for (i = (FORMAT_HEADER(stream_format) == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		stream_rows = (stream_rows << 8) | fgetc(Source_File);
+	for (i = (FORMAT_HEADER(stream_format) == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		stream_columns = (stream_columns << 8) | fgetc(Source_File);
+	for (colour = 0; colour < 3; colour++) {
+		Offsets[colour] = 0;
+		for (i = (FORMAT_HEADER(stream_format) == HEADER_WIDE) ? 7 : 3; i > 0; i--)
+			Offsets[colour] = (Offsets[colour] << 8) | (unsigned long long)fgetc(Source_File);
+		Offsets[colour] = 8*Offsets[colour] + (unsigned long long)fgetc(Source_File);
+	}
+	fstat(fileno(Source_File), &File_Status);
+	Offsets[3] = 8*(unsigned long long)File_Status.st_size;
+	fclose(Source_File);
+
+	for (colour = 0; colour < 3; colour++)
+		component_bits[colour] = (Offsets[colour + 1] > Offsets[colour]) ? Offsets[colour + 1] - Offsets[colour] : 0;
+}
+
+void Profile_Write(char *Filename, const char *Mode) {
+	// writes the profile of an encoding or a decoding to Filename.profile.json
+	const char *Symbol_Names[4] = { "ZERO_RUN", "CODE_9", "CODE_3", "BLOCK_END" };
+	struct rusage Usage;
+	double Total_Seconds = 0.0;
+	int k;
+	FILE *Json_File;
+
+	strcat(Filename, ".profile.json");
+	if ((Json_File = fopen(Filename, "w")) == NULL) {
+		printf("Problem opening profile file %s\n", Filename); exit(1); }
+	getrusage(RUSAGE_SELF, &Usage);
+
+	fprintf(Json_File, "{\n  \"mode\": \"%s\",\n  \"columns\": %d,\n  \"rows\": %d,\n  \"format\": %d,\n",
+		Mode, stream_columns, stream_rows, stream_format);
+	fprintf(Json_File, "  \"stages\": [\n");
+	for (k = 0; k < num_stages; k++) {
+		fprintf(Json_File, "    { \"name\": \"%s\", \"calls\": %d, \"seconds\": %.9f, \"cycles\": %llu }%s\n",
+			stages[k].Name, stages[k].Calls, stages[k].Seconds, stages[k].Cycles, (k < num_stages - 1) ? "," : "");
+		Total_Seconds += stages[k].Seconds;
+	}
+	fprintf(Json_File, "  ],\n  \"stage_seconds\": %.9f,\n", Total_Seconds);
+	fprintf(Json_File, "  \"bytes_read\": %llu,\n  \"bytes_written\": %llu,\n", bytes_read, bytes_written);
+	fprintf(Json_File, "  \"component_bits\": { \"Y\": %llu, \"U\": %llu, \"V\": %llu },\n",
+		component_bits[0], component_bits[1], component_bits[2]);
+	fprintf(Json_File, "  \"bits_per_pixel\": %.6f,\n", ((stream_rows > 0) && (stream_columns > 0)) ?
+		(double)(component_bits[0] + component_bits[1] + component_bits[2])/((double)stream_rows*stream_columns) : 0.0);
+	fprintf(Json_File, "  \"symbols\": {");
+	for (k = 0; k < 4; k++)
+		fprintf(Json_File, " \"%s\": %llu%s", Symbol_Names[k], symbol_counts[k], (k < 3) ? "," : " },\n");
+	fprintf(Json_File, "  \"peak_rss_kb\": %ld\n}\n", Usage.ru_maxrss);
+	fclose(Json_File);
+
+	printf("Wrote the profile to %s\n", Filename);
+}
@@ -5,18 +5,30 @@
    Ontario, Canada
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+#include "Coding.h"
 
 void Parse_bmp(char *, char *);
-void Encoder(char *, int, char *, int);
-void Decoder(char *, char *, int);
-void Compare(char *, char *);
+void Encoder(char *, int *, int, char *, int, int, long long, double, char *, int, int);
+void Encode_Sequence(char *, int, char *, int, int, int, int, char *, int, int);
+void Decoder(char *, char *, int, char *, int, int *);
+void Decode_Sequence(char *, char *, int, char *, int, int *);
+void Compare(char *, char *, int, char *);
+void Transcode_JPEG(char *, char *, int, int);
+void Transform_Stream(char *, char *, char *, int *, int);
+void Serve(char *, int, long);
+void Send_Request(char *, int, char **);
+void Stream_Statistics(char *, char *);
+void Performance_Model(char *, int, int, int, int, int, char *);
+void Profile_Write(char *, const char *);
 
 int main(int argc, char *argv[]) {
-	int compression_format, debug_level;
-	char filename_1[100], filename_2[100];
+	int i, j, valid, debug_levels, scale, write_index, wide_header, adaptive_quant, arith_coding, chroma_420, crop[4];
+	int compression_format[3], num_formats, input_size[2], num_frames, group_size, skip_threshold, quality, decode_mic;
+	int multipliers, period, sequential, num_workers, centre_chroma;
+	long cache_megabytes;
+	char filename_1[100], filename_2[100], filename_3[100], input_format[20], output_format[20], *format_item, *level_item;
+	long long target_bytes;
+	double target_bpp;
 
 	// Extract command line parameters
 	if (argc > 1) {
@@ -32,27 +44,104 @@ int main(int argc, char *argv[]) {
 				Parse_bmp(filename_1, filename_2);
 			}
 		} else if (!strcmp(argv[1], "-encode")) {
-			if (argc == 5) {
-				sscanf(argv[2], "%s", filename_1);
-				sscanf(argv[3], "%d", &compression_format);
-				sscanf(argv[4], "%s", filename_2);
-				Encoder(filename_1, compression_format, filename_2, 0);
-			} else if ((argc == 7) && !strcmp(argv[5], "-debug")) {
+			// options after the file names, in any order
+			debug_levels = 0;
+			write_index = 0;
+			wide_header = 0;
+			adaptive_quant = 0;
+			arith_coding = 0;
+			chroma_420 = 0;
+			strcpy(input_format, "ppm");
+			input_size[0] = input_size[1] = 0;
+			num_frames = 0;
+			group_size = 16;
+			skip_threshold = 0;
+			target_bytes = 0;
+			target_bpp = 0.0;
+			valid = (argc >= 5);
+			profile_enabled = 0;
+			sram_format = SRAM_NONE;
+			for (i = 5; valid && (i < argc); i++) {
+				if (!strcmp(argv[i], "-debug") && (i + 1 < argc)) {
+					// a level or a comma separated set of them, as a mask with bit n for level n
+					for (level_item = strtok(argv[++i], ","); valid && (level_item != NULL); level_item = strtok(NULL, ",")) {
+						valid = (sscanf(level_item, "%d", &j) == 1) && (j >= 0) && (j <= 4);
+						if (valid && (j > 0)) debug_levels |= 1 << j;
+					}
+				}
+				else if (!strcmp(argv[i], "-index")) write_index = 1;
+				else if (!strcmp(argv[i], "-wide")) wide_header = 1;
+				else if (!strcmp(argv[i], "-adaptive")) adaptive_quant = 1;
+				else if (!strcmp(argv[i], "-arith")) arith_coding = 1;
+				else if (!strcmp(argv[i], "-420")) chroma_420 = 1;
+				else if (!strcmp(argv[i], "-in") && (i + 1 < argc)) sscanf(argv[++i], "%19s", input_format);
+				else if (!strcmp(argv[i], "-frames") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &num_frames) == 1) && (num_frames > 0);
+				else if (!strcmp(argv[i], "-group") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &group_size) == 1) && (group_size > 0);
+				else if (!strcmp(argv[i], "-skip-threshold") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &skip_threshold) == 1) && (skip_threshold >= 0);
+				else if (!strcmp(argv[i], "-size") && (i + 2 < argc)) {
+					sscanf(argv[++i], "%d", &input_size[0]);
+					sscanf(argv[++i], "%d", &input_size[1]);
+				}
+				else if (!strcmp(argv[i], "-target-bytes") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%lld", &target_bytes) == 1) && (target_bytes > 0);
+				else if (!strcmp(argv[i], "-target-bpp") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%lf", &target_bpp) == 1) && (target_bpp > 0.0);
+				else if (!strcmp(argv[i], "-profile")) profile_enabled = 1;
+				else if (!strcmp(argv[i], "-sram") && (i + 1 < argc)) {
+					i++;
+					if (!strcmp(argv[i], "hex")) sram_format = SRAM_HEX;
+					else if (!strcmp(argv[i], "bin")) sram_format = SRAM_BINARY;
+					else valid = 0;
+				}
+				else valid = 0;
+			}
+			// level 4 (double precision encoding) changes the data of the other levels
+			if ((debug_levels & (1 << 4)) && (debug_levels != (1 << 4))) valid = 0;
+			// the format is a single quantization matrix or a comma separated list of them
+			num_formats = 0;
+			for (format_item = (valid) ? strtok(argv[3], ",") : NULL; format_item != NULL; format_item = strtok(NULL, ",")) {
+				if ((num_formats == 3) || (sscanf(format_item, "%d", &compression_format[num_formats]) != 1) ||
+				    (compression_format[num_formats] < 0) || (compression_format[num_formats] > 2)) valid = 0;
+				else {
+					for (j = 0; j < num_formats; j++)
+						if (compression_format[j] == compression_format[num_formats]) valid = 0;
+					num_formats++;
+				}
+			}
+			if ((num_formats == 0) || (((num_formats > 1) || adaptive_quant || arith_coding) && ((target_bytes > 0) || (target_bpp > 0.0)))) valid = 0;
+			// the block row index holds offsets into the fixed codes, arithmetic coded rows need none
+			if (arith_coding && write_index) valid = 0;
+			// the profile describes one stream, and its symbol counts are of all the streams coded
+			if (profile_enabled && (num_formats > 1)) valid = 0;
+			// a raw .yuv source has no header, its size is given with -size
+			if (!strcmp(input_format, "yuv422") && ((input_size[0] <= 0) || (input_size[1] <= 0))) valid = 0;
+			// sequences are coded with one format and the fixed codes, without debug data
+			if ((num_frames > 0) && ((num_formats > 1) || arith_coding || (debug_levels != 0) ||
+			    (target_bytes > 0) || (target_bpp > 0.0) || profile_enabled || sram_format)) valid = 0;
+			if (valid) {
 				sscanf(argv[2], "%s", filename_1);
-				sscanf(argv[3], "%d", &compression_format);
 				sscanf(argv[4], "%s", filename_2);
-				sscanf(argv[6], "%d", &debug_level);
-				Encoder(filename_1, compression_format, filename_2, debug_level);
+				strcpy(filename_3, filename_2);
+				for (j = 0; j < num_formats; j++) {
+					if (adaptive_quant) compression_format[j] |= 1 << 2;   // adaptive quantization flag in bit 2
+					if (arith_coding) compression_format[j] |= 1 << 3;     // entropy coder in bit 3
+					if (chroma_420) compression_format[j] |= 1 << 4;       // chroma subsampling in bit 4
+					if (wide_header) compression_format[j] |= 1 << 6;      // header layout in bits 7..6 of the format
+				}
+				if (num_frames > 0)
+					Encode_Sequence(filename_1, compression_format[0], filename_2, write_index, num_frames,
+						group_size, skip_threshold, input_format, input_size[0], input_size[1]);
+				else Encoder(filename_1, compression_format, num_formats, filename_2, debug_levels, write_index,
+					target_bytes, target_bpp, input_format, input_size[0], input_size[1]);
+				if (profile_enabled) Profile_Write(filename_3, "encode");
 			} else {
 				printf("\nFormat for straight encoding: Project -encode input_file format output_file\n");
 				printf("   input_file is a .ppm file\n");
-				printf("   format is 0 or 1\n");
+				printf("   format is 0, 1 or 2\n");
 				printf("   output_file is a .mic file\n");
 				printf("i.e. \"Project -encode file1 0 file2\" will compress file1.ppm to file2.mic\n");
 				printf("   using quantization matrix 0\n");
 				printf("\nFormat for debug encoding: Project -encode input_file format output_file -debug debug_level\n");
 				printf("   input_file is a .ppm file\n");
-				printf("   format is 0 or 1 (which quantization matrix to use)\n");
+				printf("   format is 0, 1 or 2 (which quantization matrix to use)\n");
 				printf("   output_file is a .mic file\n");
 				printf("   debug_level is:\n");
 				printf("      0 for no information (same as straight encoding)\n");
@@ -60,20 +149,130 @@ int main(int argc, char *argv[]) {
 				printf("      2 for before quantization and lossless coding (i.e. post-DCT data)\n");
 				printf("      3 to print out the integer DCT coefficients\n");
 				printf("      4 to peform encoding using double precision instead of fixed-point\n");
+				printf("   or a comma separated set of levels 1, 2 and 3, all written in one pass\n");
 				printf("e.g. \"Project -encode file1 0 file2 -debug 1\" will compress file1.ppm to file2.mic\n");
 				printf("   using quantization matrix 0 and produces the file file2.d1e which \n");
-				printf("   contains encoding debug data at level 1\n\n");
+				printf("   contains encoding debug data at level 1, and \"-debug 1,2,3\" produces\n");
+				printf("   file2.d1e, file2.d2e and file2.d3e\n\n");
+				printf("Format for indexed encoding: Project -encode input_file format output_file -index\n");
+				printf("   also writes output_file.mici, the bit offset of every block row of every\n");
+				printf("   component, which is needed for region of interest (-crop) decoding\n");
+				printf("   -index can be combined with -debug\n\n");
+				printf("Format for wide header encoding: Project -encode input_file format output_file -wide\n");
+				printf("   records the image size on 32 bits and the segment offsets on 64 bits, for images\n");
+				printf("   larger than 65535 pixels in either direction or streams larger than 16 MB\n");
+				printf("   (the default header is the one read by the hardware decoder, larger images and\n");
+				printf("   images that are not whole blocks of 8 rows (16 in 4:2:0) and 16 columns, which\n");
+				printf("   are padded, switch to the wide header automatically)\n");
+				printf("   -wide can be combined with -index and -debug\n\n");
+				printf("Format for multi-format encoding: Project -encode input_file format,format,... output_file\n");
+				printf("   colourspace conversion and DCT are done once, and the image is quantized and coded\n");
+				printf("   with each format in parallel, producing output_file_q<format>.mic for each format\n");
+				printf("e.g. \"Project -encode file1 0,1,2 file2\" compresses file1.ppm to file2_q0.mic,\n");
+				printf("   file2_q1.mic and file2_q2.mic\n");
+				printf("   the format list can be combined with -index, -wide and -debug\n\n");
+				printf("Format for target size encoding: Project -encode input_file format output_file -target-bytes size\n");
+				printf("                             or: Project -encode input_file format output_file -target-bpp bits\n");
+				printf("   encodes with the finest quantization that keeps output_file.mic within size bytes\n");
+				printf("   (or bits per pixel), trying the matrices from format down to 0 and then matrix 0\n");
+				printf("   with the high-frequency coefficients of every block zeroed from a scan position;\n");
+				printf("   the sizes are computed in memory before the stream is written\n");
+				printf("   -target-bytes and -target-bpp take a single format and can be combined with -index,\n");
+				printf("   -wide and -debug\n\n");
+				printf("Format for adaptive quantization: Project -encode input_file format output_file -adaptive\n");
+				printf("   selects the quantization matrix of every block from its AC activity: flat blocks use\n");
+				printf("   the matrices one or two steps coarser than format, textured blocks use format;\n");
+				printf("   the choice is signalled with a prefix per block (not read by the hardware decoder)\n");
+				printf("   -adaptive can be combined with a format list, -index, -wide and -debug\n\n");
+				printf("Format for arithmetic coding: Project -encode input_file format output_file -arith\n");
+				printf("   codes the quantized blocks with a context-adaptive binary arithmetic coder instead\n");
+				printf("   of the fixed codes, for smaller files (not read by the hardware decoder); every block\n");
+				printf("   row is coded on its own, so the block rows are decoded in parallel, and -crop decoding\n");
+				printf("   does not need the block row index\n");
+				printf("   -arith can be combined with a format list, -adaptive, -wide and -debug\n\n");
+				printf("Format for 4:2:0 encoding: Project -encode input_file format output_file -420\n");
+				printf("   filters and decimates U and V along the columns as well as along the rows, so they\n");
+				printf("   have half the rows of Y (not read by the hardware decoder)\n");
+				printf("   -420 can be combined with all the other options\n\n");
+				printf("Format for encoding YUV sources: Project -encode input_file format output_file -in input_format\n");
+				printf("   input_format is:\n");
+				printf("      ppm for an RGB .ppm image (default), read from input_file.ppm\n");
+				printf("      y4m for the first frame of a YUV4MPEG2 stream, 8-bit 4:2:2 (or 4:2:0 with -420),\n");
+				printf("         read from input_file.y4m\n");
+				printf("      yuv422 for raw planar 4:2:2 samples (Y, then U and V of half the width), read from\n");
+				printf("         input_file.yuv, with the size given by -size width height\n");
+				printf("   YUV sources skip the colourspace conversion and the chroma filter\n");
+				printf("   -in can be combined with all the other options\n\n");
+				printf("Format for sequence encoding: Project -encode input_file format output_file -frames count\n");
+				printf("   encodes count frames, read from input_file_0000.ppm, input_file_0001.ppm, ... (or from\n");
+				printf("   the .y4m or .yuv source given with -in), to output_file_0000.mic, output_file_0001.mic, ...\n");
+				printf("   the frames are coded in groups (of 16 frames, or of -group size frames) which are\n");
+				printf("   encoded in parallel; the first frame of a group is a plain stream and the others skip\n");
+				printf("   the blocks whose quantized coefficients are unchanged from the previous frame (or\n");
+				printf("   differ by at most -skip-threshold value), with a 1-bit flag per block\n");
+				printf("   -frames can be combined with -in, -size, -420, -adaptive, -index and -wide\n\n");
+				printf("Format for profiled encoding: Project -encode input_file format output_file -profile\n");
+				printf("   writes output_file.profile.json with the wall time and cycles of every stage, the\n");
+				printf("   bytes read and written, the bits of each component, the number of fixed code symbols\n");
+				printf("   of each type and the peak memory use (-profile cannot be combined with -frames or\n");
+				printf("   with a list of formats)\n\n");
+				printf("Format for SRAM images: Project -encode input_file format output_file -sram hex|bin\n");
+				printf("   writes the SRAM contents of the hardware encoder (16-bit words, two bytes each) that\n");
+				printf("   the testbench can preload to start at milestone 1 or 2, or check after them\n");
+				printf("   (the milestone 3 testbench starts from the .ppm):\n");
+				printf("      output_file.sram_rgb.hex, the .ppm pixels at address 0 (milestone 1 input)\n");
+				printf("      output_file.sram_yuv.hex, the downsampled Y, U and V planes at address 614400\n");
+				printf("         (milestone 1 output, milestone 2 input, as in output_file.d1e)\n");
+				printf("      output_file.sram_coeff.hex, the DCT coefficients at address 0, one per word\n");
+				printf("         (milestone 2 output, as in output_file.d2e)\n");
+				printf("   hex files are read with $readmemh (an @address line, then one word per line), bin\n");
+				printf("   files (.bin) hold the words only, most significant byte first; a .y4m or .yuv\n");
+				printf("   source has no RGB region (-sram cannot be combined with -frames)\n\n");
 			}
 		} else if (!strcmp(argv[1], "-decode")) {
-			if (argc == 4) {
-				sscanf(argv[2], "%s", filename_1);
-				sscanf(argv[3], "%s", filename_2);
-				Decoder(filename_1, filename_2, 0);
-			} else if ((argc == 6) && !strcmp(argv[4], "-debug")) {
+			// options after the file names, in any order
+			debug_levels = 0;
+			scale = 1;
+			num_frames = 0;
+			strcpy(output_format, "ppm");
+			crop[2] = crop[3] = 0;
+			valid = (argc >= 4);
+			profile_enabled = 0;
+			sram_format = SRAM_NONE;
+			for (i = 4; valid && (i < argc); i++) {
+				if (!strcmp(argv[i], "-debug") && (i + 1 < argc)) {
+					// a level or a comma separated set of them, as a mask with bit n for level n
+					for (level_item = strtok(argv[++i], ","); valid && (level_item != NULL); level_item = strtok(NULL, ",")) {
+						valid = (sscanf(level_item, "%d", &j) == 1) && (j >= 0) && (j <= 3);
+						if (valid && (j > 0)) debug_levels |= 1 << j;
+					}
+				}
+				else if (!strcmp(argv[i], "-out") && (i + 1 < argc)) sscanf(argv[++i], "%19s", output_format);
+				else if (!strcmp(argv[i], "-scale") && (i + 1 < argc)) sscanf(argv[++i], "%d", &scale);
+				else if (!strcmp(argv[i], "-frames") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &num_frames) == 1) && (num_frames > 0);
+				else if (!strcmp(argv[i], "-crop") && (i + 4 < argc)) {
+					sscanf(argv[++i], "%d", &crop[0]);
+					sscanf(argv[++i], "%d", &crop[1]);
+					sscanf(argv[++i], "%d", &crop[2]);
+					sscanf(argv[++i], "%d", &crop[3]);
+				} else if (!strcmp(argv[i], "-profile")) profile_enabled = 1;
+				else if (!strcmp(argv[i], "-sram") && (i + 1 < argc)) {
+					i++;
+					if (!strcmp(argv[i], "hex")) sram_format = SRAM_HEX;
+					else if (!strcmp(argv[i], "bin")) sram_format = SRAM_BINARY;
+					else valid = 0;
+				}
+				else valid = 0;
+			}
+			if ((num_frames > 0) && ((debug_levels != 0) || profile_enabled || sram_format)) valid = 0;
+			if (valid) {
 				sscanf(argv[2], "%s", filename_1);
 				sscanf(argv[3], "%s", filename_2);
-				sscanf(argv[5], "%d", &debug_level);
-				Decoder(filename_1, filename_2, debug_level);
+				strcpy(filename_3, filename_2);
+				if (num_frames > 0)
+					Decode_Sequence(filename_1, filename_2, num_frames, output_format, scale, (crop[2] > 0) ? crop : NULL);
+				else Decoder(filename_1, filename_2, debug_levels, output_format, scale, (crop[2] > 0) ? crop : NULL);
+				if (profile_enabled) Profile_Write(filename_3, "decode");
 			} else {
 				printf("\nFormat for straight decoding: Project -decode input_file output_file\n");
 				printf("   input_file is a .mic file\n");
@@ -87,21 +286,257 @@ int main(int argc, char *argv[]) {
 				printf("      1 for milestone 1 transmission file (downsampled data)\n");
 				printf("      2 for milestone 2 transmission file (pre-IDCT data)\n");
 				printf("      3 to print out the integer IDCT coefficients\n");
+				printf("   or a comma separated set of levels, all written in one pass\n");
 				printf("i.e. \"Project -decode file1 file2 -debug 1\" decompresses file1.mic to file2.ppm\n");
-				printf("   and produces the file file2.d1d which contains decoding debug data at level 1\n\n");
+				printf("   and produces the file file2.d1d which contains decoding debug data at level 1,\n");
+				printf("   and \"-debug 1,2,3\" produces file2.d1d, file2.d2d and file2.d3d\n\n");
+				printf("Format for decoding to other outputs: Project -decode input_file output_file -out output_format\n");
+				printf("   output_format is:\n");
+				printf("      ppm for an RGB .ppm image (default), written to output_file_sw.ppm\n");
+				printf("      yuv422 for planar YUV samples (no interpolation), written to output_file_sw.yuv\n");
+				printf("         (4:2:0 samples for a stream encoded with -420)\n");
+				printf("      y for planar Y samples only (U and V are not decoded), written to output_file_sw.y\n");
+				printf("      rgb for raw interleaved RGB samples, written to output_file_sw.rgb\n");
+				printf("      bmp for a 24-bit .bmp image, written to output_file_sw.bmp\n");
+				printf("   -out can be combined with -debug\n\n");
+				printf("Format for scaled decoding: Project -decode input_file output_file -scale denominator\n");
+				printf("   denominator is 1, 2, 4 or 8, the image is decoded at 1/denominator of its size\n");
+				printf("      8 uses only the DC coefficient of each block (no IDCT)\n");
+				printf("      4 and 2 use 2x2 and 4x4 inverse transforms of the low-frequency coefficients\n");
+				printf("   -scale can be combined with -out and -debug\n\n");
+				printf("Format for region of interest decoding: Project -decode input_file output_file -crop x y width height\n");
+				printf("   decodes only the width x height pixels starting at column x, row y, using the\n");
+				printf("   block row index input_file.mici written by \"Project -encode ... -index\"\n");
+				printf("   -crop can be combined with -out (x and width must be even for yuv422, and also\n");
+				printf("   y and height for a stream encoded with -420)\n\n");
+				printf("Format for sequence decoding: Project -decode input_file output_file -frames count\n");
+				printf("   decodes the count frames input_file_0000.mic, input_file_0001.mic, ... written by\n");
+				printf("   \"Project -encode ... -frames count\" to output_file_0000_sw.ppm, output_file_0001_sw.ppm, ...\n");
+				printf("   -frames can be combined with -out, -scale and -crop\n\n");
+				printf("Format for profiled decoding: Project -decode input_file output_file -profile\n");
+				printf("   writes output_file.profile.json, as for profiled encoding (-profile cannot be\n");
+				printf("   combined with -frames)\n\n");
+				printf("Format for SRAM images: Project -decode input_file output_file -sram hex|bin\n");
+				printf("   writes the SRAM regions of the decoding, as for encoding: output_file.sram_coeff.hex,\n");
+				printf("   the dequantized (pre-IDCT) coefficients at address 0, output_file.sram_yuv.hex, the\n");
+				printf("   Y, U and V planes after the IDCT at address 614400, and output_file.sram_rgb.hex,\n");
+				printf("   the interpolated RGB pixels at address 0 (-sram cannot be combined with -frames,\n");
+				printf("   -scale, -crop or -out y)\n\n");
+			}
+		} else if (!strcmp(argv[1], "-transcode-jpeg")) {
+			quality = 0;
+			centre_chroma = 0;
+			valid = (argc >= 4);
+			for (i = 4; valid && (i < argc); i++) {
+				if (!strcmp(argv[i], "-quality") && (i + 1 < argc))
+					valid = (sscanf(argv[++i], "%d", &quality) == 1) && (quality >= 1) && (quality <= 100);
+				else if (!strcmp(argv[i], "-centre-chroma")) centre_chroma = 1;
+				else valid = 0;
+			}
+			if (valid) {
+				sscanf(argv[2], "%s", filename_1);
+				sscanf(argv[3], "%s", filename_2);
+				Transcode_JPEG(filename_1, filename_2, quality, centre_chroma);
+			} else {
+				printf("\nFormat for JPEG transcoding: Project -transcode-jpeg input_file output_file\n");
+				printf("   input_file is a .mic file\n");
+				printf("   output_file is a baseline JPEG (JFIF) file\n");
+				printf("i.e. \"Project -transcode-jpeg file1 file2\" converts file1.mic to file2.jpg\n");
+				printf("   the coefficients of every block are requantized and Huffman coded as they are,\n");
+				printf("   without decoding the image, so the JPEG file has the same 4:2:2 (or 4:2:0)\n");
+				printf("   samples as the .mic stream; by default the JPEG quantization tables are the .mic\n");
+				printf("   matrix of the stream, so the JPEG image is the decoded image, but for the chroma\n");
+				printf("   interpolation of the JPEG decoder and the siting of U and V: the .mic samples are\n");
+				printf("   on the even columns (and rows in 4:2:0) of Y and JFIF ones halfway between, so\n");
+				printf("   the JPEG chroma lies half a pixel right (and down in 4:2:0) of the decoded one\n\n");
+				printf("Format for JPEG transcoding with a quality: Project -transcode-jpeg input_file output_file -quality q\n");
+				printf("   q is 1 to 100, the JPEG example tables are scaled as by the IJG library, for smaller\n");
+				printf("   files (at the cost of a second quantization)\n\n");
+				printf("Format for JPEG transcoding with resited chroma: Project -transcode-jpeg input_file output_file -centre-chroma\n");
+				printf("   U and V are decoded, moved to the JFIF siting with the interpolation filters of the\n");
+				printf("   decoder and transformed again (an IDCT and a DCT of every U and V block), which\n");
+				printf("   removes the half pixel offset; Y is still transcoded as it is\n");
+				printf("   -centre-chroma can be combined with -quality\n\n");
+			}
+		} else if (!strcmp(argv[1], "-transform")) {
+			// the operation, then -index
+			write_index = 0;
+			valid = (argc >= 5);
+			i = 5;
+			if (valid && !strcmp(argv[4], "crop")) {
+				valid = (argc >= 9);
+				for (j = 0; valid && (j < 4); j++)
+					valid = (sscanf(argv[5 + j], "%d", &crop[j]) == 1);
+				i = 9;
+			}
+			for (; valid && (i < argc); i++) {
+				if (!strcmp(argv[i], "-index")) write_index = 1;
+				else valid = 0;
+			}
+			if (valid) {
+				sscanf(argv[2], "%s", filename_1);
+				sscanf(argv[3], "%s", filename_2);
+				Transform_Stream(filename_1, filename_2, argv[4], crop, write_index);
+			} else {
+				printf("\nFormat for lossless transforms: Project -transform input_file output_file operation\n");
+				printf("   input_file and output_file are .mic files\n");
+				printf("   operation is hflip, vflip, rot90, rot180, rot270 (clockwise), transpose or transverse\n");
+				printf("i.e. \"Project -transform file1 file2 rot90\" rotates file1.mic to file2.mic\n");
+				printf("   the blocks are moved and their coefficients transposed or negated without decoding\n");
+				printf("   the image, and coded again with the matrices they had, so the Y plane of file2.mic\n");
+				printf("   is the Y plane of file1.mic transformed; a mirrored edge that is not on the grid of\n");
+				printf("   MCUs (16 x 8 pixels, 16 x 16 in 4:2:0) is trimmed\n");
+				printf("   U and V are sited on the even columns (and rows in 4:2:0) of Y and their planes are\n");
+				printf("   mirrored as they are, which moves them by one pixel against Y along the mirrored\n");
+				printf("   direction; the U and V planes of 4:2:2 streams are resampled by the transposing\n");
+				printf("   operations, so only 4:2:0 streams come back unchanged from inverse operations\n\n");
+				printf("Format for lossless cropping: Project -transform input_file output_file crop x y width height\n");
+				printf("   the rectangle starts on the grid of MCUs, at or up and left of x and y\n\n");
+				printf("Format for indexed output: Project -transform input_file output_file operation -index\n");
+				printf("   writes the block row index output_file.mici, as for indexed encoding (not for\n");
+				printf("   arithmetic coded streams, which need none)\n\n");
 			}
 		} else if (!strcmp(argv[1], "-compare")) {
-			if (argc != 4) {
+			// options after the file names, in any order
+			decode_mic = 0;
+			filename_3[0] = '\0';
+			valid = (argc >= 4);
+			for (i = 4; valid && (i < argc); i++) {
+				if (!strcmp(argv[i], "-mic")) decode_mic = 1;
+				else if (!strcmp(argv[i], "-map") && (i + 1 < argc)) sscanf(argv[++i], "%s", filename_3);
+				else valid = 0;
+			}
+			if (!valid) {
 				printf("\nFormat for comparison: Project -compare input_file output_file\n");
 				printf("   input_file is a .ppm file\n");
 				printf("   output_file is a .ppm file\n");
-				printf("i.e. \"Project -parse file1 file2\" will compare file1.ppm and file2.ppm\n");
-				printf("   and computes the signal-to-noise ratio (SNR)\n\n");
+				printf("i.e. \"Project -compare file1 file2\" will compare file1.ppm and file2.ppm\n");
+				printf("   and computes the peak signal-to-noise ratio (PSNR) of R, G and B together, of\n");
+				printf("   each of them and of the luma, the SSIM and MS-SSIM of the luma, and the PSNR of\n");
+				printf("   the worst 8x8 block\n\n");
+				printf("Format for comparison to a compressed file: Project -compare input_file output_file -mic\n");
+				printf("   output_file is a .mic file, decoded in memory (no output image is written)\n\n");
+				printf("Format for comparison with an error map: Project -compare input_file output_file -map map_file\n");
+				printf("   also writes map_file.pgm, one pixel per 8x8 block, holding the mean squared error\n");
+				printf("   of the block (clipped to 255)\n");
+				printf("   -map can be combined with -mic\n\n");
 			} else {
 				sscanf(argv[2], "%s", filename_1);
 				sscanf(argv[3], "%s", filename_2);
-				Compare(filename_1, filename_2);
+				Compare(filename_1, filename_2, decode_mic, (filename_3[0] != '\0') ? filename_3 : NULL);
+			}
+		} else if (!strcmp(argv[1], "-stats")) {
+			valid = (argc == 3) || ((argc == 5) && !strcmp(argv[3], "-map"));
+			if (!valid) {
+				printf("\nFormat for stream statistics: Project -stats input_file\n");
+				printf("   input_file is a .mic file of a still 4:2:2 image coded with the fixed codes and\n");
+				printf("   one quantization matrix, as the hardware writes\n");
+				printf("i.e. \"Project -stats file1\" entropy decodes file1.mic (without the IDCT) and writes\n");
+				printf("   file1.stats.json with, for each of Y, U and V, the bits per block, the total bits,\n");
+				printf("   the number of ZERO_RUN, CODE_3, CODE_9 and BLOCK_END symbols, the number of blocks\n");
+				printf("   by the scan position of their last non-zero coefficient and the number of quantized\n");
+				printf("   coefficients by magnitude (in powers of two) at each scan position, and writes\n");
+				printf("   file1_bits.pgm, one pixel per 8x8 block of Y, holding the bits of the block and its\n");
+				printf("   share of the U and V blocks (scaled to the largest block)\n\n");
+				printf("Format for stream statistics with a named map: Project -stats input_file -map map_file\n");
+				printf("   writes the map of the bits per block to map_file.pgm\n\n");
+			} else {
+				sscanf(argv[2], "%s", filename_1);
+				if (argc == 5) sscanf(argv[4], "%s", filename_3);
+				else sprintf(filename_3, "%.94s_bits", filename_1);
+				Stream_Statistics(filename_1, filename_3);
+			}
+		} else if (!strcmp(argv[1], "-serve")) {
+			// options after the socket, in any order
+			num_workers = 4;
+			cache_megabytes = 256;
+			valid = (argc >= 3);
+			for (i = 3; valid && (i < argc); i++) {
+				if (!strcmp(argv[i], "-workers") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &num_workers) == 1) && (num_workers > 0);
+				else if (!strcmp(argv[i], "-cache") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%ld", &cache_megabytes) == 1) && (cache_megabytes >= 0);
+				else valid = 0;
+			}
+			if (valid) {
+				sscanf(argv[2], "%s", filename_1);
+				Serve(filename_1, num_workers, cache_megabytes);
+			} else {
+				printf("\nFormat for the codec daemon: Project -serve socket_file\n");
+				printf("   socket_file is the Unix domain socket the daemon listens on\n");
+				printf("i.e. \"Project -serve /tmp/mic.sock\" answers requests until a quit request, one\n");
+				printf("   line each (a connection can send any number of them), with a reply line starting\n");
+				printf("   with OK or ERR; images are interleaved RGB samples, in the order of a .ppm image,\n");
+				printf("   in POSIX shared memory objects named by the client (as for shm_open, i.e. /view):\n");
+				printf("      decode file shared                  decodes file.mic to shared (created, or\n");
+				printf("                                          resized, to the image), replies OK width\n");
+				printf("                                          height bytes and the tiles found cached\n");
+				printf("      crop file x y width height shared   a rectangle of the decoded image, as decode\n");
+				printf("      encode shared width height format file [-adaptive] [-arith] [-420] [-wide] [-index]\n");
+				printf("                                          encodes the image in shared to file.mic, as\n");
+				printf("                                          -encode, replies OK and the bytes of the file\n");
+				printf("      stats                               the counts of the tile cache\n");
+				printf("      quit                                stops the daemon\n");
+				printf("   the decoded images are cached in tiles of 16 x 256 pixels, by file, time and size of\n");
+				printf("   the stream, and a request decodes only its tiles that are not cached (a fixed coded\n");
+				printf("   stream needs its block row index for that, or it is decoded whole)\n\n");
+				printf("Format for the daemon with options: Project -serve socket_file -workers n -cache megabytes\n");
+				printf("   n workers answer connections (4 by default), the tile cache holds up to the given\n");
+				printf("   megabytes of decoded images (256 by default); a worker answers one connection at\n");
+				printf("   a time, and a connection without a request for 5 seconds is closed\n\n");
+			}
+		} else if (!strcmp(argv[1], "-request")) {
+			if (argc >= 4) Send_Request(argv[2], argc - 3, &argv[3]);
+			else {
+				printf("\nFormat for daemon requests: Project -request socket_file request ...\n");
+				printf("   sends the request (the words after socket_file) to the daemon on socket_file and\n");
+				printf("   prints the reply\n");
+				printf("i.e. \"Project -request /tmp/mic.sock crop file1 0 0 640 480 /view\"\n\n");
+			}
+		} else if (!strcmp(argv[1], "-model")) {
+			// a stream or -size, then the options in any order
+			filename_1[0] = filename_3[0] = '\0';
+			input_size[0] = input_size[1] = 0;
+			multipliers = 0;
+			period = -1;
+			sequential = 0;
+			valid = (argc >= 3);
+			i = 3;
+			if (valid && !strcmp(argv[2], "-size")) {
+				valid = (argc >= 5) && (sscanf(argv[3], "%d", &input_size[0]) == 1) && (sscanf(argv[4], "%d", &input_size[1]) == 1)
+					&& (input_size[0] > 0) && (input_size[1] > 0);
+				i = 5;
+			} else if (valid) sscanf(argv[2], "%s", filename_1);
+			for (; valid && (i < argc); i++) {
+				if (!strcmp(argv[i], "-multipliers") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &multipliers) == 1) && (multipliers > 0);
+				else if (!strcmp(argv[i], "-period") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &period) == 1) && (period >= 0);
+				else if (!strcmp(argv[i], "-sequential")) sequential = 1;
+				else if (!strcmp(argv[i], "-json") && (i + 1 < argc)) sscanf(argv[++i], "%s", filename_3);
+				else valid = 0;
+			}
+			if (valid && sequential && (period >= 0)) {
+				printf("-period sets the period of the overlapped stages, it cannot be combined with -sequential\n");
+				valid = 0;
 			}
+			if (!valid) {
+				printf("\nFormat for the hardware model: Project -model input_file\n");
+				printf("   input_file is a .mic file coded with the fixed codes\n");
+				printf("i.e. \"Project -model file1\" models the encoding of file1.mic by the hardware: the\n");
+				printf("   colourspace conversion and downsampling of ColourspaceConversion_Downsample.sv and\n");
+				printf("   the DCT, quantization and lossless coding of DCT.sv, and prints the clock cycles of\n");
+				printf("   each, the 16-bit SRAM words read and written, the embedded RAM accesses and the\n");
+				printf("   multiplications per block, and the total time and multiplier use at 50 and 100 MHz;\n");
+				printf("   the coding of a block takes a cycle per coefficient and the cycles its zero runs\n");
+				printf("   hold the scan, as found in the stream\n\n");
+				printf("Format for the hardware model of an image size: Project -model -size width height\n");
+				printf("   every block is taken as coded in 64 bits without zero runs\n\n");
+				printf("Format for the hardware model of another schedule: Project -model input_file -multipliers n -period cycles\n");
+				printf("   n multipliers (4 in the RTL) are shared by the stages, and a block enters the\n");
+				printf("   DCT every period (132 cycles in the RTL, 0 for the shortest period the stages\n");
+				printf("   allow); blocks whose coding does not fit the period are reported\n");
+				printf("   -sequential takes the stages one block at a time instead\n");
+				printf("   -json model_file also writes the counts to model_file.model.json\n");
+				printf("   the options can be combined, and used with -size\n\n");
+			} else Performance_Model(filename_1, input_size[1], input_size[0], multipliers, period, sequential,
+				(filename_3[0] != '\0') ? filename_3 : NULL);
 		} else printf("Unrecognized input, run with no parameters for info\n");
 	} else {
 		printf("\nThis program contains the software model for the hardware implementation of\n");
@@ -115,9 +550,29 @@ int main(int argc, char *argv[]) {
 		printf("Format for parsing: Project -parse input_file output_file\n");
 		printf("Format for straight encoding: Project -encode input_file format output_file\n");
 		printf("Format for debug encoding: Project -encode input_file format output_file -debug debug_level\n");
+		printf("Format for indexed encoding: Project -encode input_file format output_file -index\n");
+		printf("Format for wide header encoding: Project -encode input_file format output_file -wide\n");
+		printf("Format for multi-format encoding: Project -encode input_file format,format,... output_file\n");
+		printf("Format for target size encoding: Project -encode input_file format output_file -target-bytes size\n");
+		printf("Format for adaptive quantization: Project -encode input_file format output_file -adaptive\n");
+		printf("Format for arithmetic coding: Project -encode input_file format output_file -arith\n");
+		printf("Format for 4:2:0 encoding: Project -encode input_file format output_file -420\n");
+		printf("Format for encoding YUV sources: Project -encode input_file format output_file -in input_format\n");
+		printf("Format for sequence encoding: Project -encode input_file format output_file -frames count\n");
 		printf("Format for straight decoding: Project -decode input_file output_file\n");
 		printf("Format for debug decoding: Project -decode input_file output_file -debug debug_level\n");
-		printf("Format for comparison: Project -compare input_file output_file (computes SNR)\n\n");
+		printf("Format for decoding to other outputs: Project -decode input_file output_file -out output_format\n");
+		printf("Format for scaled decoding: Project -decode input_file output_file -scale denominator\n");
+		printf("Format for region of interest decoding: Project -decode input_file output_file -crop x y width height\n");
+		printf("Format for sequence decoding: Project -decode input_file output_file -frames count\n");
+		printf("Format for JPEG transcoding: Project -transcode-jpeg input_file output_file\n");
+		printf("Format for lossless transforms: Project -transform input_file output_file operation\n");
+		printf("Format for comparison: Project -compare input_file output_file (computes PSNR and SSIM)\n");
+		printf("Format for comparison to a compressed file: Project -compare input_file output_file -mic\n");
+		printf("Format for stream statistics: Project -stats input_file\n");
+		printf("Format for the hardware model: Project -model input_file (or -size width height)\n");
+		printf("Format for the codec daemon: Project -serve socket_file\n");
+		printf("Format for daemon requests: Project -request socket_file request ...\n\n");
 
 		printf("Re-run with mode parameter only for specific details for that mode (e.g. \"Project -decode\")\n\n");
 	}
@@ -0,0 +1,814 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include "Coding.h"
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// image data type of the decoder
+typedef struct image_struct {
+	int Rows, Columns;
+	int *Pixel_Data;
+} image;
+
+// the daemon answers one request line with one reply line, on a Unix domain socket
+// (a connection can send any number of requests); the images travel through POSIX
+// shared memory objects named by the client, as interleaved RGB samples in the order
+// of a .ppm image; the decoded images are cached in tiles of TILE_ROWS rows (an MCU
+// row in 4:2:0, two block rows in 4:2:2) and TILE_COLUMNS columns, so that the
+// viewports of a large image are copied from the tiles a previous request decoded
+#define TILE_ROWS     16
+#define TILE_COLUMNS  256
+#define TILE_BUCKETS  4096   // hash table of the cached tiles
+#define REQUEST_SIZE  1024   // longest request or reply line
+#define MAX_WORDS     16     // words of a request
+#define QUEUE_SIZE    64     // connections waiting for a worker
+#define IDLE_SECONDS  5      // a connection without a request for longer is closed
+#define ACCEPT_PAUSE  100000 // microseconds between accepts after an error (out of descriptors)
+
+// a compressed stream Filename.mic, as it was when it was opened: a tile is of the
+// stream modified at Modified and File_Size bytes long, so that a tile of a stream
+// that was written again is not found
+typedef struct stream_file_struct {
+	char Filename[100];
+	struct timespec Modified;
+	off_t File_Size;
+	int Rows, Columns, Compression_Format, Indexed;
+} stream_file;
+
+// a cached tile (smaller at the bottom and right edges of the image); a tile in use
+// by a request is not evicted, and a stale tile (of a stream the daemon encoded
+// since) is not found and is freed when it is no longer used
+typedef struct tile_struct {
+	char Filename[100];
+	struct timespec Modified;
+	off_t File_Size;
+	int Tile_Row, Tile_Column, Rows, Columns, Users, Stale;
+	unsigned char *Data;
+	struct tile_struct *Next;            // in the bucket
+	struct tile_struct *Newer, *Older;   // in the order of use
+} tile;
+
+typedef struct tile_cache_struct {
+	tile *Buckets[TILE_BUCKETS];
+	tile *Newest, *Oldest;
+	size_t Size, Capacity;
+	long Tiles, Hits, Misses, Evictions;
+	pthread_mutex_t Lock;
+} tile_cache;
+
+// the tiles covering the rectangle of a request, Rows x Columns of them (by rows)
+// from the tile at First_Row, First_Column
+typedef struct tile_grid_struct {
+	int First_Row, First_Column, Rows, Columns;
+	tile **Tiles;
+} tile_grid;
+
+static tile_cache Cache;
+
+// the encoder and decoder keep the state of a stream in file scope, so the requests
+// code one at a time; the planes are in the codec context of each worker, which is
+// kept (with its arenas) for the life of the daemon
+static pthread_mutex_t Codec_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the connections accepted, waiting for a worker, and the connection each worker
+// holds (-1 when it waits), which a quit request shuts down for reading; a worker
+// holds a connection until it is closed, so idle connections time out and do not
+// keep the queued ones (a quit request among them) waiting
+static int Connections[QUEUE_SIZE], Queue_Head = 0, Queue_Count = 0;
+static int *Active, Num_Active = 0;
+static int Listen_Socket, Serving = 0;
+static pthread_mutex_t Queue_Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Queue_Ready = PTHREAD_COND_INITIALIZER;
+
+void Serve(char *, int, long);
+void Send_Request(char *, int, char **);
+int  Decode_RGB_Region(char *, int *, image *);
+int  Encode_RGB_Image(unsigned char *, int, int, int, char *, int);
+static void *Worker_Thread(void *);
+static void Serve_Connection(int);
+static void Serve_Request(char *, char *);
+static void Crop_Request(char *, int *, char *, char *);
+static void Encode_Request(char **, int, char *);
+static int  Open_Stream(char *, stream_file *, char *);
+static int  Check_Index(char *, int, off_t);
+static unsigned char *Map_Shared(char *, size_t, int, char *);
+static int  Find_Tiles(stream_file *, tile_grid *);
+static int  Decode_Tiles(stream_file *, tile_grid *);
+static unsigned int Hash_Tile(const char *, int, int);
+static tile *Find_Tile(stream_file *, int, int);
+static void Use_Tile(tile *);
+static tile *Insert_Tile(tile *, int);
+static void Release_Tiles(tile_grid *);
+static void Drop_Tiles(char *);
+static void Unlink_Tile(tile *);
+static void Evict_Tiles(void);
+
+
+void Serve(char *Socket_Path, int Num_Workers, long Cache_Megabytes) {
+	// listens on Socket_Path until a quit request, with Num_Workers workers
+	// and at most Cache_Megabytes of cached tiles
+	struct sockaddr_un Address;
+	pthread_t *Workers;
+	tile *Tile;
+	int k, Connection, Accept_Error;
+
+	if (strlen(Socket_Path) >= sizeof(Address.sun_path)) {
+		printf("Socket path %s is too long\n", Socket_Path); exit(1); }
+	Cache.Capacity = (size_t)Cache_Megabytes << 20;
+	pthread_mutex_init(&Cache.Lock, NULL);
+
+	// a client that goes away is seen as a failed write, not a signal
+	signal(SIGPIPE, SIG_IGN);
+	if ((Listen_Socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		printf("Problem creating the socket\n"); exit(1); }
+	memset(&Address, 0, sizeof(Address));
+	Address.sun_family = AF_UNIX;
+	strcpy(Address.sun_path, Socket_Path);
+	unlink(Socket_Path);
+	if (bind(Listen_Socket, (struct sockaddr *)&Address, sizeof(Address)) || listen(Listen_Socket, QUEUE_SIZE)) {
+		printf("Problem listening on socket %s\n", Socket_Path); exit(1); }
+	printf("Serving on %s with %d workers and a %ld MB tile cache\n", Socket_Path, Num_Workers, Cache_Megabytes);
+	fflush(stdout);
+
+	Serving = 1;
+	Workers = (pthread_t *)malloc(Num_Workers*sizeof(pthread_t));
+	Active = (int *)malloc(Num_Workers*sizeof(int));
+	for (k = 0; k < Num_Workers; k++) Active[k] = -1;
+	Num_Active = Num_Workers;
+	for (k = 0; k < Num_Workers; k++)
+		if (pthread_create(&Workers[k], NULL, Worker_Thread, (void *)(long)k)) {
+			printf("Problem starting worker %d\n", k); exit(1); }
+
+	// the connections are queued for the workers (a quit request shuts the socket down)
+	for (;;) {
+		Connection = accept(Listen_Socket, NULL, NULL);
+		Accept_Error = errno;
+		pthread_mutex_lock(&Queue_Lock);
+		if (!Serving) {
+			pthread_mutex_unlock(&Queue_Lock);
+			if (Connection >= 0) close(Connection);
+			break;
+		}
+		if ((Connection >= 0) && (Queue_Count == QUEUE_SIZE)) {
+			pthread_mutex_unlock(&Queue_Lock);
+			if (write(Connection, "ERR Too many connections\n", 25) < 0) {}
+			close(Connection);
+			continue;
+		}
+		if (Connection >= 0) {
+			Connections[(Queue_Head + Queue_Count) % QUEUE_SIZE] = Connection;
+			Queue_Count++;
+			pthread_cond_signal(&Queue_Ready);
+		}
+		pthread_mutex_unlock(&Queue_Lock);
+		// an error that persists (no descriptors left until a worker closes one) is
+		// retried after a pause instead of in a busy loop
+		if ((Connection < 0) && (Accept_Error != EINTR)) usleep(ACCEPT_PAUSE);
+	}
+
+	// the workers finish the connections they hold and the ones queued
+	pthread_mutex_lock(&Queue_Lock);
+	pthread_cond_broadcast(&Queue_Ready);
+	pthread_mutex_unlock(&Queue_Lock);
+	for (k = 0; k < Num_Workers; k++)
+		pthread_join(Workers[k], NULL);
+	close(Listen_Socket);
+	unlink(Socket_Path);
+
+	printf("Tile cache: %ld hits, %ld misses, %ld evictions\n", Cache.Hits, Cache.Misses, Cache.Evictions);
+	while ((Tile = Cache.Newest) != NULL) {
+		Unlink_Tile(Tile);
+		free(Tile->Data);
+		free(Tile);
+	}
+	pthread_mutex_destroy(&Cache.Lock);
+	free(Active);
+	free(Workers);
+}
+
+void Send_Request(char *Socket_Path, int Num_Words, char **Words) {
+	// sends the request of Num_Words words to the daemon on Socket_Path and prints the reply
+	struct sockaddr_un Address;
+	char Request[REQUEST_SIZE], Reply[REQUEST_SIZE];
+	int k, Connection;
+	size_t Length;
+	ssize_t Received;
+
+	Request[0] = '\0';
+	for (k = 0; k < Num_Words; k++) {
+		if (strlen(Request) + strlen(Words[k]) + 2 > sizeof(Request)) {
+			printf("Request is longer than %d characters\n", REQUEST_SIZE - 2); exit(1); }
+		if (k > 0) strcat(Request, " ");
+		strcat(Request, Words[k]);
+	}
+	strcat(Request, "\n");
+
+	if (strlen(Socket_Path) >= sizeof(Address.sun_path)) {
+		printf("Socket path %s is too long\n", Socket_Path); exit(1); }
+	memset(&Address, 0, sizeof(Address));
+	Address.sun_family = AF_UNIX;
+	strcpy(Address.sun_path, Socket_Path);
+	if (((Connection = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+	    connect(Connection, (struct sockaddr *)&Address, sizeof(Address))) {
+		printf("Problem connecting to socket %s\n", Socket_Path); exit(1); }
+	if (write(Connection, Request, strlen(Request)) != (ssize_t)strlen(Request)) {
+		printf("Problem sending the request\n"); exit(1); }
+
+	// the reply is one line
+	Length = 0;
+	while ((Length < sizeof(Reply) - 1) && ((Length == 0) || (Reply[Length - 1] != '\n')) &&
+	       ((Received = read(Connection, &Reply[Length], sizeof(Reply) - 1 - Length)) > 0))
+		Length += (size_t)Received;
+	Reply[Length] = '\0';
+	close(Connection);
+	printf("%s", Reply);
+	if (strncmp(Reply, "OK", 2)) exit(1);
+}
+
+static void *Worker_Thread(void *Worker) {
+	int Connection, k = (int)(long)Worker;
+
+	for (;;) {
+		pthread_mutex_lock(&Queue_Lock);
+		while ((Queue_Count == 0) && Serving)
+			pthread_cond_wait(&Queue_Ready, &Queue_Lock);
+		if (Queue_Count == 0) {
+			pthread_mutex_unlock(&Queue_Lock);
+			break;
+		}
+		Connection = Connections[Queue_Head];
+		Queue_Head = (Queue_Head + 1) % QUEUE_SIZE;
+		Queue_Count--;
+		Active[k] = Connection;
+		if (!Serving) shutdown(Connection, SHUT_RD);
+		pthread_mutex_unlock(&Queue_Lock);
+		Serve_Connection(Connection);
+	}
+	return NULL;
+}
+
+static void Serve_Connection(int Connection) {
+	// answers the requests of a connection until the client closes it or is idle for
+	// IDLE_SECONDS (or the daemon quits, and the requests already sent are answered)
+	char Request[REQUEST_SIZE], Reply[REQUEST_SIZE];
+	FILE *Requests;
+	int k, Character;
+	struct timeval Timeout;
+
+	Timeout.tv_sec = IDLE_SECONDS;
+	Timeout.tv_usec = 0;
+	setsockopt(Connection, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+	if ((Requests = fdopen(dup(Connection), "r")) != NULL) {
+		while (fgets(Request, sizeof(Request), Requests) != NULL) {
+			if ((strchr(Request, '\n') == NULL) && !feof(Requests)) {
+				while (((Character = fgetc(Requests)) != EOF) && (Character != '\n'));
+				sprintf(Reply, "ERR Request is longer than %d characters\n", REQUEST_SIZE - 2);
+			} else Serve_Request(Request, Reply);
+			if (write(Connection, Reply, strlen(Reply)) < 0) break;
+		}
+		fclose(Requests);
+	}
+
+	// the connection is no longer active before its descriptor can be reused
+	pthread_mutex_lock(&Queue_Lock);
+	for (k = 0; k < Num_Active; k++)
+		if (Active[k] == Connection) Active[k] = -1;
+	pthread_mutex_unlock(&Queue_Lock);
+	close(Connection);
+}
+
+static void Serve_Request(char *Request, char *Reply) {
+	// the requests are
+	//    decode file shared                      the whole image of file.mic to shared memory
+	//    crop file x y width height shared       a rectangle of it
+	//    encode shared width height format file [-adaptive] [-arith] [-420] [-wide] [-index]
+	//                                            the image in shared memory to file.mic
+	//    stats                                   the counts of the tile cache
+	//    quit                                    stops the daemon
+	char *Words[MAX_WORDS], *Word, *Position;
+	int Num_Words, k, Crop[4];
+
+	Num_Words = 0;
+	for (Word = strtok_r(Request, " \t\r\n", &Position); Word != NULL; Word = strtok_r(NULL, " \t\r\n", &Position)) {
+		if (Num_Words == MAX_WORDS) {
+			sprintf(Reply, "ERR Request has more than %d words\n", MAX_WORDS);
+			return;
+		}
+		Words[Num_Words++] = Word;
+	}
+
+	if ((Num_Words == 3) && !strcmp(Words[0], "decode"))
+		Crop_Request(Words[1], NULL, Words[2], Reply);
+	else if ((Num_Words == 7) && !strcmp(Words[0], "crop")) {
+		for (k = 0; k < 4; k++)
+			if (sscanf(Words[2 + k], "%d", &Crop[k]) != 1) {
+				sprintf(Reply, "ERR Invalid crop rectangle\n");
+				return;
+			}
+		Crop_Request(Words[1], Crop, Words[6], Reply);
+	} else if ((Num_Words >= 6) && !strcmp(Words[0], "encode"))
+		Encode_Request(Words, Num_Words, Reply);
+	else if ((Num_Words == 1) && !strcmp(Words[0], "stats")) {
+		pthread_mutex_lock(&Cache.Lock);
+		sprintf(Reply, "OK tiles %ld bytes %lu hits %ld misses %ld evictions %ld\n", Cache.Tiles,
+			(unsigned long)Cache.Size, Cache.Hits, Cache.Misses, Cache.Evictions);
+		pthread_mutex_unlock(&Cache.Lock);
+	} else if ((Num_Words == 1) && !strcmp(Words[0], "quit")) {
+		pthread_mutex_lock(&Queue_Lock);
+		Serving = 0;
+		for (k = 0; k < Num_Active; k++)
+			if (Active[k] >= 0) shutdown(Active[k], SHUT_RD);
+		pthread_cond_broadcast(&Queue_Ready);
+		pthread_mutex_unlock(&Queue_Lock);
+		shutdown(Listen_Socket, SHUT_RDWR);
+		sprintf(Reply, "OK\n");
+	} else sprintf(Reply, "ERR Unrecognized request %s\n", (Num_Words > 0) ? Words[0] : "(empty)");
+}
+
+static void Crop_Request(char *Filename, int *Crop, char *Shared_Name, char *Reply) {
+	// copies the rectangle Crop (x, y, width, height; NULL for the whole image) of the
+	// decoded image of Filename.mic to the shared memory object Shared_Name (created, or
+	// resized, to the 3*width*height bytes of the rectangle), from the cached tiles
+	// and the ones decoded for it; the reply gives the size of the rectangle, its bytes
+	// and the number of its tiles that were cached
+	stream_file Stream;
+	tile_grid Grid;
+	tile *Tile;
+	unsigned char *Shared;
+	int i, k, Rectangle[4], Cached, First_Column, Last_Column;
+	size_t Size;
+
+	if (!Open_Stream(Filename, &Stream, Reply)) return;
+	if (Crop != NULL) memcpy(Rectangle, Crop, sizeof(Rectangle));
+	else {
+		Rectangle[0] = Rectangle[1] = 0;
+		Rectangle[2] = Stream.Columns;
+		Rectangle[3] = Stream.Rows;
+	}
+	if ((Rectangle[0] < 0) || (Rectangle[1] < 0) || (Rectangle[2] <= 0) || (Rectangle[3] <= 0) ||
+	    (Rectangle[0] + Rectangle[2] > Stream.Columns) || (Rectangle[1] + Rectangle[3] > Stream.Rows)) {
+		sprintf(Reply, "ERR Crop rectangle %d %d %d %d is outside the %d x %d image\n", Rectangle[0],
+			Rectangle[1], Rectangle[2], Rectangle[3], Stream.Columns, Stream.Rows);
+		return;
+	}
+	Size = (size_t)3*Rectangle[2]*Rectangle[3];
+	if ((Shared = Map_Shared(Shared_Name, Size, 1, Reply)) == NULL) return;
+
+	// the tiles in the cache, then the missing ones
+	Grid.First_Row = Rectangle[1]/TILE_ROWS;
+	Grid.First_Column = Rectangle[0]/TILE_COLUMNS;
+	Grid.Rows = (Rectangle[1] + Rectangle[3] - 1)/TILE_ROWS - Grid.First_Row + 1;
+	Grid.Columns = (Rectangle[0] + Rectangle[2] - 1)/TILE_COLUMNS - Grid.First_Column + 1;
+	Grid.Tiles = (tile **)calloc((size_t)Grid.Rows*Grid.Columns, sizeof(tile *));
+	Cached = Find_Tiles(&Stream, &Grid);
+	if ((Cached < Grid.Rows*Grid.Columns) && Decode_Tiles(&Stream, &Grid)) {
+		Release_Tiles(&Grid);
+		munmap(Shared, Size);
+		free(Grid.Tiles);
+		sprintf(Reply, "ERR Problem decoding %s.mic\n", Filename);
+		return;
+	}
+
+	// each row of the rectangle from the tiles it crosses
+	for (i = 0; i < Rectangle[3]; i++)
+		for (k = 0; k < Grid.Columns; k++) {
+			Tile = Grid.Tiles[((Rectangle[1] + i)/TILE_ROWS - Grid.First_Row)*Grid.Columns + k];
+			First_Column = (Grid.First_Column + k)*TILE_COLUMNS;
+			Last_Column = First_Column + Tile->Columns;
+			if (First_Column < Rectangle[0]) First_Column = Rectangle[0];
+			if (Last_Column > Rectangle[0] + Rectangle[2]) Last_Column = Rectangle[0] + Rectangle[2];
+			memcpy(&Shared[(size_t)3*((size_t)i*Rectangle[2] + First_Column - Rectangle[0])],
+				&Tile->Data[(size_t)3*(((Rectangle[1] + i) % TILE_ROWS)*Tile->Columns + First_Column % TILE_COLUMNS)],
+				(size_t)3*(Last_Column - First_Column));
+		}
+	Release_Tiles(&Grid);
+	munmap(Shared, Size);
+	sprintf(Reply, "OK %d %d %lu %d of %d tiles cached\n", Rectangle[2], Rectangle[3], (unsigned long)Size,
+		Cached, Grid.Rows*Grid.Columns);
+	free(Grid.Tiles);
+}
+
+static void Encode_Request(char **Words, int Num_Words, char *Reply) {
+	// encodes the width x height RGB image in the shared memory object Words[1]
+	// to Words[5].mic, with the format and options of -encode
+	char Filename[110], Output_Filename[110];
+	unsigned char *Shared;
+	int k, Rows, Columns, Compression_Format, Write_Index, Failed;
+	size_t Size;
+	struct stat Status;
+	FILE *Output_File;
+
+	if ((sscanf(Words[2], "%d", &Columns) != 1) || (sscanf(Words[3], "%d", &Rows) != 1) || (Rows <= 0) || (Columns <= 0) ||
+	    (sscanf(Words[4], "%d", &Compression_Format) != 1) || (Compression_Format < 0) || (Compression_Format > 2)) {
+		sprintf(Reply, "ERR Invalid image size or format\n");
+		return;
+	}
+	Write_Index = 0;
+	for (k = 6; k < Num_Words; k++) {
+		if (!strcmp(Words[k], "-adaptive")) Compression_Format |= 1 << 2;
+		else if (!strcmp(Words[k], "-arith")) Compression_Format |= 1 << 3;
+		else if (!strcmp(Words[k], "-420")) Compression_Format |= 1 << 4;
+		else if (!strcmp(Words[k], "-wide")) Compression_Format |= 1 << 6;
+		else if (!strcmp(Words[k], "-index")) Write_Index = 1;
+		else {
+			sprintf(Reply, "ERR Unrecognized encoding option %s\n", Words[k]);
+			return;
+		}
+	}
+	if (Write_Index && (FORMAT_ENTROPY(Compression_Format) == ENTROPY_ARITH)) {
+		sprintf(Reply, "ERR -index is for the fixed codes, not -arith\n");
+		return;
+	}
+	if (strlen(Words[5]) >= 100) {
+		sprintf(Reply, "ERR File name %s is too long\n", Words[5]);
+		return;
+	}
+
+	// the encoder exits when it cannot write the stream or its index, so they are opened first
+	for (k = 0; k <= Write_Index; k++) {
+		sprintf(Output_Filename, (k == 0) ? "%s.mic" : "%s.mici", Words[5]);
+		if ((Output_File = fopen(Output_Filename, "ab")) == NULL) {
+			sprintf(Reply, "ERR Problem opening %s\n", Output_Filename);
+			return;
+		}
+		fclose(Output_File);
+	}
+	Size = (size_t)3*Rows*Columns;
+	if ((Shared = Map_Shared(Words[1], Size, 0, Reply)) == NULL) return;
+
+	strcpy(Filename, Words[5]);
+	pthread_mutex_lock(&Codec_Lock);
+	Failed = Encode_RGB_Image(Shared, Rows, Columns, Compression_Format, Filename, Write_Index);
+	pthread_mutex_unlock(&Codec_Lock);
+	munmap(Shared, Size);
+
+	// the tiles of the stream it replaces (found by their size and time otherwise, but
+	// the time of a file is coarser than the requests)
+	Drop_Tiles(Words[5]);
+	if (Failed || stat(Filename, &Status)) {
+		sprintf(Reply, "ERR Problem writing %s\n", Filename);
+		return;
+	}
+	sprintf(Reply, "OK %lu\n", (unsigned long)Status.st_size);
+}
+
+static int Open_Stream(char *Filename, stream_file *Stream, char *Reply) {
+	// reads the header of Filename.mic, checking everything the decoder would stop on
+	// (the segments must start inside the file, and the block row index must be of the
+	// stream), and whether a region of it can be decoded (arithmetic coded, or with a
+	// block row index)
+	char Path[110];
+	int i, colour, Header_Format;
+	unsigned long long Segment_Offset[3];
+	struct stat Status, Index_Status;
+	FILE *Source_File;
+
+	if (strlen(Filename) >= sizeof(Stream->Filename)) {
+		sprintf(Reply, "ERR File name %s is too long\n", Filename);
+		return 0;
+	}
+	strcpy(Stream->Filename, Filename);
+	sprintf(Path, "%s.mic", Filename);
+	if (stat(Path, &Status) || ((Source_File = fopen(Path, "rb")) == NULL)) {
+		sprintf(Reply, "ERR Problem opening source compressed stream %s\n", Path);
+		return 0;
+	}
+	Stream->Modified = Status.st_mtim;
+	Stream->File_Size = Status.st_size;
+
+	if ((fgetc(Source_File) != 0xEC) || (fgetc(Source_File) != 0xE7) || (fgetc(Source_File) != 0x44)) {
+		fclose(Source_File);
+		sprintf(Reply, "ERR %s is not a compressed stream\n", Path);
+		return 0;
+	}
+	Stream->Compression_Format = fgetc(Source_File);
+	Header_Format = FORMAT_HEADER(Stream->Compression_Format);
+	Stream->Rows = Stream->Columns = 0;
+	for (i = (Header_Format == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		Stream->Rows = (Stream->Rows << 8) | fgetc(Source_File);
+	for (i = (Header_Format == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		Stream->Columns = (Stream->Columns << 8) | fgetc(Source_File);
+	for (colour = 0; colour < 3; colour++) {
+		Segment_Offset[colour] = 0;
+		for (i = (Header_Format == HEADER_WIDE) ? 7 : 3; i > 0; i--)
+			Segment_Offset[colour] = (Segment_Offset[colour] << 8) | (unsigned long long)(fgetc(Source_File) & 0xFF);
+		fgetc(Source_File);
+	}
+	fclose(Source_File);
+
+	if ((Header_Format != HEADER_NARROW) && (Header_Format != HEADER_WIDE)) {
+		sprintf(Reply, "ERR Unrecognized header layout %d in %s\n", Header_Format, Path);
+		return 0;
+	}
+	if ((Stream->Rows <= 0) || (Stream->Columns <= 0) || ((long long)Status.st_size < ((Header_Format == HEADER_WIDE) ? 36 : 20))) {
+		sprintf(Reply, "ERR Invalid image size %d x %d in %s\n", Stream->Columns, Stream->Rows, Path);
+		return 0;
+	}
+	for (colour = 0; colour < 3; colour++)
+		if ((Segment_Offset[colour] > (unsigned long long)Status.st_size) ||
+		    ((colour > 0) && (Segment_Offset[colour] < Segment_Offset[colour - 1]))) {
+			sprintf(Reply, "ERR %s is truncated or corrupt\n", Path);
+			return 0;
+		}
+	if (FORMAT_SKIP(Stream->Compression_Format)) {
+		sprintf(Reply, "ERR %s is a frame of a sequence, decode it with the frames before it (-frames)\n", Path);
+		return 0;
+	}
+	// a block row index older than the stream is of a stream it replaced
+	strcat(Path, "i");
+	Stream->Indexed = (FORMAT_ENTROPY(Stream->Compression_Format) == ENTROPY_ARITH) ||
+		(!stat(Path, &Index_Status) && !access(Path, R_OK) &&
+		 ((Index_Status.st_mtim.tv_sec > Status.st_mtim.tv_sec) || ((Index_Status.st_mtim.tv_sec == Status.st_mtim.tv_sec) &&
+		  (Index_Status.st_mtim.tv_nsec >= Status.st_mtim.tv_nsec))));
+	if (Stream->Indexed && (FORMAT_ENTROPY(Stream->Compression_Format) == ENTROPY_FIXED) &&
+	    !Check_Index(Path, PADDED_ROWS(Stream->Rows, Stream->Compression_Format)/8, Status.st_size)) {
+		sprintf(Reply, "ERR Block row index %s is not of the stream %s.mic\n", Path, Filename);
+		return 0;
+	}
+	return 1;
+}
+
+static int Check_Index(char *Path, int Block_Rows, off_t Stream_Size) {
+	// whether the block row index Path has the block rows of the stream and their
+	// offsets inside it, as the decoder reads it (which exits on an index it cannot use)
+	unsigned long long Offset;
+	int i, j, Rows;
+	struct stat Status;
+	FILE *Index_File;
+
+	if (stat(Path, &Status) || (Status.st_size != 8 + (off_t)24*Block_Rows) || ((Index_File = fopen(Path, "rb")) == NULL))
+		return 0;
+	if ((fgetc(Index_File) != 0xEC) || (fgetc(Index_File) != 0xE7) || (fgetc(Index_File) != 0x44) ||
+	    (fgetc(Index_File) != 0x49)) {
+		fclose(Index_File);
+		return 0;
+	}
+	for (Rows = 0, j = 0; j < 4; j++)
+		Rows = (Rows << 8) | (fgetc(Index_File) & 0xFF);
+	for (i = 0; (Rows == Block_Rows) && (i < 3*Block_Rows); i++) {
+		for (Offset = 0, j = 0; j < 8; j++)
+			Offset = (Offset << 8) | (unsigned long long)(fgetc(Index_File) & 0xFF);
+		if (Offset/8 > (unsigned long long)Stream_Size) Rows = -1;
+	}
+	fclose(Index_File);
+	return Rows == Block_Rows;
+}
+
+static unsigned char *Map_Shared(char *Name, size_t Size, int Writable, char *Reply) {
+	// maps Size bytes of the shared memory object Name (of the client, named as for
+	// shm_open), creating it or setting its size for writing
+	unsigned char *Data;
+	int Descriptor;
+	struct stat Status;
+
+	Descriptor = Writable ? shm_open(Name, O_RDWR | O_CREAT, 0600) : shm_open(Name, O_RDONLY, 0);
+	if (Descriptor < 0) {
+		sprintf(Reply, "ERR Problem opening shared memory %s\n", Name);
+		return NULL;
+	}
+	if (Writable ? (ftruncate(Descriptor, (off_t)Size) != 0) : (fstat(Descriptor, &Status) || ((size_t)Status.st_size < Size))) {
+		close(Descriptor);
+		sprintf(Reply, "ERR Shared memory %s does not hold the %lu bytes of the image\n", Name, (unsigned long)Size);
+		return NULL;
+	}
+	Data = (unsigned char *)mmap(NULL, Size, Writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, Descriptor, 0);
+	close(Descriptor);
+	if (Data == (unsigned char *)MAP_FAILED) {
+		sprintf(Reply, "ERR Problem mapping shared memory %s\n", Name);
+		return NULL;
+	}
+	return Data;
+}
+
+static unsigned int Hash_Tile(const char *Filename, int Tile_Row, int Tile_Column) {
+	unsigned int Hash = 2166136261u;
+
+	while (*Filename) Hash = (Hash ^ (unsigned char)*Filename++) * 16777619u;
+	return (Hash ^ ((unsigned int)Tile_Row * 2654435761u) ^ ((unsigned int)Tile_Column * 40503u)) % TILE_BUCKETS;
+}
+
+static tile *Find_Tile(stream_file *Stream, int Tile_Row, int Tile_Column) {
+	// the tile of the stream, with the cache locked
+	tile *Tile;
+
+	for (Tile = Cache.Buckets[Hash_Tile(Stream->Filename, Tile_Row, Tile_Column)]; Tile != NULL; Tile = Tile->Next)
+		if ((Tile->Tile_Row == Tile_Row) && (Tile->Tile_Column == Tile_Column) && !Tile->Stale &&
+		    (Tile->File_Size == Stream->File_Size) &&
+		    (Tile->Modified.tv_sec == Stream->Modified.tv_sec) && (Tile->Modified.tv_nsec == Stream->Modified.tv_nsec) &&
+		    !strcmp(Tile->Filename, Stream->Filename))
+			return Tile;
+	return NULL;
+}
+
+static void Use_Tile(tile *Tile) {
+	// moves the tile to the newest end of the order of use, with the cache locked
+	if (Cache.Newest == Tile) return;
+	if (Tile->Newer != NULL) {
+		// already in the list
+		Tile->Newer->Older = Tile->Older;
+		if (Tile->Older != NULL) Tile->Older->Newer = Tile->Newer;
+		else Cache.Oldest = Tile->Newer;
+	}
+	Tile->Newer = NULL;
+	Tile->Older = Cache.Newest;
+	if (Cache.Newest != NULL) Cache.Newest->Newer = Tile;
+	Cache.Newest = Tile;
+	if (Cache.Oldest == NULL) Cache.Oldest = Tile;
+}
+
+static int Find_Tiles(stream_file *Stream, tile_grid *Grid) {
+	// the tiles of the grid that are cached, in use until they are released;
+	// returns their number
+	int i, j, Cached = 0;
+	tile **Tile;
+
+	pthread_mutex_lock(&Cache.Lock);
+	for (i = 0; i < Grid->Rows; i++)
+		for (j = 0; j < Grid->Columns; j++) {
+			Tile = &Grid->Tiles[i*Grid->Columns + j];
+			if ((*Tile = Find_Tile(Stream, Grid->First_Row + i, Grid->First_Column + j)) != NULL) {
+				(*Tile)->Users++;
+				Use_Tile(*Tile);
+				Cached++;
+			}
+		}
+	Cache.Hits += Cached;
+	Cache.Misses += Grid->Rows*Grid->Columns - Cached;
+	pthread_mutex_unlock(&Cache.Lock);
+	return Cached;
+}
+
+static int Decode_Tiles(stream_file *Stream, tile_grid *Grid) {
+	// decodes the tiles missing from the grid as one region, the rectangle of tiles
+	// around them, and caches all its tiles; a fixed coded stream without block row
+	// index is decoded whole (the whole image is decoded without the index); returns
+	// 1 when the stream cannot be decoded (the grid keeps its missing tiles)
+	char Filename[110];
+	image RGB_Image;
+	tile *Tile;
+	int i, j, Row, Column, Region[4], Failed;
+	int First_Row, Last_Row, First_Column, Last_Column, Last_Tile_Row, Last_Tile_Column;
+
+	First_Row = First_Column = 0x7FFFFFFF;
+	Last_Row = Last_Column = -1;
+	for (i = 0; i < Grid->Rows; i++)
+		for (j = 0; j < Grid->Columns; j++)
+			if (Grid->Tiles[i*Grid->Columns + j] == NULL) {
+				if (Grid->First_Row + i < First_Row) First_Row = Grid->First_Row + i;
+				if (Grid->First_Row + i > Last_Row) Last_Row = Grid->First_Row + i;
+				if (Grid->First_Column + j < First_Column) First_Column = Grid->First_Column + j;
+				if (Grid->First_Column + j > Last_Column) Last_Column = Grid->First_Column + j;
+			}
+	Last_Tile_Row = (Stream->Rows - 1)/TILE_ROWS;
+	Last_Tile_Column = (Stream->Columns - 1)/TILE_COLUMNS;
+	if (!Stream->Indexed) {
+		First_Row = First_Column = 0;
+		Last_Row = Last_Tile_Row;
+		Last_Column = Last_Tile_Column;
+	}
+	Region[0] = First_Column*TILE_COLUMNS;
+	Region[1] = First_Row*TILE_ROWS;
+	Region[2] = ((Last_Column == Last_Tile_Column) ? Stream->Columns : (Last_Column + 1)*TILE_COLUMNS) - Region[0];
+	Region[3] = ((Last_Row == Last_Tile_Row) ? Stream->Rows : (Last_Row + 1)*TILE_ROWS) - Region[1];
+
+	// the decoded image is in the context of this worker
+	strcpy(Filename, Stream->Filename);
+	pthread_mutex_lock(&Codec_Lock);
+	Failed = Decode_RGB_Region(Filename, (Stream->Indexed && ((Region[2] < Stream->Columns) || (Region[3] < Stream->Rows))) ?
+		Region : NULL, &RGB_Image);
+	pthread_mutex_unlock(&Codec_Lock);
+	if (Failed) return 1;
+
+	for (Row = First_Row; Row <= Last_Row; Row++)
+		for (Column = First_Column; Column <= Last_Column; Column++) {
+			i = Row - Grid->First_Row;
+			j = Column - Grid->First_Column;
+			if ((i >= 0) && (i < Grid->Rows) && (j >= 0) && (j < Grid->Columns) && (Grid->Tiles[i*Grid->Columns + j] != NULL))
+				continue;
+			Tile = (tile *)calloc(1, sizeof(tile));
+			strcpy(Tile->Filename, Stream->Filename);
+			Tile->Modified = Stream->Modified;
+			Tile->File_Size = Stream->File_Size;
+			Tile->Tile_Row = Row;
+			Tile->Tile_Column = Column;
+			Tile->Rows = (Row == Last_Tile_Row) ? Stream->Rows - Row*TILE_ROWS : TILE_ROWS;
+			Tile->Columns = (Column == Last_Tile_Column) ? Stream->Columns - Column*TILE_COLUMNS : TILE_COLUMNS;
+			Tile->Data = (unsigned char *)malloc((size_t)3*Tile->Rows*Tile->Columns);
+			for (i = 0; i < Tile->Rows; i++)
+				for (j = 0; j < 3*Tile->Columns; j++)
+					Tile->Data[3*i*Tile->Columns + j] = (unsigned char)RGB_Image.Pixel_Data[
+						(size_t)3*((size_t)(Row*TILE_ROWS + i - Region[1])*Region[2] + Column*TILE_COLUMNS - Region[0]) + j];
+			i = Row - Grid->First_Row;
+			j = Column - Grid->First_Column;
+			if ((i >= 0) && (i < Grid->Rows) && (j >= 0) && (j < Grid->Columns))
+				Grid->Tiles[i*Grid->Columns + j] = Insert_Tile(Tile, 1);
+			else Insert_Tile(Tile, 0);
+		}
+	return 0;
+}
+
+static tile *Insert_Tile(tile *New_Tile, int In_Use) {
+	// caches the tile, unless another request cached it meanwhile (the cached one is
+	// returned then, and the new one freed), and evicts the tiles used least recently
+	// that are over the capacity of the cache
+	stream_file Stream;
+	tile *Tile;
+	unsigned int Bucket;
+
+	strcpy(Stream.Filename, New_Tile->Filename);
+	Stream.Modified = New_Tile->Modified;
+	Stream.File_Size = New_Tile->File_Size;
+	pthread_mutex_lock(&Cache.Lock);
+	if ((Tile = Find_Tile(&Stream, New_Tile->Tile_Row, New_Tile->Tile_Column)) != NULL) {
+		free(New_Tile->Data);
+		free(New_Tile);
+	} else {
+		Tile = New_Tile;
+		Bucket = Hash_Tile(Tile->Filename, Tile->Tile_Row, Tile->Tile_Column);
+		Tile->Next = Cache.Buckets[Bucket];
+		Cache.Buckets[Bucket] = Tile;
+		Cache.Size += (size_t)3*Tile->Rows*Tile->Columns;
+		Cache.Tiles++;
+	}
+	Use_Tile(Tile);
+	if (In_Use) Tile->Users++;
+	Evict_Tiles();
+	pthread_mutex_unlock(&Cache.Lock);
+	return Tile;
+}
+
+static void Release_Tiles(tile_grid *Grid) {
+	tile *Tile;
+	int k;
+
+	pthread_mutex_lock(&Cache.Lock);
+	for (k = 0; k < Grid->Rows*Grid->Columns; k++) {
+		if ((Tile = Grid->Tiles[k]) == NULL) continue;   // of a region that was not decoded
+		if ((--Tile->Users == 0) && Tile->Stale) {
+			Unlink_Tile(Tile);
+			free(Tile->Data);
+			free(Tile);
+		}
+	}
+	Evict_Tiles();
+	pthread_mutex_unlock(&Cache.Lock);
+}
+
+static void Drop_Tiles(char *Filename) {
+	// the tiles of the stream Filename.mic are stale (the ones in use are freed when released)
+	tile *Tile, *Newer;
+
+	pthread_mutex_lock(&Cache.Lock);
+	for (Tile = Cache.Oldest; Tile != NULL; Tile = Newer) {
+		Newer = Tile->Newer;
+		if (strcmp(Tile->Filename, Filename)) continue;
+		if (Tile->Users > 0) Tile->Stale = 1;
+		else {
+			Unlink_Tile(Tile);
+			free(Tile->Data);
+			free(Tile);
+		}
+	}
+	pthread_mutex_unlock(&Cache.Lock);
+}
+
+static void Unlink_Tile(tile *Tile) {
+	// removes the tile from its bucket and from the order of use, with the cache locked
+	tile **Link;
+
+	for (Link = &Cache.Buckets[Hash_Tile(Tile->Filename, Tile->Tile_Row, Tile->Tile_Column)]; *Link != Tile; Link = &(*Link)->Next);
+	*Link = Tile->Next;
+	if (Tile->Newer != NULL) Tile->Newer->Older = Tile->Older;
+	else Cache.Newest = Tile->Older;
+	if (Tile->Older != NULL) Tile->Older->Newer = Tile->Newer;
+	else Cache.Oldest = Tile->Newer;
+	Cache.Size -= (size_t)3*Tile->Rows*Tile->Columns;
+	Cache.Tiles--;
+}
+
+static void Evict_Tiles(void) {
+	// frees the tiles used least recently, and not in use, until the cache fits its capacity
+	tile *Tile, *Newer;
+
+	for (Tile = Cache.Oldest; (Tile != NULL) && (Cache.Size > Cache.Capacity); Tile = Newer) {
+		Newer = Tile->Newer;
+		if (Tile->Users > 0) continue;
+		Unlink_Tile(Tile);
+		free(Tile->Data);
+		free(Tile);
+		Cache.Evictions++;
+	}
+}
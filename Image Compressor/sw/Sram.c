@@ -0,0 +1,101 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include "Coding.h"
+
+// SRAM memory images for -sram: a region of the external SRAM (16-bit words, the
+// first byte of each pair in bits 15..8, as the testbench fills the SRAM emulator)
+// written as a $readmemh file, with the address of the region on an @ line and one
+// word per line, or as the raw words for a testbench that reads the bytes itself.
+// The debug files of -debug (output_file.d<level>e and .d<level>d) are written with
+// the same byte order, by the encoder and the decoder alike.
+
+// set when exporting, to SRAM_HEX or SRAM_BINARY
+int sram_format = SRAM_NONE;
+
+void Write_SRAM_Image(char *Filename, const char *Region, long Base, const unsigned char *Bytes, size_t Size) {
+	// writes the Size bytes of a region starting at word address Base to
+	// Filename.sram_<Region>.hex (or .bin), an odd last byte is padded with 0
+	static const char Hex_Digits[] = "0123456789abcdef";
+	char SRAM_Filename[130], *Text;
+	long Words, k;
+	size_t Length;
+	FILE *SRAM_File;
+
+	Words = (long)((Size + 1)/2);
+	if (Base + Words > SRAM_WORDS) {
+		printf("The %s region (%ld words at address %ld) does not fit in the %d words of the SRAM\n",
+			Region, Words, Base, SRAM_WORDS); exit(1); }
+
+	sprintf(SRAM_Filename, "%s.sram_%s.%s", Filename, Region, (sram_format == SRAM_HEX) ? "hex" : "bin");
+	if ((SRAM_File = fopen(SRAM_Filename, "wb")) == NULL) {
+		printf("Problem opening SRAM image %s\n", SRAM_Filename); exit(1); }
+
+	if (sram_format == SRAM_HEX) {
+		// the words are formatted in memory and written at once
+		Text = (char *)malloc((size_t)5*Words + 16);
+		Length = (size_t)sprintf(Text, "@%05lx\n", Base);
+		for (k = 0; k < Words; k++) {
+			Text[Length++] = Hex_Digits[Bytes[2*k] >> 4];
+			Text[Length++] = Hex_Digits[Bytes[2*k] & 0xF];
+			Text[Length++] = (2*k + 1 < (long)Size) ? Hex_Digits[Bytes[2*k + 1] >> 4] : '0';
+			Text[Length++] = (2*k + 1 < (long)Size) ? Hex_Digits[Bytes[2*k + 1] & 0xF] : '0';
+			Text[Length++] = '\n';
+		}
+		if (fwrite(Text, 1, Length, SRAM_File) != Length) {
+			printf("Problem writing SRAM image %s\n", SRAM_Filename); exit(1); }
+		free(Text);
+	} else {
+		if (fwrite(Bytes, 1, Size, SRAM_File) != Size) {
+			printf("Problem writing SRAM image %s\n", SRAM_Filename); exit(1); }
+		if (Size % 2) fputc(0, SRAM_File);
+	}
+	fclose(SRAM_File);
+
+	printf("Wrote the %s region (%ld words at address %ld) to %s\n", Region, Words, Base, SRAM_Filename);
+}
+
+FILE *Open_Debug_File(char *Filename, int Level, char Side) {
+	// opens the debug file of a level, Filename.d<level>e for the encoder (Side 'e')
+	// and Filename.d<level>d for the decoder (Side 'd')
+	char Debug_Filename[110];
+	FILE *Debug_File;
+
+	sprintf(Debug_Filename, "%s.d%d%c", Filename, Level, Side);
+	printf("Writing debug information for level %d to file %s\n", Level, Debug_Filename);
+	if ((Debug_File = fopen(Debug_Filename, "wb")) == NULL) {
+		printf("Problem opening debug file %s\n", Debug_Filename); exit(1); }
+	return Debug_File;
+}
+
+unsigned char *Pack_Planes(const double *Double_Data, const int *Int_Data, int Rows, int Columns, int Chroma,
+	int Bytes, size_t *Size) {
+	// gathers the Y, U and V planes in memory, with Bytes bytes per sample (most
+	// significant first), as the debug files and the SRAM hold them; the planes are
+	// the encoder's (Double_Data) or the decoder's (Int_Data), the other one is NULL
+	int i, j, colour, Plane_Rows, Plane_Columns, Sample;
+	unsigned char *Buffer;
+
+	Buffer = (unsigned char *)malloc((size_t)Rows*Columns*2*Bytes);
+	*Size = 0;
+	Plane_Rows = Rows;
+	Plane_Columns = Columns;
+	for (colour = 0; colour < 3; colour++) {
+		for (i = 0; i < Plane_Rows; i++)
+			for (j = 0; j < Plane_Columns; j++) {
+				Sample = (Double_Data != NULL) ? (int)(Double_Data[YUV_index(Rows, Columns, i, j, colour)]) :
+					Int_Data[YUV_index(Rows, Columns, i, j, colour)];
+				if (Bytes == 2) Buffer[(*Size)++] = (Sample >> 8) & 0xFF;
+				Buffer[(*Size)++] = Sample & 0xFF;
+			}
+		if (colour == Y) {
+			Plane_Columns /= 2;
+			if (Chroma == CHROMA_420) Plane_Rows /= 2;
+		}
+	}
+	return Buffer;
+}
@@ -0,0 +1,227 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include "Coding.h"
+
+// Statistics of a compressed stream for -stats: the blocks are entropy decoded with the
+// decoder's Read_Coded_Block (no dequantization is needed and there is no IDCT), which
+// returns the bits of the block and the quantized coefficients in scan order, and counts
+// the fixed code symbols through the profiling counters (Profile.c).
+
+// the coefficient magnitudes are counted in classes of powers of two: 0, 1, 2..3,
+// 4..7, ..., 128..255 and 256 (the largest magnitude of a 9-bit coefficient)
+#define MAGNITUDE_CLASSES 10
+
+// the statistics of the Y, U or V segment
+typedef struct segment_stats_struct {
+	long Blocks;
+	unsigned long long Bits, Min_Bits, Max_Bits;
+	unsigned long long Symbols[4];
+	unsigned long long Coded_Length[65];   // blocks by the scan position of their last non-zero coefficient, plus one
+	unsigned long long Magnitudes[64][MAGNITUDE_CLASSES];
+	unsigned int *Block_Bits;
+} segment_stats;
+
+void Stream_Statistics(char *, char *);
+unsigned int Read_Coded_Block(FILE *, int [][8], int, int *, int *);
+void Seek_Bits(FILE *, unsigned long long);
+void Profile_Symbol_Counts(unsigned long long *);
+static int Magnitude_Class(int);
+static void Write_Bits_Map(char *, segment_stats *, int, int, int);
+static void Write_Statistics(char *, segment_stats *, int, int, int);
+
+
+void Stream_Statistics(char *Source_Filename, char *Map_Filename) {
+	// walks every block of Source_Filename.mic and writes the statistics to
+	// Source_Filename.stats.json and the bits of every block to Map_Filename.pgm
+	int i, j, k, colour, Compression_Format, Header_Format, Rows, Columns, Header_Bytes;
+	int Block_Rows, Block_Columns, Segment_Rows, Segment_Columns, Block_Quant, Last;
+	int Block_Data[8][8], Scanned_Block[65];
+	unsigned int Bits;
+	unsigned long long Offsets[3], Position, Symbols[4];
+	char Stats_Filename[120];
+	segment_stats Segments[3];
+	FILE *Source_File;
+
+	strcat(Source_Filename, ".mic");
+	if ((Source_File = fopen(Source_Filename, "rb")) == NULL) {
+		printf("Problem opening source compressed stream %s\n", Source_Filename); exit(1); }
+
+	// the header, as read by the decoder
+	fgetc(Source_File); fgetc(Source_File); fgetc(Source_File); // strip 0xECE744
+	Compression_Format = fgetc(Source_File);
+	Header_Format = FORMAT_HEADER(Compression_Format);
+	if ((Header_Format != HEADER_NARROW) && (Header_Format != HEADER_WIDE)) {
+		printf("Unrecognized header layout %d in %s\n", Header_Format, Source_Filename); exit(1); }
+	Rows = Columns = 0;
+	for (i = (Header_Format == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		Rows = (Rows << 8) | fgetc(Source_File);
+	for (i = (Header_Format == HEADER_WIDE) ? 4 : 2; i > 0; i--)
+		Columns = (Columns << 8) | fgetc(Source_File);
+	for (colour = 0; colour < 3; colour++) {
+		Offsets[colour] = 0;
+		for (i = (Header_Format == HEADER_WIDE) ? 7 : 3; i > 0; i--)
+			Offsets[colour] = (Offsets[colour] << 8) | (unsigned long long)fgetc(Source_File);
+		Offsets[colour] = 8*Offsets[colour] + (unsigned long long)fgetc(Source_File);
+	}
+	if ((Rows <= 0) || (Columns <= 0)) {
+		printf("Invalid image size %d x %d in %s\n", Columns, Rows, Source_Filename); exit(1); }
+	if (FORMAT_ENTROPY(Compression_Format) != ENTROPY_FIXED) {
+		printf("%s is arithmetic coded, statistics are gathered for the fixed codes only\n", Source_Filename); exit(1); }
+	if (FORMAT_SKIP(Compression_Format)) {
+		printf("%s is a frame of a sequence, its blocks depend on the frames before it\n", Source_Filename); exit(1); }
+	Header_Bytes = (Header_Format == HEADER_WIDE) ? 36 : 20;
+
+	Block_Rows = PADDED_ROWS(Rows, Compression_Format)/8;
+	Block_Columns = PADDED_COLUMNS(Columns)/8;
+	printf("Gathering the statistics of %s (%d x %d, format %d)\n", Source_Filename, Columns, Rows, Compression_Format);
+
+	// the segments follow each other without padding, from the end of the header
+	profile_enabled = 1;
+	Seek_Bits(Source_File, 8*(unsigned long long)Header_Bytes);
+	Position = 8*(unsigned long long)Header_Bytes;
+	for (colour = 0; colour < 3; colour++) {
+		Segment_Rows = ((colour != Y) && (FORMAT_CHROMA(Compression_Format) == CHROMA_420)) ? Block_Rows/2 : Block_Rows;
+		Segment_Columns = YUV_row_step(colour, Block_Columns);
+		memset(&Segments[colour], 0, sizeof(segment_stats));
+		Segments[colour].Blocks = (long)Segment_Rows*Segment_Columns;
+		Segments[colour].Min_Bits = ~0ULL;
+		Segments[colour].Block_Bits = (unsigned int *)malloc(Segments[colour].Blocks*sizeof(unsigned int));
+		if (Position != Offsets[colour])
+			fprintf(stdout, "Colour = %c\tEncoded bit offset = %llu\t!= Decoded bit offset = %llu\n",
+				(colour == 0) ? 'Y' : (colour == 1) ? 'U' : 'V', Offsets[colour], Position);
+		Profile_Symbol_Counts(Symbols);
+
+		for (i = 0; i < Segment_Rows; i++) {
+			Block_Quant = FORMAT_QUANT(Compression_Format);
+			for (j = 0; j < Segment_Columns; j++) {
+				Bits = Read_Coded_Block(Source_File, Block_Data, Compression_Format, &Block_Quant, Scanned_Block);
+				Segments[colour].Block_Bits[(long)i*Segment_Columns + j] = Bits;
+				Segments[colour].Bits += Bits;
+				if (Bits < Segments[colour].Min_Bits) Segments[colour].Min_Bits = Bits;
+				if (Bits > Segments[colour].Max_Bits) Segments[colour].Max_Bits = Bits;
+				for (k = 0, Last = -1; k < 64; k++) {
+					Segments[colour].Magnitudes[k][Magnitude_Class(Scanned_Block[k])]++;
+					if (Scanned_Block[k] != 0) Last = k;
+				}
+				Segments[colour].Coded_Length[Last + 1]++;
+			}
+		}
+
+		Profile_Symbol_Counts(Segments[colour].Symbols);
+		for (k = 0; k < 4; k++)
+			Segments[colour].Symbols[k] -= Symbols[k];
+		Position += Segments[colour].Bits;
+	}
+	profile_enabled = 0;
+	fclose(Source_File);
+
+	for (colour = 0; colour < 3; colour++)
+		printf("%c: %ld blocks, %llu bits (%.1f bits per block, %llu to %llu), ZERO_RUN %llu, CODE_3 %llu, CODE_9 %llu, BLOCK_END %llu\n",
+			(colour == 0) ? 'Y' : (colour == 1) ? 'U' : 'V', Segments[colour].Blocks, Segments[colour].Bits,
+			(double)Segments[colour].Bits/Segments[colour].Blocks, Segments[colour].Min_Bits, Segments[colour].Max_Bits,
+			Segments[colour].Symbols[ZERO_RUN], Segments[colour].Symbols[CODE_3],
+			Segments[colour].Symbols[CODE_9], Segments[colour].Symbols[BLOCK_END]);
+	printf("%.4f bits per pixel\n", (double)(Segments[Y].Bits + Segments[U].Bits + Segments[V].Bits)/((double)Rows*Columns));
+
+	// the input name has .mic appended, the outputs are named after the stream
+	Source_Filename[strlen(Source_Filename) - 4] = '\0';
+	sprintf(Stats_Filename, "%s.stats.json", Source_Filename);
+	Write_Statistics(Stats_Filename, Segments, Rows, Columns, Compression_Format);
+	Write_Bits_Map(Map_Filename, Segments, Block_Rows, Block_Columns, Compression_Format);
+
+	for (colour = 0; colour < 3; colour++)
+		free(Segments[colour].Block_Bits);
+}
+
+static int Magnitude_Class(int Value) {
+	// the class of the magnitude of a quantized coefficient
+	int Class = 0;
+
+	if (Value < 0) Value = -Value;
+	while ((Value > 0) && (Class < MAGNITUDE_CLASSES - 1)) {
+		Value >>= 1;
+		Class++;
+	}
+	return Class;
+}
+
+static void Write_Bits_Map(char *Filename, segment_stats *Segments, int Block_Rows, int Block_Columns,
+	int Compression_Format
+) {
+	// writes the bits spent on every 8x8 Y block as a .pgm image with one pixel per block,
+	// scaled to the largest one; a block holds its Y bits and its share of the U and V
+	// blocks covering it (a chroma block covers two Y blocks, four in 4:2:0)
+	int i, j, Chroma_Row, Share;
+	long Chroma_Block;
+	unsigned long long Max_Bits = 1, *Bits;
+	FILE *Map_File;
+
+	Share = (FORMAT_CHROMA(Compression_Format) == CHROMA_420) ? 4 : 2;
+	Bits = (unsigned long long *)malloc((size_t)Block_Rows*Block_Columns*sizeof(unsigned long long));
+	for (i = 0; i < Block_Rows; i++)
+		for (j = 0; j < Block_Columns; j++) {
+			Chroma_Row = (Share == 4) ? i/2 : i;
+			Chroma_Block = (long)Chroma_Row*(Block_Columns/2) + j/2;
+			Bits[(long)i*Block_Columns + j] = Segments[Y].Block_Bits[(long)i*Block_Columns + j] +
+				(Segments[U].Block_Bits[Chroma_Block] + Segments[V].Block_Bits[Chroma_Block] + Share/2)/Share;
+			if (Bits[(long)i*Block_Columns + j] > Max_Bits) Max_Bits = Bits[(long)i*Block_Columns + j];
+		}
+
+	strcat(Filename, ".pgm");
+	if ((Map_File = fopen(Filename, "wb")) == NULL) {
+		printf("Problem opening bits map file %s\n", Filename); exit(1); }
+	fprintf(Map_File, "P5\n%d %d\n255\n", Block_Columns, Block_Rows);
+	for (i = 0; i < Block_Rows*Block_Columns; i++)
+		fputc((int)((255*Bits[i] + Max_Bits/2)/Max_Bits), Map_File);
+	fclose(Map_File);
+	free(Bits);
+	printf("Wrote the %d x %d map of the bits per block (255 is %llu bits) to %s\n",
+		Block_Columns, Block_Rows, Max_Bits, Filename);
+}
+
+static void Write_Statistics(char *Filename, segment_stats *Segments, int Rows, int Columns, int Compression_Format) {
+	// writes the statistics of the three segments as JSON
+	const char *Symbol_Names[4] = { "ZERO_RUN", "CODE_9", "CODE_3", "BLOCK_END" };
+	int colour, k, m;
+	FILE *Json_File;
+
+	if ((Json_File = fopen(Filename, "w")) == NULL) {
+		printf("Problem opening statistics file %s\n", Filename); exit(1); }
+	fprintf(Json_File, "{\n  \"columns\": %d,\n  \"rows\": %d,\n  \"format\": %d,\n", Columns, Rows, Compression_Format);
+	// the scan order of the coefficients (as positions in the 8x8 block, in rows)
+	fprintf(Json_File, "  \"scan_pattern\": [");
+	for (k = 0; k < 64; k++)
+		fprintf(Json_File, "%s%d", (k) ? ", " : " ", Scan_Pattern[k]);
+	fprintf(Json_File, " ],\n");
+	fprintf(Json_File, "  \"magnitude_classes\": [ \"0\", \"1\", \"2-3\", \"4-7\", \"8-15\", \"16-31\", \"32-63\", \"64-127\", \"128-255\", \"256\" ],\n");
+	fprintf(Json_File, "  \"components\": {\n");
+	for (colour = 0; colour < 3; colour++) {
+		fprintf(Json_File, "    \"%c\": {\n", (colour == 0) ? 'Y' : (colour == 1) ? 'U' : 'V');
+		fprintf(Json_File, "      \"blocks\": %ld,\n      \"bits\": %llu,\n", Segments[colour].Blocks, Segments[colour].Bits);
+		fprintf(Json_File, "      \"bits_per_block\": %.4f,\n      \"min_block_bits\": %llu,\n      \"max_block_bits\": %llu,\n",
+			(double)Segments[colour].Bits/Segments[colour].Blocks, Segments[colour].Min_Bits, Segments[colour].Max_Bits);
+		fprintf(Json_File, "      \"symbols\": {");
+		for (k = 0; k < 4; k++)
+			fprintf(Json_File, " \"%s\": %llu%s", Symbol_Names[k], Segments[colour].Symbols[k], (k < 3) ? "," : " },\n");
+		// entry n counts the blocks whose last non-zero coefficient is at scan position n - 1
+		fprintf(Json_File, "      \"last_nonzero_plus_one\": [");
+		for (k = 0; k <= 64; k++)
+			fprintf(Json_File, "%s%llu", (k) ? ", " : " ", Segments[colour].Coded_Length[k]);
+		fprintf(Json_File, " ],\n      \"magnitudes\": [\n");
+		for (k = 0; k < 64; k++) {
+			fprintf(Json_File, "        [");
+			for (m = 0; m < MAGNITUDE_CLASSES; m++)
+				fprintf(Json_File, "%s%llu", (m) ? ", " : " ", Segments[colour].Magnitudes[k][m]);
+			fprintf(Json_File, " ]%s\n", (k < 63) ? "," : "");
+		}
+		fprintf(Json_File, "      ]\n    }%s\n", (colour < 2) ? "," : "");
+	}
+	fprintf(Json_File, "  }\n}\n");
+	fclose(Json_File);
+	printf("Wrote the statistics to %s\n", Filename);
+}
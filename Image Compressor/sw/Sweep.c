@@ -0,0 +1,296 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Fixed-point precision sweep for "make sweep": the precision of the codec is set at
+// compile time (Precision.h), so every precision point is a build of Project of its
+// own (the "point" target of the Makefile, run from the sw directory). The points are
+// built and run in parallel, each encodes and decodes the bundled images at every
+// quantization format, and the PSNR, the size and the multiplier widths implied by the
+// point are written as one JSON object per line.
+
+#define MAX_SWEEP_POINTS 64
+
+// a precision point, as DCT_COEFF_BITS:DCT_PASS_BITS:COLOUR_BITS
+typedef struct sweep_point_struct {
+	int Coeff_Bits, Pass_Bits, Colour_Bits;
+} sweep_point;
+
+// the default points: the hardware precision, then each width varied on its own
+static const sweep_point Default_Points[] = {
+	{ 12, 4, 16 },
+	{ 8, 4, 16 }, { 9, 4, 16 }, { 10, 4, 16 }, { 11, 4, 16 }, { 13, 4, 16 }, { 14, 4, 16 },
+	{ 12, 0, 16 }, { 12, 1, 16 }, { 12, 2, 16 }, { 12, 3, 16 }, { 12, 5, 16 }, { 12, 6, 16 },
+	{ 12, 4, 8 }, { 12, 4, 10 }, { 12, 4, 12 }, { 12, 4, 14 }, { 12, 4, 18 } };
+#define NUM_DEFAULT_POINTS 18
+
+// the multiplier operands implied by a point, in bits (signed): the coefficient and the
+// widest data operand of the DCT and of the IDCT, and of the two colourspace conversions
+typedef struct multiplier_widths_struct {
+	int DCT_Coeff, DCT_Data, IDCT_Coeff, IDCT_Data, RGB_Coeff, RGB_Data, YUV_Coeff, YUV_Data;
+} multiplier_widths;
+
+static char Work_Directory[32];
+static const char *Image_Names[] = { "fireball", "fractal1", "fractal2", "motorcycle" };
+static int Image_Present[4];
+static int Formats[3], Num_Formats;
+
+void Parse_bmp(char *, char *);
+static int Signed_Bits(long);
+static long Colour_Coeff(long, int);
+static void Multiplier_Widths(const sweep_point *, multiplier_widths *);
+static int Run_Point(const sweep_point *, int);
+
+
+int main(int argc, char *argv[]) {
+	// Sweep [-data directory] [-formats q,q,...] [-jobs count] [-out file] [point ...]
+	// builds the codec at every precision point and reports the PSNR and size of the
+	// bundled images and the implied multiplier widths
+	sweep_point Points[MAX_SWEEP_POINTS];
+	char Data_Directory[100], Format_List[20], Filename[200], Bmp_Filename[200], *Output_Filename, *Item;
+	int i, k, valid, Num_Points, Num_Jobs, Running, Status, Failed;
+	pid_t Child;
+	FILE *Results_File, *Point_File, *Bmp_File;
+
+	strcpy(Data_Directory, "../data");
+	strcpy(Format_List, "0,1,2");
+	Output_Filename = NULL;
+	Num_Jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	Num_Points = 0;
+	valid = 1;
+	for (i = 1; valid && (i < argc); i++) {
+		if (!strcmp(argv[i], "-data") && (i + 1 < argc)) sscanf(argv[++i], "%99s", Data_Directory);
+		else if (!strcmp(argv[i], "-formats") && (i + 1 < argc)) sscanf(argv[++i], "%19s", Format_List);
+		else if (!strcmp(argv[i], "-jobs") && (i + 1 < argc)) valid = (sscanf(argv[++i], "%d", &Num_Jobs) == 1) && (Num_Jobs > 0);
+		else if (!strcmp(argv[i], "-out") && (i + 1 < argc)) Output_Filename = argv[++i];
+		else if (Num_Points < MAX_SWEEP_POINTS) {
+			valid = (sscanf(argv[i], "%d:%d:%d", &Points[Num_Points].Coeff_Bits, &Points[Num_Points].Pass_Bits,
+				&Points[Num_Points].Colour_Bits) == 3);
+			Num_Points++;
+		} else valid = 0;
+	}
+	Num_Formats = 0;
+	for (Item = strtok(Format_List, ","); valid && (Item != NULL); Item = strtok(NULL, ","))
+		valid = (Num_Formats < 3) && (sscanf(Item, "%d", &Formats[Num_Formats]) == 1) &&
+			(Formats[Num_Formats] >= 0) && (Formats[Num_Formats++] <= 2);
+	if (!valid || (Num_Formats == 0)) {
+		printf("\nFormat for the precision sweep: Sweep [-data directory] [-formats q,q,...] [-jobs count]\n");
+		printf("                                     [-out file] [point ...]\n");
+		printf("   a point is DCT_COEFF_BITS:DCT_PASS_BITS:COLOUR_BITS (i.e. 12:4:16, the precision of\n");
+		printf("   the hardware), the fraction bits of the DCT coefficients, of the first pass of the\n");
+		printf("   transform and of the colourspace matrices (see Precision.h); without points the\n");
+		printf("   hardware precision and each width varied on its own are swept\n");
+		printf("   Project is built at every point (make point, from the sw directory) and encodes and\n");
+		printf("   decodes the .bmp images of directory (../data by default) with the quantization\n");
+		printf("   formats of the list (0,1,2 by default), count points at a time (one per processor\n");
+		printf("   by default); the PSNR, the size and the multiplier widths of every point, image and\n");
+		printf("   format are written as one JSON object per line to file (or to the standard output)\n\n");
+		return 1;
+	}
+	if (Num_Points == 0) {
+		memcpy(Points, Default_Points, sizeof(Default_Points));
+		Num_Points = NUM_DEFAULT_POINTS;
+	}
+
+	// the results go to the standard output, or to a file, and the codec output to /dev/null
+	if (Output_Filename != NULL) {
+		if ((Results_File = fopen(Output_Filename, "w")) == NULL) {
+			printf("Problem opening results file %s\n", Output_Filename); exit(1); }
+	} else Results_File = fdopen(dup(fileno(stdout)), "w");
+	fflush(stdout);
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		fprintf(stderr, "Problem redirecting the codec output\n"); exit(1); }
+
+	strcpy(Work_Directory, "/tmp/mic_sweep_XXXXXX");
+	if (mkdtemp(Work_Directory) == NULL) {
+		fprintf(stderr, "Problem creating a work directory\n"); exit(1); }
+
+	// the bundled images (those that are in the data directory), parsed once
+	for (i = 0; i < 4; i++) {
+		sprintf(Bmp_Filename, "%s/%s.bmp", Data_Directory, Image_Names[i]);
+		if ((Image_Present[i] = ((Bmp_File = fopen(Bmp_Filename, "rb")) != NULL)) == 0) continue;
+		fclose(Bmp_File);
+		sprintf(Bmp_Filename, "%s/%s", Data_Directory, Image_Names[i]);
+		sprintf(Filename, "%s/%s", Work_Directory, Image_Names[i]);
+		Parse_bmp(Bmp_Filename, Filename);
+	}
+	fflush(stdout);
+	fflush(Results_File);
+
+	// the points run in their own processes, Num_Jobs at a time
+	Running = Failed = 0;
+	for (k = 0; k < Num_Points; k++) {
+		if (Running == Num_Jobs) {
+			wait(&Status);
+			Failed |= !WIFEXITED(Status) || WEXITSTATUS(Status);
+			Running--;
+		}
+		if ((Child = fork()) < 0) {
+			fprintf(stderr, "Problem starting the process of point %d\n", k); exit(1); }
+		if (Child == 0) exit(Run_Point(&Points[k], k));
+		Running++;
+	}
+	for (; Running > 0; Running--) {
+		wait(&Status);
+		Failed |= !WIFEXITED(Status) || WEXITSTATUS(Status);
+	}
+
+	// the results, in the order of the points
+	for (k = 0; k < Num_Points; k++) {
+		sprintf(Filename, "%s/point_%d.json", Work_Directory, k);
+		if ((Point_File = fopen(Filename, "r")) == NULL) continue;
+		while (fgets(Bmp_Filename, sizeof(Bmp_Filename), Point_File) != NULL)
+			fputs(Bmp_Filename, Results_File);
+		fclose(Point_File);
+		remove(Filename);
+	}
+	for (i = 0; i < 4; i++) {
+		sprintf(Filename, "%s/%s.ppm", Work_Directory, Image_Names[i]);
+		remove(Filename);
+	}
+	rmdir(Work_Directory);
+	fclose(Results_File);
+	if (Failed) fprintf(stderr, "Some precision points could not be built or run\n");
+	return Failed;
+}
+
+static int Signed_Bits(long Magnitude) {
+	// the bits of a signed operand holding -Magnitude .. Magnitude
+	int Bits = 1;
+
+	while (Magnitude >= (1L << (Bits - 1))) Bits++;
+	return Bits;
+}
+
+static long Colour_Coeff(long Coeff, int Colour_Bits) {
+	// COLOUR_COEFF of Precision.h, for the bits of a point
+	if (Colour_Bits >= 16) return Coeff << (Colour_Bits - 16);
+	return (Coeff + (1L << (15 - Colour_Bits))) >> (16 - Colour_Bits);
+}
+
+static void Multiplier_Widths(const sweep_point *Point, multiplier_widths *Widths) {
+	// the operands of the multipliers at a point: the transform coefficients as set by
+	// Init_DCT_Coeffs, and the largest data of each pass (8-bit samples, butterflies of
+	// the samples in the DCT as DCT.sv does, 9-bit coefficients times the largest
+	// quantization step, 64, in the IDCT)
+	long Coeffs[8][8], Max_Coeff = 0, Row_Sum, Max_Row_Sum = 0, Column_Sum, Max_Column_Sum = 0;
+	long Pass_Data;
+	int i, j;
+	double s;
+
+	for (i = 0; i < 8; i++) {
+		s = (i == 0) ? sqrt(1.0 / 8.0) : sqrt(2.0 / 8.0);
+		for (j = 0; j < 8; j++) {
+			Coeffs[i][j] = (long)(s*cos((M_PI/8.0)*i*(j + 0.5))*(double)(1 << Point->Coeff_Bits));
+			if (labs(Coeffs[i][j]) > Max_Coeff) Max_Coeff = labs(Coeffs[i][j]);
+		}
+	}
+	for (i = 0; i < 8; i++) {
+		for (j = 0, Row_Sum = Column_Sum = 0; j < 8; j++) {
+			Row_Sum += labs(Coeffs[i][j]);
+			Column_Sum += labs(Coeffs[j][i]);
+		}
+		if (Row_Sum > Max_Row_Sum) Max_Row_Sum = Row_Sum;
+		if (Column_Sum > Max_Column_Sum) Max_Column_Sum = Column_Sum;
+	}
+
+	// DCT: the butterflies of the samples, then of the results of the first pass
+	Widths->DCT_Coeff = Signed_Bits(Max_Coeff);
+	Pass_Data = 2*((255*Max_Row_Sum) >> (Point->Coeff_Bits - Point->Pass_Bits));
+	Widths->DCT_Data = (Signed_Bits(Pass_Data) > Signed_Bits(2*255)) ? Signed_Bits(Pass_Data) : Signed_Bits(2*255);
+
+	// IDCT: the dequantized coefficients, then the results of the first pass
+	Widths->IDCT_Coeff = Widths->DCT_Coeff;
+	Pass_Data = (256*64*Max_Column_Sum) >> (Point->Coeff_Bits - Point->Pass_Bits);
+	Widths->IDCT_Data = (Signed_Bits(Pass_Data) > Signed_Bits(256*64)) ? Signed_Bits(Pass_Data) : Signed_Bits(256*64);
+
+	// the colourspace conversions: the largest coefficients (33030 and 132251 at 16 bits)
+	// times the 8-bit RGB samples, and the Y, U, V samples less their offsets
+	Widths->RGB_Coeff = Signed_Bits(Colour_Coeff(33030, Point->Colour_Bits));
+	Widths->RGB_Data = Signed_Bits(255);
+	Widths->YUV_Coeff = Signed_Bits(Colour_Coeff(132251, Point->Colour_Bits));
+	Widths->YUV_Data = Signed_Bits(255 - 16);
+}
+
+static int Run_Point(const sweep_point *Point, int Index) {
+	// builds Project at the point, encodes, decodes and compares every image at every
+	// format, and writes the results to Work_Directory/point_Index.json
+	multiplier_widths Widths;
+	char Binary[80], Name[100], Command[600], Line[200], Filename[200];
+	int i, f, Widest;
+	long Pixels;
+	double PSNR;
+	struct stat File_Status;
+	FILE *Point_File, *Compare_Output;
+
+	sprintf(Binary, "%s/Project_%d_%d_%d", Work_Directory, Point->Coeff_Bits, Point->Pass_Bits, Point->Colour_Bits);
+	sprintf(Command, "make -s point PRECISION=\"-DDCT_COEFF_BITS=%d -DDCT_PASS_BITS=%d -DCOLOUR_BITS=%d\" POINT_BINARY=%s > /dev/null 2>&1",
+		Point->Coeff_Bits, Point->Pass_Bits, Point->Colour_Bits, Binary);
+	if (system(Command) != 0) {
+		fprintf(stderr, "Problem building point %d:%d:%d\n", Point->Coeff_Bits, Point->Pass_Bits, Point->Colour_Bits);
+		return 1;
+	}
+
+	Multiplier_Widths(Point, &Widths);
+	Widest = Widths.DCT_Coeff + Widths.DCT_Data;
+	if (Widths.IDCT_Coeff + Widths.IDCT_Data > Widest) Widest = Widths.IDCT_Coeff + Widths.IDCT_Data;
+	if (Widths.RGB_Coeff + Widths.RGB_Data > Widest) Widest = Widths.RGB_Coeff + Widths.RGB_Data;
+	if (Widths.YUV_Coeff + Widths.YUV_Data > Widest) Widest = Widths.YUV_Coeff + Widths.YUV_Data;
+
+	sprintf(Filename, "%s/point_%d.json", Work_Directory, Index);
+	if ((Point_File = fopen(Filename, "w")) == NULL) {
+		fprintf(stderr, "Problem opening %s\n", Filename); return 1; }
+	for (i = 0; i < 4; i++)
+		for (f = 0; Image_Present[i] && (f < Num_Formats); f++) {
+			sprintf(Name, "%s_%d", Binary, i*3 + Formats[f]);
+			sprintf(Command, "%s -encode %s/%s %d %s > /dev/null && %s -decode %s %s > /dev/null",
+				Binary, Work_Directory, Image_Names[i], Formats[f], Name, Binary, Name, Name);
+			if (system(Command) != 0) {
+				fprintf(stderr, "Problem coding %s at point %d:%d:%d\n", Image_Names[i],
+					Point->Coeff_Bits, Point->Pass_Bits, Point->Colour_Bits);
+				fclose(Point_File); return 1;
+			}
+
+			// the PSNR of R, G and B together, from the comparison
+			sprintf(Command, "%s -compare %s/%s %s_sw", Binary, Work_Directory, Image_Names[i], Name);
+			Pixels = 0; PSNR = 0.0;
+			if ((Compare_Output = popen(Command, "r")) != NULL) {
+				while (fgets(Line, sizeof(Line), Compare_Output) != NULL)
+					sscanf(Line, "Compared %ld pixels, PSNR: %lf", &Pixels, &PSNR);
+				pclose(Compare_Output);
+			}
+			sprintf(Filename, "%s.mic", Name);
+			if ((Pixels == 0) || (stat(Filename, &File_Status) != 0)) {
+				fprintf(stderr, "Problem comparing %s at point %d:%d:%d\n", Image_Names[i],
+					Point->Coeff_Bits, Point->Pass_Bits, Point->Colour_Bits);
+				fclose(Point_File); return 1;
+			}
+
+			fprintf(Point_File, "{\"dct_coeff_bits\": %d, \"dct_pass_bits\": %d, \"colour_bits\": %d, \"image\": \"%s\", "
+				"\"format\": %d, \"bytes\": %ld, \"bits_per_pixel\": %.6f, \"psnr\": %.4f, ",
+				Point->Coeff_Bits, Point->Pass_Bits, Point->Colour_Bits, Image_Names[i], Formats[f],
+				(long)File_Status.st_size, 8.0*File_Status.st_size/Pixels, PSNR);
+			fprintf(Point_File, "\"dct_multiplier\": [%d, %d], \"idct_multiplier\": [%d, %d], "
+				"\"rgb_yuv_multiplier\": [%d, %d], \"yuv_rgb_multiplier\": [%d, %d], \"widest_product\": %d}\n",
+				Widths.DCT_Coeff, Widths.DCT_Data, Widths.IDCT_Coeff, Widths.IDCT_Data,
+				Widths.RGB_Coeff, Widths.RGB_Data, Widths.YUV_Coeff, Widths.YUV_Data, Widest);
+
+			remove(Filename);
+			sprintf(Filename, "%s_sw.ppm", Name);
+			remove(Filename);
+		}
+	fclose(Point_File);
+	remove(Binary);
+	return 0;
+}
@@ -0,0 +1,422 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include "Coding.h"
+
+// image data type
+typedef struct image_struct {
+	int Rows, Columns;
+	int *Pixel_Data;
+} image;
+
+// the JPEG file is assembled in memory and written at the end
+typedef struct jpeg_stream_struct {
+	unsigned char *Data;
+	size_t Size, Capacity;
+	unsigned int Bit_Buffer;
+	int Bit_Count;
+} jpeg_stream;
+
+// a Huffman table of the JPEG stream: the number of codes of each length (1 to 16)
+// and the symbols in order of increasing code length, as in the DHT segment, and the
+// code and length of every symbol, derived from them
+typedef struct huffman_table_struct {
+	const unsigned char *Bits, *Values;
+	unsigned short Code[256];
+	unsigned char Length[256];
+} huffman_table;
+
+// the typical Huffman tables of ITU-T T.81 Annex K (luminance DC and AC, chrominance DC and AC)
+static const unsigned char DC_Luminance_Bits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char DC_Chrominance_Bits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char DC_Values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const unsigned char AC_Luminance_Bits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const unsigned char AC_Luminance_Values[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa };
+
+static const unsigned char AC_Chrominance_Bits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char AC_Chrominance_Values[162] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa };
+
+// the example quantization tables of ITU-T T.81 Annex K (in natural order), used with -quality
+static const int JPEG_Luminance_Quant[64] = {
+	16, 11, 10, 16,  24,  40,  51,  61,  12, 12, 14, 19,  26,  58,  60,  55,
+	14, 13, 16, 24,  40,  57,  69,  56,  14, 17, 22, 29,  51,  87,  80,  62,
+	18, 22, 37, 56,  68, 109, 103,  77,  24, 35, 55, 64,  81, 104, 113,  92,
+	49, 64, 78, 87, 103, 121, 120, 101,  72, 92, 95, 98, 112, 100, 103,  99 };
+static const int JPEG_Chrominance_Quant[64] = {
+	17, 18, 24, 47, 99, 99, 99, 99,  18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99,  47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99 };
+
+// the .mic samples are studio range (Y in 16..235, U and V in 16..240 around 128) and
+// JFIF samples are full range; since the DCT is linear the range is mapped on the
+// coefficients: the AC coefficients are scaled by the gain of the component and the
+// DC coefficient is also shifted (JPEG codes samples less 128, the .mic DCT does not)
+#define LUMINANCE_GAIN   (255.0/219.0)
+#define CHROMINANCE_GAIN (255.0/224.0)
+
+void Transcode_JPEG(char *, char *, int, int);
+int  Lossless_Dequant_IDCT(char *, image *, int, int, int);
+void Stream_Header(int *, int *, int *);
+int  Quant_Val(int, int);
+void Block_IDCT(int [][8]);
+void Init_DCT_Coeffs(void);
+void Block_DCT(double [][8]);
+static void Centre_Chroma_Plane(image *, int, int, int);
+static void Build_Quant_Table(int *, int, int, int);
+static void Build_Huffman_Table(huffman_table *, const unsigned char *, const unsigned char *);
+static void Encode_JPEG_Block(jpeg_stream *, const int *, long, int, const int *, int,
+	int *, huffman_table *, huffman_table *);
+static void Put_Byte(jpeg_stream *, int);
+static void Put_Marker_Segment(jpeg_stream *, int, const unsigned char *, int);
+static void Put_Bits(jpeg_stream *, unsigned int, int);
+static void Flush_Bits(jpeg_stream *);
+
+
+void Transcode_JPEG(char *Source_Filename, char *Destination_Filename, int Quality, int Centre_Chroma) {
+	// transcodes a .mic stream to a baseline JFIF file: the dequantized coefficients of
+	// every block are requantized to the JPEG quantization tables and Huffman coded, in
+	// MCUs of two Y blocks and one U and one V block (four Y blocks in 4:2:0); there is
+	// no IDCT, colourspace conversion or DCT, and the JPEG decoder does the interpolation;
+	// the .mic U and V samples are sited on the even columns (and rows in 4:2:0) of Y and
+	// JFIF ones halfway between, so the JPEG chroma is half a Y pixel right (and down) of
+	// the decoded one, unless Centre_Chroma resamples U and V (Centre_Chroma_Plane)
+	image Source_Image;
+	int i, j, k, colour, Rows, Columns, Compression_Format, Chroma_Rows;
+	int Quant_Table[2][64], Predictor[3];
+	unsigned char Segment[1 + 16 + 256], *Byte;
+	huffman_table DC_Table[2], AC_Table[2];
+	jpeg_stream Stream;
+	FILE *Destination_File;
+
+	strcat(Source_Filename, ".mic");
+	strcat(Destination_Filename, ".jpg");
+	printf("Transcoding file %s to JPEG image %s\n", Source_Filename, Destination_Filename);
+
+	// dequantized coefficients of every block, in the place of the block
+	if (Lossless_Dequant_IDCT(Source_Filename, &Source_Image, 3, 1, 0)) exit(1);
+	Stream_Header(&Rows, &Columns, &Compression_Format);
+	if ((Rows > 65535) || (Columns > 65535)) {
+		printf("Image of %d x %d pixels is too large for a JPEG file\n", Columns, Rows); exit(1); }
+	Chroma_Rows = (FORMAT_CHROMA(Compression_Format) == CHROMA_420) ? Source_Image.Rows/2 : Source_Image.Rows;
+	if (Centre_Chroma) {
+		Centre_Chroma_Plane(&Source_Image, U, Chroma_Rows, FORMAT_CHROMA(Compression_Format));
+		Centre_Chroma_Plane(&Source_Image, V, Chroma_Rows, FORMAT_CHROMA(Compression_Format));
+	}
+
+	// quantization tables: the matrix of the format in the stream header scaled by the
+	// range gain (with adaptive quantization the blocks coded with a coarser matrix are
+	// requantized to it too), or the JPEG tables of Quality
+	Build_Quant_Table(Quant_Table[0], Compression_Format, Quality, Y);
+	Build_Quant_Table(Quant_Table[1], Compression_Format, Quality, U);
+	Build_Huffman_Table(&DC_Table[0], DC_Luminance_Bits, DC_Values);
+	Build_Huffman_Table(&AC_Table[0], AC_Luminance_Bits, AC_Luminance_Values);
+	Build_Huffman_Table(&DC_Table[1], DC_Chrominance_Bits, DC_Values);
+	Build_Huffman_Table(&AC_Table[1], AC_Chrominance_Bits, AC_Chrominance_Values);
+
+	// the coded data takes less room than the coefficients, the buffer still grows if needed
+	Stream.Capacity = (size_t)Source_Image.Rows*Source_Image.Columns + 4096;
+	Stream.Data = (unsigned char *)malloc(Stream.Capacity);
+	Stream.Size = 0;
+	Stream.Bit_Buffer = 0;
+	Stream.Bit_Count = 0;
+
+	// start of image and JFIF header (version 1.01, no density, no thumbnail)
+	Put_Byte(&Stream, 0xFF); Put_Byte(&Stream, 0xD8);
+	Put_Marker_Segment(&Stream, 0xE0, (const unsigned char *)"JFIF\0\1\1\0\0\1\0\1\0\0", 14);
+
+	// quantization tables (8-bit, in zigzag order)
+	for (i = 0; i < 2; i++) {
+		Segment[0] = i;
+		for (k = 0; k < 64; k++)
+			Segment[1 + k] = Quant_Table[i][Scan_Pattern[k]];
+		Put_Marker_Segment(&Stream, 0xDB, Segment, 65);
+	}
+
+	// frame header: 8-bit samples, Y sampled 2x1 (2x2 in 4:2:0), U and V 1x1
+	Byte = Segment;
+	*Byte++ = 8;
+	*Byte++ = Rows >> 8; *Byte++ = Rows & 0xFF;
+	*Byte++ = Columns >> 8; *Byte++ = Columns & 0xFF;
+	*Byte++ = 3;
+	for (colour = 0; colour < 3; colour++) {
+		*Byte++ = colour + 1;
+		*Byte++ = (colour != Y) ? 0x11 : (FORMAT_CHROMA(Compression_Format) == CHROMA_420) ? 0x22 : 0x21;
+		*Byte++ = (colour == Y) ? 0 : 1;
+	}
+	Put_Marker_Segment(&Stream, 0xC0, Segment, Byte - Segment);
+
+	// Huffman tables
+	for (i = 0; i < 2; i++) {
+		for (k = 0; k < 2; k++) {
+			huffman_table *Table = (k == 0) ? &DC_Table[i] : &AC_Table[i];
+			int Num_Values = 0;
+			Byte = Segment;
+			*Byte++ = (k << 4) | i;
+			for (j = 0; j < 16; j++) {
+				*Byte++ = Table->Bits[j];
+				Num_Values += Table->Bits[j];
+			}
+			for (j = 0; j < Num_Values; j++)
+				*Byte++ = Table->Values[j];
+			Put_Marker_Segment(&Stream, 0xC4, Segment, Byte - Segment);
+		}
+	}
+
+	// scan header: all three components, full spectral range, no approximation
+	Byte = Segment;
+	*Byte++ = 3;
+	for (colour = 0; colour < 3; colour++) {
+		*Byte++ = colour + 1;
+		*Byte++ = (colour == Y) ? 0x00 : 0x11;
+	}
+	*Byte++ = 0; *Byte++ = 63; *Byte++ = 0;
+	Put_Marker_Segment(&Stream, 0xDA, Segment, Byte - Segment);
+
+	// entropy coded data, in MCUs of 16 columns and 8 rows (16 rows in 4:2:0); the
+	// padded image is a whole number of MCUs
+	Predictor[Y] = Predictor[U] = Predictor[V] = 0;
+	for (i = 0; i < Chroma_Rows/8; i++) {
+		for (j = 0; j < Source_Image.Columns/16; j++) {
+			for (k = 0; k < ((FORMAT_CHROMA(Compression_Format) == CHROMA_420) ? 4 : 2); k++)
+				Encode_JPEG_Block(&Stream, Source_Image.Pixel_Data,
+					YUV_index(Source_Image.Rows, Source_Image.Columns,
+						8*(((FORMAT_CHROMA(Compression_Format) == CHROMA_420) ? 2*i : i) + k/2), 16*j + 8*(k%2), Y),
+					Source_Image.Columns, Quant_Table[0], Y,
+					&Predictor[Y], &DC_Table[0], &AC_Table[0]);
+			for (colour = U; colour <= V; colour++)
+				Encode_JPEG_Block(&Stream, Source_Image.Pixel_Data,
+					YUV_index(Source_Image.Rows, Source_Image.Columns, 8*i, 8*j, colour),
+					YUV_row_step(colour, Source_Image.Columns), Quant_Table[1], colour,
+					&Predictor[colour], &DC_Table[1], &AC_Table[1]);
+		}
+	}
+	Flush_Bits(&Stream);
+
+	// end of image
+	Put_Byte(&Stream, 0xFF); Put_Byte(&Stream, 0xD9);
+
+	if ((Destination_File = fopen(Destination_Filename, "wb")) == NULL) {
+		printf("Problem opening output JPEG file %s\n", Destination_Filename); exit(1); }
+	if (fwrite(Stream.Data, 1, Stream.Size, Destination_File) != Stream.Size) {
+		printf("Problem writing output JPEG file %s\n", Destination_Filename); exit(1); }
+	fclose(Destination_File);
+	printf("Wrote %d x %d JPEG image (%s), %lu bytes\n", Columns, Rows,
+		(FORMAT_CHROMA(Compression_Format) == CHROMA_420) ? "4:2:0" : "4:2:2", (unsigned long)Stream.Size);
+
+	free(Stream.Data);
+}
+
+static void Centre_Chroma_Plane(image *Source_Image, int colour, int Chroma_Rows, int Chroma) {
+	// for -centre-chroma, moves the plane from the .mic siting to the JFIF one: the plane
+	// is decoded, interpolated as by Interpolate_Colourspace, and every sample of the
+	// result is the mean of the sample at its .mic position and the interpolated one
+	// after it, and the blocks are transformed back in place (the coefficients are not
+	// quantized again)
+	int i, j, k, t, r, Rows, Columns, Plane_Columns, Block_Data[8][8];
+	int *Samples, *Centred, *Full_Row;
+	const int *Window[6];
+	short *Chroma_Scratch;
+	double Coefficients[8][8];
+
+	Rows = Source_Image->Rows;
+	Columns = Source_Image->Columns;
+	Plane_Columns = Columns/2;
+	Samples = (int *)malloc((size_t)2*Chroma_Rows*Plane_Columns*sizeof(int));
+	Centred = Samples + (long)Chroma_Rows*Plane_Columns;
+	Full_Row = (int *)malloc((size_t)Columns*sizeof(int));
+	Chroma_Scratch = (short *)malloc(CHROMA_SCRATCH_SIZE(Columns)*sizeof(short));
+
+	for (i = 0; i < Chroma_Rows/8; i++)
+		for (j = 0; j < Plane_Columns/8; j++) {
+			for (k = 0; k < 64; k++)
+				Block_Data[k/8][k%8] = Source_Image->Pixel_Data[YUV_index(Rows, Columns, 8*i + k/8, 8*j + k%8, colour)];
+			Block_IDCT(Block_Data);
+			for (k = 0; k < 64; k++)
+				Samples[(long)(8*i + k/8)*Plane_Columns + 8*j + k%8] = Block_Data[k/8][k%8];
+		}
+
+	// along the rows, then (in 4:2:0) along the columns
+	for (i = 0; i < Chroma_Rows; i++) {
+		Upsample_Chroma_Row(&Samples[(long)i*Plane_Columns], Full_Row, Columns, Chroma_Scratch);
+		for (j = 0; j < Plane_Columns; j++)
+			Centred[(long)i*Plane_Columns + j] = (Full_Row[2*j] + Full_Row[2*j + 1] + 1) >> 1;
+	}
+	if (Chroma == CHROMA_420) {
+		memcpy(Samples, Centred, (size_t)Chroma_Rows*Plane_Columns*sizeof(int));
+		for (i = 0; i < Chroma_Rows; i++) {
+			for (t = 0; t < 6; t++) {
+				r = i - 2 + t;
+				r = (r < 0) ? 0 : (r > Chroma_Rows - 1) ? Chroma_Rows - 1 : r;
+				Window[t] = &Samples[(long)r*Plane_Columns];
+			}
+			Upsample_Chroma_Column(Window, Full_Row, Plane_Columns);
+			for (j = 0; j < Plane_Columns; j++)
+				Centred[(long)i*Plane_Columns + j] = (Samples[(long)i*Plane_Columns + j] + Full_Row[j] + 1) >> 1;
+		}
+	}
+
+	Init_DCT_Coeffs();
+	for (i = 0; i < Chroma_Rows/8; i++)
+		for (j = 0; j < Plane_Columns/8; j++) {
+			for (k = 0; k < 64; k++)
+				Coefficients[k/8][k%8] = Centred[(long)(8*i + k/8)*Plane_Columns + 8*j + k%8];
+			Block_DCT(Coefficients);
+			for (k = 0; k < 64; k++)
+				Source_Image->Pixel_Data[YUV_index(Rows, Columns, 8*i + k/8, 8*j + k%8, colour)] =
+					(int)floor(Coefficients[k/8][k%8] + 0.5);
+		}
+
+	free(Chroma_Scratch);
+	free(Full_Row);
+	free(Samples);
+}
+
+static void Build_Quant_Table(int *Table, int Compression_Format, int Quality, int colour) {
+	// fills the JPEG quantization table of Y (or of U and V), in natural order: with a
+	// Quality of 1 to 100 the Annex K table scaled as by the IJG library, otherwise the
+	// .mic matrix of the format in JPEG units (rounded to whole steps), so that the
+	// requantized values are close to the coded ones
+	int i, Scale;
+
+	Scale = (Quality <= 0) ? 0 : (Quality < 50) ? 5000/Quality : 200 - 2*Quality;
+	for (i = 0; i < 64; i++) {
+		if (Quality > 0)
+			Table[i] = ((colour == Y) ? JPEG_Luminance_Quant[i] : JPEG_Chrominance_Quant[i])*Scale/100;
+		else Table[i] = (int)floor(Quant_Val(i, FORMAT_QUANT(Compression_Format))*
+			((colour == Y) ? LUMINANCE_GAIN : CHROMINANCE_GAIN) + 0.5);
+		if (Table[i] < 1) Table[i] = 1;
+		if (Table[i] > 255) Table[i] = 255;
+	}
+}
+
+static void Build_Huffman_Table(huffman_table *Table, const unsigned char *Bits, const unsigned char *Values) {
+	// derives the code of every symbol from the code lengths (ITU-T T.81 Annex C)
+	int Length, i, k = 0;
+	unsigned int Code = 0;
+
+	Table->Bits = Bits;
+	Table->Values = Values;
+	memset(Table->Length, 0, sizeof(Table->Length));
+	for (Length = 1; Length <= 16; Length++) {
+		for (i = 0; i < Bits[Length - 1]; i++) {
+			Table->Code[Values[k]] = Code++;
+			Table->Length[Values[k++]] = Length;
+		}
+		Code <<= 1;
+	}
+}
+
+static void Encode_JPEG_Block(jpeg_stream *Stream, const int *Data, long Position, int Row_Step,
+	const int *Quant_Table, int colour, int *Predictor,
+	huffman_table *DC_Table, huffman_table *AC_Table
+) {
+	// requantizes the coefficients of the block at Position (row by row, Row_Step apart)
+	// to the JPEG range and table, and codes them: the DC difference from the previous
+	// block of the component, then the AC run/size symbols in zigzag order
+	int k, Value, Magnitude, Size, Run;
+	double Coefficient;
+
+	for (k = 0, Run = 0; k < 64; k++) {
+		// a sample offset shifts the DC coefficient by 8 times the offset: Y is mapped from
+		// 16..235 to 0..255 and U and V from 128 - 112..128 + 112 to 0..255, less 128
+		Coefficient = Data[Position + (long)(Scan_Pattern[k]/8)*Row_Step + Scan_Pattern[k]%8];
+		if ((k == 0) && (colour == Y)) Coefficient = (Coefficient - 8.0*16.0)*LUMINANCE_GAIN - 8.0*128.0;
+		else if (k == 0) Coefficient = (Coefficient - 8.0*128.0)*CHROMINANCE_GAIN;
+		else Coefficient *= (colour == Y) ? LUMINANCE_GAIN : CHROMINANCE_GAIN;
+
+		// baseline coefficients of 8-bit samples are within -1024 and 1023 for DC, and
+		// -1023 and 1023 for AC (size category 10 at most)
+		if (Coefficient < ((k == 0) ? -1024.0 : -1023.0)) Coefficient = (k == 0) ? -1024.0 : -1023.0;
+		if (Coefficient > 1023.0) Coefficient = 1023.0;
+		Value = (int)floor(Coefficient/Quant_Table[Scan_Pattern[k]] + 0.5);
+
+		if (k == 0) {
+			Magnitude = Value - *Predictor;
+			*Predictor = Value;
+		} else if (Value == 0) {
+			Run++;
+			continue;
+		} else {
+			Magnitude = Value;
+			for (; Run > 15; Run -= 16)   // zero run length
+				Put_Bits(Stream, AC_Table->Code[0xF0], AC_Table->Length[0xF0]);
+		}
+
+		// the size category, then the magnitude (ones' complement when negative)
+		for (Size = 0; (Magnitude < 0 ? -Magnitude : Magnitude) >> Size; Size++);
+		if (k == 0) Put_Bits(Stream, DC_Table->Code[Size], DC_Table->Length[Size]);
+		else Put_Bits(Stream, AC_Table->Code[(Run << 4) | Size], AC_Table->Length[(Run << 4) | Size]);
+		if (Size > 0) Put_Bits(Stream, (Magnitude < 0) ? Magnitude - 1 : Magnitude, Size);
+		Run = 0;
+	}
+	if (Run > 0) Put_Bits(Stream, AC_Table->Code[0x00], AC_Table->Length[0x00]);   // end of block
+}
+
+static void Put_Byte(jpeg_stream *Stream, int Byte) {
+	// appends a byte to the stream, growing the buffer if needed
+	if (Stream->Size == Stream->Capacity) {
+		Stream->Capacity = 2*Stream->Capacity + 4096;
+		Stream->Data = (unsigned char *)realloc(Stream->Data, Stream->Capacity);
+	}
+	Stream->Data[Stream->Size++] = Byte;
+}
+
+static void Put_Marker_Segment(jpeg_stream *Stream, int Marker, const unsigned char *Segment, int Length) {
+	// appends a marker and its segment, preceded by the segment length
+	int i;
+
+	Put_Byte(Stream, 0xFF);
+	Put_Byte(Stream, Marker);
+	Put_Byte(Stream, (Length + 2) >> 8);
+	Put_Byte(Stream, (Length + 2) & 0xFF);
+	for (i = 0; i < Length; i++)
+		Put_Byte(Stream, Segment[i]);
+}
+
+static void Put_Bits(jpeg_stream *Stream, unsigned int Code, int Length) {
+	// appends the Length low bits of Code to the entropy coded data, most
+	// significant first, stuffing a zero byte after every 0xFF byte
+	int Byte;
+
+	Stream->Bit_Buffer = (Stream->Bit_Buffer << Length) | (Code & ((1U << Length) - 1));
+	Stream->Bit_Count += Length;
+	while (Stream->Bit_Count >= 8) {
+		Byte = (Stream->Bit_Buffer >> (Stream->Bit_Count - 8)) & 0xFF;
+		Put_Byte(Stream, Byte);
+		if (Byte == 0xFF) Put_Byte(Stream, 0x00);
+		Stream->Bit_Count -= 8;
+	}
+}
+
+static void Flush_Bits(jpeg_stream *Stream) {
+	// pads the last byte of the entropy coded data with ones
+	if (Stream->Bit_Count > 0) Put_Bits(Stream, 0x7F, 8 - Stream->Bit_Count);
+}
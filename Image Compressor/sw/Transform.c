@@ -0,0 +1,281 @@
+/*
+   Copyright by Adam Kinsman and Nicola Nicolici
+   Department of Electrical and Computer Engineering
+   McMaster University
+   Ontario, Canada
+ */
+
+#include "Coding.h"
+
+// image data types of the decoder (int samples, here the dequantized coefficients of
+// every block in its place) and of the encoder (double samples, the coefficients coded)
+typedef struct image_struct {
+	int Rows, Columns;
+	int *Pixel_Data;
+} image;
+
+typedef struct coefficient_image_struct {
+	int Rows, Columns;
+	double *Pixel_Data;
+} coefficient_image;
+
+// a transform of the image: the transposition of the image, then the mirroring of its
+// columns (left to right) and of its rows (top to bottom), or the crop to the rectangle
+// at Row_Offset, Column_Offset (a multiple of the block rows and columns of the MCU);
+// Rows and Columns are the size of the result
+typedef struct transform_struct {
+	const char *Name;
+	int Transpose, Mirror_Columns, Mirror_Rows;
+	int Row_Offset, Column_Offset;
+	int Rows, Columns;
+} transform;
+
+// the transforms: a clockwise rotation by 90 degrees is the transposition followed by
+// the mirroring of the columns, by 270 degrees the transposition followed by the
+// mirroring of the rows, and the transverse is the transposition across the other diagonal
+static const transform Transforms[] = {
+	{ "hflip",      0, 1, 0, 0, 0, 0, 0 },
+	{ "vflip",      0, 0, 1, 0, 0, 0, 0 },
+	{ "rot90",      1, 1, 0, 0, 0, 0, 0 },
+	{ "rot180",     0, 1, 1, 0, 0, 0, 0 },
+	{ "rot270",     1, 0, 1, 0, 0, 0, 0 },
+	{ "transpose",  1, 0, 0, 0, 0, 0, 0 },
+	{ "transverse", 1, 1, 1, 0, 0, 0, 0 },
+	{ "crop",       0, 0, 0, 0, 0, 0, 0 } };
+#define NUM_TRANSFORMS ((int)(sizeof(Transforms)/sizeof(Transforms[0])))
+
+void Transform_Stream(char *, char *, char *, int *, int);
+void Decode_Coefficients(char *, image *, int **);
+void Stream_Header(int *, int *, int *);
+int  Quant_Val(int, int);
+void Block_IDCT(int [][8]);
+void Init_DCT_Coeffs(void);
+void Block_DCT(double [][8]);
+void Code_Coefficients(coefficient_image *, int *, int, int, char *, int, int);
+static void Source_Position(const transform *, int, int, int *, int *);
+static long Transform_Plane(const transform *, image *, int *, coefficient_image *, int *, int, int, int, int);
+static void Resample_Chroma_Plane(const transform *, image *, coefficient_image *, int *, int, int, int);
+
+
+void Transform_Stream(char *Source_Filename, char *Destination_Filename, char *Transform_Name, int *Crop, int Write_Index) {
+	// transforms the stream Source_Filename.mic to Destination_Filename.mic in the
+	// compressed domain: the blocks are entropy decoded and dequantized, moved to their
+	// place in the transformed image and transformed themselves (a transposed block is
+	// the transposed coefficients, and mirroring negates the coefficients of odd
+	// horizontal or vertical frequency), and coded again with the matrix they had, so
+	// there is no IDCT or DCT and the Y plane is the decoded Y plane transformed; U and V
+	// are sited on the even columns (and rows in 4:2:0) of Y, and a mirrored U or V plane
+	// is not resampled, so it is one pixel off Y along the mirrored direction (the odd
+	// positions of Y have no samples of their own to move to);
+	// mirroring moves the right or bottom edge to the left or top, so the partial MCU
+	// at that edge is trimmed; a crop keeps whole MCUs, its corner moves up and left to
+	// the MCU grid; U and V of 4:2:2 have half the columns but all the rows of Y, which
+	// a transposition would turn around, so for a transposed 4:2:2 stream only the Y
+	// blocks are transformed losslessly and U and V are resampled (Resample_Chroma_Plane)
+	image Source_Image;
+	coefficient_image DCT_Image;
+	transform Transform;
+	int k, colour, Rows, Columns, Compression_Format, MCU_Rows, Source_Rows, Source_Columns;
+	int *Source_Quants, *Quants;
+	long Clipped, Quant_Base;
+
+	for (k = 0; (k < NUM_TRANSFORMS) && strcmp(Transform_Name, Transforms[k].Name); k++);
+	if (k == NUM_TRANSFORMS) {
+		printf("Unrecognized transform %s\n", Transform_Name); exit(1); }
+	Transform = Transforms[k];
+
+	// the dequantized coefficients of every block, in the place of the block, and its matrix
+	strcat(Destination_Filename, ".mic");
+	printf("Transforming file %s.mic (%s) to file %s\n", Source_Filename, Transform.Name, Destination_Filename);
+	Decode_Coefficients(Source_Filename, &Source_Image, &Source_Quants);
+	Stream_Header(&Rows, &Columns, &Compression_Format);
+	if (Write_Index && (FORMAT_ENTROPY(Compression_Format) == ENTROPY_ARITH)) {
+		printf("%s is arithmetic coded and needs no block row index (-index)\n", Source_Filename); exit(1); }
+	Source_Rows = Source_Image.Rows;
+	Source_Columns = Source_Image.Columns;
+	MCU_Rows = (FORMAT_CHROMA(Compression_Format) == CHROMA_420) ? 16 : 8;
+
+	// the size of the result, trimmed to whole MCUs along the mirrored directions
+	if (!strcmp(Transform.Name, "crop")) {
+		if ((Crop[0] < 0) || (Crop[1] < 0) || (Crop[2] <= 0) || (Crop[3] <= 0) ||
+		    (Crop[0] >= Columns) || (Crop[1] >= Rows)) {
+			printf("Invalid crop rectangle %d %d %d %d of the %d x %d image\n",
+				Crop[0], Crop[1], Crop[2], Crop[3], Columns, Rows); exit(1); }
+		Transform.Column_Offset = Crop[0] - Crop[0] % 16;
+		Transform.Row_Offset = Crop[1] - Crop[1] % MCU_Rows;
+		Transform.Columns = ((Crop[0] + Crop[2] < Columns) ? Crop[0] + Crop[2] : Columns) - Transform.Column_Offset;
+		Transform.Rows = ((Crop[1] + Crop[3] < Rows) ? Crop[1] + Crop[3] : Rows) - Transform.Row_Offset;
+		if ((Transform.Column_Offset != Crop[0]) || (Transform.Row_Offset != Crop[1]))
+			printf("The crop rectangle starts at %d %d, on the grid of %d x %d MCUs\n",
+				Transform.Column_Offset, Transform.Row_Offset, 16, MCU_Rows);
+	} else {
+		Transform.Columns = Transform.Transpose ? Rows : Columns;
+		Transform.Rows = Transform.Transpose ? Columns : Rows;
+		if (Transform.Mirror_Columns) Transform.Columns -= Transform.Columns % 16;
+		if (Transform.Mirror_Rows) Transform.Rows -= Transform.Rows % MCU_Rows;
+		if ((Transform.Columns == 0) || (Transform.Rows == 0)) {
+			printf("The %d x %d image is smaller than the MCU it would be mirrored in\n", Columns, Rows); exit(1); }
+		if ((Transform.Columns != (Transform.Transpose ? Rows : Columns)) || (Transform.Rows != (Transform.Transpose ? Columns : Rows)))
+			printf("The partial MCUs at the mirrored edges are trimmed\n");
+	}
+
+	// the coefficients of the result, coded as they are (the matrix of a block is kept)
+	DCT_Image.Rows = PADDED_ROWS(Transform.Rows, Compression_Format);
+	DCT_Image.Columns = PADDED_COLUMNS(Transform.Columns);
+	DCT_Image.Pixel_Data = (double *)Arena_Plane(&Codec_Context()->DCT_Data,
+		(size_t)DCT_Image.Rows*DCT_Image.Columns*2*sizeof(double));
+	Quants = (int *)malloc((size_t)2*(DCT_Image.Rows/8)*(DCT_Image.Columns/8)*sizeof(int));
+
+	Clipped = 0;
+	Quant_Base = 0;
+	for (colour = 0; colour < 3; colour++) {
+		if ((colour != Y) && Transform.Transpose && (FORMAT_CHROMA(Compression_Format) == CHROMA_422))
+			Resample_Chroma_Plane(&Transform, &Source_Image, &DCT_Image, &Quants[Quant_Base], colour, Rows, Columns);
+		else Clipped += Transform_Plane(&Transform, &Source_Image, Source_Quants, &DCT_Image, &Quants[Quant_Base],
+			colour, FORMAT_CHROMA(Compression_Format), Source_Rows, Source_Columns);
+		Quant_Base += (long)(((colour == Y) || (FORMAT_CHROMA(Compression_Format) == CHROMA_422)) ?
+			DCT_Image.Rows/8 : DCT_Image.Rows/16)*YUV_row_step(colour, DCT_Image.Columns/8);
+	}
+	if (Transform.Transpose && (FORMAT_CHROMA(Compression_Format) == CHROMA_422))
+		printf("The U and V planes of the 4:2:2 stream are resampled for the transposition (Y is transformed losslessly)\n");
+	if (FORMAT_CHROMA(Compression_Format) == CHROMA_420) {
+		if (Transform.Mirror_Columns || Transform.Mirror_Rows)
+			printf("The mirrored U and V planes are one pixel off Y along the mirrored directions\n");
+	} else if (Transform.Mirror_Columns && !Transform.Transpose)
+		printf("The mirrored U and V planes are one pixel off Y along the rows\n");
+	if (Clipped > 0)
+		printf("%ld mirrored coefficients of -256 are clipped to 255\n", Clipped);
+
+	Code_Coefficients(&DCT_Image, Quants, Transform.Rows, Transform.Columns, Destination_Filename,
+		Compression_Format, Write_Index);
+	printf("Wrote %d x %d image (%s)\n", Transform.Columns, Transform.Rows,
+		(FORMAT_CHROMA(Compression_Format) == CHROMA_420) ? "4:2:0" : "4:2:2");
+
+	free(Quants);
+	free(Source_Quants);
+}
+
+static void Source_Position(const transform *Transform, int Column, int Row, int *Source_Column, int *Source_Row) {
+	// the position in the source image of the pixel at Column, Row of the result
+	if (Transform->Mirror_Columns) Column = Transform->Columns - 1 - Column;
+	if (Transform->Mirror_Rows) Row = Transform->Rows - 1 - Row;
+	*Source_Column = (Transform->Transpose ? Row : Column) + Transform->Column_Offset;
+	*Source_Row = (Transform->Transpose ? Column : Row) + Transform->Row_Offset;
+}
+
+static long Transform_Plane(const transform *Transform, image *Source_Image, int *Source_Quants,
+	coefficient_image *DCT_Image, int *Quants, int colour, int Chroma, int Source_Rows, int Source_Columns
+) {
+	// moves and transforms the blocks of a component (a block of U or V covers 16 columns,
+	// and 16 rows in 4:2:0, of the image, so it is transposed with its place only in 4:2:0);
+	// the blocks of the result beyond the source (the padding of a crop or a transposition)
+	// repeat the last block of the source; returns the number of coefficients clipped
+	int i, j, k, Block_Row, Block_Column, Source_Block_Row, Source_Block_Column;
+	int Block_Rows, Block_Columns, Source_Block_Rows, Source_Block_Columns, Block_Width, Block_Height;
+	int Column_1, Row_1, Column_2, Row_2, Value, Quant;
+	long Source_Quant_Base, Clipped = 0;
+
+	Block_Width = (colour == Y) ? 8 : 16;
+	Block_Height = ((colour == Y) || (Chroma == CHROMA_422)) ? 8 : 16;
+	Block_Rows = DCT_Image->Rows/Block_Height;
+	Block_Columns = DCT_Image->Columns/Block_Width;
+	Source_Block_Rows = Source_Rows/Block_Height;
+	Source_Block_Columns = Source_Columns/Block_Width;
+
+	// the first block of the component, among the matrices of the source
+	Source_Quant_Base = (colour == Y) ? 0 : (long)(Source_Rows/8)*(Source_Columns/8);
+	if (colour == V) Source_Quant_Base += (long)Source_Block_Rows*Source_Block_Columns;
+
+	for (Block_Row = 0; Block_Row < Block_Rows; Block_Row++)
+		for (Block_Column = 0; Block_Column < Block_Columns; Block_Column++) {
+			// the source block is the one holding the opposite corners of the block
+			Source_Position(Transform, Block_Column*Block_Width, Block_Row*Block_Height, &Column_1, &Row_1);
+			Source_Position(Transform, (Block_Column + 1)*Block_Width - 1, (Block_Row + 1)*Block_Height - 1, &Column_2, &Row_2);
+			Source_Block_Column = ((Column_1 < Column_2) ? Column_1 : Column_2)/Block_Width;
+			Source_Block_Row = ((Row_1 < Row_2) ? Row_1 : Row_2)/Block_Height;
+			Source_Block_Column = (Source_Block_Column < 0) ? 0 : (Source_Block_Column >= Source_Block_Columns) ?
+				Source_Block_Columns - 1 : Source_Block_Column;
+			Source_Block_Row = (Source_Block_Row < 0) ? 0 : (Source_Block_Row >= Source_Block_Rows) ?
+				Source_Block_Rows - 1 : Source_Block_Row;
+
+			Quant = Source_Quants[Source_Quant_Base + (long)Source_Block_Row*Source_Block_Columns + Source_Block_Column];
+			Quants[(long)Block_Row*Block_Columns + Block_Column] = Quant;
+			for (i = 0; i < 8; i++)
+				for (j = 0; j < 8; j++) {
+					// the matrices are symmetric, so a transposed coefficient keeps its step
+					Value = Transform->Transpose ?
+						Source_Image->Pixel_Data[YUV_index(Source_Rows, Source_Columns, 8*Source_Block_Row + j, 8*Source_Block_Column + i, colour)] :
+						Source_Image->Pixel_Data[YUV_index(Source_Rows, Source_Columns, 8*Source_Block_Row + i, 8*Source_Block_Column + j, colour)];
+					k = ((Transform->Mirror_Columns && (j % 2)) ? 1 : 0) ^ ((Transform->Mirror_Rows && (i % 2)) ? 1 : 0);
+					if (k && (Value == -256*Quant_Val(8*i + j, Quant))) Clipped++;
+					DCT_Image->Pixel_Data[YUV_index(DCT_Image->Rows, DCT_Image->Columns, 8*Block_Row + i, 8*Block_Column + j, colour)] =
+						(double)(k ? -Value : Value);
+				}
+		}
+	return Clipped;
+}
+
+static void Resample_Chroma_Plane(const transform *Transform, image *Source_Image, coefficient_image *DCT_Image,
+	int *Quants, int colour, int Rows, int Columns
+) {
+	// a transposed 4:2:2 chroma plane: the plane is decoded and interpolated to the
+	// columns of Y (as by Interpolate_Colourspace), every row of the result is taken
+	// from the columns of the transposed image and filtered and decimated (as by
+	// Colour_Space_422), and the blocks of the result are transformed and coded with
+	// the matrix picked from their activity (the format's matrix without -adaptive)
+	int i, j, k, Source_Rows, Source_Columns, Source_Column, Source_Row, Block_Data[8][8];
+	int *Samples, *Full_Samples, *Row;
+	short *Chroma_Scratch;
+	double Coefficients[8][8];
+
+	Source_Rows = Source_Image->Rows;
+	Source_Columns = Source_Image->Columns;
+	Samples = (int *)malloc((size_t)Source_Rows*(Source_Columns/2 + Source_Columns)*sizeof(int));
+	Full_Samples = Samples + (long)Source_Rows*Source_Columns/2;
+	Row = (int *)malloc((size_t)DCT_Image->Columns*sizeof(int));
+	Chroma_Scratch = (short *)malloc(CHROMA_SCRATCH_SIZE((Source_Columns > DCT_Image->Columns) ?
+		Source_Columns : DCT_Image->Columns)*sizeof(short));
+
+	// the decoded plane, at the columns of Y
+	for (i = 0; i < Source_Rows/8; i++)
+		for (j = 0; j < Source_Columns/16; j++) {
+			for (k = 0; k < 64; k++)
+				Block_Data[k/8][k%8] = Source_Image->Pixel_Data[YUV_index(Source_Rows, Source_Columns, 8*i + k/8, 8*j + k%8, colour)];
+			Block_IDCT(Block_Data);
+			for (k = 0; k < 64; k++)
+				Samples[(long)(8*i + k/8)*(Source_Columns/2) + 8*j + k%8] = Block_Data[k/8][k%8];
+		}
+	for (i = 0; i < Source_Rows; i++)
+		Upsample_Chroma_Row(&Samples[(long)i*(Source_Columns/2)], &Full_Samples[(long)i*Source_Columns],
+			Source_Columns, Chroma_Scratch);
+
+	// the rows of the result (the padding repeats the last row and column of the image)
+	for (i = 0; i < DCT_Image->Rows; i++) {
+		for (j = 0; j < DCT_Image->Columns; j++) {
+			Source_Position(Transform, (j < Transform->Columns) ? j : Transform->Columns - 1,
+				(i < Transform->Rows) ? i : Transform->Rows - 1, &Source_Column, &Source_Row);
+			Source_Column = (Source_Column < Columns) ? Source_Column : Columns - 1;
+			Source_Row = (Source_Row < Rows) ? Source_Row : Rows - 1;
+			Row[j] = Full_Samples[(long)Source_Row*Source_Columns + Source_Column];
+		}
+		Downsample_Chroma_Row(Row, Row, DCT_Image->Columns, Chroma_Scratch);
+		for (j = 0; j < DCT_Image->Columns/2; j++)
+			DCT_Image->Pixel_Data[YUV_index(DCT_Image->Rows, DCT_Image->Columns, i, j, colour)] = (double)Row[j];
+	}
+
+	// the DCT of the blocks of the result
+	Init_DCT_Coeffs();
+	for (i = 0; i < DCT_Image->Rows/8; i++)
+		for (j = 0; j < DCT_Image->Columns/16; j++) {
+			for (k = 0; k < 64; k++)
+				Coefficients[k/8][k%8] = DCT_Image->Pixel_Data[YUV_index(DCT_Image->Rows, DCT_Image->Columns, 8*i + k/8, 8*j + k%8, colour)];
+			Block_DCT(Coefficients);
+			for (k = 0; k < 64; k++)
+				DCT_Image->Pixel_Data[YUV_index(DCT_Image->Rows, DCT_Image->Columns, 8*i + k/8, 8*j + k%8, colour)] = Coefficients[k/8][k%8];
+			Quants[(long)i*(DCT_Image->Columns/16) + j] = -1;
+		}
+
+	free(Chroma_Scratch);
+	free(Row);
+	free(Samples);
+}